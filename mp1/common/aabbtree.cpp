@@ -0,0 +1,350 @@
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include <glm/glm.hpp>
+
+#include "aabbtree.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define AABB_TREE_SSE 1
+#endif
+
+static float surfaceArea(const glm::vec3 & lo, const glm::vec3 & hi){
+	glm::vec3 d = hi - lo;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static bool contains(const glm::vec3 & outer_lo, const glm::vec3 & outer_hi, const glm::vec3 & lo, const glm::vec3 & hi){
+	return outer_lo.x <= lo.x && outer_lo.y <= lo.y && outer_lo.z <= lo.z
+		&& hi.x <= outer_hi.x && hi.y <= outer_hi.y && hi.z <= outer_hi.z;
+}
+
+AABBTree::AABBTree(float margin)
+	: root(AABB_TREE_NULL), free_list(AABB_TREE_NULL), leaf_count(0), margin(margin){
+}
+
+int AABBTree::allocateNode(){
+	if ( free_list == AABB_TREE_NULL ){
+		nodes.push_back(Node());
+		free_list = (int)nodes.size() - 1;
+		nodes[free_list].parent = AABB_TREE_NULL;
+	}
+	int node = free_list;
+	free_list = nodes[node].parent;
+	nodes[node].parent = AABB_TREE_NULL;
+	nodes[node].child[0] = nodes[node].child[1] = AABB_TREE_NULL;
+	nodes[node].height = 0;
+	nodes[node].user_id = 0;
+	return node;
+}
+
+void AABBTree::freeNode(int node){
+	nodes[node].parent = free_list;
+	nodes[node].height = -1;
+	free_list = node;
+}
+
+int AABBTree::insert(const glm::vec3 & lo, const glm::vec3 & hi, unsigned int user_id){
+	int proxy = allocateNode();
+	Node & n = nodes[proxy];
+	n.object_lo = lo;
+	n.object_hi = hi;
+	n.lo = lo - glm::vec3(margin);
+	n.hi = hi + glm::vec3(margin);
+	n.user_id = user_id;
+	insertLeaf(proxy);
+	leaf_count++;
+	return proxy;
+}
+
+void AABBTree::remove(int proxy){
+	removeLeaf(proxy);
+	freeNode(proxy);
+	leaf_count--;
+}
+
+bool AABBTree::move(int proxy, const glm::vec3 & lo, const glm::vec3 & hi){
+	Node & n = nodes[proxy];
+	glm::vec3 displacement = ((lo + hi) - (n.object_lo + n.object_hi)) * 0.5f;
+	n.object_lo = lo;
+	n.object_hi = hi;
+	if ( contains(n.lo, n.hi, lo, hi) )
+		return false;
+
+	// Objects tend to keep going the same way, stretch the fat box ahead of them
+	glm::vec3 ahead = displacement * AABB_TREE_DISPLACEMENT_FACTOR;
+	removeLeaf(proxy);
+	nodes[proxy].lo = lo - glm::vec3(margin) + glm::min(ahead, glm::vec3(0.0f));
+	nodes[proxy].hi = hi + glm::vec3(margin) + glm::max(ahead, glm::vec3(0.0f));
+	insertLeaf(proxy);
+	return true;
+}
+
+// Recomputes the boxes and heights from node up to the root, rebalancing on the way
+void AABBTree::refitUp(int node){
+	while ( node != AABB_TREE_NULL ){
+		node = balance(node);
+		Node & n = nodes[node];
+		const Node & a = nodes[n.child[0]];
+		const Node & b = nodes[n.child[1]];
+		n.lo = glm::min(a.lo, b.lo);
+		n.hi = glm::max(a.hi, b.hi);
+		n.height = 1 + std::max(a.height, b.height);
+		node = n.parent;
+	}
+}
+
+void AABBTree::insertLeaf(int leaf){
+	if ( root == AABB_TREE_NULL ){
+		root = leaf;
+		nodes[root].parent = AABB_TREE_NULL;
+		return;
+	}
+
+	// Walk down to the sibling that makes the tree grow the least
+	glm::vec3 leaf_lo = nodes[leaf].lo, leaf_hi = nodes[leaf].hi;
+	int index = root;
+	while ( nodes[index].child[0] != AABB_TREE_NULL ){
+		const Node & n = nodes[index];
+		float area = surfaceArea(n.lo, n.hi);
+		float combined_area = surfaceArea(glm::min(n.lo, leaf_lo), glm::max(n.hi, leaf_hi));
+
+		// Making a new parent for this node and the leaf
+		float cost = 2.0f * combined_area;
+		// Going down grows this node, whichever child we pick
+		float inheritance_cost = 2.0f * (combined_area - area);
+
+		float child_cost[2];
+		for ( int k=0; k<2; k++ ){
+			const Node & c = nodes[n.child[k]];
+			float grown = surfaceArea(glm::min(c.lo, leaf_lo), glm::max(c.hi, leaf_hi));
+			if ( c.child[0] == AABB_TREE_NULL )
+				child_cost[k] = grown + inheritance_cost;
+			else
+				child_cost[k] = grown - surfaceArea(c.lo, c.hi) + inheritance_cost;
+		}
+		if ( cost < child_cost[0] && cost < child_cost[1] )
+			break;
+		index = child_cost[0] < child_cost[1] ? n.child[0] : n.child[1];
+	}
+	int sibling = index;
+
+	int old_parent = nodes[sibling].parent;
+	int new_parent = allocateNode();
+	Node & p = nodes[new_parent];
+	p.parent = old_parent;
+	p.lo = glm::min(leaf_lo, nodes[sibling].lo);
+	p.hi = glm::max(leaf_hi, nodes[sibling].hi);
+	p.height = nodes[sibling].height + 1;
+	p.child[0] = sibling;
+	p.child[1] = leaf;
+	nodes[sibling].parent = new_parent;
+	nodes[leaf].parent = new_parent;
+
+	if ( old_parent == AABB_TREE_NULL )
+		root = new_parent;
+	else if ( nodes[old_parent].child[0] == sibling )
+		nodes[old_parent].child[0] = new_parent;
+	else
+		nodes[old_parent].child[1] = new_parent;
+
+	refitUp(old_parent);
+}
+
+void AABBTree::removeLeaf(int leaf){
+	if ( leaf == root ){
+		root = AABB_TREE_NULL;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grand_parent = nodes[parent].parent;
+	int sibling = nodes[parent].child[0] == leaf ? nodes[parent].child[1] : nodes[parent].child[0];
+
+	// The sibling takes the place of the parent
+	if ( grand_parent == AABB_TREE_NULL ){
+		root = sibling;
+		nodes[sibling].parent = AABB_TREE_NULL;
+		freeNode(parent);
+		return;
+	}
+	if ( nodes[grand_parent].child[0] == parent )
+		nodes[grand_parent].child[0] = sibling;
+	else
+		nodes[grand_parent].child[1] = sibling;
+	nodes[sibling].parent = grand_parent;
+	freeNode(parent);
+
+	refitUp(grand_parent);
+}
+
+// If one child of a is more than one level taller than the other, rotates it up
+// into the place of a. Returns the node now at the place of a.
+int AABBTree::balance(int a_index){
+	Node & a = nodes[a_index];
+	if ( a.child[0] == AABB_TREE_NULL || a.height < 2 )
+		return a_index;
+
+	int b_index = a.child[0];
+	int c_index = a.child[1];
+	int difference = nodes[c_index].height - nodes[b_index].height;
+	if ( difference >= -1 && difference <= 1 )
+		return a_index;
+
+	// up is the taller child, stay is the other child of a
+	int up_index = difference > 1 ? c_index : b_index;
+	int stay_index = difference > 1 ? b_index : c_index;
+	int up_side = difference > 1 ? 1 : 0;
+	Node & up = nodes[up_index];
+	const Node & stay = nodes[stay_index];
+
+	int f_index = up.child[0];
+	int g_index = up.child[1];
+	Node & f = nodes[f_index];
+	Node & g = nodes[g_index];
+
+	// up becomes the parent of a
+	up.child[0] = a_index;
+	up.parent = a.parent;
+	a.parent = up_index;
+	if ( up.parent == AABB_TREE_NULL )
+		root = up_index;
+	else if ( nodes[up.parent].child[0] == a_index )
+		nodes[up.parent].child[0] = up_index;
+	else
+		nodes[up.parent].child[1] = up_index;
+
+	// The taller grandchild stays with up, the shorter one moves under a
+	int keep_index = f.height > g.height ? f_index : g_index;
+	int move_index = f.height > g.height ? g_index : f_index;
+	Node & keep = nodes[keep_index];
+	Node & moved = nodes[move_index];
+	up.child[1] = keep_index;
+	a.child[up_side] = move_index;
+	moved.parent = a_index;
+
+	a.lo = glm::min(stay.lo, moved.lo);
+	a.hi = glm::max(stay.hi, moved.hi);
+	a.height = 1 + std::max(stay.height, moved.height);
+	up.lo = glm::min(a.lo, keep.lo);
+	up.hi = glm::max(a.hi, keep.hi);
+	up.height = 1 + std::max(a.height, keep.height);
+	return up_index;
+}
+
+void AABBTree::queryFrustum(const glm::mat4 & VP, std::vector<unsigned int> & visible) const {
+	visible.clear();
+	if ( root == AABB_TREE_NULL )
+		return;
+
+	// Frustum planes from the rows of VP (Gribb & Hartmann). A box is outside a plane
+	// if its center is further than its projected half extent behind it, and inside
+	// if the center is at least that far in front.
+	float planes[6][4], abs_normal[6][3];
+	for ( int p=0; p<6; p++ ){
+		int row = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		for ( int c=0; c<4; c++ )
+			planes[p][c] = VP[c][3] + sign * VP[c][row];
+		for ( int c=0; c<3; c++ )
+			abs_normal[p][c] = fabsf(planes[p][c]);
+	}
+
+	std::vector<int> stack;
+	std::vector<int> inside;
+	stack.push_back(root);
+	while ( !stack.empty() ){
+		int ids[4];
+		int count = (int)std::min(stack.size(), (size_t)4);
+		for ( int k=0; k<4; k++ )
+			ids[k] = k < count ? stack[stack.size() - 1 - k] : stack[stack.size() - 1];
+		stack.resize(stack.size() - count);
+
+		int outside_mask, partial_mask;
+#ifdef AABB_TREE_SSE
+		const Node & n0 = nodes[ids[0]];
+		const Node & n1 = nodes[ids[1]];
+		const Node & n2 = nodes[ids[2]];
+		const Node & n3 = nodes[ids[3]];
+		__m128 half = _mm_set1_ps(0.5f);
+		__m128 lx = _mm_setr_ps(n0.lo.x, n1.lo.x, n2.lo.x, n3.lo.x), hx = _mm_setr_ps(n0.hi.x, n1.hi.x, n2.hi.x, n3.hi.x);
+		__m128 ly = _mm_setr_ps(n0.lo.y, n1.lo.y, n2.lo.y, n3.lo.y), hy = _mm_setr_ps(n0.hi.y, n1.hi.y, n2.hi.y, n3.hi.y);
+		__m128 lz = _mm_setr_ps(n0.lo.z, n1.lo.z, n2.lo.z, n3.lo.z), hz = _mm_setr_ps(n0.hi.z, n1.hi.z, n2.hi.z, n3.hi.z);
+		__m128 cx = _mm_mul_ps(_mm_add_ps(lx, hx), half), ex = _mm_mul_ps(_mm_sub_ps(hx, lx), half);
+		__m128 cy = _mm_mul_ps(_mm_add_ps(ly, hy), half), ey = _mm_mul_ps(_mm_sub_ps(hy, ly), half);
+		__m128 cz = _mm_mul_ps(_mm_add_ps(lz, hz), half), ez = _mm_mul_ps(_mm_sub_ps(hz, lz), half);
+		__m128 outside = _mm_setzero_ps();
+		__m128 partial = _mm_setzero_ps();
+		for ( int p=0; p<6; p++ ){
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[p][0])), _mm_mul_ps(cy, _mm_set1_ps(planes[p][1]))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[p][2])), _mm_set1_ps(planes[p][3])));
+			__m128 r = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(ex, _mm_set1_ps(abs_normal[p][0])), _mm_mul_ps(ey, _mm_set1_ps(abs_normal[p][1]))),
+				_mm_mul_ps(ez, _mm_set1_ps(abs_normal[p][2])));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(d, r), _mm_setzero_ps()));
+			partial = _mm_or_ps(partial, _mm_cmplt_ps(_mm_sub_ps(d, r), _mm_setzero_ps()));
+		}
+		outside_mask = _mm_movemask_ps(outside);
+		partial_mask = _mm_movemask_ps(partial);
+#else
+		outside_mask = partial_mask = 0;
+		for ( int k=0; k<4; k++ ){
+			const Node & n = nodes[ids[k]];
+			glm::vec3 c = (n.lo + n.hi) * 0.5f;
+			glm::vec3 e = (n.hi - n.lo) * 0.5f;
+			for ( int p=0; p<6; p++ ){
+				float d = c.x*planes[p][0] + c.y*planes[p][1] + c.z*planes[p][2] + planes[p][3];
+				float r = e.x*abs_normal[p][0] + e.y*abs_normal[p][1] + e.z*abs_normal[p][2];
+				if ( d + r < 0.0f )
+					outside_mask |= 1 << k;
+				if ( d - r < 0.0f )
+					partial_mask |= 1 << k;
+			}
+		}
+#endif
+
+		for ( int k=0; k<count; k++ ){
+			if ( outside_mask & (1 << k) )
+				continue;
+			const Node & n = nodes[ids[k]];
+			if ( !(partial_mask & (1 << k)) ){
+				inside.push_back(ids[k]);
+				continue;
+			}
+			if ( n.child[0] != AABB_TREE_NULL ){
+				stack.push_back(n.child[0]);
+				stack.push_back(n.child[1]);
+				continue;
+			}
+
+			// The fat box crosses a plane, decide with the exact box
+			glm::vec3 c = (n.object_lo + n.object_hi) * 0.5f;
+			glm::vec3 e = (n.object_hi - n.object_lo) * 0.5f;
+			bool out = false;
+			for ( int p=0; p<6 && !out; p++ ){
+				float d = c.x*planes[p][0] + c.y*planes[p][1] + c.z*planes[p][2] + planes[p][3];
+				float r = e.x*abs_normal[p][0] + e.y*abs_normal[p][1] + e.z*abs_normal[p][2];
+				out = d + r < 0.0f;
+			}
+			if ( !out )
+				visible.push_back(n.user_id);
+		}
+
+		// Everything under a node fully inside is visible, no more tests
+		while ( !inside.empty() ){
+			const Node & n = nodes[inside.back()];
+			inside.pop_back();
+			if ( n.child[0] == AABB_TREE_NULL )
+				visible.push_back(n.user_id);
+			else {
+				inside.push_back(n.child[0]);
+				inside.push_back(n.child[1]);
+			}
+		}
+	}
+
+	std::sort(visible.begin(), visible.end());
+}
@@ -0,0 +1,59 @@
+#ifndef AABBTREE_HPP
+#define AABBTREE_HPP
+
+#define AABB_TREE_NULL -1
+
+// Fat boxes are grown by this much on every side, so small moves don't touch the tree
+#define AABB_TREE_MARGIN 0.1f
+// and stretched by this many times the last move in the direction of the motion
+#define AABB_TREE_DISPLACEMENT_FACTOR 2.0f
+
+// Dynamic bounding box tree over scene objects (in the spirit of Box2D's b2DynamicTree).
+// Objects are inserted one by one next to the sibling that grows the tree the least,
+// and the tree is kept balanced with rotations, so moving objects cost O(log n).
+class AABBTree{
+public:
+	AABBTree(float margin = AABB_TREE_MARGIN);
+
+	// Returns the proxy of the object, to move or remove it later
+	int insert(const glm::vec3 & lo, const glm::vec3 & hi, unsigned int user_id);
+	void remove(int proxy);
+
+	// New box of a moving object. The tree only changes when the box
+	// leaves the fat box of the object, in which case it returns true.
+	bool move(int proxy, const glm::vec3 & lo, const glm::vec3 & hi);
+
+	// User ids of the objects whose box is at least partly inside the frustum
+	// of VP, in increasing order. Pending nodes are tested 4 at a time with SSE,
+	// and subtrees fully inside the frustum are taken without any more tests.
+	void queryFrustum(const glm::mat4 & VP, std::vector<unsigned int> & visible) const;
+
+	unsigned int userId(int proxy) const { return nodes[proxy].user_id; }
+	size_t size() const { return leaf_count; }
+	int height() const { return root == AABB_TREE_NULL ? 0 : nodes[root].height; }
+
+private:
+	struct Node{
+		glm::vec3 lo, hi;               // fat box for leaves
+		glm::vec3 object_lo, object_hi; // exact box, leaves only
+		int parent;                     // next free node when unused
+		int child[2];                   // AABB_TREE_NULL for leaves
+		int height;                     // 0 for leaves, -1 when unused
+		unsigned int user_id;
+	};
+
+	int allocateNode();
+	void freeNode(int node);
+	void insertLeaf(int leaf);
+	void removeLeaf(int leaf);
+	int balance(int node);
+	void refitUp(int node);
+
+	std::vector<Node> nodes;
+	int root;
+	int free_list;
+	size_t leaf_count;
+	float margin;
+};
+
+#endif
@@ -0,0 +1,392 @@
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "parallel.hpp"
+#include "blockcompress.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BLOCK_SSE 1
+#endif
+
+unsigned int blockFourCC(BlockFormat format){
+	switch ( format ){
+	case BLOCK_BC1: return FOURCC_DXT1;
+	case BLOCK_BC3: return FOURCC_DXT5;
+	case BLOCK_BC5: return FOURCC_ATI2;
+	default: return 0;
+	}
+}
+
+unsigned int blockBytes(unsigned int fourcc){
+	return fourcc == FOURCC_DXT1 ? 8 : 16;
+}
+
+unsigned int blockLevelSize(unsigned int fourcc, unsigned int width, unsigned int height){
+	return ((width + 3) / 4) * ((height + 3) / 4) * blockBytes(fourcc);
+}
+
+static unsigned short packRGB565(int r, int g, int b){
+	return (unsigned short)((((r * 31 + 127) / 255) << 11) | (((g * 63 + 127) / 255) << 5) | ((b * 31 + 127) / 255));
+}
+
+static void unpackRGB565(unsigned short c, int rgb[3]){
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+// 16 RGBA pixels of a block to a DXT1 color block, always in 4 color mode.
+// Endpoints from the bounding box of the colors, pulled in by 1/16 of its size
+// (van Waveren, "Real-Time DXT Compression", 2006), then every pixel takes the
+// nearest of the 4 palette colors.
+static void compressColorBlock(const unsigned char block[64], unsigned char out[8]){
+	int lo[3], hi[3];
+#ifdef BLOCK_SSE
+	__m128i p0 = _mm_loadu_si128((const __m128i *)(block));
+	__m128i p1 = _mm_loadu_si128((const __m128i *)(block + 16));
+	__m128i p2 = _mm_loadu_si128((const __m128i *)(block + 32));
+	__m128i p3 = _mm_loadu_si128((const __m128i *)(block + 48));
+	__m128i mn = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+	__m128i mx = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+	mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+	mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+	mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+	mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+	unsigned int mn32 = (unsigned int)_mm_cvtsi128_si32(mn);
+	unsigned int mx32 = (unsigned int)_mm_cvtsi128_si32(mx);
+	for ( int c=0; c<3; c++ ){
+		lo[c] = (mn32 >> (c * 8)) & 255;
+		hi[c] = (mx32 >> (c * 8)) & 255;
+	}
+#else
+	for ( int c=0; c<3; c++ ){
+		lo[c] = hi[c] = block[c];
+		for ( int i=1; i<16; i++ ){
+			lo[c] = std::min(lo[c], (int)block[i*4 + c]);
+			hi[c] = std::max(hi[c], (int)block[i*4 + c]);
+		}
+	}
+#endif
+	for ( int c=0; c<3; c++ ){
+		int inset = (hi[c] - lo[c]) >> 4;
+		lo[c] += inset;
+		hi[c] -= inset;
+	}
+
+	unsigned short c0 = packRGB565(hi[0], hi[1], hi[2]);
+	unsigned short c1 = packRGB565(lo[0], lo[1], lo[2]);
+	unsigned int indices = 0;
+	if ( c0 < c1 )
+		std::swap(c0, c1);
+
+	if ( c0 != c1 ){
+		// Palette : c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+		int palette[4][3];
+		unpackRGB565(c0, palette[0]);
+		unpackRGB565(c1, palette[1]);
+		for ( int c=0; c<3; c++ ){
+			palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+			palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+		}
+
+		int best[16];
+#ifdef BLOCK_SSE
+		// Squared distances of 4 pixels at a time, r and g summed by one madd, b by another
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i rgb_mask = _mm_set1_epi32(0x00ffffff);
+		for ( int q=0; q<4; q++ ){
+			__m128i px = _mm_and_si128(_mm_loadu_si128((const __m128i *)(block + q * 16)), rgb_mask);
+			__m128i lo16 = _mm_unpacklo_epi8(px, zero); // pixels 0, 1 as r g b 0
+			__m128i hi16 = _mm_unpackhi_epi8(px, zero); // pixels 2, 3
+			__m128i best_distance = _mm_set1_epi32(0x7fffffff);
+			__m128i best_index = zero;
+			for ( int k=0; k<4; k++ ){
+				__m128i color = _mm_setr_epi16(
+					palette[k][0], palette[k][1], palette[k][2], 0,
+					palette[k][0], palette[k][1], palette[k][2], 0);
+				__m128i d_lo = _mm_sub_epi16(lo16, color);
+				__m128i d_hi = _mm_sub_epi16(hi16, color);
+				// madd leaves r*r + g*g and b*b + 0 side by side for each pixel
+				d_lo = _mm_madd_epi16(d_lo, d_lo);
+				d_hi = _mm_madd_epi16(d_hi, d_hi);
+				d_lo = _mm_add_epi32(d_lo, _mm_shuffle_epi32(d_lo, _MM_SHUFFLE(2, 3, 0, 1)));
+				d_hi = _mm_add_epi32(d_hi, _mm_shuffle_epi32(d_hi, _MM_SHUFFLE(2, 3, 0, 1)));
+				__m128i distance = _mm_castps_si128(_mm_shuffle_ps(
+					_mm_castsi128_ps(d_lo), _mm_castsi128_ps(d_hi), _MM_SHUFFLE(2, 0, 2, 0)));
+				__m128i closer = _mm_cmplt_epi32(distance, best_distance);
+				best_distance = _mm_or_si128(_mm_and_si128(closer, distance), _mm_andnot_si128(closer, best_distance));
+				best_index = _mm_or_si128(_mm_and_si128(closer, _mm_set1_epi32(k)), _mm_andnot_si128(closer, best_index));
+			}
+			_mm_storeu_si128((__m128i *)(best + q * 4), best_index);
+		}
+#else
+		for ( int i=0; i<16; i++ ){
+			int best_distance = 0x7fffffff;
+			for ( int k=0; k<4; k++ ){
+				int dr = block[i*4] - palette[k][0], dg = block[i*4+1] - palette[k][1], db = block[i*4+2] - palette[k][2];
+				int distance = dr*dr + dg*dg + db*db;
+				if ( distance < best_distance ){
+					best_distance = distance;
+					best[i] = k;
+				}
+			}
+		}
+#endif
+		for ( int i=0; i<16; i++ )
+			indices |= (unsigned int)best[i] << (i * 2);
+	}
+
+	out[0] = c0 & 255; out[1] = c0 >> 8;
+	out[2] = c1 & 255; out[3] = c1 >> 8;
+	out[4] = indices & 255; out[5] = (indices >> 8) & 255;
+	out[6] = (indices >> 16) & 255; out[7] = indices >> 24;
+}
+
+// One channel (every 4th byte from channel on) to a BC4 block, in 8 value mode
+static void compressChannelBlock(const unsigned char block[64], int channel, unsigned char out[8]){
+	int lo = 255, hi = 0;
+	for ( int i=0; i<16; i++ ){
+		lo = std::min(lo, (int)block[i*4 + channel]);
+		hi = std::max(hi, (int)block[i*4 + channel]);
+	}
+	out[0] = (unsigned char)hi;
+	out[1] = (unsigned char)lo;
+
+	unsigned long long indices = 0;
+	int range = hi - lo;
+	if ( range > 0 ){
+		for ( int i=0; i<16; i++ ){
+			// Steps of range / 7 from lo : 7 is a0 (index 0), 0 is a1 (index 1), the others 8 - step
+			int step = ((block[i*4 + channel] - lo) * 14 + range) / (2 * range);
+			int index = step == 7 ? 0 : (step == 0 ? 1 : 8 - step);
+			indices |= (unsigned long long)index << (i * 3);
+		}
+	}
+	for ( int b=0; b<6; b++ )
+		out[2 + b] = (unsigned char)(indices >> (b * 8));
+}
+
+void compressBlocks(
+	const unsigned char * rgba,
+	unsigned int width,
+	unsigned int height,
+	BlockFormat format,
+	unsigned char * out
+){
+	unsigned int fourcc = blockFourCC(format);
+	unsigned int bytes = blockBytes(fourcc);
+	unsigned int blocks_x = (width + 3) / 4;
+	unsigned int blocks_y = (height + 3) / 4;
+
+	parallelFor(blocks_y, 4, [&](size_t begin, size_t end){
+		unsigned char block[64];
+		for ( size_t by=begin; by<end; by++ ){
+			for ( unsigned int bx=0; bx<blocks_x; bx++ ){
+				// Gather the block, repeating the edge pixels past the border
+				for ( int y=0; y<4; y++ ){
+					unsigned int sy = std::min((unsigned int)by * 4 + y, height - 1);
+					for ( int x=0; x<4; x++ ){
+						unsigned int sx = std::min(bx * 4 + x, width - 1);
+						memcpy(block + (y * 4 + x) * 4, rgba + (sy * width + sx) * 4, 4);
+					}
+				}
+
+				unsigned char * dst = out + (by * blocks_x + bx) * bytes;
+				switch ( format ){
+				case BLOCK_BC1:
+					compressColorBlock(block, dst);
+					break;
+				case BLOCK_BC3:
+					compressChannelBlock(block, 3, dst);
+					compressColorBlock(block, dst + 8);
+					break;
+				case BLOCK_BC5:
+					compressChannelBlock(block, 0, dst);
+					compressChannelBlock(block, 1, dst + 8);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+	});
+}
+
+// Half size with a 2x2 box filter, the last row and column are repeated on odd sizes
+static void downsample(const unsigned char * src, unsigned int width, unsigned int height,
+	unsigned char * dst, bool normal_map){
+	unsigned int w = std::max(width / 2, 1u);
+	unsigned int h = std::max(height / 2, 1u);
+
+	parallelFor(h, 16, [&](size_t begin, size_t end){
+		for ( size_t y=begin; y<end; y++ ){
+			const unsigned char * row0 = src + std::min((unsigned int)y * 2, height - 1) * width * 4;
+			const unsigned char * row1 = src + std::min((unsigned int)y * 2 + 1, height - 1) * width * 4;
+			unsigned char * out = dst + y * w * 4;
+			unsigned int x = 0;
+#ifdef BLOCK_SSE
+			// 4 source pixels to 2 : average the rows, then the neighbouring pixels
+			if ( width % 2 == 0 ){
+				for ( ; x + 2 <= w; x += 2 ){
+					__m128i v = _mm_avg_epu8(
+						_mm_loadu_si128((const __m128i *)(row0 + x * 8)),
+						_mm_loadu_si128((const __m128i *)(row1 + x * 8)));
+					__m128i even = _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 0, 2, 0));
+					__m128i odd = _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 1, 3, 1));
+					_mm_storel_epi64((__m128i *)(out + x * 4), _mm_avg_epu8(even, odd));
+				}
+			}
+#endif
+			for ( ; x<w; x++ ){
+				unsigned int x0 = std::min(x * 2, width - 1);
+				unsigned int x1 = std::min(x * 2 + 1, width - 1);
+				for ( int c=0; c<4; c++ )
+					out[x*4 + c] = (unsigned char)((row0[x0*4 + c] + row0[x1*4 + c] + row1[x0*4 + c] + row1[x1*4 + c] + 2) / 4);
+			}
+
+			if ( normal_map ){
+				for ( x=0; x<w; x++ ){
+					float n[3];
+					for ( int c=0; c<3; c++ )
+						n[c] = out[x*4 + c] / 127.5f - 1.0f;
+					float l = sqrtf(n[0]*n[0] + n[1]*n[1] + n[2]*n[2]);
+					if ( l > 0.0f )
+						for ( int c=0; c<3; c++ )
+							out[x*4 + c] = (unsigned char)std::min(255.0f, std::max(0.0f, (n[c] / l + 1.0f) * 127.5f + 0.5f));
+				}
+			}
+		}
+	});
+}
+
+void compressMipChain(
+	const unsigned char * rgba,
+	unsigned int width,
+	unsigned int height,
+	BlockFormat format,
+	bool normal_map,
+	CompressedImage & image
+){
+	image.fourcc = blockFourCC(format);
+	image.width = width;
+	image.height = height;
+	image.level_offsets.clear();
+	image.level_sizes.clear();
+
+	unsigned int total = 0;
+	for ( unsigned int w=width, h=height; ; w=std::max(w/2, 1u), h=std::max(h/2, 1u) ){
+		image.level_offsets.push_back(total);
+		image.level_sizes.push_back(blockLevelSize(image.fourcc, w, h));
+		total += image.level_sizes.back();
+		if ( w == 1 && h == 1 )
+			break;
+	}
+	image.data.resize(total);
+
+	std::vector<unsigned char> level(rgba, rgba + (size_t)width * height * 4);
+	std::vector<unsigned char> next;
+	unsigned int w = width, h = height;
+	for ( size_t l=0; l<image.level_offsets.size(); l++ ){
+		compressBlocks(&level[0], w, h, format, &image.data[image.level_offsets[l]]);
+		if ( l + 1 == image.level_offsets.size() )
+			break;
+		next.resize((size_t)std::max(w/2, 1u) * std::max(h/2, 1u) * 4);
+		downsample(&level[0], w, h, &next[0], normal_map);
+		level.swap(next);
+		w = std::max(w/2, 1u);
+		h = std::max(h/2, 1u);
+	}
+}
+
+bool writeDDS(const char * path, const CompressedImage & image){
+	FILE * file = fopen(path, "wb");
+	if ( !file ){
+		printf("%s could not be written\n", path);
+		return false;
+	}
+
+	unsigned int header[31];
+	memset(header, 0, sizeof(header));
+	header[0] = 124;                                 // size of the header
+	header[1] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // caps, height, width, pixel format, mip count, linear size
+	header[2] = image.height;
+	header[3] = image.width;
+	header[4] = image.level_sizes.empty() ? 0 : image.level_sizes[0];
+	header[6] = (unsigned int)image.level_sizes.size();
+	header[18] = 32;                                 // size of the pixel format
+	header[19] = 0x4;                                // fourcc
+	header[20] = image.fourcc;
+	header[26] = 0x1000 | 0x400000 | 0x8;            // texture, mipmap, complex
+
+	bool ok = fwrite("DDS ", 1, 4, file) == 4
+		&& fwrite(header, 4, 31, file) == 31
+		&& fwrite(&image.data[0], 1, image.data.size(), file) == image.data.size();
+	fclose(file);
+	if ( !ok )
+		printf("%s could not be written\n", path);
+	return ok;
+}
+
+bool readDDS(const char * path, CompressedImage & image){
+	FILE * file = fopen(path, "rb");
+	if ( !file )
+		return false;
+
+	char filecode[4];
+	unsigned int header[31];
+	if ( fread(filecode, 1, 4, file) != 4 || strncmp(filecode, "DDS ", 4) != 0 || fread(header, 4, 31, file) != 31 ){
+		fclose(file);
+		return false;
+	}
+	image.height = header[2];
+	image.width = header[3];
+	image.fourcc = header[20];
+	unsigned int levels = std::max(header[6], 1u);
+	if ( image.fourcc != FOURCC_DXT1 && image.fourcc != FOURCC_DXT3
+		&& image.fourcc != FOURCC_DXT5 && image.fourcc != FOURCC_ATI2 ){
+		fclose(file);
+		return false;
+	}
+	unsigned int max_levels = 1;
+	for ( unsigned int edge=std::max(image.width, image.height); edge>1; edge/=2 )
+		max_levels++;
+	if ( image.width == 0 || image.height == 0 || image.width > DDS_MAX_SIZE || image.height > DDS_MAX_SIZE
+		|| levels > max_levels ){
+		printf("%s : bad DDS header, %u x %u with %u levels\n", path, image.width, image.height, levels);
+		fclose(file);
+		return false;
+	}
+
+	// The exact size of every level, instead of trusting the linear size
+	image.level_offsets.clear();
+	image.level_sizes.clear();
+	size_t total = 0;
+	unsigned int w = image.width, h = image.height;
+	for ( unsigned int l=0; l<levels; l++ ){
+		image.level_offsets.push_back((unsigned int)total);
+		image.level_sizes.push_back(blockLevelSize(image.fourcc, w, h));
+		total += image.level_sizes.back();
+		w = std::max(w/2, 1u);
+		h = std::max(h/2, 1u);
+	}
+
+	// All of it has to be in the file, before anything is allocated for it
+	long start = ftell(file);
+	fseek(file, 0, SEEK_END);
+	long end = ftell(file);
+	if ( start < 0 || end < start || (size_t)(end - start) < total ){
+		printf("%s is truncated\n", path);
+		fclose(file);
+		return false;
+	}
+	fseek(file, start, SEEK_SET);
+	image.data.resize(total);
+	bool ok = fread(&image.data[0], 1, total, file) == total;
+	fclose(file);
+	return ok;
+}
@@ -0,0 +1,64 @@
+#ifndef BLOCKCOMPRESS_HPP
+#define BLOCKCOMPRESS_HPP
+
+#define FOURCC_DXT1 0x31545844 // Equivalent to "DXT1" in ASCII
+#define FOURCC_DXT3 0x33545844 // Equivalent to "DXT3" in ASCII
+#define FOURCC_DXT5 0x35545844 // Equivalent to "DXT5" in ASCII
+#define FOURCC_ATI2 0x32495441 // Equivalent to "ATI2" in ASCII, BC5
+
+enum BlockFormat{
+	BLOCK_NONE, // not compressed
+	BLOCK_BC1,  // RGB, 4 bits per pixel
+	BLOCK_BC3,  // RGBA, 8 bits per pixel
+	BLOCK_BC5   // two channels (RG), 8 bits per pixel, for normal maps
+};
+
+unsigned int blockFourCC(BlockFormat format);
+
+// Bytes per 4x4 block : 8 for DXT1, 16 for the others
+unsigned int blockBytes(unsigned int fourcc);
+
+// Size of a width x height level, partial blocks count as whole ones
+unsigned int blockLevelSize(unsigned int fourcc, unsigned int width, unsigned int height);
+
+// A block compressed image with its mip chain, largest level first
+struct CompressedImage{
+	unsigned int fourcc;
+	unsigned int width, height;
+	std::vector<unsigned int> level_offsets;
+	std::vector<unsigned int> level_sizes;
+	std::vector<unsigned char> data;
+};
+
+// Compresses one RGBA level, the block rows spread over the cores.
+// out needs blockLevelSize bytes.
+void compressBlocks(
+	const unsigned char * rgba,
+	unsigned int width,
+	unsigned int height,
+	BlockFormat format,
+	unsigned char * out
+);
+
+// Box filters the RGBA image down to 1x1 and compresses every level.
+// Normal maps are renormalized after each filtering step.
+void compressMipChain(
+	const unsigned char * rgba,
+	unsigned int width,
+	unsigned int height,
+	BlockFormat format,
+	bool normal_map,
+	CompressedImage & image
+);
+
+// Edge readDDS accepts at most, the GL_MAX_TEXTURE_SIZE of the GPUs we run on.
+// Checked without a context, the file may be read on a worker thread.
+#define DDS_MAX_SIZE 16384
+
+// DDS files with a DXT1, DXT5 or ATI2 fourcc and a full mip chain.
+// readDDS rejects headers it can't trust : an empty or oversized image, more
+// levels than the chain has, or more data than the file holds.
+bool writeDDS(const char * path, const CompressedImage & image);
+bool readDDS(const char * path, CompressedImage & image);
+
+#endif
@@ -0,0 +1,560 @@
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <math.h>
+#include <float.h>
+
+#include <glm/glm.hpp>
+
+#include "parallel.hpp"
+#include "bvh.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BVH_SSE 1
+#endif
+
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE 4      // below this a node is always a leaf
+#define BVH_MAX_LEAF_SIZE 16 // above this a node is always split
+#define BVH_SAH_DEPTH 48     // past this depth, split at the median to bound the tree depth
+#define BVH_STACK_SIZE 256   // on the stack, deeper trees traverse with a heap stack
+#define BVH_PARALLEL_SIZE 4096
+
+// Binary tree built first, then collapsed into the 4 wide nodes
+struct BVHBuildNode{
+	glm::vec3 lo, hi;
+	BVHBuildNode * child[2];
+	unsigned int first, count;
+
+	BVHBuildNode(){ child[0] = child[1] = NULL; }
+	~BVHBuildNode(){ delete child[0]; delete child[1]; }
+};
+
+struct BuildTriangle{
+	glm::vec3 lo, hi, centroid;
+};
+
+struct BuildContext{
+	const std::vector<BuildTriangle> * triangles;
+	unsigned int * order;
+	int spawn_depth;
+};
+
+static float surfaceArea(const glm::vec3 & lo, const glm::vec3 & hi){
+	glm::vec3 d = hi - lo;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+static void buildNode(BVHBuildNode * node, unsigned int first, unsigned int count,
+	const BuildContext & context, int depth);
+
+static void buildChildren(BVHBuildNode * node, unsigned int first, unsigned int split, unsigned int count,
+	const BuildContext & context, int depth){
+	node->child[0] = new BVHBuildNode();
+	node->child[1] = new BVHBuildNode();
+
+	// The two halves own disjoint ranges of the order, so they can be built at the same time
+	if ( count > BVH_PARALLEL_SIZE && depth < context.spawn_depth ){
+		std::thread left(buildNode, node->child[0], first, split, std::cref(context), depth + 1);
+		buildNode(node->child[1], first + split, count - split, context, depth + 1);
+		left.join();
+	}
+	else {
+		buildNode(node->child[0], first, split, context, depth + 1);
+		buildNode(node->child[1], first + split, count - split, context, depth + 1);
+	}
+}
+
+static void buildNode(BVHBuildNode * node, unsigned int first, unsigned int count,
+	const BuildContext & context, int depth){
+	const std::vector<BuildTriangle> & triangles = *context.triangles;
+	unsigned int * order = context.order;
+
+	glm::vec3 lo(FLT_MAX), hi(-FLT_MAX), centroid_lo(FLT_MAX), centroid_hi(-FLT_MAX);
+	for ( unsigned int i=first; i<first+count; i++ ){
+		const BuildTriangle & t = triangles[order[i]];
+		lo = glm::min(lo, t.lo);
+		hi = glm::max(hi, t.hi);
+		centroid_lo = glm::min(centroid_lo, t.centroid);
+		centroid_hi = glm::max(centroid_hi, t.centroid);
+	}
+	node->lo = lo;
+	node->hi = hi;
+	node->first = first;
+	node->count = count;
+	if ( count <= BVH_LEAF_SIZE )
+		return;
+
+	// Binned SAH : sort the centroids into bins along each axis,
+	// and evaluate the cost of splitting between every two bins
+	float best_cost = FLT_MAX;
+	int best_axis = -1;
+	int best_bin = 0;
+	if ( depth < BVH_SAH_DEPTH ){
+		for ( int axis=0; axis<3; axis++ ){
+			float extent = centroid_hi[axis] - centroid_lo[axis];
+			if ( extent <= 0.0f )
+				continue;
+			float scale = BVH_BINS / extent;
+
+			glm::vec3 bin_lo[BVH_BINS], bin_hi[BVH_BINS];
+			unsigned int bin_count[BVH_BINS];
+			for ( int b=0; b<BVH_BINS; b++ ){
+				bin_lo[b] = glm::vec3(FLT_MAX);
+				bin_hi[b] = glm::vec3(-FLT_MAX);
+				bin_count[b] = 0;
+			}
+			for ( unsigned int i=first; i<first+count; i++ ){
+				const BuildTriangle & t = triangles[order[i]];
+				int b = std::min((int)((t.centroid[axis] - centroid_lo[axis]) * scale), BVH_BINS - 1);
+				bin_lo[b] = glm::min(bin_lo[b], t.lo);
+				bin_hi[b] = glm::max(bin_hi[b], t.hi);
+				bin_count[b]++;
+			}
+
+			// Right side areas swept from the end, left side from the start
+			float right_area[BVH_BINS];
+			unsigned int right_count[BVH_BINS];
+			glm::vec3 r_lo(FLT_MAX), r_hi(-FLT_MAX);
+			unsigned int r_count = 0;
+			for ( int b=BVH_BINS-1; b>0; b-- ){
+				r_lo = glm::min(r_lo, bin_lo[b]);
+				r_hi = glm::max(r_hi, bin_hi[b]);
+				r_count += bin_count[b];
+				right_area[b] = r_count ? surfaceArea(r_lo, r_hi) : 0.0f;
+				right_count[b] = r_count;
+			}
+			glm::vec3 l_lo(FLT_MAX), l_hi(-FLT_MAX);
+			unsigned int l_count = 0;
+			for ( int b=0; b<BVH_BINS-1; b++ ){
+				l_lo = glm::min(l_lo, bin_lo[b]);
+				l_hi = glm::max(l_hi, bin_hi[b]);
+				l_count += bin_count[b];
+				if ( l_count == 0 || right_count[b+1] == 0 )
+					continue;
+				float cost = surfaceArea(l_lo, l_hi) * l_count + right_area[b+1] * right_count[b+1];
+				if ( cost < best_cost ){
+					best_cost = cost;
+					best_axis = axis;
+					best_bin = b;
+				}
+			}
+		}
+	}
+
+	// Traversal costs about as much as one triangle test
+	float area = surfaceArea(lo, hi);
+	if ( count <= BVH_MAX_LEAF_SIZE && (best_axis < 0 ? depth < BVH_SAH_DEPTH : best_cost >= (count - 1.0f) * area) )
+		return;
+
+	unsigned int split = count / 2;
+	if ( best_axis >= 0 ){
+		float scale = BVH_BINS / (centroid_hi[best_axis] - centroid_lo[best_axis]);
+		float origin = centroid_lo[best_axis];
+		unsigned int * middle = std::partition(order + first, order + first + count,
+			[&](unsigned int t){
+				int b = std::min((int)((triangles[t].centroid[best_axis] - origin) * scale), BVH_BINS - 1);
+				return b <= best_bin;
+			});
+		split = (unsigned int)(middle - (order + first));
+	}
+	else {
+		// All the centroids in one point, or too deep : split at the median of the longest axis
+		glm::vec3 d = centroid_hi - centroid_lo;
+		int axis = d.x > d.y ? (d.x > d.z ? 0 : 2) : (d.y > d.z ? 1 : 2);
+		std::nth_element(order + first, order + first + split, order + first + count,
+			[&](unsigned int a, unsigned int b){ return triangles[a].centroid[axis] < triangles[b].centroid[axis]; });
+	}
+	if ( split == 0 || split == count )
+		split = count / 2;
+
+	buildChildren(node, first, split, count, context, depth);
+}
+
+TriangleBVH::TriangleBVH() : tree_depth(0), stack_capacity(1){
+}
+
+void TriangleBVH::build(const std::vector<glm::vec3> & positions){
+	std::vector<unsigned int> soup(positions.size() / 3 * 3);
+	for ( size_t i=0; i<soup.size(); i++ )
+		soup[i] = (unsigned int)i;
+	build(positions, soup);
+}
+
+void TriangleBVH::build(const std::vector<glm::vec3> & input_positions, const std::vector<unsigned int> & input_indices){
+	nodes.clear();
+	tree_depth = 0;
+	stack_capacity = 1;
+	positions = input_positions;
+	size_t triangle_count = input_indices.size() / 3;
+	indices.resize(triangle_count * 3);
+	triangle_ids.resize(triangle_count);
+	if ( triangle_count == 0 )
+		return;
+
+	std::vector<BuildTriangle> triangles(triangle_count);
+	parallelFor(triangle_count, 4096, [&](size_t begin, size_t end){
+		for ( size_t t=begin; t<end; t++ ){
+			const glm::vec3 & a = positions[input_indices[t*3]];
+			const glm::vec3 & b = positions[input_indices[t*3+1]];
+			const glm::vec3 & c = positions[input_indices[t*3+2]];
+			triangles[t].lo = glm::min(a, glm::min(b, c));
+			triangles[t].hi = glm::max(a, glm::max(b, c));
+			triangles[t].centroid = (triangles[t].lo + triangles[t].hi) * 0.5f;
+		}
+	});
+
+	std::vector<unsigned int> order(triangle_count);
+	for ( size_t t=0; t<triangle_count; t++ )
+		order[t] = (unsigned int)t;
+
+	// One thread per subtree from the top levels down, about two per core
+	int spawn_depth = 1;
+	while ( (1u << spawn_depth) < 2 * std::max(1u, std::thread::hardware_concurrency()) )
+		spawn_depth++;
+
+	BuildContext context = { &triangles, &order[0], spawn_depth };
+	BVHBuildNode root;
+	buildNode(&root, 0, (unsigned int)triangle_count, context, 0);
+
+	// The leaves point into the triangles sorted in the build order
+	for ( size_t t=0; t<triangle_count; t++ ){
+		triangle_ids[t] = order[t];
+		for ( int k=0; k<3; k++ )
+			indices[t*3 + k] = input_indices[order[t]*3 + k];
+	}
+
+	if ( root.child[0] == NULL ){
+		// A single leaf still needs a node
+		BVHBuildNode wrapper;
+		wrapper.child[0] = &root;
+		flatten(&wrapper);
+		wrapper.child[0] = NULL;
+	}
+	else
+		flatten(&root);
+
+	// Children come after their parent, one forward walk finds every depth
+	std::vector<int> levels(nodes.size(), 1);
+	for ( size_t i=0; i<nodes.size(); i++ ){
+		tree_depth = std::max(tree_depth, levels[i]);
+		for ( int k=0; k<4; k++ )
+			if ( nodes[i].child[k] >= 0 && nodes[i].count[k] == 0 )
+				levels[nodes[i].child[k]] = levels[i] + 1;
+	}
+	stack_capacity = 3 * (size_t)tree_depth + 1;
+}
+
+// Pulls the grandchildren up into the node until it has 4 children,
+// opening the biggest inner child first
+int TriangleBVH::flatten(const BVHBuildNode * node){
+	const BVHBuildNode * slots[4];
+	int slot_count = 0;
+	for ( int k=0; k<2; k++ )
+		if ( node->child[k] )
+			slots[slot_count++] = node->child[k];
+
+	while ( slot_count < 4 ){
+		int open = -1;
+		float open_area = -1.0f;
+		for ( int k=0; k<slot_count; k++ ){
+			if ( slots[k]->child[0] == NULL )
+				continue;
+			float area = surfaceArea(slots[k]->lo, slots[k]->hi);
+			if ( area > open_area ){
+				open_area = area;
+				open = k;
+			}
+		}
+		if ( open < 0 )
+			break;
+		const BVHBuildNode * opened = slots[open];
+		slots[open] = opened->child[0];
+		slots[slot_count++] = opened->child[1];
+	}
+
+	int index = (int)nodes.size();
+	nodes.push_back(Node());
+	for ( int k=0; k<4; k++ ){
+		Node & n = nodes[index];
+		if ( k >= slot_count ){
+			n.lo_x[k] = n.lo_y[k] = n.lo_z[k] = FLT_MAX;
+			n.hi_x[k] = n.hi_y[k] = n.hi_z[k] = -FLT_MAX;
+			n.child[k] = -1;
+			n.count[k] = 0;
+			continue;
+		}
+		const BVHBuildNode * s = slots[k];
+		n.lo_x[k] = s->lo.x; n.lo_y[k] = s->lo.y; n.lo_z[k] = s->lo.z;
+		n.hi_x[k] = s->hi.x; n.hi_y[k] = s->hi.y; n.hi_z[k] = s->hi.z;
+		if ( s->child[0] == NULL ){
+			n.child[k] = (int)s->first;
+			n.count[k] = s->count;
+		}
+		else {
+			// nodes may grow in the recursion, don't keep the reference across it
+			int child = flatten(s);
+			nodes[index].child[k] = child;
+			nodes[index].count[k] = 0;
+		}
+	}
+	return index;
+}
+
+void TriangleBVH::refit(const std::vector<glm::vec3> & new_positions){
+	positions = new_positions;
+
+	// Children always come after their parent, so a backward walk sees them first
+	for ( size_t i=nodes.size(); i-- > 0; ){
+		Node & n = nodes[i];
+		for ( int k=0; k<4; k++ ){
+			if ( n.child[k] < 0 )
+				continue;
+			glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+			if ( n.count[k] > 0 ){
+				for ( unsigned int t=n.child[k]; t<n.child[k]+n.count[k]; t++ ){
+					for ( int v=0; v<3; v++ ){
+						lo = glm::min(lo, positions[indices[t*3+v]]);
+						hi = glm::max(hi, positions[indices[t*3+v]]);
+					}
+				}
+			}
+			else {
+				const Node & c = nodes[n.child[k]];
+				for ( int j=0; j<4; j++ ){
+					if ( c.child[j] < 0 )
+						continue;
+					lo = glm::min(lo, glm::vec3(c.lo_x[j], c.lo_y[j], c.lo_z[j]));
+					hi = glm::max(hi, glm::vec3(c.hi_x[j], c.hi_y[j], c.hi_z[j]));
+				}
+			}
+			n.lo_x[k] = lo.x; n.lo_y[k] = lo.y; n.lo_z[k] = lo.z;
+			n.hi_x[k] = hi.x; n.hi_y[k] = hi.y; n.hi_z[k] = hi.z;
+		}
+	}
+}
+
+// Moller-Trumbore, both sides
+static bool intersectTriangle(const glm::vec3 & origin, const glm::vec3 & direction,
+	const glm::vec3 & a, const glm::vec3 & b, const glm::vec3 & c,
+	float & t, float & u, float & v){
+	glm::vec3 e1 = b - a;
+	glm::vec3 e2 = c - a;
+	glm::vec3 p = glm::cross(direction, e2);
+	float det = glm::dot(e1, p);
+	if ( fabsf(det) < 1e-12f )
+		return false;
+	float inv_det = 1.0f / det;
+	glm::vec3 s = origin - a;
+	u = glm::dot(s, p) * inv_det;
+	if ( u < 0.0f || u > 1.0f )
+		return false;
+	glm::vec3 q = glm::cross(s, e1);
+	v = glm::dot(direction, q) * inv_det;
+	if ( v < 0.0f || u + v > 1.0f )
+		return false;
+	t = glm::dot(e2, q) * inv_det;
+	return true;
+}
+
+bool TriangleBVH::intersectLeaf(const glm::vec3 & origin, const glm::vec3 & direction,
+	unsigned int first, unsigned int count, RayHit & hit) const {
+	bool found = false;
+	for ( unsigned int i=first; i<first+count; i++ ){
+		float t, u, v;
+		if ( intersectTriangle(origin, direction, positions[indices[i*3]], positions[indices[i*3+1]],
+			positions[indices[i*3+2]], t, u, v) && t >= 0.0f && t < hit.t ){
+			hit.t = t;
+			hit.u = u;
+			hit.v = v;
+			hit.triangle = triangle_ids[i];
+			found = true;
+		}
+	}
+	return found;
+}
+
+static glm::vec3 inverseDirection(const glm::vec3 & d){
+	// A huge value instead of infinity keeps 0 * inf out of the slab test
+	return glm::vec3(
+		d.x != 0.0f ? 1.0f / d.x : 1e30f,
+		d.y != 0.0f ? 1.0f / d.y : 1e30f,
+		d.z != 0.0f ? 1.0f / d.z : 1e30f);
+}
+
+bool TriangleBVH::intersect(const Ray & ray, RayHit & hit) const {
+	hit.t = ray.t_max;
+	hit.triangle = BVH_NO_HIT;
+	hit.u = hit.v = 0.0f;
+	if ( nodes.empty() )
+		return false;
+
+	glm::vec3 inv = inverseDirection(ray.direction);
+	int local_stack[BVH_STACK_SIZE];
+	std::vector<int> heap_stack;
+	int * stack = local_stack;
+	if ( stack_capacity > BVH_STACK_SIZE ){
+		heap_stack.resize(stack_capacity);
+		stack = &heap_stack[0];
+	}
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+#ifdef BVH_SSE
+	__m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+	__m128 ix = _mm_set1_ps(inv.x), iy = _mm_set1_ps(inv.y), iz = _mm_set1_ps(inv.z);
+#endif
+
+	while ( stack_size > 0 ){
+		const Node & n = nodes[stack[--stack_size]];
+
+		// Slab test of the 4 child boxes
+		float entry[4];
+		int mask;
+#ifdef BVH_SSE
+		__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.lo_x), ox), ix);
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.hi_x), ox), ix);
+		__m128 tmin = _mm_min_ps(t0, t1);
+		__m128 tmax = _mm_max_ps(t0, t1);
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.lo_y), oy), iy);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.hi_y), oy), iy);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.lo_z), oz), iz);
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n.hi_z), oz), iz);
+		tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+		tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+		tmin = _mm_max_ps(tmin, _mm_setzero_ps());
+		tmax = _mm_min_ps(tmax, _mm_set1_ps(hit.t));
+		mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+		_mm_storeu_ps(entry, tmin);
+#else
+		mask = 0;
+		for ( int k=0; k<4; k++ ){
+			float t0x = (n.lo_x[k] - ray.origin.x) * inv.x, t1x = (n.hi_x[k] - ray.origin.x) * inv.x;
+			float t0y = (n.lo_y[k] - ray.origin.y) * inv.y, t1y = (n.hi_y[k] - ray.origin.y) * inv.y;
+			float t0z = (n.lo_z[k] - ray.origin.z) * inv.z, t1z = (n.hi_z[k] - ray.origin.z) * inv.z;
+			float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.0f));
+			float tmax = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), hit.t));
+			entry[k] = tmin;
+			if ( tmin <= tmax )
+				mask |= 1 << k;
+		}
+#endif
+
+		// Leaves right away, inner nodes pushed far to near so the nearest is visited first
+		int inner[4];
+		int inner_count = 0;
+		for ( int k=0; k<4; k++ ){
+			if ( !(mask & (1 << k)) || n.child[k] < 0 )
+				continue;
+			if ( n.count[k] > 0 )
+				intersectLeaf(ray.origin, ray.direction, n.child[k], n.count[k], hit);
+			else
+				inner[inner_count++] = k;
+		}
+		for ( int i=1; i<inner_count; i++ )
+			for ( int j=i; j>0 && entry[inner[j]] > entry[inner[j-1]]; j-- )
+				std::swap(inner[j], inner[j-1]);
+		for ( int i=0; i<inner_count; i++ )
+			stack[stack_size++] = n.child[inner[i]];
+	}
+	return hit.triangle != BVH_NO_HIT;
+}
+
+void TriangleBVH::intersectPacket(const Ray rays[4], RayHit hits[4]) const {
+	for ( int r=0; r<4; r++ ){
+		hits[r].t = rays[r].t_max;
+		hits[r].triangle = BVH_NO_HIT;
+		hits[r].u = hits[r].v = 0.0f;
+	}
+	if ( nodes.empty() )
+		return;
+
+	// The rays as structure of arrays, a box is visited if any of them enters it
+	float ox[4], oy[4], oz[4], ix[4], iy[4], iz[4];
+	for ( int r=0; r<4; r++ ){
+		glm::vec3 inv = inverseDirection(rays[r].direction);
+		ox[r] = rays[r].origin.x; oy[r] = rays[r].origin.y; oz[r] = rays[r].origin.z;
+		ix[r] = inv.x; iy[r] = inv.y; iz[r] = inv.z;
+	}
+
+	int local_stack[BVH_STACK_SIZE];
+	std::vector<int> heap_stack;
+	int * stack = local_stack;
+	if ( stack_capacity > BVH_STACK_SIZE ){
+		heap_stack.resize(stack_capacity);
+		stack = &heap_stack[0];
+	}
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while ( stack_size > 0 ){
+		const Node & n = nodes[stack[--stack_size]];
+		for ( int k=3; k>=0; k-- ){
+			if ( n.child[k] < 0 )
+				continue;
+			int mask;
+#ifdef BVH_SSE
+			__m128 rox = _mm_loadu_ps(ox), roy = _mm_loadu_ps(oy), roz = _mm_loadu_ps(oz);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo_x[k]), rox), _mm_loadu_ps(ix));
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi_x[k]), rox), _mm_loadu_ps(ix));
+			__m128 tmin = _mm_min_ps(t0, t1);
+			__m128 tmax = _mm_max_ps(t0, t1);
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo_y[k]), roy), _mm_loadu_ps(iy));
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi_y[k]), roy), _mm_loadu_ps(iy));
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+			t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.lo_z[k]), roz), _mm_loadu_ps(iz));
+			t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.hi_z[k]), roz), _mm_loadu_ps(iz));
+			tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+			tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+			tmin = _mm_max_ps(tmin, _mm_setzero_ps());
+			tmax = _mm_min_ps(tmax, _mm_setr_ps(hits[0].t, hits[1].t, hits[2].t, hits[3].t));
+			mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+#else
+			mask = 0;
+			for ( int r=0; r<4; r++ ){
+				float t0x = (n.lo_x[k] - ox[r]) * ix[r], t1x = (n.hi_x[k] - ox[r]) * ix[r];
+				float t0y = (n.lo_y[k] - oy[r]) * iy[r], t1y = (n.hi_y[k] - oy[r]) * iy[r];
+				float t0z = (n.lo_z[k] - oz[r]) * iz[r], t1z = (n.hi_z[k] - oz[r]) * iz[r];
+				float tmin = std::max(std::max(std::min(t0x, t1x), std::min(t0y, t1y)), std::max(std::min(t0z, t1z), 0.0f));
+				float tmax = std::min(std::min(std::max(t0x, t1x), std::max(t0y, t1y)), std::min(std::max(t0z, t1z), hits[r].t));
+				if ( tmin <= tmax )
+					mask |= 1 << r;
+			}
+#endif
+			if ( mask == 0 )
+				continue;
+			if ( n.count[k] > 0 ){
+				for ( int r=0; r<4; r++ )
+					if ( mask & (1 << r) )
+						intersectLeaf(rays[r].origin, rays[r].direction, n.child[k], n.count[k], hits[r]);
+			}
+			else
+				stack[stack_size++] = n.child[k];
+		}
+	}
+}
+
+void TriangleBVH::intersect(const Ray * rays, RayHit * hits, size_t count) const {
+	size_t packets = (count + 3) / 4;
+	parallelFor(packets, 64, [&](size_t begin, size_t end){
+		for ( size_t p=begin; p<end; p++ ){
+			Ray packet[4];
+			RayHit packet_hits[4];
+			for ( int r=0; r<4; r++ ){
+				// The last packet is padded with rays that can't hit anything
+				size_t i = p * 4 + r;
+				packet[r] = i < count ? rays[i] : rays[count - 1];
+				if ( i >= count )
+					packet[r].t_max = -1.0f;
+			}
+			intersectPacket(packet, packet_hits);
+			for ( int r=0; r<4 && p*4+r<count; r++ )
+				hits[p*4 + r] = packet_hits[r];
+		}
+	});
+}
@@ -0,0 +1,75 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#define BVH_NO_HIT 0xffffffffu
+
+struct Ray{
+	glm::vec3 origin;
+	glm::vec3 direction; // doesn't need to be normalized, t is in units of it
+	float t_max;
+};
+
+struct RayHit{
+	float t;
+	unsigned int triangle; // index of the triangle in the build input, BVH_NO_HIT if none
+	float u, v;            // barycentric coordinates of the hit on that triangle
+};
+
+struct BVHBuildNode;
+
+// Bounding volume hierarchy over the triangles of one mesh.
+// Built as a binary tree with binned SAH, the big subtrees on their own thread,
+// then collapsed so every node holds 4 child boxes, which a ray tests at once with SSE.
+class TriangleBVH{
+public:
+	TriangleBVH();
+
+	// Indexed triangle list
+	void build(const std::vector<glm::vec3> & positions, const std::vector<unsigned int> & indices);
+	// Triangle soup, 3 vertices per triangle, as loadOBJ returns them
+	void build(const std::vector<glm::vec3> & positions);
+
+	// Moves the vertices and recomputes the boxes bottom-up, keeping the tree.
+	// Fine for animation, but the tree gets slower the further the mesh moves
+	// from the pose it was built for.
+	void refit(const std::vector<glm::vec3> & positions);
+
+	// Closest hit along the ray, in the model space of the mesh
+	bool intersect(const Ray & ray, RayHit & hit) const;
+
+	// 4 rays traversed together, for coherent rays such as a pixel block
+	void intersectPacket(const Ray rays[4], RayHit hits[4]) const;
+
+	// Any number of rays, as packets of 4 spread over the cores
+	void intersect(const Ray * rays, RayHit * hits, size_t count) const;
+
+	size_t nodeCount() const { return nodes.size(); }
+	// Levels of 4-wide nodes, the traversal stacks are sized from it
+	int depth() const { return tree_depth; }
+	size_t triangleCount() const { return triangle_ids.size(); }
+
+private:
+	// 4 child boxes as structure of arrays. A child with count > 0 is a leaf of
+	// count triangles from child on, an inner node has count == 0 and child
+	// is its node index, and an empty slot has child < 0.
+	struct Node{
+		float lo_x[4], lo_y[4], lo_z[4];
+		float hi_x[4], hi_y[4], hi_z[4];
+		int child[4];
+		unsigned int count[4];
+	};
+
+	int flatten(const BVHBuildNode * node);
+
+	bool intersectLeaf(const glm::vec3 & origin, const glm::vec3 & direction,
+		unsigned int first, unsigned int count, RayHit & hit) const;
+
+	std::vector<Node> nodes;
+	int tree_depth;
+	size_t stack_capacity; // 3 per level below the root, a node pops itself and pushes at most 4
+	std::vector<glm::vec3> positions;
+	std::vector<unsigned int> indices;      // 3 per triangle, in leaf order
+	std::vector<unsigned int> triangle_ids; // leaf order to build input order
+};
+
+#endif
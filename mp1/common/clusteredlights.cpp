@@ -0,0 +1,202 @@
+#include <math.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.hpp"
+#include "parallel.hpp"
+#include "clusteredlights.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define CLUSTERED_LIGHTS_SSE 1
+#endif
+
+#define CLUSTER_TILES (CLUSTER_TILES_X * CLUSTER_TILES_Y)
+
+ClusteredLights::ClusteredLights() : fov_y(0.0f), aspect_ratio(0.0f), near_plane(0.0f), far_plane(0.0f),
+	screen_width(1), screen_height(1), max_cluster_lights(0), bin_ms(0.0){
+	for ( int i=0; i<3; i++ )
+		buffers[i] = textures[i] = 0;
+}
+
+bool ClusteredLights::create(){
+	// lights as 3 RGBA texels each, then (offset, count) per cluster, then the light indices
+	static const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+	glGenBuffers(3, buffers);
+	glGenTextures(3, textures);
+	for ( int i=0; i<3; i++ ){
+		glState.bindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+		glState.bindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+	}
+	slice_lights.resize(CLUSTER_SLICES);
+	cluster_lights.resize(CLUSTER_COUNT);
+	ranges.resize(2 * CLUSTER_COUNT);
+	return true;
+}
+
+void ClusteredLights::setProjection(float fov_y_degrees, float aspect, float near, float far){
+	if ( fov_y_degrees == fov_y && aspect == aspect_ratio && near == near_plane && far == far_plane )
+		return;
+	fov_y = fov_y_degrees;
+	aspect_ratio = aspect;
+	near_plane = near;
+	far_plane = far;
+
+	float tan_y = tanf(fov_y_degrees * 0.5f * 3.14159265f / 180.0f);
+	float tan_x = tan_y * aspect;
+	min_x.resize(CLUSTER_COUNT); min_y.resize(CLUSTER_COUNT); min_z.resize(CLUSTER_COUNT);
+	max_x.resize(CLUSTER_COUNT); max_y.resize(CLUSTER_COUNT); max_z.resize(CLUSTER_COUNT);
+	for ( int slice=0; slice<CLUSTER_SLICES; slice++ ){
+		float d0 = near * powf(far / near, (float)slice / CLUSTER_SLICES);
+		float d1 = near * powf(far / near, (float)(slice + 1) / CLUSTER_SLICES);
+		for ( int y=0; y<CLUSTER_TILES_Y; y++ ){
+			float y0 = (-1.0f + 2.0f * y / CLUSTER_TILES_Y) * tan_y;
+			float y1 = (-1.0f + 2.0f * (y + 1) / CLUSTER_TILES_Y) * tan_y;
+			for ( int x=0; x<CLUSTER_TILES_X; x++ ){
+				float x0 = (-1.0f + 2.0f * x / CLUSTER_TILES_X) * tan_x;
+				float x1 = (-1.0f + 2.0f * (x + 1) / CLUSTER_TILES_X) * tan_x;
+				// the tile widens with depth, the box holds both ends of the slice
+				int c = (slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x;
+				min_x[c] = std::min(x0 * d0, x0 * d1);
+				max_x[c] = std::max(x1 * d0, x1 * d1);
+				min_y[c] = std::min(y0 * d0, y0 * d1);
+				max_y[c] = std::max(y1 * d0, y1 * d1);
+				min_z[c] = d0;
+				max_z[c] = d1;
+			}
+		}
+	}
+}
+
+// Every light of the slice against its clusters, the distance from the
+// sphere's center to each box against the radius
+void ClusteredLights::binSlice(int slice, const std::vector<glm::vec4> & spheres){
+	int base = slice * CLUSTER_TILES;
+	for ( int k=0; k<CLUSTER_TILES; k++ )
+		cluster_lights[base + k].clear();
+	const std::vector<unsigned int> & lights = slice_lights[slice];
+	for ( size_t i=0; i<lights.size(); i++ ){
+		const glm::vec4 & sphere = spheres[lights[i]];
+#ifdef CLUSTERED_LIGHTS_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 cx = _mm_set1_ps(sphere.x), cy = _mm_set1_ps(sphere.y), cz = _mm_set1_ps(sphere.z);
+		__m128 r2 = _mm_set1_ps(sphere.w * sphere.w);
+		for ( int k=0; k<CLUSTER_TILES; k+=4 ){
+			int c = base + k;
+			__m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&min_x[c]), cx), _mm_sub_ps(cx, _mm_loadu_ps(&max_x[c]))), zero);
+			__m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&min_y[c]), cy), _mm_sub_ps(cy, _mm_loadu_ps(&max_y[c]))), zero);
+			__m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(_mm_loadu_ps(&min_z[c]), cz), _mm_sub_ps(cz, _mm_loadu_ps(&max_z[c]))), zero);
+			__m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+			int mask = _mm_movemask_ps(_mm_cmple_ps(d2, r2));
+			for ( ; mask; mask &= mask - 1 ){
+				int bit = mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3;
+				cluster_lights[c + bit].push_back(lights[i]);
+			}
+		}
+#else
+		for ( int k=0; k<CLUSTER_TILES; k++ ){
+			int c = base + k;
+			float dx = std::max(std::max(min_x[c] - sphere.x, sphere.x - max_x[c]), 0.0f);
+			float dy = std::max(std::max(min_y[c] - sphere.y, sphere.y - max_y[c]), 0.0f);
+			float dz = std::max(std::max(min_z[c] - sphere.z, sphere.z - max_z[c]), 0.0f);
+			if ( dx * dx + dy * dy + dz * dz <= sphere.w * sphere.w )
+				cluster_lights[c].push_back(lights[i]);
+		}
+#endif
+	}
+}
+
+void ClusteredLights::update(const std::vector<ClusteredLight> & lights, const glm::mat4 & view, int width, int height){
+	if ( far_plane <= near_plane || near_plane <= 0.0f ){
+		printf("Clustered lights : setProjection() comes before update()\n");
+		return;
+	}
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	screen_width = width > 0 ? width : 1;
+	screen_height = height > 0 ? height : 1;
+
+	// view space spheres, and the slices each one's depth range covers
+	std::vector<glm::vec4> spheres(lights.size());
+	for ( int s=0; s<CLUSTER_SLICES; s++ )
+		slice_lights[s].clear();
+	float slice_scale = CLUSTER_SLICES / logf(far_plane / near_plane);
+	light_data.resize(lights.size() * 12);
+	for ( size_t i=0; i<lights.size(); i++ ){
+		const ClusteredLight & light = lights[i];
+		float * data = &light_data[i * 12];
+		data[0] = light.position.x; data[1] = light.position.y; data[2] = light.position.z; data[3] = light.radius;
+		data[4] = light.color.x; data[5] = light.color.y; data[6] = light.color.z; data[7] = light.spot_cos_outer;
+		data[8] = light.direction.x; data[9] = light.direction.y; data[10] = light.direction.z; data[11] = light.spot_cos_inner;
+
+		glm::vec4 center = view * glm::vec4(light.position, 1.0f);
+		float depth = -center.z;
+		spheres[i] = glm::vec4(center.x, center.y, depth, light.radius);
+		if ( depth + light.radius < near_plane || depth - light.radius > far_plane )
+			continue;
+		int first = (int)(logf(std::max(depth - light.radius, near_plane) / near_plane) * slice_scale);
+		int last = (int)(logf(std::min(depth + light.radius, far_plane) / near_plane) * slice_scale);
+		first = std::max(first, 0);
+		last = std::min(last, CLUSTER_SLICES - 1);
+		for ( int s=first; s<=last; s++ )
+			slice_lights[s].push_back((unsigned int)i);
+	}
+
+	// the slices write disjoint clusters, no locking
+	parallelFor(CLUSTER_SLICES, 1, [this, &spheres](size_t begin, size_t end){
+		for ( size_t s=begin; s<end; s++ )
+			binSlice((int)s, spheres);
+	});
+
+	indices.clear();
+	max_cluster_lights = 0;
+	for ( int c=0; c<CLUSTER_COUNT; c++ ){
+		unsigned int count = (unsigned int)std::min(cluster_lights[c].size(), (size_t)CLUSTER_MAX_LIGHTS);
+		ranges[2 * c] = (unsigned int)indices.size();
+		ranges[2 * c + 1] = count;
+		indices.insert(indices.end(), cluster_lights[c].begin(), cluster_lights[c].begin() + count);
+		max_cluster_lights = std::max(max_cluster_lights, count);
+	}
+
+	// orphaned every frame, the draws of the last one may still read the old storage
+	const void * data[3] = { light_data.empty() ? NULL : &light_data[0], &ranges[0], indices.empty() ? NULL : &indices[0] };
+	size_t sizes[3] = { light_data.size() * sizeof(float), ranges.size() * sizeof(unsigned int), indices.size() * sizeof(unsigned int) };
+	for ( int i=0; i<3; i++ ){
+		glState.bindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+		glBufferData(GL_TEXTURE_BUFFER, std::max(sizes[i], (size_t)16), NULL, GL_STREAM_DRAW);
+		if ( sizes[i] > 0 )
+			glBufferSubData(GL_TEXTURE_BUFFER, 0, sizes[i], data[i]);
+	}
+	bin_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void ClusteredLights::bind(GLuint light_unit, GLuint range_unit, GLuint index_unit) const{
+	glState.bindTexture(light_unit, GL_TEXTURE_BUFFER, textures[0]);
+	glState.bindTexture(range_unit, GL_TEXTURE_BUFFER, textures[1]);
+	glState.bindTexture(index_unit, GL_TEXTURE_BUFFER, textures[2]);
+}
+
+void ClusteredLights::setUniforms(GLuint program) const{
+	float slice_scale = CLUSTER_SLICES / logf(far_plane / near_plane);
+	glState.uniform4f(glGetUniformLocation(program, "cluster_grid"),
+		(float)CLUSTER_TILES_X / screen_width, (float)CLUSTER_TILES_Y / screen_height,
+		slice_scale, -logf(near_plane) * slice_scale);
+	glState.uniform4f(glGetUniformLocation(program, "cluster_depth"), near_plane, far_plane, 0.0f, 0.0f);
+}
+
+void ClusteredLights::release(){
+	for ( int i=0; i<3; i++ ){
+		glState.forgetTexture(textures[i]);
+		glState.forgetBuffer(buffers[i]);
+	}
+	glDeleteTextures(3, textures);
+	glDeleteBuffers(3, buffers);
+	for ( int i=0; i<3; i++ )
+		buffers[i] = textures[i] = 0;
+}
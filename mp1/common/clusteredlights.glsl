@@ -0,0 +1,56 @@
+// The lights of clusteredlights.hpp, after lighting.glsl for the material.
+// A fragment finds its cluster from its pixel and its depth, and loops over
+// the lights binned there only.
+
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 8
+#define CLUSTER_SLICES 24
+
+// 3 texels per light : position and radius, color and cos of the outer cone
+// (-2 for a point light), direction and cos of the inner cone
+uniform samplerBuffer cluster_light_data;
+// offset into cluster_light_indices and count, per cluster
+uniform usamplerBuffer cluster_ranges;
+uniform usamplerBuffer cluster_light_indices;
+// tiles per pixel in x and y, then the slice of a depth d is log(d) * z + w
+uniform vec4 cluster_grid;
+// near and far planes
+uniform vec4 cluster_depth;
+
+int cluster_index()
+{
+    float ndc = gl_FragCoord.z * 2.0 - 1.0;
+    float near = cluster_depth.x, far = cluster_depth.y;
+    float depth = 2.0 * near * far / (far + near - ndc * (far - near));
+    ivec3 cell = ivec3(gl_FragCoord.xy * cluster_grid.xy, log(depth) * cluster_grid.z + cluster_grid.w);
+    cell = clamp(cell, ivec3(0), ivec3(CLUSTER_TILES_X - 1, CLUSTER_TILES_Y - 1, CLUSTER_SLICES - 1));
+    return (cell.z * CLUSTER_TILES_Y + cell.y) * CLUSTER_TILES_X + cell.x;
+}
+
+// diffuse and specular of the cluster's lights with the material's colors
+vec3 clustered_lights(vec3 normal, vec3 world)
+{
+    vec3 viewDirection = normalize(camera.view_position - world);
+    uvec2 range = texelFetch(cluster_ranges, cluster_index()).xy;
+    vec3 sum = vec3(0.0);
+    for (uint i = 0u; i < range.y; i++)
+    {
+        int light = int(texelFetch(cluster_light_indices, int(range.x + i)).r);
+        vec4 position = texelFetch(cluster_light_data, 3 * light);
+        vec4 color = texelFetch(cluster_light_data, 3 * light + 1);
+        vec4 spot = texelFetch(cluster_light_data, 3 * light + 2);
+
+        vec3 toLight = position.xyz - world;
+        float distance = length(toLight);
+        vec3 surfaceToLight = toLight / max(distance, 1e-5);
+        float falloff = clamp(1.0 - distance * distance / (position.w * position.w), 0.0, 1.0);
+        falloff *= falloff;
+        if (color.w > -1.5)
+            falloff *= smoothstep(color.w, spot.w, dot(-surfaceToLight, spot.xyz));
+
+        float diffuse = max(dot(normal, surfaceToLight), 0.0);
+        float specular = diffuse > 0.0 ? pow(max(dot(reflect(-surfaceToLight, normal), viewDirection), 0.0), material.shininess) : 0.0;
+        sum += falloff * color.rgb * (material.diffuse.rgb * diffuse + material.specular.rgb * specular);
+    }
+    return sum;
+}
@@ -0,0 +1,77 @@
+#ifndef CLUSTEREDLIGHTS_HPP
+#define CLUSTEREDLIGHTS_HPP
+
+#include <vector>
+
+// The view frustum is cut into tiles on screen and slices in depth, the slices
+// thinner near the camera. Mirrored by clusteredlights.glsl.
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 8
+#define CLUSTER_SLICES 24
+#define CLUSTER_COUNT (CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+// Lights a cluster keeps at most, the ones binned after that are dropped
+#define CLUSTER_MAX_LIGHTS 128
+// spot_cos_outer of a point light
+#define CLUSTER_POINT_LIGHT -2.0f
+
+// glm has to be included before this header.
+struct ClusteredLight{
+	glm::vec3 position;
+	float radius;          // the light falls to nothing there
+	glm::vec3 color;
+	float spot_cos_outer;  // cosine of the cone's half angle, CLUSTER_POINT_LIGHT for a point light
+	glm::vec3 direction;   // where the spot points, normalized
+	float spot_cos_inner;  // full intensity inside this cosine
+};
+
+// Many point and spot lights for forward shading. Each frame the lights are
+// binned on the CPU into the clusters their spheres touch : a thread per group
+// of depth slices, and each light against the 16 x 8 clusters of a slice 4 at
+// a time with SSE. The lights, the range of every cluster into the index list
+// and the index list go to texture buffers, and a fragment only loops over the
+// lights of its own cluster, so the cost follows how many lights are near it.
+class ClusteredLights{
+public:
+	ClusteredLights();
+
+	bool create();
+
+	// The cluster bounds follow the projection, they are only rebuilt when it changes
+	void setProjection(float fov_y_degrees, float aspect, float near, float far);
+
+	// Bins the lights seen through view and uploads them, once per frame.
+	// width and height are the framebuffer's, in pixels.
+	void update(const std::vector<ClusteredLight> & lights, const glm::mat4 & view, int width, int height);
+
+	// Binds the buffers for the samplers cluster_light_data, cluster_ranges and cluster_light_indices
+	void bind(GLuint light_unit, GLuint range_unit, GLuint index_unit) const;
+
+	// The screen and depth mapping of the clusters, on the program in use
+	void setUniforms(GLuint program) const;
+
+	size_t indexCount() const { return indices.size(); }
+	unsigned int maxClusterLights() const { return max_cluster_lights; }
+	double binMilliseconds() const { return bin_ms; }
+
+	// Deletes the buffers and textures, while the context is still there
+	void release();
+
+private:
+	void binSlice(int slice, const std::vector<glm::vec4> & spheres);
+
+	GLuint buffers[3], textures[3]; // lights, ranges, indices
+	float fov_y, aspect_ratio, near_plane, far_plane;
+	int screen_width, screen_height;
+
+	// view space bounds of the clusters, depth as distance in front of the camera, slice by slice
+	std::vector<float> min_x, min_y, min_z, max_x, max_y, max_z;
+
+	std::vector<std::vector<unsigned int> > slice_lights;   // the lights whose depth range covers a slice
+	std::vector<std::vector<unsigned int> > cluster_lights;
+	std::vector<float> light_data;
+	std::vector<unsigned int> ranges, indices;
+	unsigned int max_cluster_lights;
+	double bin_ms;
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "glstate.hpp"
+#include "shader.hpp"
+#include "envprobe.hpp"
+
+EnvironmentProbe::EnvironmentProbe() : size(0), next_face(0), capture(0), filtered(0), depth(0),
+	framebuffer(0), program(0), vertex_array(0), background_program(0), background(0),
+	face_uniform(-1), cone_uniform(-1), source_level_uniform(-1), background_face_uniform(-1){
+}
+
+static GLuint makeCubeMap(int size, int levels){
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glState.bindTexture(GL_TEXTURE_CUBE_MAP, texture);
+	for ( int level=0; level<levels; level++ ){
+		int level_size = size >> level > 0 ? size >> level : 1;
+		for ( int face=0; face<6; face++ )
+			glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, level, GL_RGBA8, level_size, level_size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+bool EnvironmentProbe::create(const char * prefilter_vertex_path, const char * prefilter_fragment_path, int size){
+	this->size = size;
+	next_face = 0;
+
+	// the captured faces are read across their edges by the wider cones,
+	// and from their mips where the taps are further apart than a texel
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	capture = makeCubeMap(size, ENV_PROBE_LEVELS);
+	filtered = makeCubeMap(size, ENV_PROBE_LEVELS);
+
+	glGenRenderbuffers(1, &depth);
+	glBindRenderbuffer(GL_RENDERBUFFER, depth);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size, size);
+
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X, capture, 0);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if ( status != GL_FRAMEBUFFER_COMPLETE ){
+		printf("Environment probe framebuffer incomplete : 0x%x\n", status);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		return false;
+	}
+
+	// nothing captured yet : the background everywhere
+	for ( int level=0; level<ENV_PROBE_LEVELS; level++ )
+		for ( int face=0; face<6; face++ ){
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, filtered, level);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	program = LoadShaders(prefilter_vertex_path, prefilter_fragment_path);
+	if ( !program )
+		return false;
+	face_uniform = glGetUniformLocation(program, "face");
+	cone_uniform = glGetUniformLocation(program, "cone");
+	source_level_uniform = glGetUniformLocation(program, "source_level");
+	glState.useProgram(program);
+	glState.uniform1i(glGetUniformLocation(program, "capture"), ENV_PROBE_CAPTURE_UNIT);
+
+	// the full screen triangle comes from gl_VertexID, but the core profile wants a vertex array
+	glGenVertexArrays(1, &vertex_array);
+	return true;
+}
+
+bool EnvironmentProbe::setBackground(const char * prefilter_vertex_path, const char * background_fragment_path, GLuint texture){
+	background_program = LoadShaders(prefilter_vertex_path, background_fragment_path);
+	if ( !background_program )
+		return false;
+	background = texture;
+	background_face_uniform = glGetUniformLocation(background_program, "face");
+	glState.useProgram(background_program);
+	glState.uniform1i(glGetUniformLocation(background_program, "background"), ENV_PROBE_BACKGROUND_UNIT);
+	return true;
+}
+
+glm::mat4 EnvironmentProbe::faceViewProjection(const glm::vec3 & position, float near_plane, float far_plane) const{
+	// the cube map conventions : +X, -X, +Y, -Y, +Z, -Z with t growing downwards on the sides
+	static const glm::vec3 forward[6] = {
+		glm::vec3( 1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0,  1, 0),
+		glm::vec3(0, -1, 0), glm::vec3(0, 0,  1), glm::vec3(0, 0, -1)
+	};
+	static const glm::vec3 up[6] = {
+		glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0,  1),
+		glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0)
+	};
+	return glm::perspective(90.0f, 1.0f, near_plane, far_plane)
+		* glm::lookAt(position, position + forward[next_face], up[next_face]);
+}
+
+void EnvironmentProbe::beginFace(){
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + next_face, capture, 0);
+	glViewport(0, 0, size, size);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	if ( !background_program )
+		return;
+
+	// behind everything : no depth test, and the depth stays cleared
+	glDisable(GL_DEPTH_TEST);
+	glState.useProgram(background_program);
+	glState.bindVertexArray(vertex_array);
+	glState.bindTexture(ENV_PROBE_BACKGROUND_UNIT, GL_TEXTURE_2D, background);
+	glState.uniform1i(background_face_uniform, next_face);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glEnable(GL_DEPTH_TEST);
+}
+
+void EnvironmentProbe::endFace(){
+	// the mips of the captured faces, redone for all six though only one changed
+	glState.bindTexture(ENV_PROBE_CAPTURE_UNIT, GL_TEXTURE_CUBE_MAP, capture);
+	glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+
+	// a cone around the direction of every texel, from a point sample at level 0 up to ENV_PROBE_MAX_CONE
+	glDisable(GL_DEPTH_TEST);
+	glState.useProgram(program);
+	glState.bindVertexArray(vertex_array);
+	glState.uniform1i(face_uniform, next_face);
+	for ( int level=0; level<ENV_PROBE_LEVELS; level++ ){
+		int level_size = size >> level > 0 ? size >> level : 1;
+		float cone = ENV_PROBE_MAX_CONE * level / (ENV_PROBE_LEVELS - 1);
+		// the taps are tan(cone) / 2 apart, a texel of the face is 2 / size across at
+		// level 0 : read the level where they are a texel apart, and no finer than the
+		// one written, whose texels are as large
+		float source_level = log2f(tanf(cone) * size / 4.0f);
+		if ( source_level < (float)level )
+			source_level = (float)level;
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + next_face, filtered, level);
+		glViewport(0, 0, level_size, level_size);
+		glState.uniform1f(cone_uniform, cone);
+		glState.uniform1f(source_level_uniform, source_level);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+	}
+	glEnable(GL_DEPTH_TEST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	next_face = (next_face + 1) % 6;
+}
+
+void EnvironmentProbe::release(){
+	glDeleteProgram(program);
+	glState.forgetProgram(program);
+	if ( background_program ){
+		glDeleteProgram(background_program);
+		glState.forgetProgram(background_program);
+	}
+	glDeleteVertexArrays(1, &vertex_array);
+	glState.forgetVertexArray(vertex_array);
+	glDeleteFramebuffers(1, &framebuffer);
+	glDeleteRenderbuffers(1, &depth);
+	glDeleteTextures(1, &capture);
+	glState.forgetTexture(capture);
+	glDeleteTextures(1, &filtered);
+	glState.forgetTexture(filtered);
+	program = vertex_array = framebuffer = depth = capture = filtered = 0;
+	background_program = background = 0;
+}
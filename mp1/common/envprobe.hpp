@@ -0,0 +1,72 @@
+#ifndef ENVPROBE_HPP
+#define ENVPROBE_HPP
+
+// Edge of the probe cube map, a fraction of the screen is plenty for reflections
+#define ENV_PROBE_SIZE 128
+// Prefiltered levels, the last ones blurred over a cone this wide (radians)
+#define ENV_PROBE_LEVELS 6
+#define ENV_PROBE_MAX_CONE 0.6f
+// The units the prefilter reads the captured faces from and the background
+// pass its texture from, out of the way of the materials
+#define ENV_PROBE_CAPTURE_UNIT 7
+#define ENV_PROBE_BACKGROUND_UNIT 6
+// The units the prefilter reads the captured faces from and the background
+// pass its texture from, out of the way of the materials
+#define ENV_PROBE_CAPTURE_UNIT 7
+#define ENV_PROBE_BACKGROUND_UNIT 6
+
+// A cube map of the scene around a point, kept up to date one face per frame.
+// Each frame the caller draws the scene into the face that is due, between
+// beginFace() and endFace(), and that face alone is prefiltered into the mip
+// chain of the cube map the shaders sample: every level blurs the face over a
+// wider cone, so a level works as a glossier reflection. The cone's taps read
+// the mips of the captured faces as far apart as they are, so the wide cones
+// average the whole cone rather than aliasing. A full refresh takes six frames
+// for about a sixth of a scene render each. A background, such as a sphere
+// map, can be drawn behind the scene of every face.
+// glm has to be included before this header.
+class EnvironmentProbe{
+public:
+	EnvironmentProbe();
+
+	// Creates the cube maps and the prefilter program. The cube map starts out
+	// filled with the current clear color. False if the framebuffer is incomplete.
+	bool create(const char * prefilter_vertex_path, const char * prefilter_fragment_path, int size = ENV_PROBE_SIZE);
+
+	// The face due this frame, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+	int face() const { return next_face; }
+
+	// The 90 degree view of the current face from position
+	glm::mat4 faceViewProjection(const glm::vec3 & position, float near_plane, float far_plane) const;
+
+	// Pixels per unit of tan(angle), for level of detail selection in the probe
+	float projectionScale() const { return size * 0.5f; }
+
+	// Draws texture behind every face with a program of the prefilter vertex shader
+	// and background_fragment_path, which gets the face and the texture as face and
+	// background. False if it doesn't link, the faces are then only cleared.
+	bool setBackground(const char * prefilter_vertex_path, const char * background_fragment_path, GLuint texture);
+
+	// Binds the framebuffer of the current face, sets the viewport, clears it and
+	// draws the background, the program and the vertex array are the probe's after it
+	void beginFace();
+
+	// Prefilters the face into every level of the cube map and moves on to the
+	// next face. The default framebuffer is bound again with depth testing on,
+	// the viewport is the caller's.
+	void endFace();
+
+	// The prefiltered cube map
+	GLuint texture() const { return filtered; }
+
+	// Deletes everything, while the context is still there
+	void release();
+
+private:
+	int size, next_face;
+	GLuint capture, filtered, depth, framebuffer;
+	GLuint program, vertex_array, background_program, background;
+	GLint face_uniform, cone_uniform, source_level_uniform, background_face_uniform;
+};
+
+#endif
@@ -0,0 +1,201 @@
+#include <string.h>
+
+#include <GL/glew.h>
+
+#include "glstate.hpp"
+
+GLStateCache glState;
+
+GLStateCache::GLStateCache() : issued(0), skipped(0){
+	invalidate();
+}
+
+void GLStateCache::useProgram(GLuint program){
+	if ( program_known && this->program == program ){
+		skipped++;
+		return;
+	}
+	glUseProgram(program);
+	this->program = program;
+	program_known = true;
+	issued++;
+}
+
+void GLStateCache::bindVertexArray(GLuint vertex_array){
+	if ( vertex_array_known && this->vertex_array == vertex_array ){
+		skipped++;
+		return;
+	}
+	glBindVertexArray(vertex_array);
+	this->vertex_array = vertex_array;
+	vertex_array_known = true;
+	// the element buffer belongs to the vertex array
+	buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+	issued++;
+}
+
+void GLStateCache::activeTexture(GLuint unit){
+	if ( unit_known && active_unit == unit ){
+		skipped++;
+		return;
+	}
+	glActiveTexture(GL_TEXTURE0 + unit);
+	active_unit = unit;
+	unit_known = true;
+	issued++;
+}
+
+void GLStateCache::bindTexture(GLenum target, GLuint texture){
+	if ( !unit_known || active_unit >= GL_STATE_TEXTURE_UNITS ){
+		glBindTexture(target, texture);
+		issued++;
+		return;
+	}
+	std::map<GLenum, GLuint>::iterator bound = textures[active_unit].find(target);
+	if ( bound != textures[active_unit].end() && bound->second == texture ){
+		skipped++;
+		return;
+	}
+	glBindTexture(target, texture);
+	textures[active_unit][target] = texture;
+	issued++;
+}
+
+void GLStateCache::bindTexture(GLuint unit, GLenum target, GLuint texture){
+	// a texture already there doesn't need the unit made active
+	if ( unit < GL_STATE_TEXTURE_UNITS ){
+		std::map<GLenum, GLuint>::iterator bound = textures[unit].find(target);
+		if ( bound != textures[unit].end() && bound->second == texture ){
+			skipped++;
+			return;
+		}
+	}
+	activeTexture(unit);
+	bindTexture(target, texture);
+}
+
+void GLStateCache::bindBuffer(GLenum target, GLuint buffer){
+	std::map<GLenum, GLuint>::iterator bound = buffers.find(target);
+	if ( bound != buffers.end() && bound->second == buffer ){
+		skipped++;
+		return;
+	}
+	glBindBuffer(target, buffer);
+	buffers[target] = buffer;
+	issued++;
+}
+
+void GLStateCache::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size){
+	std::map<std::pair<GLenum, GLuint>, Range>::iterator bound = ranges.find(std::make_pair(target, index));
+	if ( bound != ranges.end() && bound->second.buffer == buffer
+		&& bound->second.offset == offset && bound->second.size == size ){
+		skipped++;
+		return;
+	}
+	glBindBufferRange(target, index, buffer, offset, size);
+	Range range = { buffer, offset, size };
+	ranges[std::make_pair(target, index)] = range;
+	// binds the generic binding point too
+	buffers[target] = buffer;
+	issued++;
+}
+
+// Remembers the value and tells whether GL has to hear about it.
+// tag tells apart uploads of the same bytes that mean different values.
+bool GLStateCache::uniformChanged(GLint location, const void * value, size_t size, unsigned char tag){
+	if ( location < 0 ){
+		skipped++;
+		return false;
+	}
+	if ( !program_known ){
+		issued++;
+		return true;
+	}
+	std::vector<unsigned char> & shadow = uniforms[program][location];
+	if ( shadow.size() == size + 1 && shadow[size] == tag && memcmp(&shadow[0], value, size) == 0 ){
+		skipped++;
+		return false;
+	}
+	shadow.assign((const unsigned char *)value, (const unsigned char *)value + size);
+	shadow.push_back(tag);
+	issued++;
+	return true;
+}
+
+void GLStateCache::uniform1i(GLint location, GLint value){
+	if ( uniformChanged(location, &value, sizeof(value)) )
+		glUniform1i(location, value);
+}
+
+void GLStateCache::uniform1f(GLint location, GLfloat value){
+	if ( uniformChanged(location, &value, sizeof(value)) )
+		glUniform1f(location, value);
+}
+
+void GLStateCache::uniform3fv(GLint location, GLsizei count, const GLfloat * value){
+	if ( uniformChanged(location, value, count * 3 * sizeof(GLfloat)) )
+		glUniform3fv(location, count, value);
+}
+
+void GLStateCache::uniform4f(GLint location, GLfloat x, GLfloat y, GLfloat z, GLfloat w){
+	const GLfloat value[4] = { x, y, z, w };
+	if ( uniformChanged(location, value, sizeof(value)) )
+		glUniform4f(location, x, y, z, w);
+}
+
+void GLStateCache::uniform4fv(GLint location, GLsizei count, const GLfloat * value){
+	if ( uniformChanged(location, value, count * 4 * sizeof(GLfloat)) )
+		glUniform4fv(location, count, value);
+}
+
+void GLStateCache::uniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat * value){
+	if ( uniformChanged(location, value, count * 9 * sizeof(GLfloat), transpose ? 1 : 0) )
+		glUniformMatrix3fv(location, count, transpose, value);
+}
+
+void GLStateCache::uniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat * value){
+	if ( uniformChanged(location, value, count * 16 * sizeof(GLfloat), transpose ? 1 : 0) )
+		glUniformMatrix4fv(location, count, transpose, value);
+}
+
+void GLStateCache::forgetProgram(GLuint program){
+	uniforms.erase(program);
+	if ( program_known && this->program == program )
+		program_known = false;
+}
+
+void GLStateCache::forgetVertexArray(GLuint vertex_array){
+	if ( vertex_array_known && this->vertex_array == vertex_array ){
+		vertex_array_known = false;
+		buffers.erase(GL_ELEMENT_ARRAY_BUFFER);
+	}
+}
+
+void GLStateCache::forgetTexture(GLuint texture){
+	for ( int unit=0; unit<GL_STATE_TEXTURE_UNITS; unit++ )
+		for ( std::map<GLenum, GLuint>::iterator i=textures[unit].begin(); i!=textures[unit].end(); ++i )
+			if ( i->second == texture )
+				i->second = 0;
+}
+
+void GLStateCache::forgetBuffer(GLuint buffer){
+	for ( std::map<GLenum, GLuint>::iterator i=buffers.begin(); i!=buffers.end(); ++i )
+		if ( i->second == buffer )
+			i->second = 0;
+	for ( std::map<std::pair<GLenum, GLuint>, Range>::iterator i=ranges.begin(); i!=ranges.end(); ){
+		if ( i->second.buffer == buffer )
+			ranges.erase(i++);
+		else
+			++i;
+	}
+}
+
+void GLStateCache::invalidate(){
+	program_known = vertex_array_known = unit_known = false;
+	program = vertex_array = active_unit = 0;
+	for ( int unit=0; unit<GL_STATE_TEXTURE_UNITS; unit++ )
+		textures[unit].clear();
+	buffers.clear();
+	ranges.clear();
+	uniforms.clear();
+}
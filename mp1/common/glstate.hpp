@@ -0,0 +1,73 @@
+#ifndef GLSTATE_HPP
+#define GLSTATE_HPP
+
+#include <map>
+#include <utility>
+#include <vector>
+
+// Texture units shadowed by GLStateCache, binds on higher units go straight to GL
+#define GL_STATE_TEXTURE_UNITS 16
+
+// Shadows the GL state the programs set over and over : the program, the
+// vertex array, the textures of each unit, the buffer bindings and the uniform
+// values of every program, and skips the calls that wouldn't change any of it.
+// Everything that binds goes through the one instance, glState; code that calls
+// GL around it has to leave the bindings as it found them, or invalidate().
+class GLStateCache{
+public:
+	GLStateCache();
+
+	void useProgram(GLuint program);
+	void bindVertexArray(GLuint vertex_array);
+
+	// unit is an index, GL_TEXTURE0 + unit for GL
+	void activeTexture(GLuint unit);
+	void bindTexture(GLenum target, GLuint texture); // on the active unit
+	void bindTexture(GLuint unit, GLenum target, GLuint texture);
+
+	void bindBuffer(GLenum target, GLuint buffer);
+	void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+
+	// Uniforms of the current program, remembered per program and location
+	void uniform1i(GLint location, GLint value);
+	void uniform1f(GLint location, GLfloat value);
+	void uniform3fv(GLint location, GLsizei count, const GLfloat * value);
+	void uniform4f(GLint location, GLfloat x, GLfloat y, GLfloat z, GLfloat w);
+	void uniform4fv(GLint location, GLsizei count, const GLfloat * value);
+	void uniformMatrix3fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat * value);
+	void uniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat * value);
+
+	// GL hands deleted names out again, call these after deleting one
+	void forgetProgram(GLuint program);
+	void forgetVertexArray(GLuint vertex_array);
+	void forgetTexture(GLuint texture);
+	void forgetBuffer(GLuint buffer);
+
+	// Forgets everything, the next call of each kind goes to GL
+	void invalidate();
+
+	size_t issuedCalls() const { return issued; }
+	size_t skippedCalls() const { return skipped; }
+	void resetCounters() { issued = skipped = 0; }
+
+private:
+	struct Range{
+		GLuint buffer;
+		GLintptr offset;
+		GLsizeiptr size;
+	};
+
+	bool uniformChanged(GLint location, const void * value, size_t size, unsigned char tag = 0);
+
+	bool program_known, vertex_array_known, unit_known;
+	GLuint program, vertex_array, active_unit;
+	std::map<GLenum, GLuint> textures[GL_STATE_TEXTURE_UNITS]; // target -> texture
+	std::map<GLenum, GLuint> buffers;                         // target -> buffer
+	std::map<std::pair<GLenum, GLuint>, Range> ranges;        // (target, index) -> range
+	std::map<GLuint, std::map<GLint, std::vector<unsigned char> > > uniforms;
+	size_t issued, skipped;
+};
+
+extern GLStateCache glState;
+
+#endif
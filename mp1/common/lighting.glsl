@@ -0,0 +1,45 @@
+// Uniform blocks shared by the programs, std140 so the structs of
+// uniformbuffer.hpp match them byte for byte, and the Phong model they feed.
+
+layout(std140) uniform Camera {
+    mat4 view_projection;
+    vec3 view_position;     // camera in world coordinates
+} camera;
+
+layout(std140) uniform Light {
+    vec4 position;          // normalized direction towards the light (w = 0), or a point (w = 1)
+} light;
+
+layout(std140) uniform Material {
+    // already multiplied by the light colors on the CPU
+    vec4 ambient;
+    vec4 diffuse;
+    vec4 specular;
+    float shininess;
+    float reflection_blur;  // mip bias into a prefiltered environment, 0 for a mirror
+} material;
+
+vec3 surface_to_light(vec3 world)
+{
+    if (light.position.w == 0.0)
+        return light.position.xyz;
+    return normalize(light.position.xyz - world);
+}
+
+vec4 phong(vec3 normal, vec3 world)
+{
+    vec3 surfaceToLight = surface_to_light(world);
+    vec3 viewDirection = normalize(camera.view_position - world);
+
+    vec4 diffuseReflection = max(dot(surfaceToLight, normal), 0.0) * material.diffuse;
+    vec4 specularReflection;
+    if (dot(normal, surfaceToLight) < 0.0) // light source on the wrong side?
+    {
+        specularReflection = vec4(0.0, 0.0, 0.0, 0.0); // no specular reflection
+    }
+    else // light source on the right side
+    {
+        specularReflection = material.specular * pow(max(0.0, dot(reflect(-surfaceToLight, normal), viewDirection)), material.shininess);
+    }
+    return material.ambient + diffuseReflection + specularReflection;
+}
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stddef.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mappedfile.hpp"
+
+MappedFile::MappedFile() : bytes(NULL), length(0){
+}
+
+MappedFile::~MappedFile(){
+	close();
+}
+
+bool MappedFile::open(const char * path){
+	close();
+	int fd = ::open(path, O_RDONLY);
+	if ( fd < 0 )
+		return false;
+
+	struct stat info;
+	if ( fstat(fd, &info) != 0 || info.st_size <= 0 ){
+		::close(fd);
+		return false;
+	}
+
+	// The mapping keeps its own reference to the file
+	void * mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if ( mapped == MAP_FAILED ){
+		printf("%s could not be mapped\n", path);
+		return false;
+	}
+	bytes = (const unsigned char *)mapped;
+	length = (size_t)info.st_size;
+	return true;
+}
+
+void MappedFile::close(){
+	if ( bytes )
+		munmap((void *)bytes, length);
+	bytes = NULL;
+	length = 0;
+}
+
+void MappedFile::willNeed(size_t offset, size_t count) const{
+	if ( !bytes || offset >= length )
+		return;
+	if ( count > length - offset )
+		count = length - offset;
+
+	// madvise wants a page aligned start
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t start = offset / page * page;
+	madvise((void *)(bytes + start), offset + count - start, MADV_WILLNEED);
+}
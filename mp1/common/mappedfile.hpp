@@ -0,0 +1,28 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+// Read-only memory mapping of a whole file. Pages are only read from disk
+// when they are touched, so opening a large file costs nothing up front.
+class MappedFile{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open(const char * path); // false if missing or empty
+	void close();
+
+	const unsigned char * data() const { return bytes; }
+	size_t size() const { return length; }
+
+	// Asks the kernel to start reading a range that will be used soon
+	void willNeed(size_t offset, size_t count) const;
+
+private:
+	MappedFile(const MappedFile &);
+	MappedFile & operator=(const MappedFile &);
+
+	const unsigned char * bytes;
+	size_t length;
+};
+
+#endif
@@ -0,0 +1,329 @@
+#include <vector>
+#include <math.h>
+#include <string.h>
+
+#include <glm/glm.hpp>
+
+#include "vertexcache.hpp"
+#include "meshlet.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define MESHLET_SSE 1
+#endif
+
+// Bounding sphere and normal cone of the triangles [begin, end)
+static void computeMeshletBounds(
+	const unsigned int * indices,
+	unsigned int begin,
+	unsigned int end,
+	const std::vector<glm::vec3> & positions,
+	Meshlet & meshlet
+){
+	glm::vec3 lo = positions[indices[begin]];
+	glm::vec3 hi = lo;
+	glm::vec3 axis(0.0f);
+	for ( unsigned int i=begin; i<end; i++ ){
+		lo = glm::min(lo, positions[indices[i]]);
+		hi = glm::max(hi, positions[indices[i]]);
+	}
+	meshlet.center = (lo + hi) * 0.5f;
+	meshlet.radius = 0.0f;
+	for ( unsigned int i=begin; i<end; i++ )
+		meshlet.radius = glm::max(meshlet.radius, glm::length(positions[indices[i]] - meshlet.center));
+
+	// The cone axis is the average of the unit face normals,
+	// its cutoff comes from the face normal furthest away from it.
+	std::vector<glm::vec3> normals;
+	for ( unsigned int i=begin; i<end; i+=3 ){
+		const glm::vec3 & a = positions[indices[i]];
+		glm::vec3 n = glm::cross(positions[indices[i+1]] - a, positions[indices[i+2]] - a);
+		float l = glm::length(n);
+		if ( l > 0.0f ){
+			normals.push_back(n / l);
+			axis += n / l;
+		}
+	}
+	float axis_length = glm::length(axis);
+	meshlet.cone_axis = axis_length > 0.0f ? axis / axis_length : glm::vec3(1, 0, 0);
+
+	float min_dot = 1.0f;
+	for ( unsigned int i=0; i<normals.size(); i++ )
+		min_dot = glm::min(min_dot, glm::dot(normals[i], meshlet.cone_axis));
+
+	// A cone wider than ~85 degrees hardly ever culls, disable the test
+	if ( normals.empty() || min_dot <= 0.1f ){
+		meshlet.cone_apex = meshlet.center;
+		meshlet.cone_cutoff = 1.0f;
+		return;
+	}
+	meshlet.cone_cutoff = sqrtf(1.0f - min_dot * min_dot);
+
+	// Move the apex back along the axis until it is behind every triangle plane
+	float max_t = 0.0f;
+	unsigned int n = 0;
+	for ( unsigned int i=begin; i<end; i+=3 ){
+		const glm::vec3 & a = positions[indices[i]];
+		glm::vec3 face = glm::cross(positions[indices[i+1]] - a, positions[indices[i+2]] - a);
+		if ( glm::length(face) == 0.0f )
+			continue;
+		float t = glm::dot(meshlet.center - a, normals[n]) / glm::dot(meshlet.cone_axis, normals[n]);
+		max_t = glm::max(max_t, t);
+		n++;
+	}
+	meshlet.cone_apex = meshlet.center - meshlet.cone_axis * max_t;
+}
+
+void buildMeshlets(
+	unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	std::vector<Meshlet> & meshlets,
+	unsigned int max_vertices,
+	unsigned int max_triangles
+){
+	meshlets.clear();
+	size_t triangle_count = index_count / 3;
+	if ( triangle_count == 0 )
+		return;
+
+	TriangleAdjacency adjacency;
+	buildTriangleAdjacency(indices, triangle_count * 3, positions.size(), adjacency);
+
+	std::vector<glm::vec3> face_normals(triangle_count);
+	std::vector<glm::vec3> centroids(triangle_count);
+	float edge_length = 0.0f;
+	for ( size_t t=0; t<triangle_count; t++ ){
+		const glm::vec3 & a = positions[indices[t*3]];
+		const glm::vec3 & b = positions[indices[t*3+1]];
+		const glm::vec3 & c = positions[indices[t*3+2]];
+		glm::vec3 n = glm::cross(b - a, c - a);
+		float l = glm::length(n);
+		face_normals[t] = l > 0.0f ? n / l : glm::vec3(0.0f);
+		centroids[t] = (a + b + c) / 3.0f;
+		edge_length += glm::length(b - a) / triangle_count;
+	}
+	edge_length = glm::max(edge_length, 1e-6f);
+
+	// Meshlet that last used each vertex, to count its unique vertices
+	std::vector<unsigned int> last_meshlet(positions.size(), 0xffffffffu);
+	std::vector<bool> emitted(triangle_count, false);
+	std::vector<unsigned int> result;
+	result.reserve(triangle_count * 3);
+	std::vector<unsigned int> frontier;
+	size_t seed = 0;
+
+	while ( result.size() < triangle_count * 3 ){
+		// Start a new meshlet from the first triangle left in the input order
+		while ( emitted[seed] )
+			seed++;
+
+		unsigned int current = (unsigned int)meshlets.size();
+		unsigned int begin = (unsigned int)result.size();
+		unsigned int vertex_count = 0;
+		glm::vec3 axis(0.0f);
+		glm::vec3 center(0.0f);
+		unsigned int meshlet_triangles = 0;
+		frontier.clear();
+		unsigned int next = (unsigned int)seed;
+
+		// Grow the meshlet over the mesh, one neighbouring triangle at a time
+		while ( true ){
+			emitted[next] = true;
+			meshlet_triangles++;
+			axis += face_normals[next];
+			center += centroids[next];
+			for ( int k=0; k<3; k++ ){
+				unsigned int v = indices[next*3 + k];
+				result.push_back(v);
+				if ( last_meshlet[v] != current ){
+					last_meshlet[v] = current;
+					vertex_count++;
+					for ( unsigned int a = adjacency.offsets[v]; a < adjacency.offsets[v + 1]; a++ )
+						if ( !emitted[adjacency.triangles[a]] )
+							frontier.push_back(adjacency.triangles[a]);
+				}
+			}
+			if ( meshlet_triangles >= max_triangles )
+				break;
+
+			// Prefer triangles adding few vertices, close to the cone axis and to the center.
+			// Triangles more than 60 degrees away from the axis would make the cone useless.
+			glm::vec3 direction = glm::length(axis) > 0.0f ? glm::normalize(axis) : glm::vec3(0.0f);
+			glm::vec3 middle = center / (float)meshlet_triangles;
+			float best_score = 0.0f;
+			int best = -1;
+			size_t kept = 0;
+			for ( size_t f=0; f<frontier.size(); f++ ){
+				unsigned int t = frontier[f];
+				if ( emitted[t] )
+					continue;
+				frontier[kept++] = t;
+
+				unsigned int added = 0;
+				for ( int k=0; k<3; k++ )
+					if ( last_meshlet[indices[t*3 + k]] != current )
+						added++;
+				float spread = glm::dot(face_normals[t], direction);
+				if ( vertex_count + added > max_vertices || spread < 0.5f )
+					continue;
+
+				float score = (float)added + 10.0f * (1.0f - spread) + 0.5f * glm::length(centroids[t] - middle) / edge_length;
+				if ( best < 0 || score < best_score ){
+					best_score = score;
+					best = (int)t;
+				}
+			}
+			frontier.resize(kept);
+			if ( best < 0 )
+				break;
+			next = (unsigned int)best;
+		}
+
+		Meshlet meshlet;
+		meshlet.index_offset = begin;
+		meshlet.index_count = (unsigned int)result.size() - begin;
+		computeMeshletBounds(&result[0], begin, (unsigned int)result.size(), positions, meshlet);
+		meshlets.push_back(meshlet);
+
+		// Growing order is not cache friendly, reorder the triangles inside the meshlet.
+		// Its vertices are renumbered locally so this stays linear in the meshlet size.
+		std::vector<unsigned int> local(meshlet.index_count);
+		std::vector<unsigned int> global;
+		for ( unsigned int i=0; i<meshlet.index_count; i++ ){
+			unsigned int v = result[begin + i];
+			unsigned int l = 0;
+			while ( l < global.size() && global[l] != v )
+				l++;
+			if ( l == global.size() )
+				global.push_back(v);
+			local[i] = l;
+		}
+		optimizeVertexCache(&local[0], local.size(), global.size());
+		for ( unsigned int i=0; i<meshlet.index_count; i++ )
+			result[begin + i] = global[local[i]];
+	}
+
+	memcpy(indices, &result[0], triangle_count * 3 * sizeof(unsigned int));
+}
+
+MeshletCuller::MeshletCuller() : count(0){
+}
+
+void MeshletCuller::init(const std::vector<Meshlet> & meshlets){
+	count = meshlets.size();
+
+	// Padding meshlets have a negative radius, so they are always outside
+	size_t padded = (count + 3) & ~(size_t)3;
+	center_x.assign(padded, 0.0f); center_y.assign(padded, 0.0f); center_z.assign(padded, 0.0f);
+	radius.assign(padded, -1.0f);
+	apex_x.assign(padded, 0.0f); apex_y.assign(padded, 0.0f); apex_z.assign(padded, 0.0f);
+	axis_x.assign(padded, 0.0f); axis_y.assign(padded, 0.0f); axis_z.assign(padded, 0.0f);
+	cutoff.assign(padded, 1.0f);
+	index_offset.assign(padded, 0);
+	index_count.assign(padded, 0);
+
+	for ( size_t i=0; i<count; i++ ){
+		center_x[i] = meshlets[i].center.x;
+		center_y[i] = meshlets[i].center.y;
+		center_z[i] = meshlets[i].center.z;
+		radius[i] = meshlets[i].radius;
+		apex_x[i] = meshlets[i].cone_apex.x;
+		apex_y[i] = meshlets[i].cone_apex.y;
+		apex_z[i] = meshlets[i].cone_apex.z;
+		axis_x[i] = meshlets[i].cone_axis.x;
+		axis_y[i] = meshlets[i].cone_axis.y;
+		axis_z[i] = meshlets[i].cone_axis.z;
+		cutoff[i] = meshlets[i].cone_cutoff;
+		index_offset[i] = meshlets[i].index_offset;
+		index_count[i] = meshlets[i].index_count;
+	}
+}
+
+size_t MeshletCuller::cull(
+	const glm::mat4 & MVP,
+	const glm::vec3 & camera_position,
+	std::vector<int> & counts,
+	std::vector<const void *> & offsets
+) const{
+	counts.clear();
+	offsets.clear();
+
+	// Frustum planes from the rows of the MVP matrix (Gribb & Hartmann),
+	// normalized so the sphere test can use the radius directly.
+	float planes[6][4];
+	for ( int p=0; p<6; p++ ){
+		int row = p / 2;
+		float sign = (p % 2 == 0) ? 1.0f : -1.0f;
+		for ( int c=0; c<4; c++ )
+			planes[p][c] = MVP[c][3] + sign * MVP[c][row];
+		float l = sqrtf(planes[p][0]*planes[p][0] + planes[p][1]*planes[p][1] + planes[p][2]*planes[p][2]);
+		for ( int c=0; c<4; c++ )
+			planes[p][c] /= l;
+	}
+
+	unsigned int draw_end = 0;
+	size_t padded = center_x.size();
+	for ( size_t i=0; i<padded; i+=4 ){
+		int visible_mask = 0;
+#ifdef MESHLET_SSE
+		__m128 cx = _mm_loadu_ps(&center_x[i]);
+		__m128 cy = _mm_loadu_ps(&center_y[i]);
+		__m128 cz = _mm_loadu_ps(&center_z[i]);
+		__m128 r = _mm_loadu_ps(&radius[i]);
+		__m128 neg_r = _mm_sub_ps(_mm_setzero_ps(), r);
+
+		// Inside the frustum : every plane distance >= -radius (and radius >= 0)
+		__m128 visible = _mm_cmpge_ps(r, _mm_setzero_ps());
+		for ( int p=0; p<6; p++ ){
+			__m128 d = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(planes[p][0])), _mm_mul_ps(cy, _mm_set1_ps(planes[p][1]))),
+				_mm_add_ps(_mm_mul_ps(cz, _mm_set1_ps(planes[p][2])), _mm_set1_ps(planes[p][3])));
+			visible = _mm_and_ps(visible, _mm_cmpge_ps(d, neg_r));
+		}
+
+		// Facing the camera : dot(apex - camera, axis) < cutoff * length(apex - camera)
+		__m128 vx = _mm_sub_ps(_mm_loadu_ps(&apex_x[i]), _mm_set1_ps(camera_position.x));
+		__m128 vy = _mm_sub_ps(_mm_loadu_ps(&apex_y[i]), _mm_set1_ps(camera_position.y));
+		__m128 vz = _mm_sub_ps(_mm_loadu_ps(&apex_z[i]), _mm_set1_ps(camera_position.z));
+		__m128 d = _mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(vx, _mm_loadu_ps(&axis_x[i])),
+			_mm_mul_ps(vy, _mm_loadu_ps(&axis_y[i]))),
+			_mm_mul_ps(vz, _mm_loadu_ps(&axis_z[i])));
+		__m128 l = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(vx, vx), _mm_mul_ps(vy, vy)), _mm_mul_ps(vz, vz)));
+		visible = _mm_and_ps(visible, _mm_cmplt_ps(d, _mm_mul_ps(_mm_loadu_ps(&cutoff[i]), l)));
+
+		visible_mask = _mm_movemask_ps(visible);
+#else
+		for ( int k=0; k<4; k++ ){
+			size_t j = i + k;
+			bool visible = radius[j] >= 0.0f;
+			for ( int p=0; p<6 && visible; p++ )
+				visible = center_x[j]*planes[p][0] + center_y[j]*planes[p][1] + center_z[j]*planes[p][2] + planes[p][3] >= -radius[j];
+			if ( visible ){
+				float vx = apex_x[j] - camera_position.x;
+				float vy = apex_y[j] - camera_position.y;
+				float vz = apex_z[j] - camera_position.z;
+				float d = vx*axis_x[j] + vy*axis_y[j] + vz*axis_z[j];
+				visible = d < cutoff[j] * sqrtf(vx*vx + vy*vy + vz*vz);
+			}
+			if ( visible )
+				visible_mask |= 1 << k;
+		}
+#endif
+
+		for ( int k=0; k<4; k++ ){
+			if ( visible_mask & (1 << k) ){
+				// Merge with the previous draw when the runs are contiguous
+				if ( !counts.empty() && index_offset[i+k] == draw_end ){
+					counts.back() += index_count[i+k];
+				}else{
+					counts.push_back(index_count[i+k]);
+					offsets.push_back((const void *)(index_offset[i+k] * sizeof(unsigned int)));
+				}
+				draw_end = index_offset[i+k] + index_count[i+k];
+			}
+		}
+	}
+	return counts.size();
+}
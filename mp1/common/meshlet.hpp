@@ -0,0 +1,65 @@
+#ifndef MESHLET_HPP
+#define MESHLET_HPP
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+// A run of consecutive triangles in the index buffer, culled as a whole.
+struct Meshlet{
+	unsigned int index_offset; // first index of the run
+	unsigned int index_count;
+
+	// Bounding sphere
+	glm::vec3 center;
+	float radius;
+
+	// Normal cone : the meshlet faces away from any camera for which
+	// dot(normalize(cone_apex - camera), cone_axis) >= cone_cutoff
+	glm::vec3 cone_apex;
+	glm::vec3 cone_axis;
+	float cone_cutoff;
+};
+
+// Groups the triangles into meshlets by growing each one over neighbouring
+// triangles that face the same way, and reorders the index buffer so every
+// meshlet is a contiguous run. Meshlets are seeded in the input order, so run
+// it after optimizeVertexCache, and before optimizeVertexFetch.
+void buildMeshlets(
+	unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	std::vector<Meshlet> & meshlets,
+	unsigned int max_vertices = MESHLET_MAX_VERTICES,
+	unsigned int max_triangles = MESHLET_MAX_TRIANGLES
+);
+
+// Frustum and backface culling of the meshlets of one mesh.
+// The bounds are kept as structure of arrays, padded to 4 meshlets,
+// so the tests run on 4 meshlets at a time with SSE.
+class MeshletCuller{
+public:
+	MeshletCuller();
+
+	void init(const std::vector<Meshlet> & meshlets);
+
+	// MVP and camera_position are in the model space of the mesh.
+	// Fills counts and offsets for glMultiDrawElements with 32-bit indices,
+	// merging neighbouring visible meshlets, and returns the number of draws.
+	size_t cull(
+		const glm::mat4 & MVP,
+		const glm::vec3 & camera_position,
+		std::vector<int> & counts,
+		std::vector<const void *> & offsets
+	) const;
+
+	size_t size() const { return count; }
+
+private:
+	size_t count;
+	std::vector<float> center_x, center_y, center_z, radius;
+	std::vector<float> apex_x, apex_y, apex_z;
+	std::vector<float> axis_x, axis_y, axis_z, cutoff;
+	std::vector<unsigned int> index_offset, index_count;
+};
+
+#endif
\ No newline at end of file
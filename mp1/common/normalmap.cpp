@@ -0,0 +1,93 @@
+#include <vector>
+#include <math.h>
+
+#include "parallel.hpp"
+#include "normalmap.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define NORMAL_MAP_SSE 1
+#endif
+
+static unsigned char toByte(float v){
+	return (unsigned char)(v * 127.5f + 128.0f);
+}
+
+void heightToNormalMap(
+	const unsigned char * heights,
+	int width,
+	int height,
+	float strength,
+	unsigned char * rgba
+){
+	// Heights as floats in [0, 1], each row with the wrapped neighbour pixel
+	// on both ends, so the filter reads x - 1 to x + 1 without any test
+	int stride = width + 2;
+	std::vector<float> padded((size_t)stride * height);
+	parallelFor(height, 64, [&](size_t begin, size_t end){
+		for ( size_t y=begin; y<end; y++ ){
+			const unsigned char * src = heights + y * width;
+			float * dst = &padded[y * stride];
+			for ( int x=0; x<width; x++ )
+				dst[x + 1] = src[x] * (1.0f / 255.0f);
+			dst[0] = dst[width];
+			dst[width + 1] = dst[1];
+		}
+	});
+
+	// The Sobel sums are 8 times the height difference between neighbour pixels
+	float scale = strength / 8.0f;
+
+	parallelFor(height, 16, [&](size_t begin, size_t end){
+		for ( size_t y=begin; y<end; y++ ){
+			const float * above = &padded[((y + height - 1) % height) * stride];
+			const float * row = &padded[y * stride];
+			const float * below = &padded[((y + 1) % height) * stride];
+			unsigned char * out = rgba + y * width * 4;
+			int x = 0;
+#ifdef NORMAL_MAP_SSE
+			const __m128 two = _mm_set1_ps(2.0f);
+			const __m128 minus_scale = _mm_set1_ps(-scale);
+			const __m128 one = _mm_set1_ps(1.0f);
+			for ( ; x + 4 <= width; x += 4 ){
+				// padded x is the left neighbour of pixel x
+				__m128 al = _mm_loadu_ps(above + x), ac = _mm_loadu_ps(above + x + 1), ar = _mm_loadu_ps(above + x + 2);
+				__m128 rl = _mm_loadu_ps(row + x),                                      rr = _mm_loadu_ps(row + x + 2);
+				__m128 bl = _mm_loadu_ps(below + x), bc = _mm_loadu_ps(below + x + 1), br = _mm_loadu_ps(below + x + 2);
+				__m128 dx = _mm_sub_ps(_mm_add_ps(_mm_add_ps(ar, br), _mm_mul_ps(two, rr)),
+				                       _mm_add_ps(_mm_add_ps(al, bl), _mm_mul_ps(two, rl)));
+				__m128 dy = _mm_sub_ps(_mm_add_ps(_mm_add_ps(bl, br), _mm_mul_ps(two, bc)),
+				                       _mm_add_ps(_mm_add_ps(al, ar), _mm_mul_ps(two, ac)));
+				__m128 nx = _mm_mul_ps(dx, minus_scale);
+				__m128 ny = _mm_mul_ps(dy, minus_scale);
+				__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), one));
+				__m128 inverse = _mm_div_ps(one, length);
+
+				float n[3][4];
+				_mm_storeu_ps(n[0], _mm_mul_ps(nx, inverse));
+				_mm_storeu_ps(n[1], _mm_mul_ps(ny, inverse));
+				_mm_storeu_ps(n[2], inverse);
+				for ( int i=0; i<4; i++ ){
+					unsigned char * p = out + (x + i) * 4;
+					p[0] = toByte(n[0][i]);
+					p[1] = toByte(n[1][i]);
+					p[2] = toByte(n[2][i]);
+					p[3] = 255;
+				}
+			}
+#endif
+			for ( ; x<width; x++ ){
+				// same order of operations as the SSE path, for the same bytes
+				float dx = ((above[x + 2] + below[x + 2]) + 2.0f * row[x + 2]) - ((above[x] + below[x]) + 2.0f * row[x]);
+				float dy = ((below[x] + below[x + 2]) + 2.0f * below[x + 1]) - ((above[x] + above[x + 2]) + 2.0f * above[x + 1]);
+				float nx = -dx * scale, ny = -dy * scale;
+				float inverse = 1.0f / sqrtf(nx * nx + ny * ny + 1.0f);
+				unsigned char * p = out + x * 4;
+				p[0] = toByte(nx * inverse);
+				p[1] = toByte(ny * inverse);
+				p[2] = toByte(inverse);
+				p[3] = 255;
+			}
+		}
+	});
+}
@@ -0,0 +1,20 @@
+#ifndef NORMALMAP_HPP
+#define NORMALMAP_HPP
+
+// Default bumpiness of heightToNormalMap
+#define NORMAL_MAP_STRENGTH 8.0f
+
+// Tangent space normal map of a height map (one byte per pixel, 255 is high),
+// from the Sobel gradient of the heights scaled by strength.
+// The borders wrap, as for a tiling texture. Rows are spread over the cores
+// and each row is filtered 4 pixels at a time with SSE.
+// rgba needs width * height * 4 bytes : x, y, z mapped to [0, 255] and alpha 255.
+void heightToNormalMap(
+	const unsigned char * heights,
+	int width,
+	int height,
+	float strength,
+	unsigned char * rgba
+);
+
+#endif
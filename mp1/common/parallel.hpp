@@ -0,0 +1,39 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <thread>
+#include <vector>
+
+// Calls body(begin, end) on contiguous chunks covering [0, count),
+// one chunk per hardware thread, and waits for all of them.
+// Work smaller than min_chunk items per thread runs on the calling thread.
+template <class Body>
+void parallelFor(size_t count, size_t min_chunk, Body body){
+	size_t threads = std::thread::hardware_concurrency();
+	if ( threads == 0 )
+		threads = 1;
+	if ( min_chunk == 0 )
+		min_chunk = 1;
+
+	size_t chunks = (count + min_chunk - 1) / min_chunk;
+	if ( chunks > threads )
+		chunks = threads;
+	if ( chunks <= 1 ){
+		if ( count > 0 )
+			body((size_t)0, count);
+		return;
+	}
+
+	size_t chunk = (count + chunks - 1) / chunks;
+	std::vector<std::thread> workers;
+	for ( size_t begin = chunk; begin < count; begin += chunk ){
+		size_t end = begin + chunk < count ? begin + chunk : count;
+		workers.push_back(std::thread(body, begin, end));
+	}
+	body((size_t)0, chunk < count ? chunk : count);
+
+	for ( size_t i=0; i<workers.size(); i++ )
+		workers[i].join();
+}
+
+#endif
\ No newline at end of file
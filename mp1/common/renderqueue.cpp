@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.hpp"
+#include "uniformbuffer.hpp"
+#include "renderqueue.hpp"
+
+RenderQueue::RenderQueue() : depth_near(0.0f), depth_scale(1.0f), draws(0), changes(0){
+}
+
+unsigned int RenderQueue::addMaterial(const UniformBuffer & buffer, size_t offset){
+	Material material;
+	material.buffer = buffer.name();
+	material.offset = offset;
+	materials.push_back(material);
+	return (unsigned int)materials.size() - 1;
+}
+
+// Ids past the key's 10 bits share the last one, those draws still run right but group worse
+unsigned int RenderQueue::stateId(std::vector<GLuint> & names, GLuint name){
+	for ( size_t i=0; i<names.size(); i++ )
+		if ( names[i] == name )
+			return (unsigned int)i;
+	if ( names.size() == RENDER_QUEUE_STATES - 1 )
+		printf("Render queue : more than %d programs or vertex arrays, the sort keys collide\n", RENDER_QUEUE_STATES - 1);
+	if ( names.size() >= RENDER_QUEUE_STATES - 1 )
+		return RENDER_QUEUE_STATES - 1;
+	names.push_back(name);
+	return (unsigned int)names.size() - 1;
+}
+
+void RenderQueue::begin(float near, float far){
+	depth_near = near;
+	depth_scale = far > near ? 1.0f / (far - near) : 1.0f;
+	items.clear();
+	entries.clear();
+}
+
+void RenderQueue::submit(int pass, GLuint program, unsigned int material, GLuint vertex_array, float depth, const RenderDraw & draw){
+	Item item;
+	item.program = program;
+	item.vertex_array = vertex_array;
+	item.material = material;
+	item.draw = draw;
+
+	// 24 bits of linear depth
+	float d = glm::clamp((depth - depth_near) * depth_scale, 0.0f, 1.0f);
+	unsigned long long z = (unsigned long long)(d * 0xFFFFFF);
+	unsigned long long p = stateId(programs, program);
+	unsigned long long m = material < RENDER_QUEUE_STATES ? material : RENDER_QUEUE_STATES - 1;
+	unsigned long long v = stateId(vertex_arrays, vertex_array);
+	SortEntry entry;
+	if ( pass == RENDER_PASS_TRANSPARENT )
+		entry.key = (unsigned long long)pass << 62 | (0xFFFFFF - z) << 38 | p << 28 | m << 18 | v << 8;
+	else
+		entry.key = (unsigned long long)pass << 62 | p << 52 | m << 42 | v << 32 | z << 8;
+	entry.item = (unsigned int)items.size();
+	items.push_back(item);
+	entries.push_back(entry);
+}
+
+// One pass over the keys counts all eight bytes, then each byte that
+// isn't the same in every key scatters the entries once, stable
+void RenderQueue::radixSort(std::vector<SortEntry> & entries, std::vector<SortEntry> & scratch){
+	size_t n = entries.size();
+	if ( n < 2 )
+		return;
+	size_t counts[8][256];
+	memset(counts, 0, sizeof(counts));
+	for ( size_t i=0; i<n; i++ )
+		for ( int b=0; b<8; b++ )
+			counts[b][(entries[i].key >> (8 * b)) & 0xFF]++;
+
+	scratch.resize(n);
+	for ( int b=0; b<8; b++ ){
+		size_t * count = counts[b];
+		if ( count[(entries[0].key >> (8 * b)) & 0xFF] == n )
+			continue;
+		size_t offset = 0;
+		for ( int i=0; i<256; i++ ){
+			size_t c = count[i];
+			count[i] = offset;
+			offset += c;
+		}
+		for ( size_t i=0; i<n; i++ )
+			scratch[count[(entries[i].key >> (8 * b)) & 0xFF]++] = entries[i];
+		entries.swap(scratch);
+	}
+}
+
+void RenderQueue::execute(){
+	radixSort(entries, scratch);
+
+	int pass = -1;
+	const Item * previous = NULL;
+	for ( size_t i=0; i<entries.size(); i++ ){
+		const Item & item = items[entries[i].item];
+		int item_pass = (int)(entries[i].key >> 62);
+		if ( item_pass != pass ){
+			pass = item_pass;
+			if ( pass == RENDER_PASS_TRANSPARENT ){
+				glEnable(GL_BLEND);
+				glDepthMask(GL_FALSE);
+			} else {
+				glDisable(GL_BLEND);
+				glDepthMask(GL_TRUE);
+			}
+			changes++;
+		}
+		if ( !previous || item.program != previous->program ){
+			glState.useProgram(item.program);
+			changes++;
+		}
+		if ( !previous || item.material != previous->material ){
+			const Material & material = materials[item.material];
+			glState.bindBufferRange(GL_UNIFORM_BUFFER, UNIFORM_BINDING_MATERIAL, material.buffer,
+				material.offset, sizeof(MaterialBlock));
+			changes++;
+		}
+		if ( !previous || item.vertex_array != previous->vertex_array ){
+			glState.bindVertexArray(item.vertex_array);
+			changes++;
+		}
+		previous = &item;
+
+		const RenderDraw & draw = item.draw;
+		if ( draw.index_type )
+			glDrawElements(draw.mode, draw.count, draw.index_type, (const void *)draw.first);
+		else
+			glDrawArrays(draw.mode, (GLint)draw.first, draw.count);
+		draws++;
+	}
+	glDepthMask(GL_TRUE);
+	items.clear();
+	entries.clear();
+}
@@ -0,0 +1,74 @@
+#ifndef RENDERQUEUE_HPP
+#define RENDERQUEUE_HPP
+
+#include <vector>
+
+// Passes, in the order they run
+#define RENDER_PASS_OPAQUE 0      // no blending, front to back
+#define RENDER_PASS_TRANSPARENT 1 // blended, no depth writes, back to front
+
+// Programs, materials and vertex arrays a queue tells apart, 10 bits of the key each
+#define RENDER_QUEUE_STATES 1024
+
+class UniformBuffer;
+
+// One draw call, without the state it needs
+struct RenderDraw{
+	GLenum mode;
+	GLsizei count;
+	GLenum index_type; // 0 for glDrawArrays
+	size_t first;      // the first vertex, or the byte offset into the element buffer
+};
+
+// The draws of a frame are submitted in any order and run sorted by a 64 bit key.
+// Opaque keys are pass, program, material, vertex array then depth, so the draws
+// that share state run together, nearest first within a state; transparent keys
+// put the depth, reversed, right after the pass so they run back to front.
+// The keys are radix sorted, and state is only set where it differs from the
+// previous draw's, so the changes grow with the distinct states, not the draws.
+class RenderQueue{
+public:
+	RenderQueue();
+
+	// A material block in a uniform buffer, bound to UNIFORM_BINDING_MATERIAL, returns its id
+	unsigned int addMaterial(const UniformBuffer & buffer, size_t offset);
+
+	// Starts a frame, the depths given to submit() are mapped from [near, far]
+	void begin(float near, float far);
+
+	void submit(int pass, GLuint program, unsigned int material, GLuint vertex_array, float depth, const RenderDraw & draw);
+
+	// Sorts and draws the frame. Depth writes are left on, for the next glClear.
+	void execute();
+
+	size_t drawCount() const { return draws; }
+	size_t stateChanges() const { return changes; }
+
+private:
+	struct Item{
+		GLuint program, vertex_array;
+		unsigned int material;
+		RenderDraw draw;
+	};
+	struct SortEntry{
+		unsigned long long key;
+		unsigned int item;
+	};
+	struct Material{
+		GLuint buffer;
+		size_t offset;
+	};
+
+	unsigned int stateId(std::vector<GLuint> & names, GLuint name);
+	// Sorts by key, least significant byte first, skipping the bytes all keys share
+	static void radixSort(std::vector<SortEntry> & entries, std::vector<SortEntry> & scratch);
+
+	std::vector<Material> materials;
+	std::vector<GLuint> programs, vertex_arrays; // names by id, ids live as long as the queue
+	std::vector<Item> items;
+	std::vector<SortEntry> entries, scratch;
+	float depth_near, depth_scale;
+	size_t draws, changes;
+};
+
+#endif
@@ -0,0 +1,184 @@
+#include <stdio.h>
+
+#include <GL/glew.h>
+
+#include "glstate.hpp"
+#include "residency.hpp"
+
+ResidencyManager::ResidencyManager(size_t budget) : budget(budget), used(0), eviction_count(0), frame(1){
+}
+
+ResidencyManager::Asset * ResidencyManager::find(GLuint name, bool texture){
+	for ( size_t i=0; i<assets.size(); i++ )
+		if ( assets[i].name == name && assets[i].texture == texture )
+			return &assets[i];
+	return NULL;
+}
+
+GLuint ResidencyManager::makeBuffer(GLenum target, const void * data, size_t size, GLenum usage){
+	GLuint buffer;
+	glGenBuffers(1, &buffer);
+	glState.bindBuffer(target, buffer);
+	glBufferData(target, size, data, usage);
+
+	Asset asset;
+	asset.name = buffer;
+	asset.texture = false;
+	asset.bytes = size;
+	asset.last_used = frame;
+	asset.data = data;
+	asset.size = size;
+	asset.usage = usage;
+	asset.fallback_offset = asset.fallback_size = 0;
+	asset.evicted = false;
+	asset.dropped_levels = 0;
+	assets.push_back(asset);
+	used += size;
+	return buffer;
+}
+
+void ResidencyManager::trackTexture(GLuint texture, TextureResize resize){
+	Asset asset;
+	asset.name = texture;
+	asset.texture = true;
+	asset.bytes = resize(0);
+	asset.last_used = frame;
+	asset.data = NULL;
+	asset.size = 0;
+	asset.usage = 0;
+	asset.fallback_offset = asset.fallback_size = 0;
+	asset.evicted = false;
+	asset.resize = resize;
+	asset.dropped_levels = 0;
+	assets.push_back(asset);
+	used += asset.bytes;
+}
+
+void ResidencyManager::setFallback(GLuint buffer, size_t offset, size_t size){
+	Asset * asset = find(buffer, false);
+	if ( !asset )
+		return;
+	asset->fallback_offset = offset;
+	asset->fallback_size = size;
+}
+
+bool ResidencyManager::onFallback(GLuint buffer){
+	Asset * asset = find(buffer, false);
+	return asset && asset->evicted && asset->fallback_size > 0;
+}
+
+void ResidencyManager::release(GLuint name, bool texture){
+	for ( size_t i=0; i<assets.size(); i++ ){
+		if ( assets[i].name != name || assets[i].texture != texture )
+			continue;
+		used -= assets[i].bytes;
+		assets.erase(assets.begin() + i);
+		break;
+	}
+	if ( texture ){
+		glDeleteTextures(1, &name);
+		glState.forgetTexture(name);
+	}
+	else{
+		glDeleteBuffers(1, &name);
+		glState.forgetBuffer(name);
+	}
+}
+
+// The copy target doesn't disturb the bindings of the vertex array or the program
+void ResidencyManager::evictBuffer(Asset & asset){
+	glBindBuffer(GL_COPY_WRITE_BUFFER, asset.name);
+	if ( asset.fallback_size > 0 )
+		glBufferData(GL_COPY_WRITE_BUFFER, asset.fallback_size,
+			(const char *)asset.data + asset.fallback_offset, asset.usage);
+	else
+		glBufferData(GL_COPY_WRITE_BUFFER, 0, NULL, asset.usage);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	used -= asset.bytes - asset.fallback_size;
+	asset.bytes = asset.fallback_size;
+	asset.evicted = true;
+}
+
+void ResidencyManager::restoreBuffer(Asset & asset){
+	glBindBuffer(GL_COPY_WRITE_BUFFER, asset.name);
+	glBufferData(GL_COPY_WRITE_BUFFER, asset.size, asset.data, asset.usage);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	used += asset.size - asset.bytes;
+	asset.bytes = asset.size;
+	asset.evicted = false;
+}
+
+void ResidencyManager::touch(GLuint name, bool texture){
+	Asset * asset = find(name, texture);
+	if ( !asset )
+		return;
+	asset->last_used = frame;
+	if ( asset->evicted && asset->fallback_size == 0 )
+		restoreBuffer(*asset);
+}
+
+void ResidencyManager::endFrame(){
+	// Texture sizes change as their levels stream in
+	used = 0;
+	for ( size_t i=0; i<assets.size(); i++ ){
+		Asset & asset = assets[i];
+		if ( asset.texture )
+			asset.bytes = asset.resize(asset.dropped_levels);
+		used += asset.bytes;
+	}
+
+	// Shrunk textures in use get a level back while the usage is well under the budget,
+	// the level is streamed in and counted over the next frames. Buffers on their
+	// fallback come back whole, if that keeps the usage under the same mark.
+	for ( size_t i=0; i<assets.size() && used < budget * RESIDENCY_RESTORE_FRACTION; i++ ){
+		Asset & asset = assets[i];
+		if ( asset.last_used != frame )
+			continue;
+		if ( asset.texture && asset.dropped_levels > 0 )
+			asset.resize(--asset.dropped_levels);
+		else if ( !asset.texture && asset.evicted
+			&& used + asset.size - asset.bytes < budget * RESIDENCY_RESTORE_FRACTION )
+			restoreBuffer(asset);
+	}
+
+	// Least recently used first, the assets of this frame only when nothing else is left.
+	// Textures lose a level at a time, so a texture in use ends up blurry rather than gone,
+	// and so do the buffers with a fallback.
+	std::vector<bool> stuck(assets.size(), false);
+	while ( used > budget ){
+		size_t victim = assets.size();
+		for ( size_t i=0; i<assets.size(); i++ ){
+			const Asset & asset = assets[i];
+			if ( stuck[i] || asset.bytes == 0 )
+				continue;
+			if ( !asset.texture && (asset.evicted || (asset.last_used == frame && asset.fallback_size == 0)) )
+				continue;
+			if ( victim == assets.size() || asset.last_used < assets[victim].last_used )
+				victim = i;
+		}
+		if ( victim == assets.size() )
+			break;
+
+		Asset & asset = assets[victim];
+		if ( asset.texture ){
+			// The levels not streamed in yet don't free anything
+			int dropped = asset.dropped_levels;
+			size_t bytes = asset.bytes;
+			while ( bytes >= asset.bytes && dropped < RESIDENCY_MAX_LEVELS )
+				bytes = asset.resize(++dropped);
+			if ( bytes >= asset.bytes ){
+				// down to its mip tail already
+				asset.resize(asset.dropped_levels);
+				stuck[victim] = true;
+				continue;
+			}
+			asset.dropped_levels = dropped;
+			used -= asset.bytes - bytes;
+			asset.bytes = bytes;
+		} else {
+			evictBuffer(asset);
+		}
+		eviction_count++;
+	}
+	frame++;
+}
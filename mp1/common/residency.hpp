@@ -0,0 +1,87 @@
+#ifndef RESIDENCY_HPP
+#define RESIDENCY_HPP
+
+#include <functional>
+#include <vector>
+
+// Default GPU memory budget for the buffers and textures of a ResidencyManager
+#define RESIDENCY_BUDGET (256u << 20)
+// Evicted textures come back once the usage falls below this part of the budget
+#define RESIDENCY_RESTORE_FRACTION 0.75f
+// More mip levels than any texture has
+#define RESIDENCY_MAX_LEVELS 16
+
+// Accounts the GPU memory of buffers and textures and keeps it under a budget.
+// Everything drawn in a frame is touch()ed, and endFrame() evicts the least
+// recently used assets until the total fits: buffers are orphaned down to
+// nothing, or down to their fallback range, and textures give up their finest
+// mip levels, the GL names stay valid. A touched buffer is uploaded again from
+// its source data on the spot, unless it has a fallback to draw meanwhile, and
+// a buffer on its fallback or a shrunk texture gets its data back, a texture
+// one level at a time, when there is room again.
+class ResidencyManager{
+public:
+	// Called with the number of finest levels a texture has to do without,
+	// returns the bytes the texture uses after that. Called every frame, so
+	// it has to give the same answer for the same count.
+	typedef std::function<size_t(int dropped_levels)> TextureResize;
+
+	ResidencyManager(size_t budget = RESIDENCY_BUDGET);
+
+	// Creates a buffer and leaves it bound to target, like make_buffer always did.
+	// The data has to stay valid as long as the buffer: it is uploaded again after an eviction.
+	GLuint makeBuffer(GLenum target, const void * data, size_t size, GLenum usage = GL_STATIC_DRAW);
+
+	// An evicted buffer keeps bytes [offset, offset + size) of its data, moved to
+	// its start, instead of nothing: the coarsest level of detail of an index buffer.
+	// It may then be evicted while in use, and it is drawn from the fallback while
+	// onFallback() says so.
+	void setFallback(GLuint buffer, size_t offset, size_t size);
+	bool onFallback(GLuint buffer);
+
+	// Accounts a texture made elsewhere (TextureStreamer), resize is how it is shrunk
+	void trackTexture(GLuint texture, TextureResize resize);
+
+	// Deletes a buffer or texture and stops accounting it
+	void release(GLuint name, bool texture = false);
+
+	// Marks an asset as used this frame, an evicted buffer without a fallback is uploaded again
+	void touch(GLuint name, bool texture = false);
+
+	// Refreshes the texture sizes and evicts until the budget holds
+	void endFrame();
+
+	void setBudget(size_t bytes) { budget = bytes; }
+	size_t budgetBytes() const { return budget; }
+	size_t usedBytes() const { return used; }
+	size_t evictions() const { return eviction_count; }
+
+private:
+	struct Asset{
+		GLuint name;
+		bool texture;
+		size_t bytes;            // resident now
+		unsigned int last_used;  // frame
+		// buffers
+		const void * data;
+		size_t size;
+		GLenum usage;
+		size_t fallback_offset, fallback_size;
+		bool evicted;
+		// textures
+		TextureResize resize;
+		int dropped_levels;
+	};
+
+	Asset * find(GLuint name, bool texture);
+	void evictBuffer(Asset & asset);
+	void restoreBuffer(Asset & asset);
+
+	std::vector<Asset> assets;
+	size_t budget;
+	size_t used;
+	size_t eviction_count;
+	unsigned int frame;
+};
+
+#endif
@@ -11,99 +11,382 @@ using namespace std;
 
 #include <GL/glew.h>
 
+#include "glstate.hpp"
 #include "shader.hpp"
 
-GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path){
+// 64 bit FNV-1a, chained through hash
+static unsigned long long fnv1a(const char * data, size_t length, unsigned long long hash = 14695981039346656037ULL){
+	for ( size_t i=0; i<length; i++ ){
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+// The key of a program : its sources and the driver that compiled it,
+// so a driver update or another GPU never gets an old binary
+static unsigned long long programKey(const std::string & vertex_code, const std::string & fragment_code){
+	unsigned long long hash = fnv1a(vertex_code.c_str(), vertex_code.size() + 1);
+	hash = fnv1a(fragment_code.c_str(), fragment_code.size() + 1, hash);
+	const GLenum strings[3] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for ( int i=0; i<3; i++ ){
+		const char * value = (const char *)glGetString(strings[i]);
+		if ( value )
+			hash = fnv1a(value, strlen(value) + 1, hash);
+	}
+	return hash;
+}
 
-	// Read the Vertex Shader code from the file
-	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}else{
-		printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", vertex_file_path);
-		getchar();
+static bool programBinarySupported(){
+	GLint formats = 0;
+	if ( GLEW_ARB_get_program_binary || GLEW_VERSION_4_1 )
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+static std::string cachePath(unsigned long long key){
+	char name[64];
+	sprintf(name, SHADER_CACHE_PREFIX "%016llx.bin", key);
+	return name;
+}
+
+// A program linked from a cached binary, 0 if there is none or the driver rejects it
+static GLuint loadProgramBinary(unsigned long long key){
+	FILE * file = fopen(cachePath(key).c_str(), "rb");
+	if ( !file )
 		return 0;
+
+	GLenum format;
+	std::vector<char> binary;
+	if ( fread(&format, sizeof(format), 1, file) == 1 ){
+		fseek(file, 0, SEEK_END);
+		long length = ftell(file) - (long)sizeof(format);
+		fseek(file, sizeof(format), SEEK_SET);
+		if ( length > 0 ){
+			binary.resize(length);
+			if ( fread(&binary[0], 1, length, file) != (size_t)length )
+				binary.clear();
+		}
 	}
+	fclose(file);
+	if ( binary.empty() )
+		return 0;
 
-	// Read the Fragment Shader code from the file
-	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+	GLuint ProgramID = glCreateProgram();
+	glProgramBinary(ProgramID, format, &binary[0], (GLsizei)binary.size());
+	GLint Result = GL_FALSE;
+	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+	if ( Result != GL_TRUE ){
+		glDeleteProgram(ProgramID);
+		return 0;
 	}
+	return ProgramID;
+}
 
+static void saveProgramBinary(GLuint ProgramID, unsigned long long key){
+	GLint length = 0;
+	glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if ( length <= 0 )
+		return;
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(ProgramID, length, NULL, &format, &binary[0]);
 
+	FILE * file = fopen(cachePath(key).c_str(), "wb");
+	if ( !file )
+		return;
+	fwrite(&format, sizeof(format), 1, file);
+	fwrite(&binary[0], 1, binary.size(), file);
+	fclose(file);
+}
 
-	GLint Result = GL_FALSE;
-	int InfoLogLength;
+// Appends a shader file to code, with every line #include "file" replaced by
+// that file, looked up next to the file including it. #line directives keep
+// the compiler's line numbers those of the original files.
+static bool readShaderFile(const std::string & path, std::string & code, int file_number, int & file_count, int depth){
+	std::ifstream ShaderStream(path.c_str(), std::ios::in);
+	if ( !ShaderStream.is_open() ){
+		printf("Impossible to open %s. Are you in the right directory ? Don't forget to read the FAQ !\n", path.c_str());
+		return false;
+	}
+	if ( depth > SHADER_MAX_INCLUDE_DEPTH ){
+		printf("%s : includes nested too deep\n", path.c_str());
+		return false;
+	}
+	std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
 
+	std::string Line = "";
+	int line_number = 0;
+	while(getline(ShaderStream, Line)){
+		line_number++;
+		size_t start = Line.find_first_not_of(" \t");
+		if ( start != std::string::npos && Line.compare(start, 8, "#include") == 0 ){
+			size_t open = Line.find('"', start);
+			size_t close = open == std::string::npos ? open : Line.find('"', open + 1);
+			if ( close == std::string::npos ){
+				printf("%s:%d : bad #include\n", path.c_str(), line_number);
+				return false;
+			}
+			int included = ++file_count;
+			code += "#line 1 " + std::to_string(included) + "\n";
+			if ( !readShaderFile(directory + Line.substr(open + 1, close - open - 1), code, included, file_count, depth + 1) )
+				return false;
+			code += "#line " + std::to_string(line_number + 1) + " " + std::to_string(file_number) + "\n";
+			continue;
+		}
+		code += Line + "\n";
+	}
+	return true;
+}
 
+// The source of one stage : the file with its includes, and the defines right after #version
+static bool preprocessShader(const char * path, const std::vector<std::string> & defines, std::string & code){
+	int file_count = 0;
+	std::string source;
+	if ( !readShaderFile(path, source, 0, file_count, 0) )
+		return false;
 
-	// Compile Vertex Shader
-	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
-	glCompileShader(VertexShaderID);
+	size_t version = source.find("#version");
+	size_t insert = version == std::string::npos ? 0 : source.find('\n', version) + 1;
+	int version_line = (int)std::count(source.begin(), source.begin() + insert, '\n');
+	std::string lines;
+	for ( size_t i=0; i<defines.size(); i++ )
+		lines += "#define " + defines[i] + " 1\n";
+	if ( !lines.empty() )
+		lines += "#line " + std::to_string(version_line + 1) + " 0\n";
+	code = source.substr(0, insert) + lines + source.substr(insert);
+	return true;
+}
 
-	// Check Vertex Shader
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	if ( InfoLogLength > 0 ){
-		std::vector<char> VertexShaderErrorMessage(InfoLogLength+1);
-		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-		printf("%s\n", &VertexShaderErrorMessage[0]);
+// Reads, preprocesses and submits both stages and the link without asking the
+// driver anything, so a driver that compiles in parallel returns right away.
+// A program from the binary cache comes back with no shaders to finish.
+static bool startProgram(const char * vertex_file_path,const char * fragment_file_path,const std::vector<std::string> & defines, ShaderCompiler::Job & job){
+
+	// Read the Vertex Shader code from the file
+	std::string VertexShaderCode;
+	if ( !preprocessShader(vertex_file_path, defines, VertexShaderCode) ){
+		getchar();
+		return false;
 	}
 
+	// Read the Fragment Shader code from the file
+	std::string FragmentShaderCode;
+	if ( !preprocessShader(fragment_file_path, defines, FragmentShaderCode) )
+		return false;
 
+	job.name = std::string(vertex_file_path) + " + " + fragment_file_path;
+	job.vertex_shader = job.fragment_shader = 0;
+
+	// A binary of the same sources from an earlier run skips compiling and linking
+	job.binary_cache = programBinarySupported();
+	job.key = 0;
+	if ( job.binary_cache ){
+		job.key = programKey(VertexShaderCode, FragmentShaderCode);
+		job.program = loadProgramBinary(job.key);
+		if ( job.program ){
+			printf("Loaded program %s from the binary cache\n", job.name.c_str());
+			return true;
+		}
+	}
+
+	// Create and compile the shaders, their status is checked in finishProgram
+	printf("Compiling shader : %s\n", vertex_file_path);
+	job.vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+	char const * VertexSourcePointer = VertexShaderCode.c_str();
+	glShaderSource(job.vertex_shader, 1, &VertexSourcePointer , NULL);
+	glCompileShader(job.vertex_shader);
 
-	// Compile Fragment Shader
 	printf("Compiling shader : %s\n", fragment_file_path);
+	job.fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
 	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
-	glCompileShader(FragmentShaderID);
+	glShaderSource(job.fragment_shader, 1, &FragmentSourcePointer , NULL);
+	glCompileShader(job.fragment_shader);
+
+	// Link the program
+	printf("Linking program\n");
+	job.program = glCreateProgram();
+	glAttachShader(job.program, job.vertex_shader);
+	glAttachShader(job.program, job.fragment_shader);
+	glBindFragDataLocation(job.program, 0, "outColor");
+	if ( job.binary_cache )
+		glProgramParameteri(job.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(job.program);
+	return true;
+}
 
-	// Check Fragment Shader
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
-	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+static void printShaderLog(GLuint ShaderID){
+	int InfoLogLength;
+	glGetShaderiv(ShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	if ( InfoLogLength > 0 ){
-		std::vector<char> FragmentShaderErrorMessage(InfoLogLength+1);
-		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-		printf("%s\n", &FragmentShaderErrorMessage[0]);
+		std::vector<char> ShaderErrorMessage(InfoLogLength+1);
+		glGetShaderInfoLog(ShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+		printf("%s\n", &ShaderErrorMessage[0]);
 	}
+}
 
+// Waits for the link if it isn't done, prints the logs and saves the binary
+static GLuint finishProgram(ShaderCompiler::Job & job){
+	if ( !job.vertex_shader )
+		return job.program;
 
+	// Check the shaders and the program
+	printShaderLog(job.vertex_shader);
+	printShaderLog(job.fragment_shader);
 
-	// Link the program
-	printf("Linking program\n");
-	GLuint ProgramID = glCreateProgram();
-	glAttachShader(ProgramID, VertexShaderID);
-	glAttachShader(ProgramID, FragmentShaderID);
-	glLinkProgram(ProgramID);
-
-	// Check the program
-	glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
-	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+	GLint Result = GL_FALSE;
+	int InfoLogLength;
+	glGetProgramiv(job.program, GL_LINK_STATUS, &Result);
+	glGetProgramiv(job.program, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	if ( InfoLogLength > 0 ){
 		std::vector<char> ProgramErrorMessage(InfoLogLength+1);
-		glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+		glGetProgramInfoLog(job.program, InfoLogLength, NULL, &ProgramErrorMessage[0]);
 		printf("%s\n", &ProgramErrorMessage[0]);
 	}
 
-	glDeleteShader(VertexShaderID);
-	glDeleteShader(FragmentShaderID);
+	glDeleteShader(job.vertex_shader);
+	glDeleteShader(job.fragment_shader);
+	job.vertex_shader = job.fragment_shader = 0;
 
-	return ProgramID;
+	if ( job.binary_cache && Result == GL_TRUE )
+		saveProgramBinary(job.program, job.key);
+
+	return job.program;
+}
+
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path){
+	return LoadShaders(vertex_file_path, fragment_file_path, std::vector<std::string>());
+}
+
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path,const std::vector<std::string> & defines){
+	ShaderCompiler::Job job;
+	if ( !startProgram(vertex_file_path, fragment_file_path, defines, job) )
+		return 0;
+	return finishProgram(job);
+}
+
+
+
+ShaderCompiler::ShaderCompiler() : parallel_compile(false), threads_set(false){
+}
+
+GLuint ShaderCompiler::submit(const char * vertex_file_path,const char * fragment_file_path,const std::vector<std::string> & defines){
+	// Let the driver use as many threads as it likes, once there is a context
+	if ( !threads_set ){
+		threads_set = true;
+		if ( GLEW_KHR_parallel_shader_compile ){
+			glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+			parallel_compile = true;
+		}
+		else if ( GLEW_ARB_parallel_shader_compile ){
+			glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+			parallel_compile = true;
+		}
+	}
+
+	Job job;
+	if ( !startProgram(vertex_file_path, fragment_file_path, defines, job) )
+		return 0;
+	if ( job.vertex_shader )
+		jobs.push_back(job);
+	return job.program;
+}
+
+// Whether the link is over, without blocking. Without the extension any
+// query waits for the driver, so only the oldest job counts as done.
+bool ShaderCompiler::completed(const Job & job) const{
+	if ( !parallel_compile )
+		return &job == &jobs.front();
+	GLint done = GL_FALSE;
+	glGetProgramiv(job.program, GL_COMPLETION_STATUS_KHR, &done);
+	return done == GL_TRUE;
 }
 
+bool ShaderCompiler::ready(GLuint program){
+	for ( size_t i=0; i<jobs.size(); i++ ){
+		if ( jobs[i].program != program )
+			continue;
+		if ( !completed(jobs[i]) )
+			return false;
+		finishProgram(jobs[i]);
+		jobs.erase(jobs.begin() + i);
+		return true;
+	}
+	return true;
+}
 
+GLuint ShaderCompiler::wait(GLuint program){
+	for ( size_t i=0; i<jobs.size(); i++ ){
+		if ( jobs[i].program == program ){
+			finishProgram(jobs[i]);
+			jobs.erase(jobs.begin() + i);
+			break;
+		}
+	}
+	return program;
+}
+
+size_t ShaderCompiler::update(){
+	for ( size_t i=0; i<jobs.size(); ){
+		if ( completed(jobs[i]) ){
+			finishProgram(jobs[i]);
+			jobs.erase(jobs.begin() + i);
+			// one blocking finish per frame when the driver can't be polled
+			if ( !parallel_compile )
+				break;
+		}
+		else
+			i++;
+	}
+	return jobs.size();
+}
+
+void ShaderCompiler::finish(){
+	for ( size_t i=0; i<jobs.size(); i++ )
+		finishProgram(jobs[i]);
+	jobs.clear();
+}
+
+
+
+ShaderVariants::ShaderVariants(const char * vertex_file_path, const char * fragment_file_path,
+	const char * const * feature_names, int feature_count)
+	: vertex_file_path(vertex_file_path), fragment_file_path(fragment_file_path),
+	  feature_names(feature_names, feature_names + feature_count){
+}
+
+void ShaderVariants::prepare(unsigned int features){
+	if ( programs.count(features) )
+		return;
+
+	std::vector<std::string> defines;
+	for ( size_t i=0; i<feature_names.size(); i++ )
+		if ( features & (1u << i) )
+			defines.push_back(feature_names[i]);
+	programs[features] = compiler.submit(vertex_file_path.c_str(), fragment_file_path.c_str(), defines);
+}
+
+void ShaderVariants::prepareAll(){
+	for ( unsigned int features=0; features < (1u << feature_names.size()); features++ )
+		prepare(features);
+}
+
+GLuint ShaderVariants::program(unsigned int features){
+	prepare(features);
+	return compiler.wait(programs[features]);
+}
+
+GLuint ShaderVariants::ready(unsigned int features){
+	prepare(features);
+	GLuint ProgramID = programs[features];
+	return compiler.ready(ProgramID) ? ProgramID : 0;
+}
+
+void ShaderVariants::release(){
+	compiler.finish();
+	for ( std::map<unsigned int, GLuint>::iterator i=programs.begin(); i!=programs.end(); ++i ){
+		glDeleteProgram(i->second);
+		glState.forgetProgram(i->second);
+	}
+	programs.clear();
+}
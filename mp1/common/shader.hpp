@@ -1,6 +1,101 @@
 #ifndef SHADER_HPP
 #define SHADER_HPP
 
+#include <map>
+#include <string>
+#include <vector>
+
+// Linked programs are cached in the working directory under this prefix,
+// named after a hash of the sources and of the GL vendor, renderer and version
+#define SHADER_CACHE_PREFIX "shadercache-"
+// Shader files can #include "file", down to this many levels
+#define SHADER_MAX_INCLUDE_DEPTH 8
+
+// Compiles and links a vertex and a fragment shader, with the fragment output
+// outColor on draw buffer 0. When the driver supports program binaries, the
+// linked program is saved, and later runs with the same sources load it instead.
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path);
 
+// Same, with "#define NAME 1" for each of the defines right after #version in both stages
+GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path,const std::vector<std::string> & defines);
+
+// Compiles programs without waiting for the driver. Every submit only hands the
+// sources to GL; with KHR_parallel_shader_compile (or the ARB one) the driver
+// builds them on its own threads and GL_COMPLETION_STATUS_KHR tells when one is
+// done, so the render loop keeps going meanwhile. Without it, the programs are
+// finished one per update, in the order they were submitted.
+class ShaderCompiler{
+public:
+	struct Job{
+		GLuint program;
+		GLuint vertex_shader, fragment_shader; // 0 once finished, or when loaded from the binary cache
+		unsigned long long key;
+		bool binary_cache;
+		std::string name;
+	};
+
+	ShaderCompiler();
+
+	// Starts compiling and linking, the program handle is returned right away
+	// but is only usable once ready. 0 if a file can't be read.
+	GLuint submit(const char * vertex_file_path,const char * fragment_file_path,
+		const std::vector<std::string> & defines = std::vector<std::string>());
+
+	// True when the program is linked (or failed to), never blocks with the extension
+	bool ready(GLuint program);
+
+	// Blocks until the program is linked and returns it
+	GLuint wait(GLuint program);
+
+	// Finishes the programs that are done, returns how many are still compiling.
+	// Call it once per frame.
+	size_t update();
+
+	// Blocks until every program is linked
+	void finish();
+
+	size_t pending() const { return jobs.size(); }
+	bool parallel() const { return parallel_compile; }
+
+private:
+	bool completed(const Job & job) const;
+
+	std::vector<Job> jobs;
+	bool parallel_compile;
+	bool threads_set;
+};
+
+// The permutations of a shader pair, one program per combination of features.
+// Bit i of the features defines feature_names[i], so the shaders test the features
+// with #ifdef instead of branching on uniforms. Programs are built on first use.
+class ShaderVariants{
+public:
+	ShaderVariants(const char * vertex_file_path, const char * fragment_file_path,
+		const char * const * feature_names, int feature_count);
+
+	// Submits the variant to the compiler, or all of them, without waiting
+	void prepare(unsigned int features);
+	void prepareAll();
+
+	// The variant, waiting for it if it is still compiling
+	GLuint program(unsigned int features);
+
+	// The variant if it is linked, else 0 : keep drawing with another one meanwhile
+	GLuint ready(unsigned int features);
+
+	// Polls the variants being compiled, returns how many are left
+	size_t update() { return compiler.update(); }
+
+	size_t compiledCount() const { return programs.size() - compiler.pending(); }
+
+	// Deletes the programs, while the context is still there
+	void release();
+
+private:
+	std::string vertex_file_path, fragment_file_path;
+	std::vector<std::string> feature_names;
+	std::map<unsigned int, GLuint> programs;
+	ShaderCompiler compiler;
+};
+
 #endif
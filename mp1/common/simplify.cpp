@@ -0,0 +1,348 @@
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#include <glm/glm.hpp>
+
+#include "vertexcache.hpp"
+#include "simplify.hpp"
+
+// Sum of squared distances to a set of planes, weighted by triangle area
+// (Garland and Heckbert, "Surface Simplification Using Quadric Error Metrics", 1997)
+struct Quadric{
+	float a00, a11, a22, a10, a20, a21; // symmetric n * n^T
+	float b0, b1, b2;                   // n * d
+	float c;                            // d * d
+	float w;                            // total weight
+};
+
+static void quadricFromPlane(Quadric & q, const glm::vec3 & n, float d, float w){
+	q.a00 = w * n.x * n.x; q.a11 = w * n.y * n.y; q.a22 = w * n.z * n.z;
+	q.a10 = w * n.y * n.x; q.a20 = w * n.z * n.x; q.a21 = w * n.z * n.y;
+	q.b0 = w * n.x * d; q.b1 = w * n.y * d; q.b2 = w * n.z * d;
+	q.c = w * d * d;
+	q.w = w;
+}
+
+static void quadricAdd(Quadric & q, const Quadric & r){
+	q.a00 += r.a00; q.a11 += r.a11; q.a22 += r.a22;
+	q.a10 += r.a10; q.a20 += r.a20; q.a21 += r.a21;
+	q.b0 += r.b0; q.b1 += r.b1; q.b2 += r.b2;
+	q.c += r.c;
+	q.w += r.w;
+}
+
+// Mean squared distance from v to the planes of q
+static float quadricError(const Quadric & q, const glm::vec3 & v){
+	float rx = q.a00 * v.x + q.a10 * v.y + q.a20 * v.z;
+	float ry = q.a10 * v.x + q.a11 * v.y + q.a21 * v.z;
+	float rz = q.a20 * v.x + q.a21 * v.y + q.a22 * v.z;
+	float r = rx * v.x + ry * v.y + rz * v.z
+		+ 2.0f * (q.b0 * v.x + q.b1 * v.y + q.b2 * v.z) + q.c;
+	r = fabsf(r);
+	return q.w > 0.0f ? r / q.w : r;
+}
+
+struct Collapse{
+	float cost;
+	unsigned int from, to;
+	bool operator<(const Collapse & other) const {
+		if ( cost != other.cost )
+			return cost < other.cost;
+		return from < other.from;
+	}
+};
+
+static bool lessPosition(const std::pair<glm::vec3, unsigned int> & a, const std::pair<glm::vec3, unsigned int> & b){
+	if ( a.first.x != b.first.x ) return a.first.x < b.first.x;
+	if ( a.first.y != b.first.y ) return a.first.y < b.first.y;
+	if ( a.first.z != b.first.z ) return a.first.z < b.first.z;
+	return a.second < b.second;
+}
+
+// Seam and border vertices
+static void findLockedVertices(
+	const unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	std::vector<bool> & locked
+){
+	size_t vertex_count = positions.size();
+	locked.assign(vertex_count, false);
+
+	// Seams : a position shared by several vertices
+	std::vector< std::pair<glm::vec3, unsigned int> > sorted(vertex_count);
+	for ( size_t v=0; v<vertex_count; v++ )
+		sorted[v] = std::make_pair(positions[v], (unsigned int)v);
+	std::sort(sorted.begin(), sorted.end(), lessPosition);
+	for ( size_t i=1; i<vertex_count; i++ ){
+		if ( sorted[i].first == sorted[i-1].first ){
+			locked[sorted[i].second] = true;
+			locked[sorted[i-1].second] = true;
+		}
+	}
+
+	// Borders : an edge used by a single triangle
+	std::vector<unsigned long long> edges(index_count);
+	for ( size_t i=0; i<index_count; i++ ){
+		unsigned int a = indices[i];
+		unsigned int b = indices[i - i % 3 + (i + 1) % 3];
+		edges[i] = a < b ? ((unsigned long long)a << 32) | b : ((unsigned long long)b << 32) | a;
+	}
+	std::sort(edges.begin(), edges.end());
+	for ( size_t i=0; i<edges.size(); ){
+		size_t j = i + 1;
+		while ( j < edges.size() && edges[j] == edges[i] )
+			j++;
+		if ( j - i == 1 ){
+			locked[(unsigned int)(edges[i] >> 32)] = true;
+			locked[(unsigned int)(edges[i] & 0xffffffffu)] = true;
+		}
+		i = j;
+	}
+}
+
+// Link condition : the collapse keeps the surface a manifold only if from and
+// to have no other common neighbour than the third vertices of their shared triangles
+static bool collapseKeepsManifold(
+	const std::vector<unsigned int> & indices,
+	const TriangleAdjacency & adjacency,
+	unsigned int from,
+	unsigned int to,
+	std::vector<unsigned int> & scratch
+){
+	scratch.clear();
+	unsigned int opposite[2];
+	size_t shared = 0;
+	for ( unsigned int a = adjacency.offsets[from]; a < adjacency.offsets[from + 1]; a++ ){
+		const unsigned int * t = &indices[adjacency.triangles[a] * 3];
+		bool has_to = t[0] == to || t[1] == to || t[2] == to;
+		for ( int k=0; k<3; k++ ){
+			if ( t[k] == from || t[k] == to )
+				continue;
+			if ( has_to ){
+				if ( shared == 2 )
+					return false; // edge used by more than two triangles
+				opposite[shared++] = t[k];
+			}
+			else
+				scratch.push_back(t[k]);
+		}
+	}
+	if ( shared == 0 )
+		return false;
+	std::sort(scratch.begin(), scratch.end());
+
+	for ( unsigned int a = adjacency.offsets[to]; a < adjacency.offsets[to + 1]; a++ ){
+		const unsigned int * t = &indices[adjacency.triangles[a] * 3];
+		for ( int k=0; k<3; k++ ){
+			unsigned int n = t[k];
+			if ( n == to || n == from || n == opposite[0] || (shared == 2 && n == opposite[1]) )
+				continue;
+			if ( std::binary_search(scratch.begin(), scratch.end(), n) )
+				return false;
+		}
+	}
+	return true;
+}
+
+// Whether moving from onto to turns any triangle around from over
+static bool collapseFlips(
+	const std::vector<unsigned int> & indices,
+	const TriangleAdjacency & adjacency,
+	const std::vector<glm::vec3> & positions,
+	unsigned int from,
+	unsigned int to
+){
+	for ( unsigned int a = adjacency.offsets[from]; a < adjacency.offsets[from + 1]; a++ ){
+		const unsigned int * t = &indices[adjacency.triangles[a] * 3];
+		if ( t[0] == to || t[1] == to || t[2] == to )
+			continue; // removed by the collapse
+
+		glm::vec3 p[3], q[3];
+		for ( int k=0; k<3; k++ ){
+			p[k] = positions[t[k]];
+			q[k] = t[k] == from ? positions[to] : p[k];
+		}
+		glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+		glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+		// Also reject slivers, anything turned by more than ~75 degrees
+		if ( glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after) )
+			return true;
+	}
+	return false;
+}
+
+size_t simplifyMesh(
+	unsigned int * destination,
+	const unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	size_t target_index_count,
+	float * error
+){
+	size_t vertex_count = positions.size();
+	std::vector<unsigned int> result(indices, indices + index_count);
+	float max_error = 0.0f;
+
+	std::vector<bool> locked;
+	findLockedVertices(indices, index_count, positions, locked);
+
+	// Every vertex starts with the planes of its triangles
+	Quadric zero;
+	memset(&zero, 0, sizeof(zero));
+	std::vector<Quadric> quadrics(vertex_count, zero);
+	for ( size_t i=0; i+2<index_count; i+=3 ){
+		const glm::vec3 & p0 = positions[indices[i]];
+		glm::vec3 n = glm::cross(positions[indices[i+1]] - p0, positions[indices[i+2]] - p0);
+		float length = glm::length(n);
+		if ( length == 0.0f )
+			continue;
+		n /= length;
+		Quadric q;
+		quadricFromPlane(q, n, -glm::dot(n, p0), length * 0.5f);
+		for ( int k=0; k<3; k++ )
+			quadricAdd(quadrics[indices[i+k]], q);
+	}
+
+	TriangleAdjacency adjacency;
+	std::vector<Collapse> collapses;
+	std::vector<unsigned int> collapse_to(vertex_count);
+	std::vector<bool> touched(vertex_count);
+	std::vector<unsigned int> scratch;
+
+	// Each pass collapses the cheapest edges that don't share a triangle, then
+	// rebuilds the index buffer, until the target is met or nothing is left to do
+	while ( result.size() > target_index_count ){
+		buildTriangleAdjacency(&result[0], result.size(), vertex_count, adjacency);
+
+		collapses.clear();
+		for ( size_t i=0; i<result.size(); i++ ){
+			unsigned int a = result[i];
+			unsigned int b = result[i - i % 3 + (i + 1) % 3];
+			if ( a > b )
+				continue; // every edge once per triangle is enough
+			Quadric q = quadrics[a];
+			quadricAdd(q, quadrics[b]);
+			Collapse c;
+			c.cost = -1.0f;
+			if ( !locked[a] ){
+				c.cost = quadricError(q, positions[b]);
+				c.from = a;
+				c.to = b;
+			}
+			if ( !locked[b] ){
+				float cost = quadricError(q, positions[a]);
+				if ( c.cost < 0.0f || cost < c.cost ){
+					c.cost = cost;
+					c.from = b;
+					c.to = a;
+				}
+			}
+			if ( c.cost >= 0.0f )
+				collapses.push_back(c);
+		}
+		std::sort(collapses.begin(), collapses.end());
+
+		// A collapse removes about two triangles
+		size_t wanted = (result.size() - target_index_count) / 6 + 1;
+		size_t done = 0;
+		for ( size_t v=0; v<vertex_count; v++ ){
+			collapse_to[v] = (unsigned int)v;
+			touched[v] = false;
+		}
+		for ( size_t i=0; i<collapses.size() && done < wanted; i++ ){
+			const Collapse & c = collapses[i];
+			if ( touched[c.from] || touched[c.to] )
+				continue;
+			if ( !collapseKeepsManifold(result, adjacency, c.from, c.to, scratch) )
+				continue;
+			if ( collapseFlips(result, adjacency, positions, c.from, c.to) )
+				continue;
+
+			collapse_to[c.from] = c.to;
+			quadricAdd(quadrics[c.to], quadrics[c.from]);
+			max_error = std::max(max_error, c.cost);
+			done++;
+
+			// The triangles around from change, keep their vertices out of this pass
+			for ( unsigned int a = adjacency.offsets[c.from]; a < adjacency.offsets[c.from + 1]; a++ ){
+				const unsigned int * t = &result[adjacency.triangles[a] * 3];
+				touched[t[0]] = touched[t[1]] = touched[t[2]] = true;
+			}
+		}
+		if ( done == 0 )
+			break;
+
+		// Drop the triangles that lost an edge
+		size_t write = 0;
+		for ( size_t i=0; i+2<result.size(); i+=3 ){
+			unsigned int a = collapse_to[result[i]];
+			unsigned int b = collapse_to[result[i+1]];
+			unsigned int c = collapse_to[result[i+2]];
+			if ( a == b || b == c || c == a )
+				continue;
+			result[write++] = a;
+			result[write++] = b;
+			result[write++] = c;
+		}
+		result.resize(write);
+	}
+
+	if ( !result.empty() )
+		memcpy(destination, &result[0], result.size() * sizeof(unsigned int));
+	if ( error )
+		*error = sqrtf(max_error);
+	return result.size();
+}
+
+void buildLodChain(
+	const unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	unsigned int level_count,
+	std::vector<unsigned int> & lod_indices,
+	std::vector<MeshLod> & lods
+){
+	lod_indices.assign(indices, indices + index_count);
+	lods.clear();
+	MeshLod full = {0, (unsigned int)index_count, 0.0f};
+	lods.push_back(full);
+
+	std::vector<unsigned int> level(index_count);
+	for ( unsigned int i=1; i<level_count && i<LOD_MAX_LEVELS; i++ ){
+		const MeshLod & previous = lods.back();
+		size_t target = previous.index_count / 6 * 3;
+		float error = 0.0f;
+		size_t count = simplifyMesh(&level[0], &lod_indices[previous.index_offset], previous.index_count,
+			positions, target, &error);
+
+		// Not worth a level if it saves less than a quarter of the triangles
+		if ( count == 0 || count > previous.index_count / 4 * 3 )
+			break;
+
+		optimizeVertexCache(&level[0], count, positions.size());
+
+		// The error is measured against the previous level, the sum bounds it against the full mesh
+		MeshLod lod = {(unsigned int)lod_indices.size(), (unsigned int)count, previous.error + error};
+		lod_indices.insert(lod_indices.end(), level.begin(), level.begin() + count);
+		lods.push_back(lod);
+	}
+}
+
+unsigned int selectLod(
+	const std::vector<MeshLod> & lods,
+	float distance,
+	float projection_scale,
+	float pixel_error
+){
+	if ( distance <= 0.0f )
+		return 0;
+	unsigned int level = 0;
+	for ( unsigned int i=1; i<lods.size(); i++ ){
+		if ( lods[i].error / distance * projection_scale < pixel_error )
+			level = i;
+	}
+	return level;
+}
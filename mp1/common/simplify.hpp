@@ -0,0 +1,52 @@
+#ifndef SIMPLIFY_HPP
+#define SIMPLIFY_HPP
+
+#define LOD_MAX_LEVELS 5
+
+// Quadric error edge collapse. Writes a simplified copy of the triangle list to
+// destination (index_count entries must fit) and returns its index count, which
+// is at most target_index_count unless no collapse is left. Only the existing
+// vertices are used, so every level can share the vertex buffer.
+// Vertices on a border, or on a seam (several vertices sharing a position, with
+// different normals or UVs), never move.
+// error receives the largest collapse error, as a distance in model units.
+size_t simplifyMesh(
+	unsigned int * destination,
+	const unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	size_t target_index_count,
+	float * error
+);
+
+// One level of detail : a range of the index buffer built by buildLodChain
+struct MeshLod{
+	unsigned int index_offset; // first index of the level
+	unsigned int index_count;
+	float error;               // distance to the full mesh, in model units
+};
+
+// Level 0 is a copy of indices, every next level has about half the triangles
+// of the previous one. All the levels are appended to lod_indices, each one
+// optimized for the post-transform cache. Stops early once a level can't be
+// reduced any further.
+void buildLodChain(
+	const unsigned int * indices,
+	size_t index_count,
+	const std::vector<glm::vec3> & positions,
+	unsigned int level_count,
+	std::vector<unsigned int> & lod_indices,
+	std::vector<MeshLod> & lods
+);
+
+// Picks the coarsest level whose error covers less than pixel_error pixels on screen.
+// distance is from the camera to the mesh, in model units.
+// projection_scale is viewport_height / 2 / tan(fov_y / 2).
+unsigned int selectLod(
+	const std::vector<MeshLod> & lods,
+	float distance,
+	float projection_scale,
+	float pixel_error = 1.0f
+);
+
+#endif
@@ -0,0 +1,550 @@
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "softrasterizer.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SOFT_RASTERIZER_SSE 1
+#endif
+
+// Vertices snap to 1/16 pixel, so the edge functions are exact integers and
+// the triangles on both sides of an edge share its pixels without gaps or overlaps
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL (1 << SUBPIXEL_BITS)
+// Triangles are clipped to this many times the screen in x and y, the edge
+// functions inside a block then fit 32 bits
+#define GUARD_BAND 4.0f
+#define TILE_BLOCKS (SOFT_TILE_SIZE / SOFT_BLOCK_SIZE)
+
+static unsigned int pack_color(const glm::vec4 & color){
+	unsigned int r = (unsigned int)(std::min(std::max(color.x, 0.0f), 1.0f) * 255.0f + 0.5f);
+	unsigned int g = (unsigned int)(std::min(std::max(color.y, 0.0f), 1.0f) * 255.0f + 0.5f);
+	unsigned int b = (unsigned int)(std::min(std::max(color.z, 0.0f), 1.0f) * 255.0f + 0.5f);
+	unsigned int a = (unsigned int)(std::min(std::max(color.w, 0.0f), 1.0f) * 255.0f + 0.5f);
+	return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+static glm::vec4 unpack_color(unsigned int packed){
+	return glm::vec4((packed & 255) / 255.0f, ((packed >> 8) & 255) / 255.0f,
+		((packed >> 16) & 255) / 255.0f, (packed >> 24) / 255.0f);
+}
+
+SoftRasterizer::SoftRasterizer() : screen_width(0), screen_height(0), stride(0), tiles_x(0), tiles_y(0), blocks_x(0),
+	clear_color(0), clearing(false), used_batches(0), triangles(0), culled_blocks(0), last_triangles(0), last_culled_blocks(0),
+	job(NULL), job_count(0), busy_workers(0), next_item(0), generation(0), stopping(false){
+}
+
+SoftRasterizer::~SoftRasterizer(){
+	stop();
+}
+
+bool SoftRasterizer::create(int width, int height){
+	if ( width <= 0 || height <= 0 ){
+		printf("Soft rasterizer : can't make a %d x %d framebuffer\n", width, height);
+		return false;
+	}
+	screen_width = width;
+	screen_height = height;
+	// whole tiles, a block of 4 pixels never runs off the end of a row
+	tiles_x = (width + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+	tiles_y = (height + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+	stride = tiles_x * SOFT_TILE_SIZE;
+	blocks_x = tiles_x * TILE_BLOCKS;
+	color.assign((size_t)stride * tiles_y * SOFT_TILE_SIZE, 0);
+	depth.assign((size_t)stride * tiles_y * SOFT_TILE_SIZE, 1.0f);
+	block_max.assign((size_t)blocks_x * tiles_y * TILE_BLOCKS, 1.0f);
+	tile_max.assign((size_t)tiles_x * tiles_y, 1.0f);
+
+	// the calling thread takes its share of every job
+	if ( workers.empty() ){
+		stopping = false;
+		unsigned int cores = std::thread::hardware_concurrency();
+		for ( unsigned int i=1; i<cores; i++ )
+			workers.push_back(std::thread(&SoftRasterizer::work, this));
+	}
+	return true;
+}
+
+void SoftRasterizer::clear(const glm::vec4 & clear_to){
+	clear_color = pack_color(clear_to);
+	clearing = true;
+}
+
+// Calls job(i) for i in [0, count) on the workers and the calling thread,
+// each one taking the next i until they run out
+void SoftRasterizer::run(size_t count, const std::function<void(size_t)> & body){
+	if ( count == 0 )
+		return;
+	if ( count == 1 || workers.empty() ){
+		for ( size_t i=0; i<count; i++ )
+			body(i);
+		return;
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		job = &body;
+		job_count = count;
+		next_item = 0;
+		busy_workers = workers.size();
+		generation++;
+	}
+	wake.notify_all();
+	for ( size_t i; (i = next_item++) < count; )
+		body(i);
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [this]{ return busy_workers == 0; });
+}
+
+void SoftRasterizer::work(){
+	unsigned int seen = 0;
+	std::unique_lock<std::mutex> lock(mutex);
+	for ( ;; ){
+		wake.wait(lock, [this, &seen]{ return stopping || generation != seen; });
+		if ( stopping )
+			return;
+		seen = generation;
+		const std::function<void(size_t)> * body = job;
+		size_t count = job_count;
+		lock.unlock();
+		for ( size_t i; (i = next_item++) < count; )
+			(*body)(i);
+		lock.lock();
+		if ( --busy_workers == 0 )
+			done.notify_one();
+	}
+}
+
+void SoftRasterizer::stop(){
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for ( size_t i=0; i<workers.size(); i++ )
+		workers[i].join();
+	workers.clear();
+}
+
+void SoftRasterizer::draw(int mode, const unsigned int * indices, size_t count, size_t vertex_count, int varying_count,
+	const VertexShader & vertex_shader, const FragmentShader & fragment_shader, const SoftState & state){
+	if ( varying_count < 0 || varying_count > SOFT_MAX_VARYINGS ){
+		printf("Soft rasterizer : %d varyings, at most %d\n", varying_count, SOFT_MAX_VARYINGS);
+		return;
+	}
+	size_t primitives = mode == SOFT_TRIANGLES ? count / 3 : count >= 3 ? count - 2 : 0;
+	if ( primitives == 0 || color.empty() )
+		return;
+
+	// vertex stage
+	vertices.resize(vertex_count);
+	run((vertex_count + 255) / 256, [this, vertex_count, &vertex_shader](size_t block){
+		size_t end = std::min(block * 256 + 256, vertex_count);
+		for ( size_t i=block * 256; i<end; i++ )
+			vertex_shader((unsigned int)i, vertices[i]);
+	});
+
+	// setup and binning, a batch per job keeps the order within every tile
+	Draw record;
+	record.shader = fragment_shader;
+	record.state = state;
+	record.varying_count = varying_count;
+	record.first_batch = used_batches;
+	record.batch_count = (primitives + SOFT_SETUP_BATCH - 1) / SOFT_SETUP_BATCH;
+	used_batches += record.batch_count;
+	if ( batches.size() < used_batches )
+		batches.resize(used_batches);
+	size_t tile_count = (size_t)tiles_x * tiles_y;
+	for ( size_t b=record.first_batch; b<used_batches; b++ ){
+		batches[b].triangles.clear();
+		batches[b].varyings.clear();
+		batches[b].bins.resize(tile_count);
+		for ( size_t t=0; t<tile_count; t++ )
+			batches[b].bins[t].clear();
+	}
+
+	run(record.batch_count, [&](size_t job_index){
+		Batch & batch = batches[record.first_batch + job_index];
+		size_t end = std::min((job_index + 1) * SOFT_SETUP_BATCH, primitives);
+		for ( size_t p=job_index * SOFT_SETUP_BATCH; p<end; p++ ){
+			size_t corner[3];
+			if ( mode == SOFT_TRIANGLES ){
+				corner[0] = 3 * p; corner[1] = 3 * p + 1; corner[2] = 3 * p + 2;
+			} else if ( mode == SOFT_TRIANGLE_STRIP ){
+				corner[0] = p; corner[1] = p + 1; corner[2] = p + 2;
+			} else {
+				corner[0] = 0; corner[1] = p + 1; corner[2] = p + 2;
+			}
+			unsigned int v[3];
+			for ( int k=0; k<3; k++ )
+				v[k] = indices ? indices[corner[k]] : (unsigned int)corner[k];
+			if ( v[0] >= vertex_count || v[1] >= vertex_count || v[2] >= vertex_count )
+				continue;
+			clipTriangle(&vertices[v[0]], &vertices[v[1]], &vertices[v[2]], varying_count, batch);
+		}
+	});
+	for ( size_t b=record.first_batch; b<used_batches; b++ )
+		triangles += batches[b].triangles.size();
+	draws.push_back(record);
+}
+
+// Distance inside each clip plane : near, far, then the guard band left, right, bottom, top
+static float plane_distance(const glm::vec4 & p, int plane){
+	switch ( plane ){
+		case 0: return p.w + p.z;
+		case 1: return p.w - p.z;
+		case 2: return GUARD_BAND * p.w + p.x;
+		case 3: return GUARD_BAND * p.w - p.x;
+		case 4: return GUARD_BAND * p.w + p.y;
+		default: return GUARD_BAND * p.w - p.y;
+	}
+}
+
+void SoftRasterizer::clipTriangle(const SoftVertex * a, const SoftVertex * b, const SoftVertex * c, int varying_count, Batch & batch){
+	const SoftVertex * corners[3] = { a, b, c };
+	unsigned int outside[3] = { 0, 0, 0 };
+	for ( int k=0; k<3; k++ )
+		for ( int plane=0; plane<6; plane++ )
+			if ( plane_distance(corners[k]->position, plane) < 0.0f )
+				outside[k] |= 1u << plane;
+	if ( outside[0] & outside[1] & outside[2] )
+		return;
+	if ( (outside[0] | outside[1] | outside[2]) == 0 ){
+		setupTriangle(a, b, c, varying_count, batch);
+		return;
+	}
+
+	// Sutherland-Hodgman against the planes crossed, then a fan
+	SoftVertex polygons[2][9];
+	int count = 3;
+	for ( int k=0; k<3; k++ )
+		polygons[0][k] = *corners[k];
+	int from = 0;
+	unsigned int crossed = outside[0] | outside[1] | outside[2];
+	for ( int plane=0; plane<6 && count >= 3; plane++ ){
+		if ( !(crossed & (1u << plane)) )
+			continue;
+		const SoftVertex * in = polygons[from];
+		SoftVertex * out = polygons[1 - from];
+		int kept = 0;
+		for ( int k=0; k<count; k++ ){
+			const SoftVertex & p = in[k];
+			const SoftVertex & q = in[(k + 1) % count];
+			float dp = plane_distance(p.position, plane), dq = plane_distance(q.position, plane);
+			if ( dp >= 0.0f )
+				out[kept++] = p;
+			if ( (dp >= 0.0f) != (dq >= 0.0f) ){
+				float t = dp / (dp - dq);
+				SoftVertex & v = out[kept++];
+				v.position = p.position + (q.position - p.position) * t;
+				for ( int i=0; i<varying_count; i++ )
+					v.varyings[i] = p.varyings[i] + (q.varyings[i] - p.varyings[i]) * t;
+			}
+		}
+		count = kept;
+		from = 1 - from;
+	}
+	for ( int k=2; k<count; k++ )
+		setupTriangle(&polygons[from][0], &polygons[from][k - 1], &polygons[from][k], varying_count, batch);
+}
+
+void SoftRasterizer::setupTriangle(const SoftVertex * a, const SoftVertex * b, const SoftVertex * c, int varying_count, Batch & batch){
+	const SoftVertex * corners[3] = { a, b, c };
+	long long x[3], y[3];
+	float z[3], q[3];
+	for ( int k=0; k<3; k++ ){
+		const glm::vec4 & p = corners[k]->position;
+		q[k] = 1.0f / p.w;
+		// window coordinates with y up as in GL, snapped
+		x[k] = (long long)floorf((p.x * q[k] * 0.5f + 0.5f) * screen_width * SUBPIXEL + 0.5f);
+		y[k] = (long long)floorf((p.y * q[k] * 0.5f + 0.5f) * screen_height * SUBPIXEL + 0.5f);
+		z[k] = p.z * q[k] * 0.5f + 0.5f;
+	}
+	long long area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if ( area == 0 )
+		return;
+	// counter-clockwise, both faces are drawn
+	if ( area < 0 ){
+		std::swap(corners[1], corners[2]);
+		std::swap(x[1], x[2]); std::swap(y[1], y[2]);
+		std::swap(z[1], z[2]); std::swap(q[1], q[2]);
+		area = -area;
+	}
+
+	// the pixels whose centers are within the bounds, on screen
+	Triangle t;
+	long long lo_x = std::min(x[0], std::min(x[1], x[2])), hi_x = std::max(x[0], std::max(x[1], x[2]));
+	long long lo_y = std::min(y[0], std::min(y[1], y[2])), hi_y = std::max(y[0], std::max(y[1], y[2]));
+	t.min_x = std::max((int)ceil((lo_x - SUBPIXEL / 2) / (double)SUBPIXEL), 0);
+	t.min_y = std::max((int)ceil((lo_y - SUBPIXEL / 2) / (double)SUBPIXEL), 0);
+	t.max_x = std::min((int)floor((hi_x - SUBPIXEL / 2) / (double)SUBPIXEL), screen_width - 1);
+	t.max_y = std::min((int)floor((hi_y - SUBPIXEL / 2) / (double)SUBPIXEL), screen_height - 1);
+	if ( t.min_x > t.max_x || t.min_y > t.max_y )
+		return;
+
+	// edge k is opposite corner k, positive inside; the top and left edges own the pixels on them
+	long long origin_x = (long long)t.min_x * SUBPIXEL + SUBPIXEL / 2, origin_y = (long long)t.min_y * SUBPIXEL + SUBPIXEL / 2;
+	double at_origin[3];
+	for ( int k=0; k<3; k++ ){
+		int i = (k + 1) % 3, j = (k + 2) % 3;
+		long long dx = x[j] - x[i], dy = y[j] - y[i];
+		t.edge_a[k] = (int)-dy;
+		t.edge_b[k] = (int)dx;
+		t.edge_c[k] = dy * x[i] - dx * y[i];
+		bool top_left = dy < 0 || (dy == 0 && dx < 0);
+		t.edge_bias[k] = top_left ? -1 : 0;
+		at_origin[k] = (double)(-dy * origin_x + dx * origin_y + t.edge_c[k]);
+	}
+	// the barycentric of a corner is the edge opposite it over the area
+	t.l1[0] = (float)((double)t.edge_a[1] * SUBPIXEL / area);
+	t.l1[1] = (float)((double)t.edge_b[1] * SUBPIXEL / area);
+	t.l1[2] = (float)(at_origin[1] / area);
+	t.l2[0] = (float)((double)t.edge_a[2] * SUBPIXEL / area);
+	t.l2[1] = (float)((double)t.edge_b[2] * SUBPIXEL / area);
+	t.l2[2] = (float)(at_origin[2] / area);
+	for ( int i=0; i<3; i++ )
+		t.depth[i] = t.l1[i] * (z[1] - z[0]) + t.l2[i] * (z[2] - z[0]);
+	t.depth[2] += z[0];
+	t.min_depth = std::min(z[0], std::min(z[1], z[2]));
+	for ( int k=0; k<3; k++ )
+		t.q[k] = q[k];
+
+	t.varyings = (unsigned int)batch.varyings.size();
+	for ( int i=0; i<varying_count; i++ )
+		batch.varyings.push_back(corners[0]->varyings[i]);
+	for ( int k=1; k<3; k++ )
+		for ( int i=0; i<varying_count; i++ )
+			batch.varyings.push_back(corners[k]->varyings[i] - corners[0]->varyings[i]);
+
+	unsigned int index = (unsigned int)batch.triangles.size();
+	batch.triangles.push_back(t);
+	for ( int ty=t.min_y / SOFT_TILE_SIZE; ty<=t.max_y / SOFT_TILE_SIZE; ty++ )
+		for ( int tx=t.min_x / SOFT_TILE_SIZE; tx<=t.max_x / SOFT_TILE_SIZE; tx++ )
+			batch.bins[ty * tiles_x + tx].push_back(index);
+}
+
+void SoftRasterizer::finish(){
+	run((size_t)tiles_x * tiles_y, [this](size_t tile){ rasterizeTile((int)tile); });
+	clearing = false;
+	draws.clear();
+	used_batches = 0;
+	last_triangles = triangles.exchange(0);
+	last_culled_blocks = culled_blocks.exchange(0);
+}
+
+void SoftRasterizer::rasterizeTile(int tile){
+	int x0 = (tile % tiles_x) * SOFT_TILE_SIZE, y0 = (tile / tiles_x) * SOFT_TILE_SIZE;
+	int x1 = std::min(x0 + SOFT_TILE_SIZE, screen_width) - 1, y1 = std::min(y0 + SOFT_TILE_SIZE, screen_height) - 1;
+	if ( clearing ){
+		for ( int y=y0; y<y0 + SOFT_TILE_SIZE; y++ ){
+			std::fill(&color[(size_t)y * stride + x0], &color[(size_t)y * stride + x0] + SOFT_TILE_SIZE, clear_color);
+			std::fill(&depth[(size_t)y * stride + x0], &depth[(size_t)y * stride + x0] + SOFT_TILE_SIZE, 1.0f);
+		}
+		for ( int by=0; by<TILE_BLOCKS; by++ )
+			for ( int bx=0; bx<TILE_BLOCKS; bx++ )
+				block_max[(size_t)(y0 / SOFT_BLOCK_SIZE + by) * blocks_x + x0 / SOFT_BLOCK_SIZE + bx] = 1.0f;
+		tile_max[tile] = 1.0f;
+	}
+
+	size_t culled = 0;
+	for ( size_t d=0; d<draws.size(); d++ ){
+		const Draw & draw = draws[d];
+		for ( size_t b=draw.first_batch; b<draw.first_batch + draw.batch_count; b++ ){
+			const Batch & batch = batches[b];
+			const std::vector<unsigned int> & bin = batch.bins[tile];
+			for ( size_t i=0; i<bin.size(); i++ ){
+				const Triangle & triangle = batch.triangles[bin[i]];
+				culled += rasterizeTriangle(triangle, &batch.varyings[triangle.varyings], draw, tile, x0, y0, x1, y1);
+			}
+		}
+	}
+	culled_blocks += culled;
+}
+
+// Returns the blocks the depth hierarchy rejected
+size_t SoftRasterizer::rasterizeTriangle(const Triangle & t, const float * varyings, const Draw & draw, int tile,
+	int x0, int y0, int x1, int y1){
+	x0 = std::max(x0, t.min_x); y0 = std::max(y0, t.min_y);
+	x1 = std::min(x1, t.max_x); y1 = std::min(y1, t.max_y);
+	if ( x0 > x1 || y0 > y1 )
+		return 0;
+	// behind everything in the tile
+	bool depth_test = draw.state.depth_test;
+	if ( depth_test && t.min_depth >= tile_max[tile] )
+		return (size_t)(x1 / SOFT_BLOCK_SIZE - x0 / SOFT_BLOCK_SIZE + 1) * (y1 / SOFT_BLOCK_SIZE - y0 / SOFT_BLOCK_SIZE + 1);
+
+	size_t culled = 0;
+	bool tile_dirty = false;
+	const long long span = (long long)(SOFT_BLOCK_SIZE - 1) * SUBPIXEL;
+	for ( int py=y0 & ~(SOFT_BLOCK_SIZE - 1); py<=y1; py+=SOFT_BLOCK_SIZE ){
+		for ( int px=x0 & ~(SOFT_BLOCK_SIZE - 1); px<=x1; px+=SOFT_BLOCK_SIZE ){
+			float & farthest = block_max[(size_t)(py / SOFT_BLOCK_SIZE) * blocks_x + px / SOFT_BLOCK_SIZE];
+			if ( depth_test ){
+				// the nearest the triangle's plane gets in the block
+				float fx0 = (float)(px - t.min_x), fy0 = (float)(py - t.min_y);
+				float fx1 = fx0 + SOFT_BLOCK_SIZE - 1, fy1 = fy0 + SOFT_BLOCK_SIZE - 1;
+				float nearest = t.depth[2] + std::min(t.depth[0] * fx0, t.depth[0] * fx1) + std::min(t.depth[1] * fy0, t.depth[1] * fy1);
+				if ( std::max(nearest, t.min_depth) >= farthest ){
+					culled++;
+					continue;
+				}
+			}
+
+			// each edge over the block : all outside, all inside, or tested per pixel
+			int edge_start[3];
+			int crossing = 0;
+			bool outside = false;
+			for ( int k=0; k<3 && !outside; k++ ){
+				long long a = t.edge_a[k], b = t.edge_b[k];
+				long long e = a * ((long long)px * SUBPIXEL + SUBPIXEL / 2) + b * ((long long)py * SUBPIXEL + SUBPIXEL / 2) + t.edge_c[k];
+				long long lo = e + std::min(0LL, a * span) + std::min(0LL, b * span);
+				long long hi = e + std::max(0LL, a * span) + std::max(0LL, b * span);
+				if ( hi <= t.edge_bias[k] )
+					outside = true;
+				else if ( lo <= t.edge_bias[k] ){
+					edge_start[k] = (int)e;
+					crossing |= 1 << k;
+				}
+			}
+			if ( outside )
+				continue;
+
+			float before = farthest;
+			if ( shadeBlock(t, varyings, draw, px, py, std::max(x0, px), std::max(y0, py),
+				std::min(x1, px + SOFT_BLOCK_SIZE - 1), std::min(y1, py + SOFT_BLOCK_SIZE - 1), edge_start, crossing) ){
+				float block_far = 0.0f;
+				for ( int y=py; y<py + SOFT_BLOCK_SIZE; y++ ){
+					const float * row = &depth[(size_t)y * stride + px];
+					for ( int x=0; x<SOFT_BLOCK_SIZE; x++ )
+						block_far = std::max(block_far, row[x]);
+				}
+				farthest = block_far;
+				if ( before == tile_max[tile] && block_far < before )
+					tile_dirty = true;
+			}
+		}
+	}
+	if ( tile_dirty ){
+		int bx0 = (tile % tiles_x) * TILE_BLOCKS, by0 = (tile / tiles_x) * TILE_BLOCKS;
+		float tile_far = 0.0f;
+		for ( int by=by0; by<by0 + TILE_BLOCKS; by++ )
+			for ( int bx=bx0; bx<bx0 + TILE_BLOCKS; bx++ )
+				tile_far = std::max(tile_far, block_max[(size_t)by * blocks_x + bx]);
+		tile_max[tile] = tile_far;
+	}
+	return culled;
+}
+
+// Shades the pixels of [x0, x1] x [y0, y1] in the block at (px, py), 4 at a time.
+// Returns whether the depth was written.
+bool SoftRasterizer::shadeBlock(const Triangle & t, const float * varyings, const Draw & draw,
+	int px, int py, int x0, int y0, int x1, int y1, const int * edge_start, int crossing){
+	const SoftState & state = draw.state;
+	int n = draw.varying_count;
+	bool wrote = false;
+#ifdef SOFT_RASTERIZER_SSE
+	// 4 pixels along x
+	__m128i edge_step[3];
+	for ( int k=0; k<3; k++ ){
+		int step = t.edge_a[k] * SUBPIXEL;
+		edge_step[k] = _mm_set_epi32(3 * step, 2 * step, step, 0);
+	}
+	__m128 depth_step = _mm_set_ps(3.0f * t.depth[0], 2.0f * t.depth[0], t.depth[0], 0.0f);
+#endif
+	for ( int y=y0; y<=y1; y++ ){
+		for ( int g=px + ((x0 - px) & ~3); g<=x1; g+=4 ){
+			// the columns of the group within the bounds
+			int mask = 0;
+			for ( int k=0; k<4; k++ )
+				if ( g + k >= x0 && g + k <= x1 )
+					mask |= 1 << k;
+			float * depth_row = &depth[(size_t)y * stride + g];
+			float z[4];
+			float z0 = t.depth[0] * (g - t.min_x) + t.depth[1] * (y - t.min_y) + t.depth[2];
+#ifdef SOFT_RASTERIZER_SSE
+			for ( int k=0; k<3; k++ ){
+				if ( !(crossing & (1 << k)) )
+					continue;
+				int base = edge_start[k] + t.edge_b[k] * SUBPIXEL * (y - py) + t.edge_a[k] * SUBPIXEL * (g - px);
+				__m128i e = _mm_add_epi32(_mm_set1_epi32(base), edge_step[k]);
+				mask &= _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(e, _mm_set1_epi32(t.edge_bias[k]))));
+			}
+			if ( !mask )
+				continue;
+			__m128 zs = _mm_add_ps(_mm_set1_ps(z0), depth_step);
+			if ( state.depth_test )
+				mask &= _mm_movemask_ps(_mm_cmplt_ps(zs, _mm_loadu_ps(depth_row)));
+			_mm_storeu_ps(z, zs);
+#else
+			for ( int k=0; k<3; k++ ){
+				if ( !(crossing & (1 << k)) )
+					continue;
+				int base = edge_start[k] + t.edge_b[k] * SUBPIXEL * (y - py) + t.edge_a[k] * SUBPIXEL * (g - px);
+				for ( int l=0; l<4; l++ )
+					if ( base + l * t.edge_a[k] * SUBPIXEL <= t.edge_bias[k] )
+						mask &= ~(1 << l);
+			}
+			for ( int l=0; l<4; l++ ){
+				z[l] = z0 + l * t.depth[0];
+				if ( state.depth_test && !(z[l] < depth_row[l]) )
+					mask &= ~(1 << l);
+			}
+#endif
+			for ( ; mask; mask &= mask - 1 ){
+				int l = mask & 1 ? 0 : mask & 2 ? 1 : mask & 4 ? 2 : 3;
+				int x = g + l;
+				// perspective correct barycentrics from the screen ones
+				float fx = (float)(x - t.min_x), fy = (float)(y - t.min_y);
+				float l1 = t.l1[0] * fx + t.l1[1] * fy + t.l1[2];
+				float l2 = t.l2[0] * fx + t.l2[1] * fy + t.l2[2];
+				float q = t.q[0] + l1 * (t.q[1] - t.q[0]) + l2 * (t.q[2] - t.q[0]);
+				float w1 = l1 * t.q[1] / q, w2 = l2 * t.q[2] / q;
+				float interpolated[SOFT_MAX_VARYINGS];
+				for ( int i=0; i<n; i++ )
+					interpolated[i] = varyings[i] + w1 * varyings[n + i] + w2 * varyings[2 * n + i];
+
+				glm::vec4 fragment;
+				draw.shader(interpolated, fragment);
+				unsigned int & pixel = color[(size_t)y * stride + x];
+				if ( state.blend ){
+					float alpha = std::min(std::max(fragment.w, 0.0f), 1.0f);
+					fragment = fragment * alpha + unpack_color(pixel) * (1.0f - alpha);
+				}
+				pixel = pack_color(fragment);
+				if ( state.depth_write ){
+					depth_row[l] = z[l];
+					wrote = true;
+				}
+			}
+		}
+	}
+	return wrote;
+}
+
+void SoftRasterizer::readPixels(std::vector<unsigned char> & rgb) const{
+	rgb.resize((size_t)screen_width * screen_height * 3);
+	unsigned char * out = rgb.empty() ? NULL : &rgb[0];
+	for ( int y=screen_height - 1; y>=0; y-- ){
+		const unsigned int * row = &color[(size_t)y * stride];
+		for ( int x=0; x<screen_width; x++ ){
+			*out++ = (unsigned char)(row[x] & 255);
+			*out++ = (unsigned char)((row[x] >> 8) & 255);
+			*out++ = (unsigned char)((row[x] >> 16) & 255);
+		}
+	}
+}
+
+void SoftRasterizer::release(){
+	stop();
+	color.clear(); color.shrink_to_fit();
+	depth.clear(); depth.shrink_to_fit();
+	block_max.clear();
+	tile_max.clear();
+	batches.clear();
+	vertices.clear();
+	draws.clear();
+	used_batches = 0;
+}
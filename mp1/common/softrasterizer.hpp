@@ -0,0 +1,144 @@
+#ifndef SOFTRASTERIZER_HPP
+#define SOFTRASTERIZER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Primitives, as GL_TRIANGLES, GL_TRIANGLE_STRIP and GL_TRIANGLE_FAN
+#define SOFT_TRIANGLES 0
+#define SOFT_TRIANGLE_STRIP 1
+#define SOFT_TRIANGLE_FAN 2
+// Floats a vertex passes down to its fragments at most
+#define SOFT_MAX_VARYINGS 12
+// Pixels per side of a tile, the work a thread takes at once, and of a block
+// of the depth hierarchy inside it
+#define SOFT_TILE_SIZE 64
+#define SOFT_BLOCK_SIZE 8
+// Triangles per setup job at least
+#define SOFT_SETUP_BATCH 2048
+
+// glm has to be included before this header.
+struct SoftVertex{
+	glm::vec4 position;                // clip space, as gl_Position
+	float varyings[SOFT_MAX_VARYINGS];
+};
+
+struct SoftState{
+	bool depth_test;   // GL_LESS
+	bool depth_write;
+	bool blend;        // GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+};
+
+// Draws triangles on the CPU the way the GL programs do, for the hosts without
+// a GPU. A draw shades its vertices and sets up its triangles on worker threads
+// right away : clipped to the near and far planes and a guard band, snapped to
+// 1/16 pixel and binned to the 64 x 64 tiles their bounds touch. finish() then
+// hands the tiles to the workers, each one running the bins of its tile in the
+// order of submission, so blending comes out as on a GPU. Coverage is tested 4
+// pixels at a time with exact integer edge functions, an 8 x 8 block at a time
+// once the block is known to be partly covered, and the farthest depth of every
+// block and of every tile rejects hidden triangles before they are rasterized.
+// The varyings are interpolated perspective correct.
+class SoftRasterizer{
+public:
+	// Writes the vertex of the given index, from the worker threads
+	typedef std::function<void(unsigned int index, SoftVertex & vertex)> VertexShader;
+	// The interpolated varyings of a pixel to its color, from the worker threads
+	typedef std::function<void(const float * varyings, glm::vec4 & color)> FragmentShader;
+
+	SoftRasterizer();
+	~SoftRasterizer(); // stops the workers
+
+	// Allocates a width x height RGBA8 + float depth framebuffer and starts the workers
+	bool create(int width, int height);
+
+	// Clears the color to color and the depth to 1, done by the tiles in finish()
+	void clear(const glm::vec4 & color);
+
+	// Draws count indices, or the first count vertices if indices is NULL,
+	// vertex_shader is called once for each of the vertex_count vertices
+	void draw(int mode, const unsigned int * indices, size_t count, size_t vertex_count, int varying_count,
+		const VertexShader & vertex_shader, const FragmentShader & fragment_shader, const SoftState & state);
+
+	// Rasterizes everything drawn since the last finish()
+	void finish();
+
+	// The framebuffer as RGB rows from the top, after finish()
+	void readPixels(std::vector<unsigned char> & rgb) const;
+
+	int width() const { return screen_width; }
+	int height() const { return screen_height; }
+	size_t threadCount() const { return workers.size() + 1; }
+	// Of the last finish()
+	size_t triangleCount() const { return last_triangles; }
+	size_t culledBlocks() const { return last_culled_blocks; }
+
+	// Stops the workers and frees the framebuffer
+	void release();
+
+private:
+	// A triangle ready to rasterize. The edge functions a x + b y + c are in sub-pixels
+	// and above bias inside, the planes in pixels from (min_x, min_y).
+	struct Triangle{
+		int edge_a[3], edge_b[3], edge_bias[3];
+		long long edge_c[3];
+		int min_x, min_y, max_x, max_y; // the pixels it may cover
+		float l1[3], l2[3], depth[3];   // planes of the barycentrics of corners 1 and 2, and of the depth
+		float q[3];                     // 1 / w of the corners
+		float min_depth;
+		unsigned int varyings;          // into the batch's : corner 0, then 1 - 0 and 2 - 0
+	};
+	// The triangles of one setup job, binned by tile
+	struct Batch{
+		std::vector<Triangle> triangles;
+		std::vector<float> varyings;
+		std::vector<std::vector<unsigned int> > bins;
+	};
+	struct Draw{
+		FragmentShader shader;
+		SoftState state;
+		int varying_count;
+		size_t first_batch, batch_count;
+	};
+
+	void run(size_t count, const std::function<void(size_t)> & job);
+	void work();
+	void stop();
+	void clipTriangle(const SoftVertex * a, const SoftVertex * b, const SoftVertex * c, int varying_count, Batch & batch);
+	void setupTriangle(const SoftVertex * a, const SoftVertex * b, const SoftVertex * c, int varying_count, Batch & batch);
+	void rasterizeTile(int tile);
+	size_t rasterizeTriangle(const Triangle & triangle, const float * varyings, const Draw & draw, int tile,
+		int x0, int y0, int x1, int y1);
+	bool shadeBlock(const Triangle & triangle, const float * varyings, const Draw & draw,
+		int px, int py, int x0, int y0, int x1, int y1, const int * edge_start, int crossing);
+
+	int screen_width, screen_height, stride, tiles_x, tiles_y, blocks_x;
+	std::vector<unsigned int> color;
+	std::vector<float> depth;
+	std::vector<float> block_max, tile_max; // the farthest depth in each block and tile
+	unsigned int clear_color;
+	bool clearing;
+
+	std::vector<SoftVertex> vertices;
+	std::vector<Batch> batches;
+	size_t used_batches;
+	std::vector<Draw> draws;
+	std::atomic<size_t> triangles, culled_blocks;
+	size_t last_triangles, last_culled_blocks;
+
+	// the job the workers are on
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(size_t)> * job;
+	size_t job_count, busy_workers;
+	std::atomic<size_t> next_item;
+	unsigned int generation;
+	bool stopping;
+};
+
+#endif
@@ -1,8 +1,12 @@
 #include <vector>
 #include <glm/glm.hpp>
 
+#include "parallel.hpp"
+#include "vertexcache.hpp"
 #include "tangentspace.hpp"
 
+#include <math.h>
+
 void computeTangentBasis(
 	// inputs
 	std::vector<glm::vec3> & vertices,
@@ -70,4 +74,148 @@ void computeTangentBasis(
 
 }
 
+void computeVertexNormals(
+	// inputs
+	const std::vector<unsigned int> & indices,
+	const std::vector<glm::vec3> & vertices,
+	NormalWeighting weighting,
+	// outputs
+	std::vector<glm::vec3> & normals
+){
+	size_t triangle_count = indices.size() / 3;
+	normals.assign(vertices.size(), glm::vec3(0.0f));
+	if ( triangle_count == 0 )
+		return;
+
+	TriangleAdjacency adjacency;
+	buildTriangleAdjacency(&indices[0], triangle_count * 3, vertices.size(), adjacency);
+
+	// Weighted normal of each triangle corner
+	std::vector<glm::vec3> corners(triangle_count * 3);
+	parallelFor(triangle_count, 4096, [&](size_t begin, size_t end){
+		for ( size_t t=begin; t<end; t++ ){
+			const glm::vec3 & v0 = vertices[indices[t*3+0]];
+			const glm::vec3 & v1 = vertices[indices[t*3+1]];
+			const glm::vec3 & v2 = vertices[indices[t*3+2]];
+
+			// Length of the cross product = twice the area
+			glm::vec3 normal = glm::cross(v1-v0, v2-v0);
+			if ( weighting == NORMAL_WEIGHT_AREA ){
+				corners[t*3+0] = corners[t*3+1] = corners[t*3+2] = normal;
+				continue;
+			}
+
+			float length = glm::length(normal);
+			if ( length == 0.0f ){
+				corners[t*3+0] = corners[t*3+1] = corners[t*3+2] = glm::vec3(0.0f);
+				continue;
+			}
+			normal /= length;
+			const glm::vec3 * v[3] = {&v0, &v1, &v2};
+			for ( int k=0; k<3; k++ ){
+				glm::vec3 e1 = *v[(k+1)%3] - *v[k];
+				glm::vec3 e2 = *v[(k+2)%3] - *v[k];
+				float cosine = glm::dot(e1, e2) / (glm::length(e1) * glm::length(e2));
+				corners[t*3+k] = normal * acosf(glm::clamp(cosine, -1.0f, 1.0f));
+			}
+		}
+	});
+
+	// Each vertex sums its corners, in triangle order
+	parallelFor(vertices.size(), 4096, [&](size_t begin, size_t end){
+		for ( size_t v=begin; v<end; v++ ){
+			glm::vec3 sum(0.0f);
+			for ( unsigned int a = adjacency.offsets[v]; a < adjacency.offsets[v+1]; a++ ){
+				unsigned int t = adjacency.triangles[a];
+				for ( int k=0; k<3; k++ )
+					if ( indices[t*3+k] == v )
+						sum += corners[t*3+k];
+			}
+			float length = glm::length(sum);
+			normals[v] = length > 0.0f ? sum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+		}
+	});
+}
 
+void computeTangentBasisIndexed(
+	// inputs
+	const std::vector<unsigned int> & indices,
+	const std::vector<glm::vec3> & vertices,
+	const std::vector<glm::vec2> & uvs,
+	const std::vector<glm::vec3> & normals,
+	// outputs
+	std::vector<glm::vec3> & tangents,
+	std::vector<glm::vec3> & bitangents
+){
+	size_t triangle_count = indices.size() / 3;
+	tangents.assign(vertices.size(), glm::vec3(0.0f));
+	bitangents.assign(vertices.size(), glm::vec3(0.0f));
+	if ( triangle_count == 0 )
+		return;
+
+	TriangleAdjacency adjacency;
+	buildTriangleAdjacency(&indices[0], triangle_count * 3, vertices.size(), adjacency);
+
+	// Tangent and bitangent of each triangle, as in computeTangentBasis
+	std::vector<glm::vec3> face_tangents(triangle_count);
+	std::vector<glm::vec3> face_bitangents(triangle_count);
+	parallelFor(triangle_count, 4096, [&](size_t begin, size_t end){
+		for ( size_t t=begin; t<end; t++ ){
+			// Shortcuts for vertices
+			const glm::vec3 & v0 = vertices[indices[t*3+0]];
+			const glm::vec3 & v1 = vertices[indices[t*3+1]];
+			const glm::vec3 & v2 = vertices[indices[t*3+2]];
+
+			// Shortcuts for UVs
+			const glm::vec2 & uv0 = uvs[indices[t*3+0]];
+			const glm::vec2 & uv1 = uvs[indices[t*3+1]];
+			const glm::vec2 & uv2 = uvs[indices[t*3+2]];
+
+			// Edges of the triangle : postion delta
+			glm::vec3 deltaPos1 = v1-v0;
+			glm::vec3 deltaPos2 = v2-v0;
+
+			// UV delta
+			glm::vec2 deltaUV1 = uv1-uv0;
+			glm::vec2 deltaUV2 = uv2-uv0;
+
+			// Triangles without UV area have no tangent space, they don't contribute
+			float det = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+			if ( fabsf(det) < 1e-12f ){
+				face_tangents[t] = face_bitangents[t] = glm::vec3(0.0f);
+				continue;
+			}
+			float r = 1.0f / det;
+			face_tangents[t] = (deltaPos1 * deltaUV2.y   - deltaPos2 * deltaUV1.y)*r;
+			face_bitangents[t] = (deltaPos2 * deltaUV1.x   - deltaPos1 * deltaUV2.x)*r;
+		}
+	});
+
+	// Each vertex sums the triangles around it, in triangle order
+	parallelFor(vertices.size(), 4096, [&](size_t begin, size_t end){
+		for ( size_t v=begin; v<end; v++ ){
+			glm::vec3 t(0.0f), b(0.0f);
+			for ( unsigned int a = adjacency.offsets[v]; a < adjacency.offsets[v+1]; a++ ){
+				t += face_tangents[adjacency.triangles[a]];
+				b += face_bitangents[adjacency.triangles[a]];
+			}
+			const glm::vec3 & n = normals[v];
+
+			// Gram-Schmidt orthogonalize
+			t = t - n * glm::dot(n, t);
+			float length = glm::length(t);
+			if ( length > 0.0f ){
+				t /= length;
+			}else{
+				// No usable UVs around : any direction orthogonal to the normal
+				t = fabsf(n.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0);
+				t = glm::normalize(t - n * glm::dot(n, t));
+			}
+
+			// Calculate handedness
+			float handedness = glm::dot(glm::cross(n, t), b) < 0.0f ? -1.0f : 1.0f;
+			tangents[v] = t;
+			bitangents[v] = glm::cross(n, t) * handedness;
+		}
+	});
+}
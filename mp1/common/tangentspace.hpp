@@ -11,5 +11,38 @@ void computeTangentBasis(
 	std::vector<glm::vec3> & bitangents
 );
 
+// How the face normals around a vertex are weighted
+enum NormalWeighting{
+	NORMAL_WEIGHT_AREA,  // by triangle area
+	NORMAL_WEIGHT_ANGLE  // by corner angle, doesn't depend on how the surface is triangulated
+};
+
+// Smooth normals of an indexed triangle list.
+// Each vertex gathers from its own triangles through a vertex to triangle
+// adjacency, so vertices run in parallel without atomics, and the sums are
+// always done in the same order : the result doesn't depend on the thread count.
+void computeVertexNormals(
+	// inputs
+	const std::vector<unsigned int> & indices,
+	const std::vector<glm::vec3> & vertices,
+	NormalWeighting weighting,
+	// outputs
+	std::vector<glm::vec3> & normals
+);
+
+// Tangent basis of an indexed triangle list, gathered like the normals.
+// Tangents are Gram-Schmidt orthogonalized against the normals, and
+// bitangents = cross(normal, tangent) with the handedness of the UVs.
+void computeTangentBasisIndexed(
+	// inputs
+	const std::vector<unsigned int> & indices,
+	const std::vector<glm::vec3> & vertices,
+	const std::vector<glm::vec2> & uvs,
+	const std::vector<glm::vec3> & normals,
+	// outputs
+	std::vector<glm::vec3> & tangents,
+	std::vector<glm::vec3> & bitangents
+);
+
 
 #endif
\ No newline at end of file
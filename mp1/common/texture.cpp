@@ -4,7 +4,12 @@
 
 #include <GL/glew.h>
 
+#include "mappedfile.hpp"
+
+// glfwLoadTexture2D only exists up to GLFW 2
+#ifdef TEXTURE_GLFW2
 #include <GL/glfw.h>
+#endif
 
 
 GLuint loadBMP_custom(const char * imagepath){
@@ -12,24 +17,23 @@ GLuint loadBMP_custom(const char * imagepath){
 	printf("Reading image %s\n", imagepath);
 
 	// Data read from the header of the BMP file
-	unsigned char header[54];
+	const unsigned char * header;
 	unsigned int dataPos;
 	unsigned int imageSize;
 	unsigned int width, height;
-	// Actual RGB data
-	unsigned char * data;
 
-	// Open the file
-	FILE * file = fopen(imagepath,"rb");
-	if (!file)							    {printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); return 0;}
+	// Map the file : the pixels are read straight from it, without a copy
+	MappedFile file;
+	if ( !file.open(imagepath) )	    {printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); return 0;}
 
 	// Read the header, i.e. the 54 first bytes
 
-	// If less than 54 bytes are read, problem
-	if ( fread(header, 1, 54, file)!=54 ){ 
+	// If less than 54 bytes are there, problem
+	if ( file.size() < 54 ){ 
 		printf("Not a correct BMP file\n");
 		return 0;
 	}
+	header = file.data();
 	// A BMP files always begins with "BM"
 	if ( header[0]!='B' || header[1]!='M' ){
 		printf("Not a correct BMP file\n");
@@ -49,14 +53,11 @@ GLuint loadBMP_custom(const char * imagepath){
 	if (imageSize==0)    imageSize=width*height*3; // 3 : one byte for each Red, Green and Blue component
 	if (dataPos==0)      dataPos=54; // The BMP header is done that way
 
-	// Create a buffer
-	data = new unsigned char [imageSize];
-
-	// Read the actual data from the file into the buffer
-	fread(data,1,imageSize,file);
-
-	// Everything is in memory now, the file wan be closed
-	fclose (file);
+	// Rows are padded to 4 bytes, which is also GL's default unpack alignment
+	if ( dataPos > file.size() || file.size() - dataPos < (size_t)((width*3 + 3) & ~3u) * height ){
+		printf("Not a correct BMP file\n");
+		return 0;
+	}
 
 	// Create one OpenGL texture
 	GLuint textureID;
@@ -65,11 +66,8 @@ GLuint loadBMP_custom(const char * imagepath){
 	// "Bind" the newly created texture : all future texture functions will modify this texture
 	glBindTexture(GL_TEXTURE_2D, textureID);
 
-	// Give the image to OpenGL
-	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, data);
-
-	// OpenGL has now copied the data. Free our own version
-	delete [] data;
+	// Give the image to OpenGL, it copies the pages it touches before returning
+	glTexImage2D(GL_TEXTURE_2D, 0,GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, file.data() + dataPos);
 
 	// Poor filtering, or ...
 	//glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
@@ -87,6 +85,10 @@ GLuint loadBMP_custom(const char * imagepath){
 }
 
 GLuint loadTGA_glfw(const char * imagepath){
+#ifndef TEXTURE_GLFW2
+	printf("%s could not be loaded, loadTGA_glfw needs GLFW 2 (TEXTURE_GLFW2)\n", imagepath);
+	return 0;
+#else
 
 	// Create one OpenGL texture
 	GLuint textureID;
@@ -107,6 +109,7 @@ GLuint loadTGA_glfw(const char * imagepath){
 
 	// Return the ID of the texture we just created
 	return textureID;
+#endif
 }
 
 
@@ -114,48 +117,40 @@ GLuint loadTGA_glfw(const char * imagepath){
 #define FOURCC_DXT1 0x31545844 // Equivalent to "DXT1" in ASCII
 #define FOURCC_DXT3 0x33545844 // Equivalent to "DXT3" in ASCII
 #define FOURCC_DXT5 0x35545844 // Equivalent to "DXT5" in ASCII
+#define FOURCC_ATI2 0x32495441 // Equivalent to "ATI2" in ASCII, BC5
 
-GLuint loadDDS(const char * imagepath){
+#ifndef GL_COMPRESSED_RG_RGTC2
+#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
 
-	unsigned char header[124];
+GLuint loadDDS(const char * imagepath){
 
-	FILE *fp; 
+	MappedFile file;
  
-	/* try to open the file */ 
-	fp = fopen(imagepath, "rb"); 
-	if (fp == NULL){
+	/* try to map the file */ 
+	if (!file.open(imagepath)){
 		printf("%s could not be opened. Are you in the right directory ? Don't forget to read the FAQ !\n", imagepath); getchar(); 
 		return 0;
 	}
    
 	/* verify the type of file */ 
-	char filecode[4]; 
-	fread(filecode, 1, 4, fp); 
-	if (strncmp(filecode, "DDS ", 4) != 0) { 
-		fclose(fp); 
+	if (file.size() < 128 || strncmp((const char *)file.data(), "DDS ", 4) != 0) { 
 		return 0; 
 	}
 	
 	/* get the surface desc */ 
-	fread(&header, 124, 1, fp); 
+	const unsigned char * header = file.data() + 4;
 
 	unsigned int height      = *(unsigned int*)&(header[8 ]);
 	unsigned int width	     = *(unsigned int*)&(header[12]);
-	unsigned int linearSize	 = *(unsigned int*)&(header[16]);
 	unsigned int mipMapCount = *(unsigned int*)&(header[24]);
 	unsigned int fourCC      = *(unsigned int*)&(header[80]);
+	if (mipMapCount == 0) mipMapCount = 1;
+
+	/* the levels follow the header, each one is read from the mapping when it is uploaded */ 
+	const unsigned char * buffer = file.data() + 128;
+	size_t bufsize = file.size() - 128;
 
- 
-	unsigned char * buffer;
-	unsigned int bufsize;
-	/* how big is it going to be including all mipmaps? */ 
-	bufsize = mipMapCount > 1 ? linearSize * 2 : linearSize; 
-	buffer = (unsigned char*)malloc(bufsize * sizeof(unsigned char)); 
-	fread(buffer, 1, bufsize, fp); 
-	/* close the file pointer */ 
-	fclose(fp);
-
-	unsigned int components  = (fourCC == FOURCC_DXT1) ? 3 : 4; 
 	unsigned int format;
 	switch(fourCC) 
 	{ 
@@ -168,8 +163,10 @@ GLuint loadDDS(const char * imagepath){
 	case FOURCC_DXT5: 
 		format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; 
 		break; 
+	case FOURCC_ATI2: 
+		format = GL_COMPRESSED_RG_RGTC2; 
+		break; 
 	default: 
-		free(buffer); 
 		return 0; 
 	}
 
@@ -182,12 +179,15 @@ GLuint loadDDS(const char * imagepath){
 	glPixelStorei(GL_UNPACK_ALIGNMENT,1);	
 	
 	unsigned int blockSize = (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16; 
-	unsigned int offset = 0;
+	size_t offset = 0;
+	unsigned int level;
 
-	/* load the mipmaps */ 
-	for (unsigned int level = 0; level < mipMapCount && (width || height); ++level) 
+	/* load the mipmaps, each one with its exact size, stopping at the end of the file */ 
+	for (level = 0; level < mipMapCount; ++level) 
 	{ 
 		unsigned int size = ((width+3)/4)*((height+3)/4)*blockSize; 
+		if (offset + size > bufsize)
+			break;
 		glCompressedTexImage2D(GL_TEXTURE_2D, level, format, width, height,  
 			0, size, buffer + offset); 
 	 
@@ -200,10 +200,16 @@ GLuint loadDDS(const char * imagepath){
 		if(height < 1) height = 1;
 
 	} 
+	glPixelStorei(GL_UNPACK_ALIGNMENT,4);
 
-	free(buffer); 
+	if (level == 0){
+		printf("%s is truncated\n", imagepath);
+		glDeleteTextures(1, &textureID);
+		return 0;
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
 
 	return textureID;
 
 
-}
\ No newline at end of file
+}
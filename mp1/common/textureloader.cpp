@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include <GL/glew.h>
+
+#include "soil.h"
+#include "blockcompress.hpp"
+#include "normalmap.hpp"
+#include "textureloader.hpp"
+
+#ifndef GL_COMPRESSED_RG_RGTC2
+#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+
+TextureLoader::TextureLoader() : running_workers(0){
+}
+
+TextureLoader::~TextureLoader(){
+	for ( size_t i=0; i<workers.size(); i++ )
+		workers[i].join();
+	for ( size_t i=0; i<jobs.size(); i++ ){
+		if ( jobs[i]->pixels )
+			SOIL_free_image_data(jobs[i]->pixels);
+		delete jobs[i]->compressed;
+		delete jobs[i];
+	}
+}
+
+GLuint TextureLoader::load(const char * path, const unsigned char placeholder[3], BlockFormat format){
+	return start(path, placeholder, format, 0.0f);
+}
+
+GLuint TextureLoader::loadHeightMap(const char * path, const unsigned char placeholder[3], float strength){
+	return start(path, placeholder, BLOCK_BC5, strength);
+}
+
+std::string TextureLoader::cachePath(const char * path, float bump_strength){
+	if ( bump_strength <= 0.0f )
+		return std::string(path) + ".dds";
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".bump%g.dds", bump_strength);
+	return std::string(path) + suffix;
+}
+
+bool TextureLoader::cacheStale(const char * path, float bump_strength){
+	struct stat image, cache;
+	if ( stat(cachePath(path, bump_strength).c_str(), &cache) != 0 )
+		return true;
+	if ( stat(path, &image) != 0 )
+		return false;
+	return image.st_mtime > cache.st_mtime;
+}
+
+GLuint TextureLoader::start(const char * path, const unsigned char placeholder[3], BlockFormat format, float bump_strength){
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, placeholder);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, bound);
+
+	Job * job = new Job();
+	job->path = path;
+	job->texture = texture;
+	job->format = format;
+	job->bump_strength = bump_strength;
+	job->pixels = NULL;
+	job->compressed = NULL;
+	job->width = job->height = 0;
+	job->decoded = false;
+	job->failed = false;
+	job->uploaded = false;
+	job->pbo = 0;
+	job->mapped = NULL;
+	job->copied = 0;
+	jobs.push_back(job);
+
+	// Workers quit when the queue runs dry, start one if less than one per core are left
+	std::lock_guard<std::mutex> lock(mutex);
+	queue.push_back(job);
+	size_t cores = std::thread::hardware_concurrency();
+	if ( running_workers < (cores ? cores : 2) ){
+		running_workers++;
+		workers.push_back(std::thread(&TextureLoader::work, this));
+	}
+	return texture;
+}
+
+// Decodes queued images until the queue is empty
+void TextureLoader::work(){
+	for (;;){
+		Job * job;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if ( queue.empty() ){
+				running_workers--;
+				return;
+			}
+			job = queue.front();
+			queue.pop_front();
+		}
+
+		int width = 0, height = 0;
+		unsigned char * pixels = NULL;
+		CompressedImage * compressed = NULL;
+		if ( job->format == BLOCK_NONE ){
+			pixels = SOIL_load_image(job->path.c_str(), &width, &height, 0, SOIL_LOAD_RGB);
+		} else {
+			compressed = loadCompressed(job);
+			if ( compressed ){
+				width = compressed->width;
+				height = compressed->height;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		job->pixels = pixels;
+		job->compressed = compressed;
+		job->width = width;
+		job->height = height;
+		job->failed = width <= 0 || height <= 0 || (!pixels && (!compressed || compressed->data.empty()));
+		job->decoded = true;
+	}
+}
+
+// Reads the DDS cache, or compresses the image and writes it for the next run.
+// Height maps become normal maps first, so the cache holds the normals.
+CompressedImage * TextureLoader::loadCompressed(const Job * job){
+	std::string cache = cachePath(job->path.c_str(), job->bump_strength);
+	CompressedImage * image = new CompressedImage();
+	if ( !cacheStale(job->path.c_str(), job->bump_strength) && readDDS(cache.c_str(), *image)
+		&& image->fourcc == blockFourCC(job->format) )
+		return image;
+
+	int width, height;
+	unsigned char * pixels = SOIL_load_image(job->path.c_str(), &width, &height, 0,
+		job->bump_strength > 0.0f ? SOIL_LOAD_L : SOIL_LOAD_RGBA);
+	if ( !pixels ){
+		delete image;
+		return NULL;
+	}
+	if ( job->bump_strength > 0.0f ){
+		std::vector<unsigned char> normals((size_t)width * height * 4);
+		heightToNormalMap(pixels, width, height, job->bump_strength, &normals[0]);
+		compressMipChain(&normals[0], width, height, job->format, true, *image);
+	} else {
+		compressMipChain(pixels, width, height, job->format, job->format == BLOCK_BC5, *image);
+	}
+	SOIL_free_image_data(pixels);
+	writeDDS(cache.c_str(), *image);
+	return image;
+}
+
+size_t TextureLoader::update(){
+	size_t waiting = 0;
+	size_t budget = TEXTURE_UPLOAD_BYTES;
+	for ( size_t i=0; i<jobs.size(); i++ ){
+		Job * job = jobs[i];
+		if ( job->uploaded )
+			continue;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if ( !job->decoded ){
+				waiting++;
+				continue;
+			}
+		}
+		if ( job->failed ){
+			printf("%s could not be loaded, keeping the placeholder\n", job->path.c_str());
+			if ( job->pixels )
+				SOIL_free_image_data(job->pixels);
+			delete job->compressed;
+			job->pixels = NULL;
+			job->compressed = NULL;
+			job->uploaded = true;
+			continue;
+		}
+		const unsigned char * source;
+		size_t size;
+		if ( job->format == BLOCK_NONE ){
+			source = job->pixels;
+			size = (size_t)job->width * job->height * 3;
+		} else {
+			source = &job->compressed->data[0];
+			size = job->compressed->data.size();
+		}
+		if ( !budget ){
+			waiting++;
+			continue;
+		}
+
+		// Copy into a pixel buffer, so the texture calls return without waiting
+		// for the transfer and the image can be freed right away. The buffer
+		// stays mapped across updates until the whole image is in.
+		if ( !job->pbo ){
+			glGenBuffers(1, &job->pbo);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->pbo);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+			job->mapped = (unsigned char *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+			job->copied = job->mapped ? 0 : size;
+		} else {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->pbo);
+		}
+		size_t chunk = size - job->copied < budget ? size - job->copied : budget;
+		if ( chunk )
+			memcpy(job->mapped + job->copied, source + job->copied, chunk);
+		job->copied += chunk;
+		budget -= chunk;
+		if ( job->copied < size ){
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			waiting++;
+			continue;
+		}
+
+		if ( job->mapped )
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		job->uploaded = true;
+		if ( job->format == BLOCK_NONE )
+			upload(job);
+		else
+			uploadCompressed(job);
+		job->mapped = NULL;
+
+		// The buffer is only deleted once the transfer is done
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &job->pbo);
+		job->pbo = 0;
+	}
+	return waiting;
+}
+
+// From the filled pixel buffer, bound by update()
+void TextureLoader::upload(Job * job){
+	SOIL_free_image_data(job->pixels);
+	job->pixels = NULL;
+
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	glBindTexture(GL_TEXTURE_2D, job->texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if ( job->mapped )
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, job->width, job->height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, bound);
+}
+
+// All levels come from the one pixel buffer update() filled, the mips come from
+// the file so there is no glGenerateMipmap, and the data stays compressed on the GPU
+void TextureLoader::uploadCompressed(Job * job){
+	CompressedImage * image = job->compressed;
+	GLenum format;
+	switch ( image->fourcc ){
+	case FOURCC_DXT1: format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+	case FOURCC_DXT5: format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+	default:          format = GL_COMPRESSED_RG_RGTC2; break;
+	}
+
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	glBindTexture(GL_TEXTURE_2D, job->texture);
+	if ( job->mapped ){
+		unsigned int width = image->width, height = image->height;
+		for ( size_t level=0; level<image->level_sizes.size(); level++ ){
+			glCompressedTexImage2D(GL_TEXTURE_2D, (GLint)level, format, width, height, 0,
+				image->level_sizes[level], (const void *)(size_t)image->level_offsets[level]);
+			width = width > 1 ? width / 2 : 1;
+			height = height > 1 ? height / 2 : 1;
+		}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)image->level_sizes.size() - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+	}
+	glBindTexture(GL_TEXTURE_2D, bound);
+
+	delete image;
+	job->compressed = NULL;
+}
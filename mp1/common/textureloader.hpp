@@ -0,0 +1,76 @@
+#ifndef TEXTURELOADER_HPP
+#define TEXTURELOADER_HPP
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Bytes copied into the pixel buffers per update() at most
+#define TEXTURE_UPLOAD_BYTES (2 << 20)
+
+// Loads images with SOIL on worker threads, one decode per core at a time,
+// and uploads them on the GL thread through pixel buffer objects, filled at
+// most TEXTURE_UPLOAD_BYTES per update so a big image doesn't stall a frame.
+// Block compressed textures are read from a DDS cache next to the image
+// (see cachePath), made and written by the worker on the first run and
+// again whenever the image is newer than it.
+// Every texture exists right away as a 1x1 placeholder, so the first frame
+// doesn't wait for any decode, and all of them are done after the slowest one.
+class TextureLoader{
+public:
+	TextureLoader();
+	~TextureLoader(); // waits for the decodes still running
+
+	// Creates the texture with the placeholder color (RGB) and queues the decode.
+	// blockcompress.hpp has to be included before this header.
+	GLuint load(const char * path, const unsigned char placeholder[3], BlockFormat format = BLOCK_NONE);
+
+	// Same, for a BC5 normal map made from a height map with heightToNormalMap
+	GLuint loadHeightMap(const char * path, const unsigned char placeholder[3], float strength);
+
+	// The DDS cache of an image : path + ".dds", or path + ".bump<strength>.dds"
+	// for a height map, so another strength doesn't reuse the old normals
+	static std::string cachePath(const char * path, float bump_strength = 0.0f);
+
+	// True when the cache is missing or older than the image, which then has to
+	// be compressed again. A cache without its image is still good.
+	static bool cacheStale(const char * path, float bump_strength = 0.0f);
+
+	// Copies the finished decodes into pixel buffers, within TEXTURE_UPLOAD_BYTES,
+	// and uploads the ones fully copied. Call it once per frame on the GL thread.
+	// Returns the number of textures still waiting.
+	size_t update();
+
+private:
+	struct Job{
+		std::string path;       // copied, the caller's string may be gone before the decode
+		GLuint texture;
+		BlockFormat format;
+		float bump_strength;    // > 0 for a height map
+		unsigned char * pixels; // NULL if the decode failed
+		CompressedImage * compressed; // instead of pixels for block formats
+		int width, height;
+		bool decoded;           // guarded by mutex
+		bool failed;            // decoded to nothing, the placeholder stays
+		bool uploaded;
+		GLuint pbo;             // mapped while the pixels are copied over several updates
+		unsigned char * mapped;
+		size_t copied;
+	};
+
+	GLuint start(const char * path, const unsigned char placeholder[3], BlockFormat format, float bump_strength);
+	void work();
+	CompressedImage * loadCompressed(const Job * job);
+	void upload(Job * job);
+	void uploadCompressed(Job * job);
+
+	std::vector<Job *> jobs;
+	std::deque<Job *> queue;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	size_t running_workers;
+};
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "blockcompress.hpp"
+#include "mappedfile.hpp"
+#include "texturestream.hpp"
+
+#ifndef GL_COMPRESSED_RG_RGTC2
+#define GL_COMPRESSED_RG_RGTC2 0x8DBD
+#endif
+
+TextureStreamer::TextureStreamer(size_t frame_budget) : frame_budget(frame_budget){
+}
+
+TextureStreamer::~TextureStreamer(){
+	for ( size_t i=0; i<streams.size(); i++ )
+		delete streams[i];
+}
+
+GLuint TextureStreamer::load(const char * path){
+	Stream * stream = new Stream();
+	if ( !stream->file.open(path) ){
+		delete stream;
+		return 0;
+	}
+
+	const unsigned char * bytes = stream->file.data();
+	if ( stream->file.size() < 128 || strncmp((const char *)bytes, "DDS ", 4) != 0 ){
+		printf("%s is not a DDS file\n", path);
+		delete stream;
+		return 0;
+	}
+	const unsigned int * header = (const unsigned int *)(bytes + 4);
+	stream->height = header[2];
+	stream->width = header[3];
+	unsigned int levels = header[6] ? header[6] : 1;
+	unsigned int fourcc = header[20];
+	switch ( fourcc ){
+	case FOURCC_DXT1: stream->format = GL_COMPRESSED_RGB_S3TC_DXT1_EXT; break;
+	case FOURCC_DXT5: stream->format = GL_COMPRESSED_RGBA_S3TC_DXT5_EXT; break;
+	case FOURCC_ATI2: stream->format = GL_COMPRESSED_RG_RGTC2; break;
+	default:
+		printf("%s : unsupported DDS format\n", path);
+		delete stream;
+		return 0;
+	}
+
+	// The exact place of every level, the levels past the end of the file are dropped
+	size_t offset = 128;
+	unsigned int w = stream->width, h = stream->height;
+	for ( unsigned int l=0; l<levels; l++ ){
+		unsigned int size = blockLevelSize(fourcc, w, h);
+		if ( offset + size > stream->file.size() )
+			break;
+		stream->level_offsets.push_back(offset);
+		stream->level_sizes.push_back(size);
+		offset += size;
+		w = w > 1 ? w / 2 : 1;
+		h = h > 1 ? h / 2 : 1;
+	}
+	if ( stream->level_sizes.empty() ){
+		printf("%s is truncated\n", path);
+		delete stream;
+		return 0;
+	}
+
+	int last = (int)stream->level_sizes.size() - 1;
+	stream->resident = last + 1;
+	stream->needed = 0;
+	stream->limit = 0;
+
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	glGenTextures(1, &stream->texture);
+	glBindTexture(GL_TEXTURE_2D, stream->texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, last);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, bound);
+
+	// The tail, at least the last level, so the texture is complete from the start
+	do {
+		uploadLevel(stream, stream->resident - 1);
+	} while ( stream->resident > 0
+		&& (stream->width >> (stream->resident - 1)) <= STREAM_TAIL_SIZE
+		&& (stream->height >> (stream->resident - 1)) <= STREAM_TAIL_SIZE );
+
+	stream->tail = stream->resident;
+
+	// The next level will be wanted soon
+	if ( stream->resident > 0 )
+		stream->file.willNeed(stream->level_offsets[stream->resident - 1], stream->level_sizes[stream->resident - 1]);
+
+	streams.push_back(stream);
+	return stream->texture;
+}
+
+TextureStreamer::Stream * TextureStreamer::find(GLuint texture) const{
+	for ( size_t i=0; i<streams.size(); i++ )
+		if ( streams[i]->texture == texture )
+			return streams[i];
+	return NULL;
+}
+
+void TextureStreamer::require(GLuint texture, float pixels){
+	Stream * stream = find(texture);
+	if ( !stream )
+		return;
+	int last = (int)stream->level_sizes.size() - 1;
+	int level = pixels > 0.0f ? (int)floorf(log2f(stream->width / pixels)) : last;
+	stream->needed = level < 0 ? 0 : (level > last ? last : level);
+}
+
+size_t TextureStreamer::pending() const{
+	size_t count = 0;
+	for ( size_t i=0; i<streams.size(); i++ )
+		if ( streams[i]->resident > wanted(streams[i]) )
+			count += streams[i]->resident - wanted(streams[i]);
+	return count;
+}
+
+int TextureStreamer::residentLevel(GLuint texture) const{
+	Stream * stream = find(texture);
+	return stream ? stream->resident : -1;
+}
+
+size_t TextureStreamer::update(){
+	size_t uploaded = 0;
+	for (;;){
+		// The texture with the most levels missing goes first
+		Stream * next = NULL;
+		for ( size_t i=0; i<streams.size(); i++ ){
+			Stream * stream = streams[i];
+			if ( stream->resident > wanted(stream)
+				&& ( !next || stream->resident - wanted(stream) > next->resident - wanted(next) ) )
+				next = stream;
+		}
+		if ( !next )
+			break;
+		size_t size = next->level_sizes[next->resident - 1];
+		if ( uploaded > 0 && uploaded + size > frame_budget )
+			break;
+
+		uploadLevel(next, next->resident - 1);
+		uploaded += size;
+		if ( next->resident > wanted(next) )
+			next->file.willNeed(next->level_offsets[next->resident - 1], next->level_sizes[next->resident - 1]);
+	}
+	return uploaded;
+}
+
+size_t TextureStreamer::limit(GLuint texture, int finest){
+	Stream * stream = find(texture);
+	if ( !stream )
+		return 0;
+	stream->limit = finest < 0 ? 0 : (finest > stream->tail ? stream->tail : finest);
+
+	if ( stream->resident < stream->limit ){
+		GLint bound;
+		glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+		glBindTexture(GL_TEXTURE_2D, stream->texture);
+		// Out of the base level first, then each dropped level is redefined
+		// as empty, which frees it and keeps the texture complete
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, stream->limit);
+		for ( int l=stream->resident; l<stream->limit; l++ )
+			glTexImage2D(GL_TEXTURE_2D, l, GL_RGBA, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, bound);
+		stream->resident = stream->limit;
+	}
+
+	size_t bytes = 0;
+	for ( size_t l=stream->resident; l<stream->level_sizes.size(); l++ )
+		bytes += stream->level_sizes[l];
+	return bytes;
+}
+
+// Levels go in from the coarsest one, and the base level follows, so the
+// texture never samples a level that isn't there yet
+void TextureStreamer::uploadLevel(Stream * stream, int level){
+	GLint bound;
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	glBindTexture(GL_TEXTURE_2D, stream->texture);
+
+	unsigned int w = stream->width >> level, h = stream->height >> level;
+	glCompressedTexImage2D(GL_TEXTURE_2D, level, stream->format, w ? w : 1, h ? h : 1, 0,
+		stream->level_sizes[level], stream->file.data() + stream->level_offsets[level]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+	stream->resident = level;
+
+	glBindTexture(GL_TEXTURE_2D, bound);
+}
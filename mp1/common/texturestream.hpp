@@ -0,0 +1,63 @@
+#ifndef TEXTURESTREAM_HPP
+#define TEXTURESTREAM_HPP
+
+// Levels up to this size are uploaded as soon as the texture is loaded
+#define STREAM_TAIL_SIZE 64
+// Bytes of mip levels uploaded per frame by default
+#define STREAM_FRAME_BUDGET (1 << 20)
+
+// Streams the mip levels of block compressed DDS files from a memory mapping.
+// load() only uploads the small mip tail, so the texture can be drawn right away,
+// then update() adds the larger levels one at a time, within a byte budget per
+// frame, for the textures that are furthest from the level their on-screen size needs.
+// mappedfile.hpp has to be included before this header.
+class TextureStreamer{
+public:
+	TextureStreamer(size_t frame_budget = STREAM_FRAME_BUDGET);
+	~TextureStreamer(); // unmaps the files, the textures belong to the caller
+
+	// 0 if the file is missing or not a DXT1, DXT5 or ATI2 DDS file
+	GLuint load(const char * path);
+
+	// Width in pixels the whole texture covers on screen this frame,
+	// the level with about one texel per pixel is the one needed
+	void require(GLuint texture, float pixels);
+
+	// Uploads the needed levels, the first one even when it is over the budget.
+	// Returns the bytes uploaded.
+	size_t update();
+
+	// Number of levels still to upload for the current requirements
+	size_t pending() const;
+
+	// Keeps the texture at finest level or coarser, dropping the finer levels
+	// already there, but never the mip tail. A lower limit streams them back in.
+	// Returns the bytes the texture uses, a ResidencyManager::TextureResize.
+	size_t limit(GLuint texture, int finest);
+
+	// Finest level uploaded, -1 for a texture not loaded by this streamer
+	int residentLevel(GLuint texture) const;
+
+private:
+	struct Stream{
+		GLuint texture;
+		MappedFile file;
+		GLenum format;
+		unsigned int width, height;
+		std::vector<size_t> level_offsets; // into the file
+		std::vector<unsigned int> level_sizes;
+		int resident; // finest level uploaded, the base level of the texture
+		int needed;   // finest level worth having
+		int limit;    // finest level allowed
+		int tail;     // first level of the mip tail
+	};
+
+	Stream * find(GLuint texture) const;
+	static int wanted(const Stream * stream) { return stream->needed > stream->limit ? stream->needed : stream->limit; }
+	void uploadLevel(Stream * stream, int level);
+
+	std::vector<Stream *> streams;
+	size_t frame_budget;
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "glstate.hpp"
+#include "uniformbuffer.hpp"
+
+CameraBlock cameraBlock(const glm::mat4 & view, const glm::mat4 & projection){
+	CameraBlock camera;
+	camera.view_projection = projection * view;
+	camera.view_position = glm::vec4(glm::vec3(glm::inverse(view)[3]), 1.0f);
+	return camera;
+}
+
+LightBlock directionalLight(const glm::vec3 & direction){
+	LightBlock light;
+	light.position = glm::vec4(glm::normalize(-direction), 0.0f);
+	return light;
+}
+
+LightBlock pointLight(const glm::vec3 & position){
+	LightBlock light;
+	light.position = glm::vec4(position, 1.0f);
+	return light;
+}
+
+MaterialBlock litMaterial(
+	const glm::vec4 & ambient, const glm::vec4 & diffuse, const glm::vec4 & specular, float shininess,
+	const glm::vec4 & light_ambient, const glm::vec4 & light_diffuse, const glm::vec4 & light_specular
+){
+	MaterialBlock material;
+	material.ambient = ambient * light_ambient;
+	material.diffuse = diffuse * light_diffuse;
+	material.specular = specular * light_specular;
+	material.shininess = shininess;
+	material.reflection_blur = 0.0f;
+	material.padding[0] = material.padding[1] = 0.0f;
+	return material;
+}
+
+UniformBuffer::UniformBuffer() : buffer(0), alignment(0), dirty_begin(0), dirty_end(0){
+}
+
+size_t UniformBuffer::add(size_t size){
+	if ( !alignment ){
+		GLint value = 0;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &value);
+		alignment = value > 0 ? value : 256;
+	}
+	size_t offset = (data.size() + alignment - 1) / alignment * alignment;
+	data.resize(offset + size, 0);
+	return offset;
+}
+
+void UniformBuffer::create(){
+	glGenBuffers(1, &buffer);
+	glState.bindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferData(GL_UNIFORM_BUFFER, data.size(), data.empty() ? NULL : &data[0], GL_DYNAMIC_DRAW);
+	dirty_begin = dirty_end = 0;
+}
+
+void UniformBuffer::set(size_t offset, const void * block, size_t size){
+	memcpy(&data[offset], block, size);
+	if ( dirty_begin == dirty_end ){
+		dirty_begin = offset;
+		dirty_end = offset + size;
+	}
+	else{
+		dirty_begin = dirty_begin < offset ? dirty_begin : offset;
+		dirty_end = dirty_end > offset + size ? dirty_end : offset + size;
+	}
+}
+
+void UniformBuffer::upload(){
+	if ( dirty_begin == dirty_end )
+		return;
+	glState.bindBuffer(GL_UNIFORM_BUFFER, buffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, dirty_begin, dirty_end - dirty_begin, &data[dirty_begin]);
+	dirty_begin = dirty_end = 0;
+}
+
+void UniformBuffer::bind(GLuint binding, size_t offset, size_t size) const{
+	glState.bindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, size);
+}
+
+void UniformBuffer::release(){
+	glDeleteBuffers(1, &buffer);
+	glState.forgetBuffer(buffer);
+	buffer = 0;
+}
+
+void bindUniformBlocks(GLuint program){
+	const char * names[3] = { "Camera", "Light", "Material" };
+	const GLuint bindings[3] = { UNIFORM_BINDING_CAMERA, UNIFORM_BINDING_LIGHT, UNIFORM_BINDING_MATERIAL };
+	for ( int i=0; i<3; i++ ){
+		GLuint index = glGetUniformBlockIndex(program, names[i]);
+		if ( index != GL_INVALID_INDEX )
+			glUniformBlockBinding(program, index, bindings[i]);
+	}
+}
@@ -0,0 +1,79 @@
+#ifndef UNIFORMBUFFER_HPP
+#define UNIFORMBUFFER_HPP
+
+#include <vector>
+
+// Binding points of the blocks declared in lighting.glsl
+#define UNIFORM_BINDING_CAMERA 0
+#define UNIFORM_BINDING_LIGHT 1
+#define UNIFORM_BINDING_MATERIAL 2
+
+// std140 copies of the blocks in lighting.glsl, a vec3 takes a whole vec4.
+// glm has to be included before this header.
+struct CameraBlock{
+	glm::mat4 view_projection;
+	glm::vec4 view_position; // camera in world coordinates, w unused
+};
+
+struct LightBlock{
+	glm::vec4 position; // normalized direction towards the light with w = 0, or a point with w = 1
+};
+
+// Colors already multiplied by the light's, see litMaterial
+struct MaterialBlock{
+	glm::vec4 ambient;
+	glm::vec4 diffuse;
+	glm::vec4 specular;
+	float shininess;
+	float reflection_blur; // mip bias into a prefiltered environment, 0 for a mirror
+	float padding[2];
+};
+
+CameraBlock cameraBlock(const glm::mat4 & view, const glm::mat4 & projection);
+LightBlock directionalLight(const glm::vec3 & direction); // the direction the light travels
+LightBlock pointLight(const glm::vec3 & position);
+MaterialBlock litMaterial(
+	const glm::vec4 & ambient, const glm::vec4 & diffuse, const glm::vec4 & specular, float shininess,
+	const glm::vec4 & light_ambient, const glm::vec4 & light_diffuse, const glm::vec4 & light_specular
+);
+
+// Several uniform blocks in one buffer, each at an offset aligned to
+// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, so switching material is a glBindBufferRange.
+// The buffer is mirrored on the CPU, and the blocks set since the last upload
+// go to the GPU as one glBufferSubData of the range they span.
+class UniformBuffer{
+public:
+	UniformBuffer();
+
+	// Reserves room for a block of size bytes and returns its offset, before create()
+	size_t add(size_t size);
+
+	// Creates the buffer with the blocks set so far
+	void create();
+
+	// Copies a block at its offset and marks it for the next upload
+	void set(size_t offset, const void * block, size_t size);
+
+	// Uploads the changed range, if any
+	void upload();
+
+	// Binds the block at offset to a binding point
+	void bind(GLuint binding, size_t offset, size_t size) const;
+
+	// Deletes the buffer, while the context is still there
+	void release();
+
+	GLuint name() const { return buffer; }
+
+private:
+	GLuint buffer;
+	size_t alignment;
+	std::vector<unsigned char> data;
+	size_t dirty_begin, dirty_end;
+};
+
+// Points the Camera, Light and Material blocks of a program at their binding
+// points, GLSL 3.30 has no binding qualifier. Blocks the program doesn't use are skipped.
+void bindUniformBlocks(GLuint program);
+
+#endif
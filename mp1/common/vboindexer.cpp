@@ -1,100 +1,297 @@
 #include <vector>
-#include <map>
 
 #include <glm/glm.hpp>
 
 #include "vboindexer.hpp"
 
 #include <string.h> // for memcmp
+#include <math.h>
 
 
+void packIndices(
+	const std::vector<unsigned int> & indices,
+	size_t vertex_count,
+	IndexBuffer & out_indices
+){
+	out_indices.indices16.clear();
+	out_indices.indices32.clear();
+
+	// 16-bit indices can address vertices 0..65535
+	out_indices.use32 = vertex_count > 65536;
+	if ( out_indices.use32 ){
+		out_indices.indices32 = indices;
+	}else{
+		out_indices.indices16.resize(indices.size());
+		for ( unsigned int i=0; i<indices.size(); i++ )
+			out_indices.indices16[i] = (unsigned short)indices[i];
+	}
+}
+
+// Two values closer than this are considered equal by the tolerant indexers
+#define WELD_EPSILON 0.01f
+
 // Returns true iif v1 can be considered equal to v2
 bool is_near(float v1, float v2){
-	return fabs( v1-v2 ) < 0.01f;
+	return fabs( v1-v2 ) < WELD_EPSILON;
 }
 
-// Searches through all already-exported vertices
-// for a similar one.
-// Similar = same position + same UVs + same normal
-bool getSimilarVertexIndex( 
-	glm::vec3 & in_vertex, 
-	glm::vec2 & in_uv, 
-	glm::vec3 & in_normal, 
-	std::vector<glm::vec3> & out_vertices,
-	std::vector<glm::vec2> & out_uvs,
-	std::vector<glm::vec3> & out_normals,
-	unsigned short & result
-){
-	// Lame linear search
-	for ( unsigned int i=0; i<out_vertices.size(); i++ ){
-		if (
-			is_near( in_vertex.x , out_vertices[i].x ) &&
-			is_near( in_vertex.y , out_vertices[i].y ) &&
-			is_near( in_vertex.z , out_vertices[i].z ) &&
-			is_near( in_uv.x     , out_uvs     [i].x ) &&
-			is_near( in_uv.y     , out_uvs     [i].y ) &&
-			is_near( in_normal.x , out_normals [i].x ) &&
-			is_near( in_normal.y , out_normals [i].y ) &&
-			is_near( in_normal.z , out_normals [i].z )
-		){
-			result = i;
-			return true;
+// Uniform grid over the positions of the already-exported vertices, used
+// to find a similar vertex without scanning all of them.
+// Cells are twice the tolerance wide, so every vertex near a given one
+// is in the same cell or in one of its 26 neighbours.
+// Cells are hashed into a flat open addressing table, and the vertices
+// of a cell are chained through next[].
+class VertexGrid{
+public:
+	VertexGrid(
+		size_t max_vertices,
+		std::vector<glm::vec3> & out_vertices,
+		std::vector<glm::vec2> & out_uvs,
+		std::vector<glm::vec3> & out_normals
+	) : vertices(out_vertices), uvs(out_uvs), normals(out_normals)
+	{
+		unsigned int capacity = 16;
+		while ( capacity < max_vertices * 2 )
+			capacity *= 2;
+		mask = capacity - 1;
+		Cell empty = {0, 0, 0, EMPTY};
+		cells.assign(capacity, empty);
+		next.reserve(max_vertices);
+	}
+
+	// Searches the neighbouring cells for a similar vertex.
+	// Similar = same position + same UVs + same normal, within WELD_EPSILON.
+	// Like a linear search over out_XXXX, the lowest matching index wins.
+	bool findSimilar(
+		glm::vec3 & in_vertex,
+		glm::vec2 & in_uv,
+		glm::vec3 & in_normal,
+		unsigned int & result
+	) const{
+		int cx, cy, cz;
+		cellOf(in_vertex, cx, cy, cz);
+
+		bool found = false;
+		for ( int dz=-1; dz<=1; dz++ ){
+			for ( int dy=-1; dy<=1; dy++ ){
+				for ( int dx=-1; dx<=1; dx++ ){
+					unsigned int s = findCell(cx+dx, cy+dy, cz+dz);
+					if ( cells[s].head == EMPTY )
+						continue;
+					for ( unsigned int i = cells[s].head; i != EMPTY; i = next[i] ){
+						if ( found && i >= result )
+							continue;
+						if (
+							is_near( in_vertex.x , vertices[i].x ) &&
+							is_near( in_vertex.y , vertices[i].y ) &&
+							is_near( in_vertex.z , vertices[i].z ) &&
+							is_near( in_uv.x     , uvs     [i].x ) &&
+							is_near( in_uv.y     , uvs     [i].y ) &&
+							is_near( in_normal.x , normals [i].x ) &&
+							is_near( in_normal.y , normals [i].y ) &&
+							is_near( in_normal.z , normals [i].z )
+						){
+							result = i;
+							found = true;
+						}
+					}
+				}
+			}
 		}
+		return found;
+	}
+
+	// Adds the vertex out_XXXX[i] to the grid. Must be called in index order.
+	void insert(unsigned int i){
+		int cx, cy, cz;
+		cellOf(vertices[i], cx, cy, cz);
+		unsigned int s = findCell(cx, cy, cz);
+		if ( cells[s].head == EMPTY ){
+			cells[s].x = cx;
+			cells[s].y = cy;
+			cells[s].z = cz;
+		}
+		next.push_back(cells[s].head);
+		cells[s].head = i;
+	}
+
+private:
+	static const unsigned int EMPTY = 0xffffffffu;
+
+	struct Cell{
+		int x, y, z;
+		unsigned int head; // last vertex added to the cell
+	};
+
+	static void cellOf(const glm::vec3 & p, int & cx, int & cy, int & cz){
+		const float inv_size = 1.0f / (2.0f * WELD_EPSILON);
+		cx = (int)floorf(p.x * inv_size);
+		cy = (int)floorf(p.y * inv_size);
+		cz = (int)floorf(p.z * inv_size);
+	}
+
+	// Returns the slot of the cell, or the empty slot where it would go
+	unsigned int findCell(int cx, int cy, int cz) const{
+		unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^ (unsigned int)cz * 83492791u;
+		h ^= h >> 15;
+		h *= 0x2c1b3c6du;
+		h ^= h >> 12;
+		unsigned int s = h & mask;
+		while ( cells[s].head != EMPTY && ( cells[s].x != cx || cells[s].y != cy || cells[s].z != cz ) )
+			s = (s + 1) & mask;
+		return s;
+	}
+
+	std::vector<glm::vec3> & vertices;
+	std::vector<glm::vec2> & uvs;
+	std::vector<glm::vec3> & normals;
+	std::vector<Cell> cells;
+	std::vector<unsigned int> next;
+	unsigned int mask;
+};
+
+struct PackedVertex{
+	glm::vec3 position;
+	glm::vec2 uv;
+	glm::vec3 normal;
+};
+
+// Hashes the raw bits of the vertex, so it agrees with the memcmp equality below
+static unsigned int hashPackedVertex(const PackedVertex & packed){
+	unsigned int words[sizeof(PackedVertex) / sizeof(unsigned int)];
+	memcpy(words, &packed, sizeof(PackedVertex));
+
+	unsigned int h = 2166136261u;
+	for ( unsigned int i=0; i<sizeof(words)/sizeof(words[0]); i++ ){
+		unsigned int k = words[i] * 0xcc9e2d51u;
+		k = (k << 15) | (k >> 17);
+		h ^= k * 0x1b873593u;
+		h = ((h << 13) | (h >> 19)) * 5 + 0xe6546b64u;
 	}
-	// No other vertex could be used instead.
-	// Looks like we'll have to add it to the VBO.
-	return false;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h;
 }
 
+// Open addressing hash table from a vertex to its index in out_XXXX.
+// All slots live in one flat array and collisions are resolved by linear
+// probing, so a lookup is usually a single cache line instead of a walk
+// down a std::map. The vertex itself is not copied : each slot remembers
+// which input vertex it was made from and compares against in_XXXX.
+class VertexHashTable{
+public:
+	VertexHashTable(
+		std::vector<glm::vec3> & in_vertices,
+		std::vector<glm::vec2> & in_uvs,
+		std::vector<glm::vec3> & in_normals
+	) : vertices(in_vertices), uvs(in_uvs), normals(in_normals)
+	{
+		// Keep the load factor under 1/2 even if no vertex gets merged
+		unsigned int capacity = 16;
+		while ( capacity < in_vertices.size() * 2 )
+			capacity *= 2;
+		mask = capacity - 1;
+		Slot empty = {0, EMPTY, EMPTY};
+		slots.assign(capacity, empty);
+	}
+
+	// Returns the output index stored for a vertex equal to input vertex i,
+	// or false if there is none yet.
+	bool find(unsigned int i, unsigned int & result) const{
+		PackedVertex packed = pack(i);
+		unsigned int hash = hashPackedVertex(packed);
+		for ( unsigned int s = hash & mask; slots[s].in_index != EMPTY; s = (s + 1) & mask ){
+			if ( slots[s].hash == hash ){
+				PackedVertex other = pack(slots[s].in_index);
+				if ( memcmp(&packed, &other, sizeof(PackedVertex)) == 0 ){
+					result = slots[s].out_index;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	// Remembers that input vertex i is stored at out_index.
+	// Vertices already in the table are left alone.
+	void insert(unsigned int i, unsigned int out_index){
+		PackedVertex packed = pack(i);
+		unsigned int hash = hashPackedVertex(packed);
+		unsigned int s = hash & mask;
+		for ( ; slots[s].in_index != EMPTY; s = (s + 1) & mask ){
+			if ( slots[s].hash == hash ){
+				PackedVertex other = pack(slots[s].in_index);
+				if ( memcmp(&packed, &other, sizeof(PackedVertex)) == 0 )
+					return;
+			}
+		}
+		slots[s].hash = hash;
+		slots[s].in_index = i;
+		slots[s].out_index = out_index;
+	}
+
+private:
+	static const unsigned int EMPTY = 0xffffffffu;
+
+	struct Slot{
+		unsigned int hash;
+		unsigned int in_index;
+		unsigned int out_index;
+	};
+
+	PackedVertex pack(unsigned int i) const{
+		PackedVertex packed;
+		packed.position = vertices[i];
+		packed.uv = uvs[i];
+		packed.normal = normals[i];
+		return packed;
+	}
+
+	std::vector<glm::vec3> & vertices;
+	std::vector<glm::vec2> & uvs;
+	std::vector<glm::vec3> & normals;
+	std::vector<Slot> slots;
+	unsigned int mask;
+};
+
 void indexVBO_slow(
 	std::vector<glm::vec3> & in_vertices,
 	std::vector<glm::vec2> & in_uvs,
 	std::vector<glm::vec3> & in_normals,
 
-	std::vector<unsigned short> & out_indices,
+	IndexBuffer & out_indices,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec2> & out_uvs,
 	std::vector<glm::vec3> & out_normals
 ){
+	VertexHashTable VertexToOutIndex(in_vertices, in_uvs, in_normals);
+	VertexGrid NearVertices(in_vertices.size(), out_vertices, out_uvs, out_normals);
+	std::vector<unsigned int> indices;
+	indices.reserve(in_vertices.size());
+
 	// For each input vertex
 	for ( unsigned int i=0; i<in_vertices.size(); i++ ){
 
-		// Try to find a similar vertex in out_XXXX
-		unsigned short index;
-		bool found = getSimilarVertexIndex(in_vertices[i], in_uvs[i], in_normals[i],     out_vertices, out_uvs, out_normals, index);
+		// Exact duplicates are found in the hash table, near ones in the grid
+		unsigned int index;
+		bool found = VertexToOutIndex.find(i, index) ||
+			NearVertices.findSimilar(in_vertices[i], in_uvs[i], in_normals[i], index);
 
 		if ( found ){ // A similar vertex is already in the VBO, use it instead !
-			out_indices.push_back( index );
+			indices.push_back( index );
 		}else{ // If not, it needs to be added in the output data.
 			out_vertices.push_back( in_vertices[i]);
 			out_uvs     .push_back( in_uvs[i]);
 			out_normals .push_back( in_normals[i]);
-			out_indices .push_back( (unsigned short)out_vertices.size() - 1 );
+			index = (unsigned int)out_vertices.size() - 1;
+			indices     .push_back( index );
+			NearVertices.insert( index );
 		}
+		VertexToOutIndex.insert( i, index );
 	}
-}
 
-struct PackedVertex{
-	glm::vec3 position;
-	glm::vec2 uv;
-	glm::vec3 normal;
-	bool operator<(const PackedVertex that) const{
-		return memcmp((void*)this, (void*)&that, sizeof(PackedVertex))>0;
-	};
-};
-
-bool getSimilarVertexIndex_fast( 
-	PackedVertex & packed, 
-	std::map<PackedVertex,unsigned short> & VertexToOutIndex,
-	unsigned short & result
-){
-	std::map<PackedVertex,unsigned short>::iterator it = VertexToOutIndex.find(packed);
-	if ( it == VertexToOutIndex.end() ){
-		return false;
-	}else{
-		result = it->second;
-		return true;
-	}
+	packIndices(indices, out_vertices.size(), out_indices);
 }
 
 void indexVBO(
@@ -102,34 +299,35 @@ void indexVBO(
 	std::vector<glm::vec2> & in_uvs,
 	std::vector<glm::vec3> & in_normals,
 
-	std::vector<unsigned short> & out_indices,
+	IndexBuffer & out_indices,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec2> & out_uvs,
 	std::vector<glm::vec3> & out_normals
 ){
-	std::map<PackedVertex,unsigned short> VertexToOutIndex;
+	VertexHashTable VertexToOutIndex(in_vertices, in_uvs, in_normals);
+	std::vector<unsigned int> indices;
+	indices.reserve(in_vertices.size());
 
 	// For each input vertex
 	for ( unsigned int i=0; i<in_vertices.size(); i++ ){
 
-		PackedVertex packed = {in_vertices[i], in_uvs[i], in_normals[i]};
-		
-
 		// Try to find a similar vertex in out_XXXX
-		unsigned short index;
-		bool found = getSimilarVertexIndex_fast( packed, VertexToOutIndex, index);
+		unsigned int index;
+		bool found = VertexToOutIndex.find(i, index);
 
 		if ( found ){ // A similar vertex is already in the VBO, use it instead !
-			out_indices.push_back( index );
+			indices.push_back( index );
 		}else{ // If not, it needs to be added in the output data.
 			out_vertices.push_back( in_vertices[i]);
 			out_uvs     .push_back( in_uvs[i]);
 			out_normals .push_back( in_normals[i]);
-			unsigned short newindex = (unsigned short)out_vertices.size() - 1;
-			out_indices .push_back( newindex );
-			VertexToOutIndex[ packed ] = newindex;
+			unsigned int newindex = (unsigned int)out_vertices.size() - 1;
+			indices     .push_back( newindex );
+			VertexToOutIndex.insert( i, newindex );
 		}
 	}
+
+	packIndices(indices, out_vertices.size(), out_indices);
 }
 
 
@@ -145,22 +343,28 @@ void indexVBO_TBN(
 	std::vector<glm::vec3> & in_tangents,
 	std::vector<glm::vec3> & in_bitangents,
 
-	std::vector<unsigned short> & out_indices,
+	IndexBuffer & out_indices,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec2> & out_uvs,
 	std::vector<glm::vec3> & out_normals,
 	std::vector<glm::vec3> & out_tangents,
 	std::vector<glm::vec3> & out_bitangents
 ){
+	VertexHashTable VertexToOutIndex(in_vertices, in_uvs, in_normals);
+	VertexGrid NearVertices(in_vertices.size(), out_vertices, out_uvs, out_normals);
+	std::vector<unsigned int> indices;
+	indices.reserve(in_vertices.size());
+
 	// For each input vertex
 	for ( unsigned int i=0; i<in_vertices.size(); i++ ){
 
-		// Try to find a similar vertex in out_XXXX
-		unsigned short index;
-		bool found = getSimilarVertexIndex(in_vertices[i], in_uvs[i], in_normals[i],     out_vertices, out_uvs, out_normals, index);
+		// Exact duplicates are found in the hash table, near ones in the grid
+		unsigned int index;
+		bool found = VertexToOutIndex.find(i, index) ||
+			NearVertices.findSimilar(in_vertices[i], in_uvs[i], in_normals[i], index);
 
 		if ( found ){ // A similar vertex is already in the VBO, use it instead !
-			out_indices.push_back( index );
+			indices.push_back( index );
 
 			// Average the tangents and the bitangents
 			out_tangents[index] += in_tangents[i];
@@ -171,7 +375,12 @@ void indexVBO_TBN(
 			out_normals .push_back( in_normals[i]);
 			out_tangents .push_back( in_tangents[i]);
 			out_bitangents .push_back( in_bitangents[i]);
-			out_indices .push_back( (unsigned short)out_vertices.size() - 1 );
+			index = (unsigned int)out_vertices.size() - 1;
+			indices     .push_back( index );
+			NearVertices.insert( index );
 		}
+		VertexToOutIndex.insert( i, index );
 	}
+
+	packIndices(indices, out_vertices.size(), out_indices);
 }
@@ -1,12 +1,40 @@
 #ifndef VBOINDEXER_HPP
 #define VBOINDEXER_HPP
 
+// Index buffer filled by the indexVBO functions.
+// Indices are kept 16-bit as long as every vertex can be addressed with them,
+// and switch to 32-bit automatically for bigger meshes.
+struct IndexBuffer{
+	std::vector<unsigned short> indices16;
+	std::vector<unsigned int>   indices32;
+	bool use32;
+
+	IndexBuffer() : use32(false) {}
+
+	size_t size() const { return use32 ? indices32.size() : indices16.size(); }
+	// 2 for GL_UNSIGNED_SHORT, 4 for GL_UNSIGNED_INT
+	size_t indexSize() const { return use32 ? sizeof(unsigned int) : sizeof(unsigned short); }
+	size_t byteSize() const { return size() * indexSize(); }
+	const void * data() const {
+		if (size() == 0) return 0;
+		return use32 ? (const void*)&indices32[0] : (const void*)&indices16[0];
+	}
+	unsigned int operator[](size_t i) const { return use32 ? indices32[i] : indices16[i]; }
+};
+
+// Stores the indices into out_indices, picking 16 or 32 bits from vertex_count
+void packIndices(
+	const std::vector<unsigned int> & indices,
+	size_t vertex_count,
+	IndexBuffer & out_indices
+);
+
 void indexVBO(
 	std::vector<glm::vec3> & in_vertices,
 	std::vector<glm::vec2> & in_uvs,
 	std::vector<glm::vec3> & in_normals,
 
-	std::vector<unsigned short> & out_indices,
+	IndexBuffer & out_indices,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec2> & out_uvs,
 	std::vector<glm::vec3> & out_normals
@@ -20,7 +48,7 @@ void indexVBO_TBN(
 	std::vector<glm::vec3> & in_tangents,
 	std::vector<glm::vec3> & in_bitangents,
 
-	std::vector<unsigned short> & out_indices,
+	IndexBuffer & out_indices,
 	std::vector<glm::vec3> & out_vertices,
 	std::vector<glm::vec2> & out_uvs,
 	std::vector<glm::vec3> & out_normals,
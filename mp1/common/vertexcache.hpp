@@ -0,0 +1,62 @@
+#ifndef VERTEXCACHE_HPP
+#define VERTEXCACHE_HPP
+
+// Post-transform cache size assumed by the optimizer and the statistics
+#define VERTEX_CACHE_SIZE 16
+
+struct VertexCacheStatistics{
+	float acmr; // average cache miss ratio : transformed vertices per triangle (0.5 .. 3)
+	float atvr; // average transformed vertex ratio : transformed vertices per vertex (1 .. 6)
+};
+
+// Simulates a FIFO post-transform cache over a triangle list
+VertexCacheStatistics analyzeVertexCache(
+	const unsigned int * indices,
+	size_t index_count,
+	size_t vertex_count,
+	unsigned int cache_size = VERTEX_CACHE_SIZE
+);
+
+// Vertex to triangle adjacency, stored as offsets into one flat array :
+// the triangles around vertex v are triangles[offsets[v]] .. triangles[offsets[v+1]-1]
+struct TriangleAdjacency{
+	std::vector<unsigned int> offsets; // vertex_count + 1 entries
+	std::vector<unsigned int> triangles;
+};
+
+void buildTriangleAdjacency(
+	const unsigned int * indices,
+	size_t index_count,
+	size_t vertex_count,
+	TriangleAdjacency & adjacency
+);
+
+// Reorders the triangles for the post-transform cache (Tipsify).
+// The input order is kept if its simulated ACMR is already lower,
+// as for meshes exported in strips.
+void optimizeVertexCache(
+	unsigned int * indices,
+	size_t index_count,
+	size_t vertex_count,
+	unsigned int cache_size = VERTEX_CACHE_SIZE
+);
+
+// Renumbers the vertices in the order the triangles first use them,
+// so the vertex fetch walks the buffers forward.
+// Fills remap[old_index] = new_index, to be applied with remapVertexBuffer.
+void optimizeVertexFetch(
+	unsigned int * indices,
+	size_t index_count,
+	size_t vertex_count,
+	std::vector<unsigned int> & remap
+);
+
+// Moves every vertex_size bytes element of vertices to its remapped position
+void remapVertexBuffer(
+	void * vertices,
+	size_t vertex_count,
+	size_t vertex_size,
+	const std::vector<unsigned int> & remap
+);
+
+#endif
\ No newline at end of file
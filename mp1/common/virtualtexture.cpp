@@ -0,0 +1,349 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#include <GL/glew.h>
+
+#include "glstate.hpp"
+#include "virtualtexture.hpp"
+
+// Where texel (0, 0) of a page falls in the virtual texture, and the distance between texels
+static void pageOrigin(int level, int x, int y, float & u0, float & v0, float & step){
+	int pages = VT_PAGES >> level;
+	step = 1.0f / ((float)pages * VT_PAGE_PAYLOAD);
+	u0 = (float)x / pages + (0.5f - VT_PAGE_BORDER) * step;
+	v0 = (float)y / pages + (0.5f - VT_PAGE_BORDER) * step;
+}
+
+VirtualTexture::VirtualTexture() : page_table(0), cache(0), framebuffer(0), feedback_color(0), feedback_depth(0),
+	feedback_width(0), feedback_height(0), readback_frame(0), frame(0), uploads(0), stopping(false){
+	readback[0] = readback[1] = 0;
+}
+
+VirtualTexture::~VirtualTexture(){
+	stop();
+}
+
+void VirtualTexture::stop(){
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		queue.clear();
+	}
+	wake.notify_all();
+	for ( size_t i=0; i<workers.size(); i++ )
+		workers[i].join();
+	workers.clear();
+	for ( size_t i=0; i<finished.size(); i++ )
+		delete finished[i];
+	finished.clear();
+}
+
+bool VirtualTexture::create(PageGenerator page_generator){
+	generator = page_generator;
+
+	// One texel per page and one mip level per level, no filtering between entries
+	glGenTextures(1, &page_table);
+	glState.bindTexture(GL_TEXTURE_2D, page_table);
+	for ( int level=0; level<VT_LEVELS; level++ ){
+		int pages = VT_PAGES >> level;
+		table[level].assign((size_t)pages * pages * 4, 0);
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, pages, pages, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, VT_LEVELS - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// The borders keep the bilinear filter inside a page, the cache has no mips
+	glGenTextures(1, &cache);
+	glState.bindTexture(GL_TEXTURE_2D, cache);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, VT_CACHE_PAGES * VT_PAGE_SIZE, VT_CACHE_PAGES * VT_PAGE_SIZE, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	Slot free_slot = { NO_PAGE, 0 };
+	slots.assign(VT_CACHE_PAGES * VT_CACHE_PAGES, free_slot);
+	glGenBuffers(2, readback);
+
+	// The coarsest page is the fallback of all the others, it never leaves
+	Page top;
+	top.level = VT_LEVELS - 1;
+	top.x = top.y = 0;
+	top.rgba.resize(VT_PAGE_SIZE * VT_PAGE_SIZE * 4);
+	float u0, v0, step;
+	pageOrigin(top.level, top.x, top.y, u0, v0, step);
+	generator(u0, v0, step, &top.rgba[0]);
+	upload(top);
+	slots[resident[pageKey(top.level, top.x, top.y)]].last_used = 0xFFFFFFFFu;
+	updatePageTable();
+
+	// Keep a core for the render thread
+	unsigned int cores = std::thread::hardware_concurrency();
+	unsigned int count = cores > 1 ? cores - 1 : 1;
+	for ( unsigned int i=0; i<count; i++ )
+		workers.push_back(std::thread(&VirtualTexture::work, this));
+	return true;
+}
+
+// Generates queued pages until the texture is destroyed
+void VirtualTexture::work(){
+	for (;;){
+		unsigned int key;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while ( !stopping && queue.empty() )
+				wake.wait(lock);
+			if ( stopping )
+				return;
+			key = queue.front();
+			queue.pop_front();
+			in_flight.insert(key);
+		}
+
+		Page * page = new Page();
+		page->level = key >> 16;
+		page->y = (key >> 8) & 0xFF;
+		page->x = key & 0xFF;
+		page->rgba.resize(VT_PAGE_SIZE * VT_PAGE_SIZE * 4);
+		float u0, v0, step;
+		pageOrigin(page->level, page->x, page->y, u0, v0, step);
+		generator(u0, v0, step, &page->rgba[0]);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		finished.push_back(page);
+	}
+}
+
+void VirtualTexture::beginFeedback(int width, int height){
+	int w = width / VT_FEEDBACK_DIVISOR, h = height / VT_FEEDBACK_DIVISOR;
+	if ( w < 1 ) w = 1;
+	if ( h < 1 ) h = 1;
+	if ( w != feedback_width || h != feedback_height ){
+		if ( !framebuffer ){
+			glGenFramebuffers(1, &framebuffer);
+			glGenRenderbuffers(1, &feedback_color);
+			glGenRenderbuffers(1, &feedback_depth);
+		}
+		glBindRenderbuffer(GL_RENDERBUFFER, feedback_color);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, w, h);
+		glBindRenderbuffer(GL_RENDERBUFFER, feedback_depth);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, feedback_color);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedback_depth);
+		if ( glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE )
+			printf("The virtual texture feedback framebuffer is incomplete\n");
+
+		for ( int i=0; i<2; i++ ){
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr)w * h * 4, NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		feedback_width = w;
+		feedback_height = h;
+		readback_frame = 0;
+	}
+
+	// glClearBuffer leaves the caller's clear colour alone
+	static const GLfloat nothing[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	static const GLfloat far_depth = 1.0f;
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glViewport(0, 0, w, h);
+	glClearBufferfv(GL_COLOR, 0, nothing);
+	glClearBufferfv(GL_DEPTH, 0, &far_depth);
+}
+
+void VirtualTexture::endFeedback(){
+	// This frame is read into one buffer while the other, filled a frame ago, is mapped
+	int current = readback_frame % 2;
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[current]);
+	glReadPixels(0, 0, feedback_width, feedback_height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+	std::set<unsigned int> seen;
+	if ( readback_frame > 0 ){
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, readback[1 - current]);
+		const unsigned char * pixels = (const unsigned char *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		if ( pixels ){
+			unsigned int last = NO_PAGE;
+			for ( int i=0; i<feedback_width * feedback_height; i++, pixels += 4 ){
+				if ( pixels[3] == 0 || pixels[2] >= VT_LEVELS )
+					continue;
+				unsigned int key = pageKey(pixels[2], pixels[0], pixels[1]);
+				if ( key != last )
+					seen.insert(key);
+				last = key;
+			}
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	readback_frame++;
+
+	// Every page wants its ancestors too, they are what it falls back to
+	std::set<unsigned int> wanted;
+	for ( std::set<unsigned int>::iterator it=seen.begin(); it!=seen.end(); ++it ){
+		int level = *it >> 16, y = (*it >> 8) & 0xFF, x = *it & 0xFF;
+		for ( ; level<VT_LEVELS; level++, x/=2, y/=2 )
+			if ( !wanted.insert(pageKey(level, x, y)).second )
+				break;
+	}
+	if ( readback_frame > 1 )
+		request(std::vector<unsigned int>(wanted.rbegin(), wanted.rend()));
+}
+
+// Marks the resident pages as used and queues the rest, coarse levels first.
+// Pages that went off screen before a worker got to them are dropped.
+void VirtualTexture::request(const std::vector<unsigned int> & wanted){
+	std::lock_guard<std::mutex> lock(mutex);
+	queue.clear();
+	for ( size_t i=0; i<wanted.size(); i++ ){
+		std::map<unsigned int, int>::iterator found = resident.find(wanted[i]);
+		if ( found != resident.end() ){
+			if ( slots[found->second].last_used != 0xFFFFFFFFu )
+				slots[found->second].last_used = frame;
+			continue;
+		}
+		if ( !in_flight.count(wanted[i]) )
+			queue.push_back(wanted[i]);
+	}
+	if ( !queue.empty() )
+		wake.notify_all();
+}
+
+void VirtualTexture::update(){
+	std::vector<Page *> done;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		size_t count = finished.size() < VT_UPLOADS_PER_FRAME ? finished.size() : VT_UPLOADS_PER_FRAME;
+		done.assign(finished.begin(), finished.begin() + count);
+		finished.erase(finished.begin(), finished.begin() + count);
+		for ( size_t i=0; i<done.size(); i++ )
+			in_flight.erase(pageKey(done[i]->level, done[i]->x, done[i]->y));
+	}
+	for ( size_t i=0; i<done.size(); i++ ){
+		upload(*done[i]);
+		delete done[i];
+	}
+	if ( !dirty_pages.empty() )
+		updatePageTable();
+	frame++;
+}
+
+// Takes a free slot, or the least recently used one not seen this frame.
+// When every page in the cache is on screen the new one is dropped.
+void VirtualTexture::upload(const Page & page){
+	unsigned int key = pageKey(page.level, page.x, page.y);
+	if ( resident.count(key) )
+		return;
+	int best = -1;
+	for ( size_t i=0; i<slots.size(); i++ ){
+		if ( slots[i].key == NO_PAGE ){
+			best = (int)i;
+			break;
+		}
+		if ( slots[i].last_used < frame && (best < 0 || slots[i].last_used < slots[best].last_used) )
+			best = (int)i;
+	}
+	if ( best < 0 )
+		return;
+	if ( slots[best].key != NO_PAGE ){
+		resident.erase(slots[best].key);
+		dirty_pages.push_back(slots[best].key);
+	}
+
+	glState.bindTexture(GL_TEXTURE_2D, cache);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, (best % VT_CACHE_PAGES) * VT_PAGE_SIZE, (best / VT_CACHE_PAGES) * VT_PAGE_SIZE,
+		VT_PAGE_SIZE, VT_PAGE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, &page.rgba[0]);
+	slots[best].key = key;
+	slots[best].last_used = frame;
+	resident[key] = best;
+	uploads++;
+	dirty_pages.push_back(key);
+}
+
+// Every entry is its resident page, or else the entry of its parent. A page that
+// came or went only changes the entries under it, so those are redone top down,
+// from its own level to the finest, and only their rectangles are uploaded.
+void VirtualTexture::updatePageTable(){
+	// Coarse pages first, a page under one already redone is skipped
+	std::sort(dirty_pages.begin(), dirty_pages.end());
+	std::set<unsigned int> redone;
+	glState.bindTexture(GL_TEXTURE_2D, page_table);
+	for ( size_t i=dirty_pages.size(); i-->0; ){
+		unsigned int key = dirty_pages[i];
+		int level = key >> 16, y = (key >> 8) & 0xFF, x = key & 0xFF;
+		bool covered = false;
+		for ( int l=level, px=x, py=y; l<VT_LEVELS && !covered; l++, px/=2, py/=2 )
+			covered = redone.count(pageKey(l, px, py)) > 0;
+		if ( covered )
+			continue;
+		redone.insert(key);
+
+		for ( int l=level; l>=0; l-- ){
+			int pages = VT_PAGES >> l, size = 1 << (level - l);
+			int x0 = x << (level - l), y0 = y << (level - l);
+			unsigned char * entries = &table[l][0];
+			for ( int ey=y0; ey<y0+size; ey++ ){
+				unsigned char * row = &entries[(ey * pages + x0) * 4];
+				if ( l < VT_LEVELS - 1 ){
+					const unsigned char * parents = &table[l + 1][((ey / 2) * (pages / 2)) * 4];
+					for ( int ex=x0; ex<x0+size; ex++ )
+						memcpy(&row[(ex - x0) * 4], &parents[(ex / 2) * 4], 4);
+				} else {
+					memset(row, 0, size * 4);
+				}
+				// The keys of a row are consecutive in x
+				unsigned int first = pageKey(l, 0, ey);
+				std::map<unsigned int, int>::iterator it = resident.lower_bound(first + x0);
+				std::map<unsigned int, int>::iterator end = resident.lower_bound(first + x0 + size);
+				for ( ; it!=end; ++it ){
+					unsigned char * entry = &entries[(ey * pages + (it->first & 0xFF)) * 4];
+					entry[0] = (unsigned char)(it->second % VT_CACHE_PAGES);
+					entry[1] = (unsigned char)(it->second / VT_CACHE_PAGES);
+					entry[2] = (unsigned char)l;
+					entry[3] = 255;
+				}
+			}
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, pages);
+			glTexSubImage2D(GL_TEXTURE_2D, l, x0, y0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, &entries[(y0 * pages + x0) * 4]);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	dirty_pages.clear();
+}
+
+float VirtualTexture::feedbackBias() const{
+	return -log2f((float)VT_FEEDBACK_DIVISOR);
+}
+
+void VirtualTexture::bind(GLuint page_table_unit, GLuint cache_unit) const{
+	glState.bindTexture(page_table_unit, GL_TEXTURE_2D, page_table);
+	glState.bindTexture(cache_unit, GL_TEXTURE_2D, cache);
+}
+
+size_t VirtualTexture::pendingPages(){
+	std::lock_guard<std::mutex> lock(mutex);
+	return queue.size() + in_flight.size();
+}
+
+void VirtualTexture::release(){
+	stop();
+	glState.forgetTexture(page_table);
+	glState.forgetTexture(cache);
+	glDeleteTextures(1, &page_table);
+	glDeleteTextures(1, &cache);
+	glDeleteBuffers(2, readback);
+	if ( framebuffer ){
+		glDeleteFramebuffers(1, &framebuffer);
+		glDeleteRenderbuffers(1, &feedback_color);
+		glDeleteRenderbuffers(1, &feedback_depth);
+	}
+	page_table = cache = framebuffer = 0;
+}
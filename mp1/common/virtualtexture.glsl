@@ -0,0 +1,46 @@
+// Lookups into a virtual texture, the layout is the one of virtualtexture.hpp.
+// The page table has an entry per page and a mip level per level, each entry
+// is the cache slot of the page, or of its finest resident ancestor, and the
+// level of what it points to.
+
+#define VT_PAGES 256.0
+#define VT_LEVELS 9.0
+#define VT_PAGE_SIZE 128.0
+#define VT_PAGE_BORDER 1.0
+#define VT_PAGE_PAYLOAD (VT_PAGE_SIZE - 2.0 * VT_PAGE_BORDER)
+#define VT_CACHE_PAGES 16.0
+
+uniform sampler2D page_table;
+uniform sampler2D page_cache;
+
+// The level a lookup wants from the screen space derivatives of its coordinates
+float virtual_texture_level(vec2 uv, float bias)
+{
+    vec2 texels = uv * (VT_PAGES * VT_PAGE_PAYLOAD);
+    vec2 dx = dFdx(texels);
+    vec2 dy = dFdy(texels);
+    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + bias;
+    return clamp(floor(lod), 0.0, VT_LEVELS - 1.0);
+}
+
+vec4 virtual_texture(vec2 uv)
+{
+    uv = clamp(uv, 0.0, 0.99999);
+    float wanted = virtual_texture_level(uv, 0.0);
+    vec2 page = floor(uv * (VT_PAGES / exp2(wanted)));
+    vec3 entry = floor(texelFetch(page_table, ivec2(page), int(wanted)).rgb * 255.0 + 0.5);
+
+    // where uv falls inside the page that is there, which may be coarser
+    vec2 inPage = fract(uv * (VT_PAGES / exp2(entry.b)));
+    vec2 texel = entry.rg * VT_PAGE_SIZE + VT_PAGE_BORDER + inPage * VT_PAGE_PAYLOAD;
+    return textureLod(page_cache, texel / (VT_CACHE_PAGES * VT_PAGE_SIZE), 0.0);
+}
+
+// What the feedback pass writes : the page a lookup at uv wants, alpha marks a page
+vec4 virtual_texture_feedback(vec2 uv, float bias)
+{
+    uv = clamp(uv, 0.0, 0.99999);
+    float level = virtual_texture_level(uv, bias);
+    vec2 page = floor(uv * (VT_PAGES / exp2(level)));
+    return vec4(page, level, 255.0) / 255.0;
+}
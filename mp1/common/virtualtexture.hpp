@@ -0,0 +1,113 @@
+#ifndef VIRTUALTEXTURE_HPP
+#define VIRTUALTEXTURE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The layout of a virtual texture, mirrored by virtualtexture.glsl.
+// Pages per side of the finest level : VT_PAGES * VT_PAGE_PAYLOAD texels across
+#define VT_PAGES 256
+// Levels down to a single page
+#define VT_LEVELS 9
+// Texels per side of a page in the cache, a border on each side for the filtering
+#define VT_PAGE_SIZE 128
+#define VT_PAGE_BORDER 1
+#define VT_PAGE_PAYLOAD (VT_PAGE_SIZE - 2 * VT_PAGE_BORDER)
+// Pages per side of the physical cache : 16 x 16 pages of 128 x 128 RGBA, 16 MB
+#define VT_CACHE_PAGES 16
+// The feedback pass renders at this fraction of the screen
+#define VT_FEEDBACK_DIVISOR 8
+// Pages uploaded to the cache per frame at most
+#define VT_UPLOADS_PER_FRAME 8
+
+// A texture far too large to keep, of which only the pages on screen are.
+// A page table (one texel per page, one level per mip level) points every
+// page at its place in a fixed cache texture, or at the finest resident page
+// above it while it isn't there. A low resolution feedback pass writes the
+// page each pixel wants, read back a frame late without stalling, and the
+// missing pages are generated on worker threads, coarse levels first, and
+// replace the least recently seen ones in the cache.
+class VirtualTexture{
+public:
+	// Fills a VT_PAGE_SIZE x VT_PAGE_SIZE RGBA page, borders included : texel (i, j)
+	// covers (u0 + i * step, v0 + j * step) of the [0, 1] x [0, 1] texture.
+	// Called from the worker threads.
+	typedef std::function<void(float u0, float v0, float step, unsigned char * rgba)> PageGenerator;
+
+	VirtualTexture();
+	~VirtualTexture(); // stops the workers
+
+	// Creates the textures and the feedback framebuffer and makes the single
+	// page of the coarsest level on the spot, so every lookup finds something
+	bool create(PageGenerator generator);
+
+	// Binds the feedback framebuffer for a screen of width x height and clears it,
+	// the caller then draws with virtual_texture_feedback() and feedbackBias()
+	void beginFeedback(int width, int height);
+
+	// Reads the feedback back and queues the pages it asks for.
+	// The default framebuffer is bound again, the viewport is the caller's.
+	void endFeedback();
+
+	// Uploads finished pages and the page table, once per frame
+	void update();
+
+	// The level bias of the feedback pass, its derivatives are VT_FEEDBACK_DIVISOR times larger
+	float feedbackBias() const;
+
+	// Binds the page table and the cache for the samplers page_table and page_cache
+	void bind(GLuint page_table_unit, GLuint cache_unit) const;
+
+	size_t residentPages() const { return resident.size(); }
+	size_t pendingPages();
+	size_t uploadedPages() const { return uploads; }
+
+	// Stops the workers and deletes the GL objects, while the context is still there
+	void release();
+
+private:
+	struct Page{
+		int level, x, y;
+		std::vector<unsigned char> rgba;
+	};
+	struct Slot{
+		unsigned int key;       // the page in it, NO_PAGE if free
+		unsigned int last_used; // frame
+	};
+
+	static const unsigned int NO_PAGE = 0xFFFFFFFFu;
+	static unsigned int pageKey(int level, int x, int y) { return (level << 16) | (y << 8) | x; }
+	void work();
+	void stop();
+	void request(const std::vector<unsigned int> & wanted);
+	void upload(const Page & page);
+	void updatePageTable();
+
+	PageGenerator generator;
+	GLuint page_table, cache, framebuffer, feedback_color, feedback_depth;
+	GLuint readback[2];
+	int feedback_width, feedback_height, readback_frame;
+	std::vector<Slot> slots;
+	std::map<unsigned int, int> resident; // page key -> slot
+	std::vector<unsigned char> table[VT_LEVELS];
+	std::vector<unsigned int> dirty_pages; // made resident or evicted since the last updatePageTable()
+	unsigned int frame;
+	size_t uploads;
+
+	// shared with the workers
+	std::deque<unsigned int> queue;
+	std::set<unsigned int> in_flight; // taken by a worker, or generated and not uploaded
+	std::vector<Page *> finished;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+};
+
+#endif
@@ -8,13 +8,17 @@
 #include <stdio.h>
 #include <ctime>
 #include <cmath>
-#include "shader.h"
+#include "shader.hpp"
+#include "residency.hpp"
+#include "glstate.hpp"
 
 #define PI 3.14159265
 
 int nFPS = 30;
 bool onlyEdge = false;
+static bool waveZ = false;
 float fAspect = 1;
+static ResidencyManager residency;
 
 // error callback function
 static void error_callback(int error, const char* description)
@@ -34,17 +38,16 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         glfwSetWindowShouldClose(window, GL_TRUE);
     else if (key == GLFW_KEY_E && (action == GLFW_REPEAT || action == GLFW_PRESS))
         onlyEdge = true;
+    else if (key == GLFW_KEY_Z && action == GLFW_PRESS)
+        waveZ = !waveZ;
     else
         onlyEdge = false;
 }
 
-// make buffers for different targets
+// make buffers for different targets,
+// accounted by the residency manager, the data has to outlive the buffer
 static GLuint make_buffer(GLenum target, const void* buffer_data, GLsizei buffer_size) {
-    GLuint buffer;
-    glGenBuffers(1, &buffer);
-    glBindBuffer(target, buffer);
-    glBufferData(target, buffer_size, buffer_data, GL_STATIC_DRAW);
-    return buffer;
+    return residency.makeBuffer(target, buffer_data, buffer_size);
 }
 
 int main(void)
@@ -81,7 +84,7 @@ int main(void)
     // Store the vertex array object which stores the attributes mapping
     GLuint vao;
     glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    glState.bindVertexArray(vao);
 
     // make the vertices buffer
     GLfloat IBufferData[] = {
@@ -146,8 +149,12 @@ int main(void)
     GLuint veo = make_buffer(GL_ELEMENT_ARRAY_BUFFER, elementBufferData, sizeof(elementBufferData));
 
     // compile the shader program
-    GLuint shaderProgram = LoadShaders("vertex_shader.vert", "fragment_shader.frag");
-    glUseProgram(shaderProgram);
+    // one program per combination of features, the others compile while the first one draws
+    const char* featureNames[] = { "WAVE_Z" };
+    ShaderVariants shaders("vertex_shader.vert", "fragment_shader.frag", featureNames, 1);
+    shaders.prepareAll();
+    GLuint shaderProgram = shaders.program(0);
+    glState.useProgram(shaderProgram);
 
     // Get the position attribute and enable
     GLuint posAttrib = glGetAttribLocation(shaderProgram, "position");
@@ -202,28 +209,41 @@ int main(void)
                     );
                 //set the time value for sine function
                 time = (time + 0.01) -(int)(time +0.01);
-                glUniform1f(timeUniform, time);
 	}
 
+        // Z switches to the variant that also waves along z, once it's linked
+        shaders.update();
+        GLuint program = shaders.ready(waveZ ? 1 : 0);
+        if (program && program != shaderProgram) {
+            shaderProgram = program;
+            glState.useProgram(shaderProgram);
+            MVPUniform = glGetUniformLocation(shaderProgram, "MVP");
+            colorUniform = glGetUniformLocation(shaderProgram, "color");
+            timeUniform = glGetUniformLocation(shaderProgram, "time");
+        }
+        glState.uniform1f(timeUniform, time);
+
 
         projMat = glm::perspective(45.0f, fAspect, 0.1f, 100.0f);
         // Our ModelViewProjection : multiplication of our 3 matrices
         glm::mat4 MVPMat = projMat * viewMat * modelMat;
-        glUniformMatrix4fv(MVPUniform, 1, GL_FALSE, glm::value_ptr(MVPMat));
+        glState.uniformMatrix4fv(MVPUniform, 1, GL_FALSE, glm::value_ptr(MVPMat));
 
         // choose from two modes: line or fill
         if (onlyEdge == true) {
             glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
             // White color
-            glUniform4f(colorUniform, 1.0f, 1.0f, 1.0f, 1.0f);
+            glState.uniform4f(colorUniform, 1.0f, 1.0f, 1.0f, 1.0f);
             }
         else {
             // Orange color
             glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-            glUniform4f(colorUniform, 1.0f, 0.5f, 0.0f, 0.6f);
+            glState.uniform4f(colorUniform, 1.0f, 0.5f, 0.0f, 0.6f);
         }
 
         // Begin to draw all the polygons
+        residency.touch(VBO);
+        residency.touch(veo);
         glDrawElements(GL_TRIANGLE_STRIP, 6, GL_UNSIGNED_INT, 0);
         glDrawElements(GL_TRIANGLE_FAN, 4, GL_UNSIGNED_INT, (GLvoid*)(6* sizeof(GLuint)));
         glDrawElements(GL_TRIANGLE_STRIP, 6, GL_UNSIGNED_INT, (GLvoid*)(10* sizeof(GLuint)));
@@ -237,15 +257,19 @@ int main(void)
 
         // buffer swapping
         glfwSwapBuffers(window);
+        residency.endFrame();
         // Poll events
         glfwPollEvents();
     }
 
     // clean
+    printf("GL state cache : %zu calls issued, %zu skipped\n", glState.issuedCalls(), glState.skippedCalls());
     glDisableVertexAttribArray(posAttrib);
-    glDeleteProgram(shaderProgram);
-    glDeleteBuffers(1, &VBO);
+    shaders.release();
+    residency.release(VBO);
+    residency.release(veo);
     glDeleteVertexArrays(1, &vao);
+    glState.forgetVertexArray(vao);
     glfwDestroyWindow(window);
     glfwTerminate();
 
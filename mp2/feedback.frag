@@ -0,0 +1,17 @@
+#version 330 core
+#include "../mp1/common/virtualtexture.glsl"
+
+// the terrain spans [-5, 5] in x and y, the virtual texture [0, 1]
+#define TERRAIN_SIZE 10.0
+
+in vec3 vertex_world;
+
+// the feedback is rendered smaller, so its derivatives are larger
+uniform float lod_bias;
+
+out vec4 outColor;
+
+void main()
+{
+    outColor = virtual_texture_feedback(vertex_world.xy / TERRAIN_SIZE + 0.5, lod_bias);
+}
@@ -9,10 +9,30 @@
 #include <stdio.h>
 #include <ctime>
 #include <cmath>
-#include "shader.h"
+#include <vector>
+#include <algorithm>
+#include "shader.hpp"
 #include "mp2.h"
+#include "vertexcache.hpp"
+#include "residency.hpp"
+#include "uniformbuffer.hpp"
+#include "glstate.hpp"
+#include "virtualtexture.hpp"
+#include "renderqueue.hpp"
+#include "clusteredlights.hpp"
 
 #define PI 3.14159265
+// the terrain spans [-5, 5] in x and y, the virtual texture [0, 1]
+#define TERRAIN_SIZE 10.0f
+#define PAGE_TABLE_UNIT 0
+#define PAGE_CACHE_UNIT 1
+#define LIGHT_DATA_UNIT 2
+#define CLUSTER_RANGE_UNIT 3
+#define CLUSTER_INDEX_UNIT 4
+
+// features of the shader variants
+static const unsigned int FEATURE_UNDERWATER = 1;
+static const unsigned int FEATURE_VIRTUAL_TEXTURE = 2;
 
 GLfloat sealevel;
 static float speed = 0.005;
@@ -21,6 +41,7 @@ static float fAspect = 1;
 static glm::vec3 forwardVector = glm::vec3(-1.0f, 0.0f ,0.0f);
 static glm::vec3 upVector = glm::vec3(0.0f, 0.0f, 1.0f);
 static glm::mat4 viewMat;
+static ResidencyManager residency;
 
 // error callback function
 static void error_callback(int error, const char* description)
@@ -65,16 +86,144 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     }
 }
 
-// make buffers for different targets
+// uniform locations of one variant of the shader program,
+// camera, light and materials come from the uniform buffer
+struct TerrainUniforms {
+    GLint M, normal_matrix;
+};
+
+static void get_uniforms(GLuint program, TerrainUniforms &u) {
+    bindUniformBlocks(program);
+    u.M = glGetUniformLocation(program, "M");
+    u.normal_matrix = glGetUniformLocation(program, "normal_matrix");
+    glState.uniform1i(glGetUniformLocation(program, "page_table"), PAGE_TABLE_UNIT);
+    glState.uniform1i(glGetUniformLocation(program, "page_cache"), PAGE_CACHE_UNIT);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_light_data"), LIGHT_DATA_UNIT);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_ranges"), CLUSTER_RANGE_UNIT);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_light_indices"), CLUSTER_INDEX_UNIT);
+}
+
+// the variant once it is linked, else the one drawn so far,
+// its uniforms are set up whenever it takes over
+static GLuint select_variant(ShaderVariants &shaders, unsigned int features, GLuint current,
+                             const glm::mat4 &modelMat, const glm::mat3 &normalMat)
+{
+    GLuint program = shaders.ready(features);
+    if (!program || program == current)
+        return current;
+    TerrainUniforms uniforms;
+    glState.useProgram(program);
+    get_uniforms(program, uniforms);
+    glState.uniformMatrix4fv(uniforms.M, 1, GL_FALSE, glm::value_ptr(modelMat));
+    glState.uniformMatrix3fv(uniforms.normal_matrix, 1, GL_FALSE, glm::value_ptr(normalMat));
+    return program;
+}
+
+// height of the terrain at (u, v) of the virtual texture, bilinear between the grid vertices
+static float terrain_height(const std::vector<float> &heights, float u, float v) {
+    float x = glm::clamp(u, 0.0f, 1.0f) * (res - 1);
+    float y = glm::clamp(v, 0.0f, 1.0f) * (res - 1);
+    int i = std::min((int)x, res - 2);
+    int j = std::min((int)y, res - 2);
+    const float *h = &heights[j*res + i];
+    return glm::mix(glm::mix(h[0], h[1], x - i), glm::mix(h[res], h[res + 1], x - i), y - j);
+}
+
+// value noise in [0, 1], hashed from the lattice so every page agrees on it
+static float lattice(int x, int y) {
+    unsigned int h = (unsigned int)x * 374761393u + (unsigned int)y * 668265263u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    return (h ^ (h >> 16)) / 4294967295.0f;
+}
+
+static float value_noise(float x, float y) {
+    float fx = floorf(x), fy = floorf(y);
+    int i = (int)fx, j = (int)fy;
+    float sx = glm::smoothstep(0.0f, 1.0f, x - fx);
+    float sy = glm::smoothstep(0.0f, 1.0f, y - fy);
+    return glm::mix(glm::mix(lattice(i, j), lattice(i + 1, j), sx),
+                    glm::mix(lattice(i, j + 1), lattice(i + 1, j + 1), sx), sy);
+}
+
+// colour a page of the virtual texture : sand at the shore, grass, rock on the
+// slopes and snow on the tops, with noise down to the size of the page's texels
+// so the finer levels carry detail the mesh doesn't have
+static void generate_terrain_page(const std::vector<float> &heights, float u0, float v0, float step, unsigned char *rgba) {
+    const glm::vec3 sand(0.76f, 0.70f, 0.50f);
+    const glm::vec3 grass(0.25f, 0.42f, 0.15f);
+    const glm::vec3 rock(0.42f, 0.38f, 0.34f);
+    const glm::vec3 snow(0.95f, 0.95f, 0.97f);
+    float cell = 1.0f / (res - 1);
+    for (int j = 0; j < VT_PAGE_SIZE; j++) {
+        for (int i = 0; i < VT_PAGE_SIZE; i++) {
+            float u = u0 + i*step, v = v0 + j*step;
+            float h = terrain_height(heights, u, v);
+            float dx = (terrain_height(heights, u + cell, v) - terrain_height(heights, u - cell, v)) / (2.0f*cell*TERRAIN_SIZE);
+            float dy = (terrain_height(heights, u, v + cell) - terrain_height(heights, u, v - cell)) / (2.0f*cell*TERRAIN_SIZE);
+            float slope = sqrtf(dx*dx + dy*dy);
+
+            // octaves from four grid cells across down to two texels of this level
+            float detail = 0.0f, amplitude = 0.5f;
+            for (float frequency = (res - 1) / 4.0f; frequency*step < 0.5f && amplitude > 0.01f; frequency *= 2.0f, amplitude *= 0.5f)
+                detail += amplitude * (value_noise(u*frequency, v*frequency) - 0.5f);
+
+            float height = h - sealevel + 0.05f*detail;
+            glm::vec3 color = glm::mix(sand, grass, glm::smoothstep(0.02f, 0.06f, height));
+            color = glm::mix(color, rock, glm::smoothstep(0.5f, 0.9f, slope + 0.3f*detail));
+            color = glm::mix(color, snow, glm::smoothstep(0.35f, 0.45f, height) * (1.0f - glm::smoothstep(0.8f, 1.2f, slope)));
+            color = glm::clamp(color * (1.0f + 0.6f*detail), 0.0f, 1.0f);
+
+            unsigned char *texel = &rgba[4*(j*VT_PAGE_SIZE + i)];
+            texel[0] = (unsigned char)(color.x * 255.0f);
+            texel[1] = (unsigned char)(color.y * 255.0f);
+            texel[2] = (unsigned char)(color.z * 255.0f);
+            texel[3] = 255;
+        }
+    }
+}
+
+// make buffers for different targets,
+// accounted by the residency manager, the data has to outlive the buffer
 static GLuint make_buffer(GLenum target, const void* buffer_data, GLsizei buffer_size) {
-    GLuint buffer;
-    glGenBuffers(1, &buffer);
-    glBindBuffer(target, buffer);
-    glBufferData(target, buffer_size, buffer_data, GL_STATIC_DRAW);
-    return buffer;
+    return residency.makeBuffer(target, buffer_data, buffer_size);
+}
+
+// lamps hovering over the terrain, one in four a spot looking down,
+// each circling around where it was put
+struct Lamp {
+    glm::vec3 anchor;
+    float orbit, phase;
+};
+
+static void make_lamps(const std::vector<float> &heights, int count,
+                       std::vector<Lamp> &lamps, std::vector<ClusteredLight> &lights) {
+    srand(7);
+    lamps.resize(count);
+    lights.resize(count);
+    for (int i = 0; i < count; i++) {
+        float u = rand() / (float)RAND_MAX, v = rand() / (float)RAND_MAX;
+        float ground = std::max(terrain_height(heights, u, v), sealevel);
+        lamps[i].anchor = glm::vec3((u - 0.5f)*TERRAIN_SIZE, (v - 0.5f)*TERRAIN_SIZE, ground + 0.05f + 0.1f*rand()/(float)RAND_MAX);
+        lamps[i].orbit = 0.05f + 0.15f*rand()/(float)RAND_MAX;
+        lamps[i].phase = 6.2831853f*rand()/(float)RAND_MAX;
+
+        ClusteredLight &light = lights[i];
+        float hue = 6.0f*rand()/(float)RAND_MAX;
+        light.color = 1.5f*glm::clamp(glm::vec3(fabsf(hue - 3.0f) - 1.0f, 2.0f - fabsf(hue - 2.0f), 2.0f - fabsf(hue - 4.0f)), 0.0f, 1.0f);
+        light.direction = glm::vec3(0.0f, 0.0f, -1.0f);
+        if (i % 4 == 0) {
+            light.radius = 0.4f;
+            light.spot_cos_outer = cosf(40.0f*PI/180.0f);
+            light.spot_cos_inner = cosf(25.0f*PI/180.0f);
+        } else {
+            light.radius = 0.15f + 0.15f*rand()/(float)RAND_MAX;
+            light.spot_cos_outer = CLUSTER_POINT_LIGHT;
+            light.spot_cos_inner = 1.0f;
+        }
+    }
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
     GLFWwindow* window;
     glfwSetErrorCallback(error_callback);
@@ -108,10 +257,31 @@ int main(void)
     // Begin to program
     // generate terrain data
     makemountain();
+    sealevel = 0.0f;
 
-    // compile the shader program
-    GLuint shaderProgram = LoadShaders("vertex_shader.vert", "fragment_shader.frag");
-    glUseProgram(shaderProgram);
+    // the heights on the grid for the virtual texture, before the vertices are reordered
+    std::vector<float> heights(res*res);
+    for (int i = 0; i < res*res; i++)
+        heights[i] = verts[3*i + 2];
+
+    // reorder the terrain triangles for the post-transform cache, then the vertices in fetch order
+    VertexCacheStatistics cacheBefore = analyzeVertexCache(faces, 6*(res-1)*(res-1), res*res);
+    optimizeVertexCache(faces, 6*(res-1)*(res-1), res*res);
+    std::vector<unsigned int> remap;
+    optimizeVertexFetch(faces, 6*(res-1)*(res-1), res*res, remap);
+    remapVertexBuffer(verts, res*res, 3*sizeof(GLfloat), remap);
+    remapVertexBuffer(norms, res*res, 3*sizeof(GLfloat), remap);
+    VertexCacheStatistics cacheAfter = analyzeVertexCache(faces, 6*(res-1)*(res-1), res*res);
+    printf("terrain vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+           cacheBefore.acmr, cacheAfter.acmr, cacheBefore.atvr, cacheAfter.atvr);
+
+    // compile the shader programs : the terrain's reads the virtual texture, the sea's
+    // doesn't, and the underwater variants of both come in the background
+    const char* featureNames[] = { "UNDERWATER", "VIRTUAL_TEXTURE" };
+    ShaderVariants shaders("vertex_shader.vert", "fragment_shader.frag", featureNames, 2);
+    shaders.prepareAll();
+    GLuint shaderProgram = shaders.program(FEATURE_VIRTUAL_TEXTURE);
+    shaders.program(0);
 
     GLuint posAttrib = glGetAttribLocation(shaderProgram, "position");
     GLuint normAttrib = glGetAttribLocation(shaderProgram, "norm");
@@ -121,7 +291,7 @@ int main(void)
     glGenVertexArrays(2, vao);
 
     // vao for terrain
-    glBindVertexArray(vao[0]);
+    glState.bindVertexArray(vao[0]);
     // Get the position attribute and enable
     GLuint verts_vbo = make_buffer(GL_ARRAY_BUFFER, verts,res*res*3*sizeof(GLfloat));
     glEnableVertexAttribArray(posAttrib);
@@ -136,7 +306,6 @@ int main(void)
     GLuint veo = make_buffer(GL_ELEMENT_ARRAY_BUFFER, faces, 6*(res-1)*(res-1)*sizeof(GLuint));
 
     // make the vertex buffer
-    sealevel = 0.0f;
     GLfloat sea_verts[] = {
         -5.0f, -5.0f, sealevel, 0.0f, 0.0f, 1.0f,
          5.0f, -5.0f, sealevel, 0.0f, 0.0f, 1.0f,
@@ -145,13 +314,13 @@ int main(void)
     };
 
     // vao for sea
-    glBindVertexArray(vao[1]);
+    glState.bindVertexArray(vao[1]);
     GLuint sea_vbo = make_buffer(GL_ARRAY_BUFFER, sea_verts, sizeof(sea_verts));
     glEnableVertexAttribArray(posAttrib);
     glVertexAttribPointer(posAttrib, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), 0);
     glEnableVertexAttribArray(normAttrib);
     glVertexAttribPointer(normAttrib, 3, GL_FLOAT, GL_FALSE, 6*sizeof(GLfloat), (GLvoid*)(3*sizeof(GLfloat)));
-    glBindVertexArray(0);
+    glState.bindVertexArray(0);
 
 
     // Projection matrix : 90° Field of View, 1:1 ratio, display range : 0.1 unit <-> 10 units
@@ -161,38 +330,19 @@ int main(void)
     viewMat = glm::lookAt(planePosition, planePosition + forwardVector, upVector);
 
     glm::mat4 modelMat = glm::mat4(1.0f);
-    glm::mat3 modelMatInv = glm::inverse(glm::mat3(modelMat));
-
-    // Get all the uniform identifier in our shader program
-    GLuint MVPUniform = glGetUniformLocation(shaderProgram, "MVP");
-    GLuint M_invUniform = glGetUniformLocation(shaderProgram, "M_inv");
-    GLuint V_invUniform = glGetUniformLocation(shaderProgram, "V_inv");
-    //GLuint timeUniform = glGetUniformLocation(shaderProgram, "time");
-
-    GLuint MUniform = glGetUniformLocation(shaderProgram, "M");
-    glUniformMatrix4fv(MUniform, 1, GL_FALSE, glm::value_ptr(modelMat));
-    glUniformMatrix3fv(M_invUniform, 1, GL_FALSE, glm::value_ptr(modelMatInv));
+    // the normals take the transpose of the inverse, once here instead of per fragment
+    glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
 
     // light
-    GLuint light_direction_uniform = glGetUniformLocation(shaderProgram, "light.direction");
-    GLuint light_ambient_uniform = glGetUniformLocation(shaderProgram, "light.ambient");
-    GLuint light_diffuse_uniform = glGetUniformLocation(shaderProgram, "light.diffuse");
-    GLuint light_specular_uniform = glGetUniformLocation(shaderProgram, "light.specular");
-
     glm::vec3 direction = glm::vec3(0.0,0.0,-1.0);
     glm::vec4 amb = glm::vec4(1.0,1.0,1.0,1.0);
     glm::vec4 diff = glm::vec4(1.0,1.0,1.0,1.0);
     glm::vec4 spec = glm::vec4(1.0,1.0,1.0,1.0);
 
-    glUniform3fv(light_direction_uniform, 1, glm::value_ptr(direction));
-    glUniform4fv(light_ambient_uniform, 1, glm::value_ptr(amb));
-    glUniform4fv(light_diffuse_uniform, 1, glm::value_ptr(diff));
-    glUniform4fv(light_specular_uniform, 1, glm::value_ptr(spec));
-
-    // dirt doesn't glisten
-    glm::vec4 tanamb  = glm::vec4(0.2,0.15,0.1,1.0);
-    glm::vec4 tandiff = glm::vec4(0.4,0.3,0.2,1.0);
-    glm::vec4 tanspec = glm::vec4(0.4,0.3,0.2,1.0);
+    // the colour of the ground comes from the virtual texture, dirt doesn't glisten
+    glm::vec4 tanamb  = glm::vec4(0.35,0.35,0.35,1.0);
+    glm::vec4 tandiff = glm::vec4(0.9,0.9,0.9,1.0);
+    glm::vec4 tanspec = glm::vec4(0.1,0.1,0.1,1.0);
     GLfloat tanshininess = 50.0;
 
     // Single polygon, will only have highlight if light hits a vertex just right
@@ -201,16 +351,64 @@ int main(void)
     glm::vec4 seaspec = glm::vec4(0.5,0.5,1.0,0.4);
     GLfloat seashininess = 10.0;
 
-    GLuint material_shininess_uniform = glGetUniformLocation(shaderProgram, "material.shininess");
-    GLuint material_ambient_uniform = glGetUniformLocation(shaderProgram, "material.ambient");
-    GLuint material_diffuse_uniform = glGetUniformLocation(shaderProgram, "material.diffuse");
-    GLuint material_specular_uniform = glGetUniformLocation(shaderProgram, "material.specular");
+    // camera, light and both materials in one uniform buffer, the light colors
+    // are folded into the materials once here instead of in every fragment
+    UniformBuffer uniformBuffer;
+    size_t cameraOffset = uniformBuffer.add(sizeof(CameraBlock));
+    size_t lightOffset = uniformBuffer.add(sizeof(LightBlock));
+    size_t tanOffset = uniformBuffer.add(sizeof(MaterialBlock));
+    size_t seaOffset = uniformBuffer.add(sizeof(MaterialBlock));
+    LightBlock light = directionalLight(direction);
+    MaterialBlock tanMaterial = litMaterial(tanamb, tandiff, tanspec, tanshininess, amb, diff, spec);
+    MaterialBlock seaMaterial = litMaterial(seaamb, seadiff, seaspec, seashininess, amb, diff, spec);
+    uniformBuffer.set(lightOffset, &light, sizeof(light));
+    uniformBuffer.set(tanOffset, &tanMaterial, sizeof(tanMaterial));
+    uniformBuffer.set(seaOffset, &seaMaterial, sizeof(seaMaterial));
+    uniformBuffer.create();
+    uniformBuffer.bind(UNIFORM_BINDING_CAMERA, cameraOffset, sizeof(CameraBlock));
+    uniformBuffer.bind(UNIFORM_BINDING_LIGHT, lightOffset, sizeof(LightBlock));
+
+    // many small lights, binned into clusters of the view frustum every frame
+    int lampCount = argc > 1 ? atoi(argv[1]) : 1024;
+    std::vector<Lamp> lamps;
+    std::vector<ClusteredLight> lights;
+    make_lamps(heights, std::max(lampCount, 0), lamps, lights);
+    ClusteredLights clusters;
+    clusters.create();
+    clusters.setProjection(90.0f, fAspect, 0.01f, 10.0f);
+
+    // the draws of a frame go through a queue sorted by state and depth,
+    // the sea is blended so it draws last, after everything under it
+    RenderQueue renderQueue;
+    unsigned int tanMaterialId = renderQueue.addMaterial(uniformBuffer, tanOffset);
+    unsigned int seaMaterialId = renderQueue.addMaterial(uniformBuffer, seaOffset);
+    RenderDraw terrainDraw = { GL_TRIANGLES, 6*(res-1)*(res-1), GL_UNSIGNED_INT, 0 };
+    RenderDraw seaDraw = { GL_TRIANGLE_STRIP, 4, 0, 0 };
+    glm::vec3 terrainCenter = glm::vec3(0.0f, 0.0f, 0.0f);
+    glm::vec3 seaCenter = glm::vec3(0.0f, 0.0f, sealevel);
+
+    // the terrain colour as a virtual texture, only the pages on screen are generated,
+    // on worker threads, into a fixed cache
+    VirtualTexture virtualTexture;
+    virtualTexture.create([&heights](float u0, float v0, float step, unsigned char *rgba) {
+        generate_terrain_page(heights, u0, v0, step, rgba);
+    });
+
+    // the feedback pass draws the terrain with the page each pixel wants
+    GLuint feedbackProgram = LoadShaders("vertex_shader.vert", "feedback.frag");
+    bindUniformBlocks(feedbackProgram);
+    glState.useProgram(feedbackProgram);
+    glState.uniformMatrix4fv(glGetUniformLocation(feedbackProgram, "M"), 1, GL_FALSE, glm::value_ptr(modelMat));
+    glState.uniformMatrix3fv(glGetUniformLocation(feedbackProgram, "normal_matrix"), 1, GL_FALSE, glm::value_ptr(normalMat));
+    glState.uniform1f(glGetUniformLocation(feedbackProgram, "lod_bias"), virtualTexture.feedbackBias());
+
+    // the variants drawing the terrain and the sea, their uniforms are set up when they are selected
+    GLuint terrainProgram = 0, seaProgram = 0;
 
     GLfloat fRotateAngle = 1.0f;
     clock_t startClock=0,curClock;
     float time = 0;
-    // Enable blending
-    glEnable(GL_BLEND);
+    // Blending, the render queue enables it for the transparent pass only
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     // configurations
     glEnable(GL_DEPTH_TEST);
@@ -231,38 +429,80 @@ int main(void)
                 viewMat = glm::translate(glm::mat4(1.0f),glm::vec3(0.0f, 0.0f, speed)) * viewMat;
 	}
 
-        // Our ModelViewProjection : multiplication of our 3 matrices
-        glm::mat4 MVPMat = projMat * viewMat * modelMat;
-        glUniformMatrix4fv(MVPUniform, 1, GL_FALSE, glm::value_ptr(MVPMat));
-        glm::mat4 V_inv = glm::inverse(viewMat);
-        glUniformMatrix4fv(V_invUniform, 1, GL_FALSE, glm::value_ptr(V_inv));
-
-        // Begin to draw all the polygons
-        glBindVertexArray(vao[0]);
-        glUniform1f(material_shininess_uniform, tanshininess);
-        glUniform4fv(material_ambient_uniform, 1, glm::value_ptr(tanamb));
-        glUniform4fv(material_diffuse_uniform, 1, glm::value_ptr(tandiff));
-        glUniform4fv(material_specular_uniform, 1, glm::value_ptr(tanspec));
+        // the camera block is the only upload of the frame
+        CameraBlock camera = cameraBlock(viewMat, projMat);
+        uniformBuffer.set(cameraOffset, &camera, sizeof(camera));
+        uniformBuffer.upload();
+
+        // the pages wanted this frame are read back next frame, the ones generated since go to the cache
+        int width, height;
+        glfwGetFramebufferSize(window, &width, &height);
+        virtualTexture.beginFeedback(width, height);
+        glState.useProgram(feedbackProgram);
+        glState.bindVertexArray(vao[0]);
         glDrawElements(GL_TRIANGLES, 6*(res-1)*(res-1), GL_UNSIGNED_INT, 0);
+        virtualTexture.endFeedback();
+        glViewport(0, 0, width, height);
+        virtualTexture.update();
+        virtualTexture.bind(PAGE_TABLE_UNIT, PAGE_CACHE_UNIT);
+
+        // the camera decides once per frame whether everything is seen from under the sea
+        glm::vec3 viewPosition = glm::vec3(camera.view_position);
+        shaders.update();
+        unsigned int underwater = viewPosition.z < sealevel ? FEATURE_UNDERWATER : 0;
+        terrainProgram = select_variant(shaders, underwater | FEATURE_VIRTUAL_TEXTURE, terrainProgram, modelMat, normalMat);
+        seaProgram = select_variant(shaders, underwater, seaProgram, modelMat, normalMat);
+
+        // move the lamps and bin them for this view
+        double now = glfwGetTime();
+        for (size_t i = 0; i < lamps.size(); i++) {
+            float angle = lamps[i].phase + 0.5f*now;
+            lights[i].position = lamps[i].anchor + lamps[i].orbit*glm::vec3(cosf(angle), sinf(angle), 0.0f);
+        }
+        clusters.update(lights, viewMat, width, height);
+        clusters.bind(LIGHT_DATA_UNIT, CLUSTER_RANGE_UNIT, CLUSTER_INDEX_UNIT);
+        glState.useProgram(terrainProgram);
+        clusters.setUniforms(terrainProgram);
+        glState.useProgram(seaProgram);
+        clusters.setUniforms(seaProgram);
 
-        glBindVertexArray(vao[1]);
-        glUniform1f( material_shininess_uniform, seashininess);
-        glUniform4fv(material_ambient_uniform, 1, glm::value_ptr(seaamb));
-        glUniform4fv(material_diffuse_uniform, 1, glm::value_ptr(seadiff));
-        glUniform4fv(material_specular_uniform, 1, glm::value_ptr(seaspec));
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        // Begin to draw all the polygons
+        residency.touch(verts_vbo);
+        residency.touch(norms_vbo);
+        residency.touch(veo);
+        residency.touch(sea_vbo);
+        renderQueue.begin(0.01f, 10.0f);
+        renderQueue.submit(RENDER_PASS_OPAQUE, terrainProgram, tanMaterialId, vao[0],
+                           glm::length(terrainCenter - viewPosition), terrainDraw);
+        renderQueue.submit(RENDER_PASS_TRANSPARENT, seaProgram, seaMaterialId, vao[1],
+                           glm::length(seaCenter - viewPosition), seaDraw);
+        renderQueue.execute();
         // buffer swapping
         glfwSwapBuffers(window);
+        residency.endFrame();
         // Poll events
         glfwPollEvents();
     }
 
     // clean
-    glDeleteProgram(shaderProgram);
-    glDeleteBuffers(1, &verts_vbo);
-    glDeleteBuffers(1, &norms_vbo);
-    glDeleteBuffers(1, &sea_vbo);
+    printf("GL state cache : %zu calls issued, %zu skipped\n", glState.issuedCalls(), glState.skippedCalls());
+    printf("render queue : %zu draws, %zu state changes\n", renderQueue.drawCount(), renderQueue.stateChanges());
+    printf("clustered lights : %d lights, %.2f ms to bin the last frame, %zu indices, up to %u in a cluster\n",
+           (int)lights.size(), clusters.binMilliseconds(), clusters.indexCount(), clusters.maxClusterLights());
+    clusters.release();
+    printf("virtual texture : %zu pages resident, %zu uploaded\n", virtualTexture.residentPages(), virtualTexture.uploadedPages());
+    virtualTexture.release();
+    glDeleteProgram(feedbackProgram);
+    glState.forgetProgram(feedbackProgram);
+    shaders.release();
+    uniformBuffer.release();
+    residency.release(verts_vbo);
+    residency.release(norms_vbo);
+    residency.release(veo);
+    residency.release(sea_vbo);
     glDeleteVertexArrays(2, vao);
+    glState.forgetVertexArray(vao[0]);
+    glState.forgetVertexArray(vao[1]);
     glfwDestroyWindow(window);
     glfwTerminate();
 
@@ -1,18 +1,20 @@
 #version 330 core
+#include "../mp1/common/lighting.glsl"
 
-in vec3 position;
-in vec3 norm;
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 norm;
 
-uniform mat4 MVP;
 uniform mat4 M;
+// transpose of the inverse of M, from the CPU
+uniform mat3 normal_matrix;
 
 out vec3 vertex_norm;
-out vec4 vertex_world;
+out vec3 vertex_world;
 
 void main()
 {
-    gl_Position = MVP * vec4(position, 1.0);
-    vertex_norm = norm;
-    vertex_world = M * vec4(position, 1.0);
+    vec4 world = M * vec4(position, 1.0);
+    gl_Position = camera.view_projection * world;
+    vertex_norm = normal_matrix * norm;
+    vertex_world = vec3(world);
 }
-
@@ -0,0 +1,6 @@
+#version 330 core
+
+// the depth pre-pass writes depth only, the colour writes are masked
+void main()
+{
+}
@@ -0,0 +1,15 @@
+#version 330 core
+#include "../mp1/common/lighting.glsl"
+
+// the locations and the transform of vertex_shader.vert, invariant on both
+// sides so the shading pass matches these depths exactly under GL_EQUAL
+layout(location = 0) in vec3 position;
+layout(location = 5) in mat4 instance_model;
+
+invariant gl_Position;
+
+void main()
+{
+    vec4 world = instance_model * vec4(position, 1.0);
+    gl_Position = camera.view_projection * world;
+}
@@ -1,4 +1,8 @@
 #version 330 core
+#include "../mp1/common/lighting.glsl"
+#ifdef CLUSTERED_LIGHTS
+#include "../mp1/common/clusteredlights.glsl"
+#endif
 
 in vec3 vertex_world;
 //in vec3 vertex_norm;
@@ -7,38 +11,32 @@ in mat3 TBN;
 
 out vec4 outColor;
 uniform sampler2D surface;
-uniform sampler2D env;
+// the environment probe around the teapots, prefiltered down its mip chain
+uniform samplerCube env;
 uniform sampler2D normal_map;
 
-uniform mat3 M_inv;
-uniform mat4 V_inv;
 void main()
 {
     //calculate normal in world coordinates
-    vec3 lightPosition = vec3(1,1,1);
-    vec3 viewPosition = vec3(V_inv * vec4(0.0, 0.0, 0.0, 1.0));
-    vec3 viewDirection = normalize(viewPosition - vertex_world);
-    vec3 normal_tangentspace =  normalize(texture(normal_map, Texcoord).rgb*2.0 - 1.0);
-    vec3 normal_modelspace = normalize(TBN * normal_tangentspace);
-    vec3 normal = normalize(transpose(M_inv) * normal_modelspace);
-
-    //calculate the location of this fragment (pixel) in world coordinates
-    vec3 surfaceToLight = normalize(lightPosition - vertex_world);
-
-    vec4 diffuseReflection = max(dot(surfaceToLight, normal),0.0) * vec4(0.7, 0.7, 0.7, 0.7);
-    vec4 ambientReflection = vec4(0.4, 0.4, 0.4, 0.4);
-    vec4 specularReflection;
-    if (dot(normal, surfaceToLight) < 0.0) // light source on the wrong side?
-    {
-        specularReflection = vec4(0.0, 0.0, 0.0, 0.0); // no specular reflection
-    }
-    else // light source on the right side
-    {
-        specularReflection = vec4(1, 1, 1, 1) * pow(max(0.0, dot(reflect(-surfaceToLight, normal), viewDirection)), 0.8);
-    }
-
-    vec4 color = ambientReflection + diffuseReflection + specularReflection;
-    vec4 reflection = texture(env, vec2(normal.x/2 + 0.5, 1 - ((normal.y)/2 + 0.5)));
+#ifdef NORMAL_MAP
+    // BC5 normal map : only x and y are stored
+    vec2 normal_xy = texture(normal_map, Texcoord).rg*2.0 - 1.0;
+    vec3 normal_tangentspace = vec3(normal_xy, sqrt(max(0.0, 1.0 - dot(normal_xy, normal_xy))));
+    vec3 normal = normalize(TBN * normal_tangentspace);
+#else
+    vec3 normal = normalize(TBN[2]);
+#endif
+
+    vec4 color = phong(normal, vertex_world);
+#ifdef CLUSTERED_LIGHTS
+    color.rgb += clustered_lights(normal, vertex_world);
+#endif
+#ifdef ENVIRONMENT_MAP
+    vec3 viewDirection = normalize(camera.view_position - vertex_world);
+    vec4 reflection = texture(env, reflect(-viewDirection, normal), material.reflection_blur);
+#else
+    vec4 reflection = vec4(1.0);
+#endif
     outColor = texture(surface, Texcoord) * reflection * color;
 
 }
@@ -11,18 +11,54 @@
 #include <string>
 #include <vector>
 #include <stdio.h>
+#include <string.h>
 #include <ctime>
+#include <chrono>
 #include <cmath>
+#include <algorithm>
 #include "soil.h"
-#include "shader.h"
+#include "shader.hpp"
+#include "vertexcache.hpp"
+#include "meshlet.hpp"
+#include "tangentspace.hpp"
+#include "simplify.hpp"
+#include "parallel.hpp"
+#include "bvh.hpp"
+#include "aabbtree.hpp"
+#include "blockcompress.hpp"
+#include "normalmap.hpp"
+#include "textureloader.hpp"
+#include "mappedfile.hpp"
+#include "texturestream.hpp"
+#include "residency.hpp"
+#include "uniformbuffer.hpp"
+#include "glstate.hpp"
+#include "envprobe.hpp"
+#include "clusteredlights.hpp"
 
 #define PI 3.14159265
 
 static int nFPS = 30;
 static float fAspect = 1;
 static bool pause = false;
+static bool culling = true;
+static bool lod = true;
+static bool normalMapping = true;
+static bool environmentMapping = true;
+static bool depthPrepass = false;
+// the GPU time of the scene passes is printed once D has been pressed, even for the single teapot
+static bool depthPrepassToggled = false;
+
+// the #defines of the shader variants, one bit each
+static const char* featureNames[] = { "NORMAL_MAP", "ENVIRONMENT_MAP", "CLUSTERED_LIGHTS" };
+static const unsigned int FEATURE_NORMAL_MAP = 1;
+static const unsigned int FEATURE_ENVIRONMENT_MAP = 2;
+static const unsigned int FEATURE_CLUSTERED_LIGHTS = 4;
+static bool pickRequested = false;
+static double pickX, pickY;
 static glm::mat4 viewMat;
 static glm::mat4 modelMat;
+static ResidencyManager residency;
 
 // error callback function
 static void error_callback(int error, const char* description)
@@ -72,16 +108,275 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
             if (action == GLFW_REPEAT || action == GLFW_PRESS)
                 pause = !pause;
             break;
+        case GLFW_KEY_C:
+            if (action == GLFW_PRESS)
+                culling = !culling;
+            break;
+        case GLFW_KEY_L:
+            if (action == GLFW_PRESS)
+                lod = !lod;
+            break;
+        case GLFW_KEY_N:
+            if (action == GLFW_PRESS)
+                normalMapping = !normalMapping;
+            break;
+        case GLFW_KEY_E:
+            if (action == GLFW_PRESS)
+                environmentMapping = !environmentMapping;
+            break;
+        case GLFW_KEY_D:
+            if (action == GLFW_PRESS)
+            {
+                depthPrepass = !depthPrepass;
+                depthPrepassToggled = true;
+                printf("depth pre-pass %s\n", depthPrepass ? "on" : "off");
+            }
+            break;
+    }
+}
+
+// mouse click callback function, the pick happens in the next frame
+static void mouse_button_callback(GLFWwindow* window, int button, int action, int mods)
+{
+    if (button == GLFW_MOUSE_BUTTON_LEFT && action == GLFW_PRESS)
+    {
+        glfwGetCursorPos(window, &pickX, &pickY);
+        pickRequested = true;
+    }
+}
+
+// whether the ray comes closer than radius to center
+static bool ray_hits_sphere(const Ray &ray, const glm::vec3 &center, float radius)
+{
+    glm::vec3 toCenter = center - ray.origin;
+    float along = glm::dot(toCenter, ray.direction) / glm::dot(ray.direction, ray.direction);
+    glm::vec3 closest = ray.origin + ray.direction * glm::max(along, 0.0f);
+    return glm::length(center - closest) <= radius;
+}
+
+// per-instance vertex attributes, read by vertex_shader.vert
+struct Instance
+{
+    glm::mat4 model;
+    glm::mat3 normal;   // inverse transpose of the model matrix, for the tangent frame
+};
+
+// point the per-instance attributes at the instances from first on
+static void set_instance_attributes(GLuint modelAttrib, GLuint normalAttrib, size_t first)
+{
+    size_t offset = first * sizeof(Instance);
+    for (int i = 0; i < 4; i++)
+        glVertexAttribPointer(modelAttrib + i, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offset + i*sizeof(glm::vec4)));
+    for (int i = 0; i < 3; i++)
+        glVertexAttribPointer(normalAttrib + i, 3, GL_FLOAT, GL_FALSE, sizeof(Instance), (void*)(offset + sizeof(glm::mat4) + i*sizeof(glm::vec3)));
+}
+
+// lay the teapots of the stress scene on a square grid, each turned its own way
+static void make_scene(int count, std::vector<glm::vec3> &positions, std::vector<float> &phases)
+{
+    int side = (int)ceil(sqrt((double)count));
+    float spacing = 0.6f;
+    positions.resize(count);
+    phases.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        positions[i] = glm::vec3((i % side - side / 2) * spacing, 0.0f, (i / side - side / 2) * spacing);
+        phases[i] = (i * 37) % 360;
+    }
+}
+
+// small lights circling the teapots : a ring around the single one,
+// or scattered over the stress scene, one in four a spot looking down
+struct Lamp
+{
+    glm::vec3 anchor;
+    float orbit, phase;
+};
+
+static void make_lamps(const std::vector<glm::vec3> &positions, std::vector<Lamp> &lamps, std::vector<ClusteredLight> &lights)
+{
+    int count = positions.size() > 1 ? std::min((int)positions.size() / 4 + 8, 8192) : 8;
+    glm::vec3 lo = positions[0], hi = positions[0];
+    for (size_t i = 1; i < positions.size(); i++)
+    {
+        lo = glm::min(lo, positions[i]);
+        hi = glm::max(hi, positions[i]);
+    }
+    srand(11);
+    lamps.resize(count);
+    lights.resize(count);
+    for (int i = 0; i < count; i++)
+    {
+        float hue = 6.0f * rand() / (float)RAND_MAX;
+        ClusteredLight &light = lights[i];
+        light.color = glm::clamp(glm::vec3(fabsf(hue - 3.0f) - 1.0f, 2.0f - fabsf(hue - 2.0f), 2.0f - fabsf(hue - 4.0f)), 0.0f, 1.0f);
+        light.direction = glm::vec3(0.0f, -1.0f, 0.0f);
+        light.radius = 0.5f;
+        light.spot_cos_outer = CLUSTER_POINT_LIGHT;
+        light.spot_cos_inner = 1.0f;
+        if (positions.size() == 1)
+        {
+            lamps[i].anchor = glm::vec3(0.0f, 0.1f + 0.25f * (i % 2), 0.0f);
+            lamps[i].orbit = 0.35f;
+            lamps[i].phase = 6.2831853f * i / count;
+            continue;
+        }
+        float u = rand() / (float)RAND_MAX, v = rand() / (float)RAND_MAX;
+        lamps[i].anchor = glm::vec3(lo.x + u * (hi.x - lo.x), 0.1f + 0.3f * rand() / (float)RAND_MAX, lo.z + v * (hi.z - lo.z));
+        lamps[i].orbit = 0.1f + 0.2f * rand() / (float)RAND_MAX;
+        lamps[i].phase = 6.2831853f * rand() / (float)RAND_MAX;
+        if (i % 4 == 0)
+        {
+            light.radius = 0.8f;
+            light.spot_cos_outer = cosf(35.0f * PI / 180.0f);
+            light.spot_cos_inner = cosf(20.0f * PI / 180.0f);
+        }
+    }
+}
+
+// milliseconds since start
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// frustum test of every box, what culling costs without a tree
+static void cull_brute_force(const glm::mat4 &VP, const std::vector<glm::vec3> &lo, const std::vector<glm::vec3> &hi,
+                             std::vector<unsigned int> &visible)
+{
+    float planes[6][4];
+    for (int p = 0; p < 6; p++)
+        for (int c = 0; c < 4; c++)
+            planes[p][c] = VP[c][3] + (p % 2 == 0 ? 1.0f : -1.0f) * VP[c][p / 2];
+    visible.clear();
+    for (size_t i = 0; i < lo.size(); i++)
+    {
+        glm::vec3 center = (lo[i] + hi[i]) * 0.5f;
+        glm::vec3 extent = (hi[i] - lo[i]) * 0.5f;
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; p++)
+        {
+            float d = center.x * planes[p][0] + center.y * planes[p][1] + center.z * planes[p][2] + planes[p][3];
+            float r = extent.x * fabs(planes[p][0]) + extent.y * fabs(planes[p][1]) + extent.z * fabs(planes[p][2]);
+            outside = d + r < 0.0f;
+        }
+        if (!outside)
+            visible.push_back(i);
     }
 }
 
-// make buffers for different targets
+// "mp3 bench" : the AABB tree against brute force culling, with 10% of the objects moving every frame
+static void run_culling_benchmark()
+{
+    const int frames = 50;
+    int counts[3] = {1000, 10000, 100000};
+    srand(1);
+    for (int c = 0; c < 3; c++)
+    {
+        int count = counts[c];
+        // keep the density the same, about 1 object in 10 visible
+        float side = 4.0f * cbrt((float)count);
+        std::vector<glm::vec3> lo(count), hi(count);
+        for (int i = 0; i < count; i++)
+        {
+            glm::vec3 center = (glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX - 0.5f) * side;
+            glm::vec3 extent = glm::vec3(0.2f + rand() / (float)RAND_MAX);
+            lo[i] = center - extent;
+            hi[i] = center + extent;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        AABBTree tree;
+        std::vector<int> proxies(count);
+        for (int i = 0; i < count; i++)
+            proxies[i] = tree.insert(lo[i], hi[i], i);
+        double buildTime = elapsed_ms(start);
+
+        double treeTime = 0, bruteTime = 0, moveTime = 0;
+        size_t visibleTotal = 0;
+        int mismatches = 0;
+        std::vector<unsigned int> treeVisible, bruteVisible;
+        for (int f = 0; f < frames; f++)
+        {
+            // objects drifting around
+            start = std::chrono::steady_clock::now();
+            for (int k = 0; k < count / 10; k++)
+            {
+                int i = rand() % count;
+                glm::vec3 step = (glm::vec3(rand(), rand(), rand()) / (float)RAND_MAX - 0.5f) * 0.5f;
+                lo[i] += step;
+                hi[i] += step;
+                tree.move(proxies[i], lo[i], hi[i]);
+            }
+            moveTime += elapsed_ms(start);
+
+            // a camera turning around the middle of the cloud
+            glm::mat4 VP = glm::perspective(60.0f, 1.0f, 0.1f, side * 0.5f)
+                         * glm::rotate(glm::mat4(1.0f), f * 360.0f / frames, glm::vec3(0, 1, 0));
+
+            start = std::chrono::steady_clock::now();
+            tree.queryFrustum(VP, treeVisible);
+            treeTime += elapsed_ms(start);
+
+            start = std::chrono::steady_clock::now();
+            cull_brute_force(VP, lo, hi, bruteVisible);
+            bruteTime += elapsed_ms(start);
+
+            visibleTotal += treeVisible.size();
+            if (treeVisible != bruteVisible)
+                mismatches++;
+        }
+        printf("%6d objects: build %.2f ms, height %d, %d visible per frame\n",
+               count, buildTime, tree.height(), (int)(visibleTotal / frames));
+        printf("        tree %.3f ms, brute force %.3f ms, moves %.3f ms per frame, %d mismatching frames\n",
+               treeTime / frames, bruteTime / frames, moveTime / frames, mismatches);
+    }
+}
+
+// the shader variant for the current toggles, the camera's view always has the clustered lights,
+// the probe faces don't as the clusters are the camera's
+static unsigned int shader_features()
+{
+    return (normalMapping ? FEATURE_NORMAL_MAP : 0) | (environmentMapping ? FEATURE_ENVIRONMENT_MAP : 0)
+         | FEATURE_CLUSTERED_LIGHTS;
+}
+
+// switch to another variant : its samplers and uniform blocks
+static void use_program(GLuint program)
+{
+    glState.useProgram(program);
+    glState.uniform1i(glGetUniformLocation(program, "surface"), 0);
+    glState.uniform1i(glGetUniformLocation(program, "env"), 1);
+    glState.uniform1i(glGetUniformLocation(program, "normal_map"), 2);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_light_data"), 3);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_ranges"), 4);
+    glState.uniform1i(glGetUniformLocation(program, "cluster_light_indices"), 5);
+    bindUniformBlocks(program);
+}
+
+// the .dds cache streams in level by level, the first run, or the first after the image
+// changed, decodes the image and writes it.
+// With a bump strength the image is a height map, turned into a BC5 normal map
+static GLuint load_texture(TextureStreamer &streamer, TextureLoader &loader, const char *path,
+                           const unsigned char placeholder[3], BlockFormat format, float bumpStrength = 0.0f)
+{
+    // an image edited since its cache was written is compressed again
+    if (!TextureLoader::cacheStale(path, bumpStrength))
+    {
+        std::string cache = TextureLoader::cachePath(path, bumpStrength);
+        GLuint texture = streamer.load(cache.c_str());
+        if (texture)
+            return texture;
+    }
+    if (bumpStrength > 0.0f)
+        return loader.loadHeightMap(path, placeholder, bumpStrength);
+    return loader.load(path, placeholder, format);
+}
+
+// make buffers for different targets,
+// accounted by the residency manager, the data has to outlive the buffer
 static GLuint make_buffer(GLenum target, const void* buffer_data, GLsizei buffer_size) {
-    GLuint buffer;
-    glGenBuffers(1, &buffer);
-    glBindBuffer(target, buffer);
-    glBufferData(target, buffer_size, buffer_data, GL_STATIC_DRAW);
-    return buffer;
+    return residency.makeBuffer(target, buffer_data, buffer_size);
 }
 
 // load the obj file
@@ -122,8 +417,24 @@ void load_obj(const char* filename, std::vector<glm::vec3> &vertices, std::vecto
 
 
 
-int main(void)
+int main(int argc, char** argv)
 {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        run_culling_benchmark();
+        return 0;
+    }
+
+    // more than one teapot switches to the instanced stress scene
+    int instanceCount = 1;
+    if (argc > 1)
+        instanceCount = atoi(argv[1]);
+    if (instanceCount < 1)
+        instanceCount = 1;
+    // then the GPU memory budget in MB
+    if (argc > 2)
+        residency.setBudget((size_t)atoi(argv[2]) << 20);
+
     GLFWwindow* window;
     glfwSetErrorCallback(error_callback);
 
@@ -145,6 +456,7 @@ int main(void)
     // Set the context to be the created window
     glfwMakeContextCurrent(window);
     glfwSetKeyCallback(window, key_callback);
+    glfwSetMouseButtonCallback(window, mouse_button_callback);
 
     // Initialize GLEW
     glewExperimental = true; // Needed for core profile
@@ -158,24 +470,56 @@ int main(void)
     std::vector<glm::vec3> vertices;
     std::vector<unsigned int> indices;
     load_obj("teapot_0.obj", vertices, indices);
-    glm::vec3 *normals = new glm::vec3[vertices.size()];
 
-    // initialization
-    for (int i = 0; i != vertices.size(); i++)
-        normals[i] = glm::vec3(0);
-    // calculate the normals
-    for (int i = 0; i != indices.size(); i += 3)
+    // prepare for element buffer
+    std::vector<GLuint> faces(indices.size());
+    for (std::vector<unsigned int>::size_type i = 0; i != indices.size(); i++)
+    {
+        faces[i] = indices[i] - 1;
+    }
+
+    // reorder the triangles for the post-transform cache
+    VertexCacheStatistics cacheBefore = analyzeVertexCache(&faces[0], faces.size(), vertices.size());
+    optimizeVertexCache(&faces[0], faces.size(), vertices.size());
+    // split into meshlets that can be culled on their own
+    std::vector<Meshlet> meshlets;
+    buildMeshlets(&faces[0], faces.size(), vertices, meshlets, MESHLET_MAX_VERTICES, 32);
+    MeshletCuller culler;
+    culler.init(meshlets);
+    // then renumber the vertices in fetch order
+    std::vector<unsigned int> remap;
+    optimizeVertexFetch(&faces[0], faces.size(), vertices.size(), remap);
+    remapVertexBuffer(&vertices[0], vertices.size(), sizeof(glm::vec3), remap);
+    VertexCacheStatistics cacheAfter = analyzeVertexCache(&faces[0], faces.size(), vertices.size());
+    printf("teapot vertex cache: ACMR %.3f -> %.3f, ATVR %.3f -> %.3f\n",
+           cacheBefore.acmr, cacheAfter.acmr, cacheBefore.atvr, cacheAfter.atvr);
+    printf("teapot meshlets: %d\n", (int)meshlets.size());
+
+    // coarser levels of detail, drawn from the same vertex buffer
+    std::vector<GLuint> lodFaces;
+    std::vector<MeshLod> lods;
+    buildLodChain(&faces[0], faces.size(), vertices, 4, lodFaces, lods);
+    for (std::vector<MeshLod>::size_type i = 0; i != lods.size(); i++)
+        printf("teapot lod %d: %d triangles, error %f\n", (int)i, (int)lods[i].index_count / 3, lods[i].error);
+
+    // bounding sphere for the level selection
+    glm::vec3 lo = vertices[0], hi = vertices[0];
+    for (std::vector<glm::vec3>::iterator iter = vertices.begin(); iter != vertices.end(); iter++)
     {
-        glm::vec3 a = vertices[indices[i] - 1];
-        glm::vec3 b = vertices[indices[i + 1] - 1];
-        glm::vec3 c = vertices[indices[i + 2] - 1];
-        glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
-        normals[indices[i] - 1] += normal;
-        normals[indices[i + 1] - 1] += normal;
-        normals[indices[i + 2] - 1] += normal;
+        lo = glm::min(lo, *iter);
+        hi = glm::max(hi, *iter);
     }
-    for (int i = 0; i != vertices.size(); i++)
-        normals[i] = glm::normalize(normals[i]);
+    glm::vec3 teapotCenter = (lo + hi) * 0.5f;
+    float teapotRadius = glm::length(hi - lo) * 0.5f;
+
+    // triangle hierarchy for picking
+    TriangleBVH teapotBVH;
+    teapotBVH.build(vertices, faces);
+    printf("teapot bvh: %d nodes\n", (int)teapotBVH.nodeCount());
+
+    // calculate the normals
+    std::vector<glm::vec3> normals;
+    computeVertexNormals(faces, vertices, NORMAL_WEIGHT_ANGLE, normals);
 
     // get the maximum y value
     GLfloat max_y = 0;
@@ -184,7 +528,20 @@ int main(void)
         if (iter->y > max_y)
             max_y = iter->y;
     }
-    GLfloat *verts = new GLfloat[vertices.size()*8];
+    // cylindrical texture coordinates
+    std::vector<glm::vec2> uvs(vertices.size());
+    for (std::vector<glm::vec3>::size_type i = 0; i != vertices.size(); i++)
+    {
+        uvs[i].x = atan2(vertices[i].z, vertices[i].x) / (2* PI) + 0.5;
+        uvs[i].y = vertices[i].y / max_y;
+    }
+
+    // normal mapping
+    std::vector<glm::vec3> tangents;
+    std::vector<glm::vec3> bitangents;
+    computeTangentBasisIndexed(faces, vertices, uvs, normals, tangents, bitangents);
+
+    std::vector<GLfloat> verts(vertices.size()*8);
     // create vbo buffer data
     for (std::vector<glm::vec3>::size_type i = 0; i != vertices.size(); i++)
     {
@@ -195,79 +552,25 @@ int main(void)
         verts[index + 3] = normals[i].x;
         verts[index + 4] = normals[i].y;
         verts[index + 5] = normals[i].z;
-        verts[index + 6] = atan2(vertices[i].z, vertices[i].x) / (2* PI) + 0.5;
-        verts[index + 7] = vertices[i].y / max_y;
+        verts[index + 6] = uvs[i].x;
+        verts[index + 7] = uvs[i].y;
     }
-    delete normals;
 
-    // prepare for element buffer
-    GLuint *faces = new GLuint[indices.size()];
-    for (std::vector<glm::vec3>::size_type i = 0; i != indices.size(); i++)
-    {
-        faces[i] = indices[i] - 1;
-    }
-
-    // normal mapping
-    glm::vec3 *tangents = new glm::vec3[vertices.size()];
-    glm::vec3 *bitangents = new glm::vec3[vertices.size()];
-    for (int i = 0; i != vertices.size(); i++)
-        tangents[i] = bitangents[i] = glm::vec3(0);
-    for (int i = 0; i != indices.size(); i+=3)
-    {
-        // Shortcuts for vertices
-        glm::vec3 & v0 = vertices[faces[i]];
-        glm::vec3 & v1 = vertices[faces[i+1]];
-        glm::vec3 & v2 = vertices[faces[i+2]];
-
-        // Shortcuts for UVs
-        glm::vec2 uv0 = glm::vec2(verts[faces[i]*8 + 6], verts[faces[i]*8 + 7]);
-        glm::vec2 uv1 = glm::vec2(verts[faces[i+1]*8 + 6], verts[faces[i+1]*8 + 7]);
-        glm::vec2 uv2 = glm::vec2(verts[faces[i+2]*8 + 6], verts[faces[i+2]*8 + 7]);
-
-        // Edges of the triangle : postion delta
-        glm::vec3 deltaPos1 = v1-v0;
-        glm::vec3 deltaPos2 = v2-v0;
-
-        // UV delta
-        glm::vec2 deltaUV1 = uv1-uv0;
-        glm::vec2 deltaUV2 = uv2-uv0;
-
-        float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-        glm::vec3 tangent = (deltaPos1 * deltaUV2.y   - deltaPos2 * deltaUV1.y)*r;
-        glm::vec3 bitangent = (deltaPos2 * deltaUV1.x   - deltaPos1 * deltaUV2.x)*r;
-
-        tangents[faces[i]] += tangent;
-        bitangents[faces[i]] += bitangent;
-    }
-
-    //GLfloat *tangent_buffer = new GLfloat[vertices.size() * 3];
-    //GLfloat *bitangent_buffer = new GLfloat[vertices.size() * 3];
-    for (int i = 0; i != vertices.size(); i++ )
-    {
-        tangents[i] = glm::normalize(tangents[i]);
-        bitangents[i] = glm::normalize(bitangents[i]);
-        //tangent_buffer[3*i] = t.x;
-        //tangent_buffer[3*i + 1] = t.y;
-        //tangent_buffer[3*i + 2] = t.z;
-        //bitangent_buffer[3*i] = b.x;
-        //bitangent_buffer[3*i + 1] = b.y;
-        //bitangent_buffer[3*i + 2] = b.z;
-    }
-
-    // compile the shader program
-    GLuint shaderProgram = LoadShaders("vertex_shader.vert", "fragment_shader.frag");
-    glUseProgram(shaderProgram);
+    // submit every variant up front, the driver links them in parallel while
+    // the one with every feature is waited for
+    ShaderVariants shaders("vertex_shader.vert", "fragment_shader.frag", featureNames, 3);
+    shaders.prepareAll();
+    GLuint shaderProgram = shaders.program(shader_features());
 
 
 
     // Store the vertex array object which stores the attributes mapping
     GLuint vao;
     glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
+    glState.bindVertexArray(vao);
 
     // Get the position attribute and enable
-    GLuint vbo = make_buffer(GL_ARRAY_BUFFER, verts, 8*vertices.size()*sizeof(GLfloat));
-    delete verts;
+    GLuint vbo = make_buffer(GL_ARRAY_BUFFER, &verts[0], 8*vertices.size()*sizeof(GLfloat));
     GLuint posAttrib = glGetAttribLocation(shaderProgram, "position");
     GLuint normAttrib = glGetAttribLocation(shaderProgram, "norm");
     GLuint texAttrib = glGetAttribLocation(shaderProgram, "texcoord");
@@ -278,95 +581,264 @@ int main(void)
     glVertexAttribPointer(normAttrib, 3, GL_FLOAT, GL_FALSE, 8*sizeof(GLfloat), (void*)(3*sizeof(GLfloat)));
     glVertexAttribPointer(texAttrib, 2, GL_FLOAT, GL_FALSE, 8*sizeof(GLfloat), (void*)(6*sizeof(GLfloat)));
 
-    GLuint tangent_buffer = make_buffer(GL_ARRAY_BUFFER, tangents, vertices.size() * sizeof(glm::vec3));
+    GLuint tangent_buffer = make_buffer(GL_ARRAY_BUFFER, &tangents[0], vertices.size() * sizeof(glm::vec3));
     GLuint tangentAttrib = glGetAttribLocation(shaderProgram, "tangent");
     glEnableVertexAttribArray(tangentAttrib);
     glVertexAttribPointer(tangentAttrib, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-    GLuint bitangent_buffer = make_buffer(GL_ARRAY_BUFFER, bitangents, vertices.size() * sizeof(glm::vec3));
+    GLuint bitangent_buffer = make_buffer(GL_ARRAY_BUFFER, &bitangents[0], vertices.size() * sizeof(glm::vec3));
     GLuint bitangentAttrib = glGetAttribLocation(shaderProgram, "bitangent");
     glEnableVertexAttribArray(bitangentAttrib);
     glVertexAttribPointer(bitangentAttrib, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
+    // the instance buffer, refilled every frame
+    GLuint instance_buffer = make_buffer(GL_ARRAY_BUFFER, NULL, instanceCount * sizeof(Instance));
+    GLuint modelAttrib = glGetAttribLocation(shaderProgram, "instance_model");
+    GLuint normalMatAttrib = glGetAttribLocation(shaderProgram, "instance_normal");
+    for (int i = 0; i < 4; i++)
+    {
+        glEnableVertexAttribArray(modelAttrib + i);
+        glVertexAttribDivisor(modelAttrib + i, 1);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        glEnableVertexAttribArray(normalMatAttrib + i);
+        glVertexAttribDivisor(normalMatAttrib + i, 1);
+    }
+
     // Set the element buffer
-    GLuint veo = make_buffer(GL_ELEMENT_ARRAY_BUFFER, faces, indices.size()*sizeof(GLuint));
-    delete faces;
-
-    // Load texture
-    GLuint tex[3];
-    glGenTextures(3, tex);
-
-    int width, height;
-    unsigned char* image;
-
-    // load the textures
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex[0]);
-    image = SOIL_load_image("qinghua.jpg", &width, &height, 0, SOIL_LOAD_RGB);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    SOIL_free_image_data(image);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glUniform1i(glGetUniformLocation(shaderProgram, "surface"), 0);
-
-    // the texture from environment mapping
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, tex[1]);
-    image = SOIL_load_image("sphere.jpg", &width, &height, 0, SOIL_LOAD_RGB);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    SOIL_free_image_data(image);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glUniform1i(glGetUniformLocation(shaderProgram, "env"), 1);
-
-    // normal mapping texture
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, tex[2]);
-    image = SOIL_load_image("normal.jpg", &width, &height, 0, SOIL_LOAD_RGB);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-    SOIL_free_image_data(image);
-    glGenerateMipmap(GL_TEXTURE_2D);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glUniform1i(glGetUniformLocation(shaderProgram, "normal_map"), 2);
+    GLuint veo = make_buffer(GL_ELEMENT_ARRAY_BUFFER, &lodFaces[0], lodFaces.size()*sizeof(GLuint));
+    // evicted, it keeps the coarsest level rather than nothing
+    residency.setFallback(veo, lods.back().index_offset*sizeof(GLuint), lods.back().index_count*sizeof(GLuint));
+
+    // Load textures : block compressed, streamed from the .dds caches next to the images,
+    // or decoded on worker threads with placeholders until they arrive on the first run
+    TextureLoader textureLoader;
+    TextureStreamer textureStreamer;
+    const unsigned char white[3] = {255, 255, 255};
+    const unsigned char flatNormal[3] = {128, 128, 255};
+    // the surface on unit 0 and the normal map on unit 2, the environment probe takes unit 1
+    // and draws the sphere map from its background unit behind what it captures
+    const int textureCount = 3;
+    const GLuint textureUnits[textureCount] = {0, 2, ENV_PROBE_BACKGROUND_UNIT};
+    GLuint tex[textureCount];
+    tex[0] = load_texture(textureStreamer, textureLoader, "qinghua.jpg", white, BLOCK_BC1);
+    // normal mapping texture from the bump map, x and y only, z is rebuilt in the fragment shader
+    tex[1] = load_texture(textureStreamer, textureLoader, "bump.jpg", flatNormal, BLOCK_BC5, NORMAL_MAP_STRENGTH);
+    tex[2] = load_texture(textureStreamer, textureLoader, "sphere.jpg", white, BLOCK_BC1);
+    for (int i = 0; i < textureCount; i++)
+        glState.bindTexture(textureUnits[i], GL_TEXTURE_2D, tex[i]);
+    // the streamed textures give up their finest levels when over the memory budget
+    for (int i = 0; i < textureCount; i++)
+    {
+        GLuint texture = tex[i];
+        if (textureStreamer.residentLevel(texture) >= 0)
+            residency.trackTexture(texture, [&textureStreamer, texture](int droppedLevels) {
+                return textureStreamer.limit(texture, droppedLevels);
+            });
+    }
+    size_t texturesWaiting = textureCount;
 
     // Projection matrix : 90° Field of View, 1:1 ratio, display range : 0.01 unit <-> 10 units
     glm::vec3 upVector = glm::vec3(0, 1, 0);
-    glm::mat4 projMat = glm::perspective(90.0f, fAspect, 0.01f, 10.0f);
+    GLfloat fov = 90.0f;
+    GLfloat farPlane = instanceCount > 1 ? 100.0f : 10.0f;
+    glm::mat4 projMat = glm::perspective(fov, fAspect, 0.01f, farPlane);
     viewMat = glm::lookAt(glm::vec3(0.0, 0.5,1),
                                     glm::vec3(0.0, 0.3, 0.0),
                                     upVector);
     // Camera matrix
-    modelMat = glm::scale(glm::mat4(1.0f),glm::vec3(0.2f));
+    GLfloat teapotScale = 0.2f;
+    modelMat = glm::scale(glm::mat4(1.0f),glm::vec3(teapotScale));
+
+    // camera, light and material in one uniform buffer, only the camera changes per frame
+    UniformBuffer uniformBuffer;
+    size_t cameraOffset = uniformBuffer.add(sizeof(CameraBlock));
+    size_t probeCameraOffset = uniformBuffer.add(sizeof(CameraBlock));
+    size_t lightOffset = uniformBuffer.add(sizeof(LightBlock));
+    size_t materialOffset = uniformBuffer.add(sizeof(MaterialBlock));
+    glm::vec4 whiteLight = glm::vec4(1.0f);
+    LightBlock light = pointLight(glm::vec3(1.0f, 1.0f, 1.0f));
+    MaterialBlock material = litMaterial(glm::vec4(0.4f), glm::vec4(0.7f), glm::vec4(1.0f), 0.8f, whiteLight, whiteLight, whiteLight);
+    // glazed porcelain, a slightly blurred reflection
+    material.reflection_blur = 1.5f;
+    uniformBuffer.set(lightOffset, &light, sizeof(light));
+    uniformBuffer.set(materialOffset, &material, sizeof(material));
+    uniformBuffer.create();
+    uniformBuffer.bind(UNIFORM_BINDING_CAMERA, cameraOffset, sizeof(CameraBlock));
+    uniformBuffer.bind(UNIFORM_BINDING_LIGHT, lightOffset, sizeof(LightBlock));
+    uniformBuffer.bind(UNIFORM_BINDING_MATERIAL, materialOffset, sizeof(MaterialBlock));
+    use_program(shaderProgram);
+
+    // the teapots, a single one at the origin by default
+    std::vector<glm::vec3> scenePositions;
+    std::vector<float> scenePhases;
+    make_scene(instanceCount, scenePositions, scenePhases);
+    std::vector<Instance> instances(instanceCount);
+    std::vector<Instance> sortedInstances(instanceCount);
+    std::vector<unsigned char> instanceLevels(instanceCount);
+    if (instanceCount > 1)
+        printf("stress scene: %d teapots\n", instanceCount);
+    // the crowded scene hides most of what it rasterizes, a single teapot hardly any
+    depthPrepass = instanceCount > 1;
+
+    // the lamps, binned into clusters of the camera's frustum every frame
+    std::vector<Lamp> lamps;
+    std::vector<ClusteredLight> lights;
+    make_lamps(scenePositions, lamps, lights);
+    ClusteredLights clusters;
+    clusters.create();
+    if (instanceCount > 1)
+        printf("stress scene: %d lamps\n", (int)lights.size());
+
+    // the depth pre-pass program : position only, no fragment work
+    GLuint depthProgram = LoadShaders("depth_only.vert", "depth_only.frag");
+    bindUniformBlocks(depthProgram);
 
-    // Get all the uniform identifier in our shader program
-    GLuint MVPUniform = glGetUniformLocation(shaderProgram, "MVP");
-    GLuint M_invUniform = glGetUniformLocation(shaderProgram, "M_inv");
-    GLuint V_invUniform = glGetUniformLocation(shaderProgram, "V_inv");
-    GLuint MUniform = glGetUniformLocation(shaderProgram, "M");
+    // the teapots only turn in place, a box around the sphere they sweep holds them for good
+    AABBTree sceneTree;
+    float sweptRadius = (glm::length(teapotCenter) + teapotRadius) * teapotScale;
+    for (int i = 0; i < instanceCount; i++)
+        sceneTree.insert(scenePositions[i] - glm::vec3(sweptRadius), scenePositions[i] + glm::vec3(sweptRadius), i);
+    std::vector<unsigned int> visibleInstances;
 
     GLfloat fRotateAngle = 1.0f;
     clock_t startClock=0,curClock;
     float time = 0;
+    std::vector<GLsizei> drawCounts;
+    std::vector<const void*> drawOffsets;
+    unsigned int level = 0;
+    size_t levelCount[LOD_MAX_LEVELS];
+    size_t levelFirst[LOD_MAX_LEVELS];
+    double statsStart = glfwGetTime();
+    int statsFrames = 0;
+    // GPU time of the scene passes, each query read back a frame later so nothing waits
+    GLuint sceneQueries[2];
+    int sceneFrame = 0;
+    glGenQueries(2, sceneQueries);
+    bool sceneQueryIssued[2] = {false, false};
+    double sceneGpuMs = 0.0;
+    int sceneGpuFrames = 0;
+    bool statsPrepass = depthPrepass;
 
     // configurations
     glEnable(GL_DEPTH_TEST);
     glDepthFunc(GL_LESS);
     glClearColor(1.0, 1.0, 1.0, 0.0);	// sky
 
+    // live reflections : a cube map around the middle of the single teapot, or of the
+    // crowd, one face rendered per frame with the plain variant of the program over the
+    // sphere map, then prefiltered for the blur. The teapots around the probe don't draw
+    // into it, they would only show their own insides
+    EnvironmentProbe probe;
+    glm::vec3 sceneLo = scenePositions[0], sceneHi = scenePositions[0];
+    for (int i = 1; i < instanceCount; i++)
+    {
+        sceneLo = glm::min(sceneLo, scenePositions[i]);
+        sceneHi = glm::max(sceneHi, scenePositions[i]);
+    }
+    glm::vec3 sceneCenter = (sceneLo + sceneHi) * 0.5f + glm::vec3(0.0f, teapotCenter.y * teapotScale, 0.0f);
+    if (!probe.create("probe_prefilter.vert", "probe_prefilter.frag"))
+        environmentMapping = false;
+    else if (!probe.setBackground("probe_prefilter.vert", "probe_background.frag", tex[2]))
+        printf("no background for the environment probe, its faces show the sky color\n");
+    glState.bindTexture(1, GL_TEXTURE_CUBE_MAP, probe.texture());
+    GLuint probeProgram = 0;
+
+    // place the teapots seen through VP and pick their level of detail from the projected size of the error.
+    // With skipAround, the teapots whose bounds hold eye are left out
+    auto placeInstances = [&](const glm::mat4 &VP, const glm::vec3 &eye, float projScale, bool skipAround) -> int {
+        sceneTree.queryFrustum(VP, visibleInstances);
+        if (skipAround)
+            visibleInstances.erase(std::remove_if(visibleInstances.begin(), visibleInstances.end(),
+                                                  [&](unsigned int id) { return glm::length(scenePositions[id] - eye) < sweptRadius; }),
+                                   visibleInstances.end());
+        int count = visibleInstances.size();
+        parallelFor(count, 1024, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                unsigned int id = visibleInstances[i];
+                glm::mat4 model = glm::translate(glm::mat4(1.0f), scenePositions[id]) * modelMat
+                                * glm::rotate(glm::mat4(1.0f), scenePhases[id], upVector);
+                instances[i].model = model;
+                instances[i].normal = glm::transpose(glm::inverse(glm::mat3(model)));
+                glm::vec3 center = glm::vec3(model * glm::vec4(teapotCenter, 1.0f));
+                float distance = glm::length(eye - center) / teapotScale - teapotRadius;
+                instanceLevels[i] = lod ? selectLod(lods, distance, projScale) : 0;
+            }
+        });
+        return count;
+    };
+
+    // group the placed instances by level, so each level is a single instanced draw, and draw them.
+    // again repeats the draws of the pass before for another program : same instances, same meshlets.
+    // With the element buffer evicted down to the coarsest level, every teapot draws that one
+    auto drawInstances = [&](int count, const glm::mat4 &VP, const glm::vec3 &eye, bool meshletCulling, bool again) {
+        bool fallback = residency.onFallback(veo);
+        if (!again)
+        {
+            if (fallback)
+                for (int i = 0; i < count; i++)
+                    instanceLevels[i] = lods.size() - 1;
+            for (int l = 0; l < LOD_MAX_LEVELS; l++)
+                levelCount[l] = 0;
+            for (int i = 0; i < count; i++)
+                levelCount[instanceLevels[i]]++;
+            size_t first = 0;
+            for (int l = 0; l < LOD_MAX_LEVELS; l++)
+            {
+                levelFirst[l] = first;
+                first += levelCount[l];
+            }
+            for (int i = 0; i < count; i++)
+                sortedInstances[levelFirst[instanceLevels[i]]++] = instances[i];
+            for (int l = 0; l < LOD_MAX_LEVELS; l++)
+                levelFirst[l] -= levelCount[l];
+
+            // orphan the last pass's storage instead of waiting for the draws still reading it
+            glState.bindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+            glBufferData(GL_ARRAY_BUFFER, instanceCount * sizeof(Instance), NULL, GL_STREAM_DRAW);
+            if (count > 0)
+                glBufferSubData(GL_ARRAY_BUFFER, 0, count * sizeof(Instance), &sortedInstances[0]);
+        }
+
+        for (unsigned int l = 0; l < lods.size(); l++)
+        {
+            if (levelCount[l] == 0)
+                continue;
+            set_instance_attributes(modelAttrib, normalMatAttrib, levelFirst[l]);
+            if (l == 0 && meshletCulling)
+            {
+                // skip the meshlets facing away or outside the frustum
+                if (!again)
+                {
+                    glm::mat4 MVPMat = VP * instances[0].model;
+                    glm::vec3 eyeModel = glm::vec3(glm::inverse(instances[0].model) * glm::vec4(eye, 1.0f));
+                    culler.cull(MVPMat, eyeModel, drawCounts, drawOffsets);
+                }
+                if (!drawCounts.empty())
+                    glMultiDrawElements(GL_TRIANGLES, &drawCounts[0], GL_UNSIGNED_INT, (const GLvoid **)&drawOffsets[0], drawCounts.size());
+            }
+            else
+                glDrawElementsInstanced(GL_TRIANGLES, lods[l].index_count, GL_UNSIGNED_INT,
+                                        (void*)((fallback ? 0 : lods[l].index_offset)*sizeof(GLuint)), levelCount[l]);
+        }
+    };
+
     //rendering
+    bool firstFrame = true;
     while (!glfwWindowShouldClose(window)) {
         // Clear the color buffer
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        // swap the placeholders for the textures decoded since the last frame
+        if (texturesWaiting > 0)
+        {
+            texturesWaiting = textureLoader.update();
+            if (texturesWaiting == 0)
+                printf("textures ready after %.1f ms\n", 1000.0 * glfwGetTime());
+        }
+
         curClock=clock();
 
 	float elapsed=(curClock-startClock)/(float)CLOCKS_PER_SEC;
@@ -377,29 +849,242 @@ int main(void)
                     modelMat = glm::rotate(modelMat, 1.0f, upVector);
         }
 
-        // Our ModelViewProjection : multiplication of our 3 matrices
-        glm::mat4 MVPMat = projMat * viewMat * modelMat;
-        glUniformMatrix4fv(MVPUniform, 1, GL_FALSE, glm::value_ptr(MVPMat));
-        glm::mat3 inverseModel = glm::inverse(glm::mat3(modelMat));
-        glUniformMatrix3fv(M_invUniform, 1, GL_FALSE, glm::value_ptr(inverseModel));
-        glm::mat4 inverseView = glm::inverse(viewMat);
-        glUniformMatrix4fv(V_invUniform, 1, GL_FALSE, glm::value_ptr(inverseView));
-        glUniformMatrix4fv(MUniform, 1, GL_FALSE, glm::value_ptr(modelMat));
+        // N and E toggle features, each combination is its own program,
+        // the current one keeps drawing until the new one is linked
+        shaders.update();
+        GLuint program = shaders.ready(shader_features());
+        if (program && program != shaderProgram)
+        {
+            shaderProgram = program;
+            use_program(shaderProgram);
+        }
+
+        CameraBlock camera = cameraBlock(viewMat, projMat);
+        uniformBuffer.set(cameraOffset, &camera, sizeof(camera));
+        glm::mat4 VPMat = camera.view_projection;
+        glm::vec3 cameraWorld = glm::vec3(camera.view_position);
+        int winWidth, winHeight;
+        glfwGetFramebufferSize(window, &winWidth, &winHeight);
+
+        // everything this frame draws, the evicted buffers come back now
+        residency.touch(vbo);
+        residency.touch(tangent_buffer);
+        residency.touch(bitangent_buffer);
+        residency.touch(veo);
+        residency.touch(instance_buffer);
+        for (int i = 0; i < textureCount; i++)
+            residency.touch(tex[i], true);
+
+        // the probe face due this frame, seen from the middle of the reflecting teapots, without reflections of its own
+        GLuint readyProbeProgram = environmentMapping ? shaders.ready(0) : 0;
+        if (readyProbeProgram)
+        {
+            if (readyProbeProgram != probeProgram)
+            {
+                probeProgram = readyProbeProgram;
+                use_program(probeProgram);
+            }
+            glm::vec3 probeCenter = sceneCenter;
+            if (instanceCount == 1)
+                probeCenter = glm::vec3(glm::translate(glm::mat4(1.0f), scenePositions[0]) * modelMat
+                                        * glm::rotate(glm::mat4(1.0f), scenePhases[0], upVector) * glm::vec4(teapotCenter, 1.0f));
+            CameraBlock probeCamera;
+            probeCamera.view_projection = probe.faceViewProjection(probeCenter, 0.01f, farPlane);
+            probeCamera.view_position = glm::vec4(probeCenter, 1.0f);
+            uniformBuffer.set(probeCameraOffset, &probeCamera, sizeof(probeCamera));
+            uniformBuffer.upload();
+            uniformBuffer.bind(UNIFORM_BINDING_CAMERA, probeCameraOffset, sizeof(CameraBlock));
+
+            probe.beginFace();
+            glState.useProgram(probeProgram);
+            glState.bindVertexArray(vao);
+            int probeCount = placeInstances(probeCamera.view_projection, probeCenter, probe.projectionScale(), true);
+            drawInstances(probeCount, probeCamera.view_projection, probeCenter, false, false);
+            probe.endFace();
 
-        // Begin to draw all the polygons
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
+            glViewport(0, 0, winWidth, winHeight);
+            glState.bindVertexArray(vao);
+            uniformBuffer.bind(UNIFORM_BINDING_CAMERA, cameraOffset, sizeof(CameraBlock));
+        }
+        uniformBuffer.upload();
+        glState.useProgram(shaderProgram);
+
+        // move the lamps and bin them for this view
+        double lampTime = glfwGetTime();
+        for (size_t i = 0; i < lamps.size(); i++)
+        {
+            float angle = lamps[i].phase + 0.7f * lampTime;
+            lights[i].position = lamps[i].anchor + lamps[i].orbit * glm::vec3(cosf(angle), 0.0f, sinf(angle));
+        }
+        clusters.setProjection(fov, fAspect, 0.01f, farPlane);
+        clusters.update(lights, viewMat, winWidth, winHeight);
+        clusters.bind(3, 4, 5);
+        clusters.setUniforms(shaderProgram);
+
+        // place every visible teapot
+        float projScale = winHeight * 0.5f / tan(fov * 0.5f * PI / 180.0f);
+        int visibleCount = placeInstances(VPMat, cameraWorld, projScale, false);
+
+        // stream the texture levels the nearest teapot needs : its texture wraps
+        // around it, so about twice its projected diameter in pixels
+        if (visibleCount > 0)
+        {
+            float nearest = farPlane;
+            for (int i = 0; i < visibleCount; i++)
+                nearest = std::min(nearest, glm::length(cameraWorld - glm::vec3(instances[i].model[3])));
+            float pixels = 4.0f * teapotRadius * teapotScale * projScale / std::max(nearest, 0.01f);
+            for (int i = 0; i < textureCount; i++)
+                textureStreamer.require(tex[i], pixels);
+        }
+        bool streaming = textureStreamer.pending() > 0;
+        textureStreamer.update();
+        if (streaming && textureStreamer.pending() == 0)
+            printf("texture levels streamed after %.1f ms\n", 1000.0 * glfwGetTime());
+
+        // cast the clicked pixel's ray at the teapots, each tested in its own model space
+        if (pickRequested)
+        {
+            pickRequested = false;
+            int winPointWidth, winPointHeight;
+            glfwGetWindowSize(window, &winPointWidth, &winPointHeight);
+            glm::vec2 ndc(2.0f * pickX / winPointWidth - 1.0f, 1.0f - 2.0f * pickY / winPointHeight);
+            glm::mat4 inverseVP = glm::inverse(VPMat);
+            glm::vec4 nearPoint = inverseVP * glm::vec4(ndc.x, ndc.y, -1.0f, 1.0f);
+            glm::vec4 farPoint = inverseVP * glm::vec4(ndc.x, ndc.y, 1.0f, 1.0f);
+            Ray worldRay;
+            worldRay.origin = glm::vec3(nearPoint) / nearPoint.w;
+            worldRay.direction = glm::vec3(farPoint) / farPoint.w - worldRay.origin;
+            worldRay.t_max = 1.0f;
+
+            // an affine transform keeps t, so the hits of all the teapots compare directly
+            RayHit best;
+            best.t = worldRay.t_max;
+            best.triangle = BVH_NO_HIT;
+            int bestInstance = -1;
+            for (int i = 0; i < visibleCount; i++)
+            {
+                const glm::mat4 &model = instances[i].model;
+                glm::vec3 center = glm::vec3(model * glm::vec4(teapotCenter, 1.0f));
+                if (!ray_hits_sphere(worldRay, center, teapotRadius * teapotScale))
+                    continue;
+                glm::mat4 inverseModel = glm::inverse(model);
+                Ray modelRay;
+                modelRay.origin = glm::vec3(inverseModel * glm::vec4(worldRay.origin, 1.0f));
+                modelRay.direction = glm::vec3(inverseModel * glm::vec4(worldRay.direction, 0.0f));
+                modelRay.t_max = best.t;
+                RayHit hit;
+                if (teapotBVH.intersect(modelRay, hit))
+                {
+                    best = hit;
+                    bestInstance = visibleInstances[i];
+                }
+            }
+            if (bestInstance >= 0)
+                printf("picked teapot %d, triangle %d\n", bestInstance, (int)best.triangle);
+            else
+                printf("picked nothing\n");
+        }
+
+        if (instanceCount == 1 && visibleCount == 1 && instanceLevels[0] != level)
+        {
+            level = instanceLevels[0];
+            printf("teapot lod %d\n", (int)level);
+        }
+
+        // Begin to draw all the polygons. With the pre-pass a trivial program lays down the
+        // nearest depths first, then the shading only runs on the fragments that match them,
+        // once per visible pixel instead of once per covered fragment
+        int sceneQuery = sceneFrame++ % 2;
+        if (sceneQueryIssued[sceneQuery])
+        {
+            GLuint64 nanoseconds;
+            glGetQueryObjectui64v(sceneQueries[sceneQuery], GL_QUERY_RESULT, &nanoseconds);
+            sceneGpuMs += nanoseconds / 1e6;
+            sceneGpuFrames++;
+        }
+        glBeginQuery(GL_TIME_ELAPSED, sceneQueries[sceneQuery]);
+        bool meshletCulling = culling && instanceCount == 1;
+        if (depthPrepass)
+        {
+            glState.useProgram(depthProgram);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            drawInstances(visibleCount, VPMat, cameraWorld, meshletCulling, false);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            glDepthMask(GL_FALSE);
+            glDepthFunc(GL_EQUAL);
+            glState.useProgram(shaderProgram);
+            drawInstances(visibleCount, VPMat, cameraWorld, meshletCulling, true);
+            glDepthMask(GL_TRUE);
+            glDepthFunc(GL_LESS);
+        }
+        else
+            drawInstances(visibleCount, VPMat, cameraWorld, meshletCulling, false);
+        glEndQuery(GL_TIME_ELAPSED);
+        sceneQueryIssued[sceneQuery] = true;
+
+        // frame time of the stress scene, and the cost of the scene passes with or
+        // without the pre-pass, each average over frames of a single setting
+        statsFrames++;
+        double now = glfwGetTime();
+        if (depthPrepass != statsPrepass)
+        {
+            statsPrepass = depthPrepass;
+            statsStart = now;
+            statsFrames = 0;
+            sceneGpuMs = 0.0;
+            sceneGpuFrames = 0;
+        }
+        if ((instanceCount > 1 || depthPrepassToggled) && now - statsStart >= 2.0)
+        {
+            if (instanceCount > 1)
+            {
+                printf("%d teapots, %d visible: %.2f ms per frame, lod", instanceCount, visibleCount,
+                       1000.0 * (now - statsStart) / statsFrames);
+                for (unsigned int l = 0; l < lods.size(); l++)
+                    printf(" %d", (int)levelCount[l]);
+                printf(", gpu memory %.1f of %.1f MB, %d evictions\n", residency.usedBytes() / 1048576.0,
+                       residency.budgetBytes() / 1048576.0, (int)residency.evictions());
+                printf("        %d lamps binned in %.2f ms, up to %u in a cluster\n", (int)lights.size(),
+                       clusters.binMilliseconds(), clusters.maxClusterLights());
+            }
+            printf("        depth pre-pass %s, scene passes %.2f ms on the gpu\n", depthPrepass ? "on" : "off",
+                   sceneGpuFrames > 0 ? sceneGpuMs / sceneGpuFrames : 0.0);
+            statsStart = now;
+            statsFrames = 0;
+            sceneGpuMs = 0.0;
+            sceneGpuFrames = 0;
+        }
 
         // buffer swapping
         glfwSwapBuffers(window);
+        residency.endFrame();
+        if (firstFrame)
+        {
+            printf("first frame after %.1f ms\n", 1000.0 * glfwGetTime());
+            firstFrame = false;
+        }
         // Poll events
         glfwPollEvents();
     }
 
     // clean
-    glDeleteProgram(shaderProgram);
-    glDeleteBuffers(1, &vbo);
-    glDeleteBuffers(1, &veo);
+    printf("GL state cache : %zu calls issued, %zu skipped\n", glState.issuedCalls(), glState.skippedCalls());
+    shaders.release();
+    glDeleteProgram(depthProgram);
+    glState.forgetProgram(depthProgram);
+    glDeleteQueries(2, sceneQueries);
+    uniformBuffer.release();
+    residency.release(vbo);
+    residency.release(tangent_buffer);
+    residency.release(bitangent_buffer);
+    residency.release(veo);
+    residency.release(instance_buffer);
+    for (int i = 0; i < textureCount; i++)
+        residency.release(tex[i], true);
+    probe.release();
+    clusters.release();
     glDeleteVertexArrays(1, &vao);
+    glState.forgetVertexArray(vao);
     glfwDestroyWindow(window);
     glfwTerminate();
 
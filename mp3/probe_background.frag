@@ -0,0 +1,29 @@
+#version 330 core
+
+in vec2 facePosition;
+
+out vec4 outColor;
+
+// a photo of a mirror ball, what the probe sees behind the teapots
+uniform sampler2D background;
+// the face being captured, in the order of the cube map targets
+uniform int face;
+
+// the direction through a texel of the face, s and t as the cube map lookup defines them
+vec3 face_direction(vec2 p)
+{
+    if (face == 0) return vec3( 1.0, -p.y, -p.x);
+    if (face == 1) return vec3(-1.0, -p.y,  p.x);
+    if (face == 2) return vec3( p.x,  1.0,  p.y);
+    if (face == 3) return vec3( p.x, -1.0, -p.y);
+    if (face == 4) return vec3( p.x, -p.y,  1.0);
+    return vec3(-p.x, -p.y, -1.0);
+}
+
+void main()
+{
+    // the sphere map lookup of a reflected direction, upside down like the image
+    vec3 r = normalize(face_direction(facePosition));
+    float m = 2.0 * sqrt(r.x * r.x + r.y * r.y + (r.z + 1.0) * (r.z + 1.0));
+    outColor = texture(background, vec2(r.x / m + 0.5, 1.0 - (r.y / m + 0.5)));
+}
@@ -0,0 +1,54 @@
+#version 330 core
+
+in vec2 facePosition;
+
+out vec4 outColor;
+
+uniform samplerCube capture;
+// the face being filtered, in the order of the cube map targets
+uniform int face;
+// half angle of the blur, 0 copies the face
+uniform float cone;
+// the level of capture the taps read, where they are about a texel apart
+uniform float source_level;
+
+// the direction through a texel of the face, s and t as the cube map lookup defines them
+vec3 face_direction(vec2 p)
+{
+    if (face == 0) return vec3( 1.0, -p.y, -p.x);
+    if (face == 1) return vec3(-1.0, -p.y,  p.x);
+    if (face == 2) return vec3( p.x,  1.0,  p.y);
+    if (face == 3) return vec3( p.x, -1.0, -p.y);
+    if (face == 4) return vec3( p.x, -p.y,  1.0);
+    return vec3(-p.x, -p.y, -1.0);
+}
+
+void main()
+{
+    vec3 direction = normalize(face_direction(facePosition));
+    if (cone <= 0.0)
+    {
+        outColor = textureLod(capture, direction, source_level);
+        return;
+    }
+
+    // two rings of taps around the direction, weighted towards the middle
+    vec3 side = normalize(cross(abs(direction.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0), direction));
+    vec3 up = cross(direction, side);
+    float spread = tan(cone);
+    vec4 sum = textureLod(capture, direction, source_level);
+    float weight = 1.0;
+    for (int ring = 1; ring <= 2; ring++)
+    {
+        float radius = spread * float(ring) / 2.0;
+        float ringWeight = 1.0 / float(ring + 1);
+        for (int i = 0; i < 8; i++)
+        {
+            float angle = (float(i) + 0.5 * float(ring)) * 0.785398;
+            vec3 tap = direction + radius * (cos(angle) * side + sin(angle) * up);
+            sum += ringWeight * textureLod(capture, tap, source_level);
+            weight += ringWeight;
+        }
+    }
+    outColor = sum / weight;
+}
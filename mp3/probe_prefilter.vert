@@ -0,0 +1,11 @@
+#version 330 core
+
+// one triangle covering the face, from the vertex index alone
+out vec2 facePosition;
+
+void main()
+{
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    facePosition = corner * 2.0 - 1.0;
+    gl_Position = vec4(facePosition, 0.0, 1.0);
+}
@@ -1,25 +1,31 @@
 #version 330 core
+#include "../mp1/common/lighting.glsl"
 
-in vec3 position;
-in vec3 norm;
-in vec2 texcoord;
-in vec3 tangent;
-in vec3 bitangent;
+// fixed locations, so every variant of the program shares the vertex array
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texcoord;
+layout(location = 3) in vec3 tangent;
+layout(location = 4) in vec3 bitangent;
+// per instance
+layout(location = 5) in mat4 instance_model;
+layout(location = 9) in mat3 instance_normal;
 
 out vec3 vertex_world;
 out vec2 Texcoord;
 //out vec3 vertex_norm;
 out mat3 TBN;
 
-uniform mat4 MVP;
-uniform mat4 M;
-
+// the depth pre-pass computes the same position with depth_only.vert
+invariant gl_Position;
 
 void main()
 {
-    gl_Position = MVP * vec4(position, 1.0);
-    vertex_world = vec3(M * vec4(position, 1.0));
+    vec4 world = instance_model * vec4(position, 1.0);
+    gl_Position = camera.view_projection * world;
+    vertex_world = vec3(world);
     Texcoord = texcoord;
     //vertex_norm = norm;
-    TBN = mat3(tangent, bitangent, norm);
+    // tangent frame in world space
+    TBN = instance_normal * mat3(tangent, bitangent, norm);
 }
@@ -0,0 +1,544 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <stdlib.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#ifndef SWRENDER_NO_SOIL
+#include "soil.h"
+#endif
+#include "parallel.hpp"
+#include "tangentspace.hpp"
+#include "softrasterizer.hpp"
+
+// The scenes of mp1, mp2 and mp3 drawn on the CPU, their shaders ported to C++.
+// Each frame steps the animation as one tick of the GL program does.
+
+#define PI 3.14159265
+#define WIDTH 480
+#define HEIGHT 480
+// the terrain spans [-5, 5] in x and y, its colour texture [0, 1]
+#define TERRAIN_SIZE 10.0f
+// texels per side of the terrain colour, the virtual texture of mp2 at about its level 2
+#define TERRAIN_TEXTURE_SIZE 1024
+
+// lighting.glsl
+struct Material {
+    glm::vec4 ambient, diffuse, specular;
+    float shininess;
+};
+
+static glm::vec4 phong(const Material &material, const glm::vec4 &light, const glm::vec3 &viewPosition,
+                       const glm::vec3 &normal, const glm::vec3 &world) {
+    glm::vec3 surfaceToLight = light.w == 0.0f ? glm::vec3(light.x, light.y, light.z)
+                                               : glm::normalize(glm::vec3(light.x, light.y, light.z) - world);
+    glm::vec3 viewDirection = glm::normalize(viewPosition - world);
+    float lambert = glm::dot(surfaceToLight, normal);
+    glm::vec4 color = material.ambient + std::max(lambert, 0.0f) * material.diffuse;
+    if (lambert >= 0.0f)
+        color = color + material.specular * powf(std::max(0.0f, glm::dot(glm::reflect(-surfaceToLight, normal), viewDirection)), material.shininess);
+    return color;
+}
+
+static glm::vec3 camera_position(const glm::mat4 &view) {
+    glm::mat4 inverse = glm::inverse(view);
+    return glm::vec3(inverse[3].x, inverse[3].y, inverse[3].z);
+}
+
+// RGB image, bilinear with clamp to edge as the GL textures
+struct Image {
+    int width, height;
+    std::vector<unsigned char> rgb;
+};
+
+static glm::vec3 sample(const Image &image, float u, float v) {
+    float x = glm::clamp(u * image.width - 0.5f, 0.0f, image.width - 1.0f);
+    float y = glm::clamp(v * image.height - 0.5f, 0.0f, image.height - 1.0f);
+    int i = std::min((int)x, image.width - 2), j = std::min((int)y, image.height - 2);
+    float fx = x - i, fy = y - j;
+    const unsigned char *t = &image.rgb[3*(j*image.width + i)];
+    const unsigned char *b = t + 3*image.width;
+    glm::vec3 texel[4];
+    for (int k = 0; k < 4; k++) {
+        const unsigned char *p = k < 2 ? t + 3*k : b + 3*(k - 2);
+        texel[k] = glm::vec3(p[0], p[1], p[2]) * (1.0f/255.0f);
+    }
+    return glm::mix(glm::mix(texel[0], texel[1], fx), glm::mix(texel[2], texel[3], fx), fy);
+}
+
+static void write_ppm(const char *path, const std::vector<unsigned char> &rgb, int width, int height) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        printf("can't write %s\n", path);
+        return;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    fwrite(&rgb[0], 1, rgb.size(), file);
+    fclose(file);
+    printf("wrote %s\n", path);
+}
+
+// A scene sets itself up once, then draws frame after frame
+struct Scene {
+    virtual ~Scene() {}
+    virtual bool load() = 0;
+    virtual void draw(SoftRasterizer &raster, int frame) = 0;
+};
+
+// ---- mp1 : the dancing I -------------------------------------------------
+
+struct DancingI : Scene {
+    std::vector<float> positions;
+    std::vector<unsigned int> elements;
+
+    bool load() {
+        const float IBufferData[] = {
+            -0.6f,  0.6f,  0.1f,  -0.6f,  1.0f,  0.1f,   0.6f,  1.0f,  0.1f,   0.6f,  0.6f,  0.1f,
+             0.2f,  0.6f,  0.1f,   0.2f, -0.6f,  0.1f,   0.6f, -0.6f,  0.1f,   0.6f, -1.0f,  0.1f,
+            -0.6f, -1.0f,  0.1f,  -0.6f, -0.6f,  0.1f,  -0.2f, -0.6f,  0.1f,  -0.2f,  0.6f,  0.1f,
+            -0.6f,  0.6f, -0.1f,  -0.6f,  1.0f, -0.1f,   0.6f,  1.0f, -0.1f,   0.6f,  0.6f, -0.1f,
+             0.2f,  0.6f, -0.1f,   0.2f, -0.6f, -0.1f,   0.6f, -0.6f, -0.1f,   0.6f, -1.0f, -0.1f,
+            -0.6f, -1.0f, -0.1f,  -0.6f, -0.6f, -0.1f,  -0.2f, -0.6f, -0.1f,  -0.2f,  0.6f, -0.1f
+        };
+        const unsigned int elementBufferData[] = {
+            0, 1, 11, 2, 4, 3,
+            4, 11, 10, 5,
+            6, 7, 5, 8, 10, 9,
+            12, 13, 23, 14, 16, 15,
+            16, 23, 22, 17,
+            18, 19, 17, 20, 22, 21,
+            0, 1, 12, 13,   1, 2, 13, 14,   2, 3, 14, 15,   3, 4, 15, 16,
+            4, 5, 16, 17,   5, 6, 17, 18,   6, 7, 18, 19,   7, 8, 19, 20,
+            8, 9, 20, 21,   9, 10, 21, 22,  10, 11, 22, 23, 11, 0, 23, 0
+        };
+        positions.assign(IBufferData, IBufferData + sizeof(IBufferData)/sizeof(float));
+        elements.assign(elementBufferData, elementBufferData + sizeof(elementBufferData)/sizeof(unsigned int));
+        return true;
+    }
+
+    void draw(SoftRasterizer &raster, int frame) {
+        // a degree and a hundredth of the wave per tick
+        glm::mat4 projMat = glm::perspective(45.0f, 1.0f, 0.1f, 100.0f);
+        glm::mat4 viewMat = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0));
+        glm::mat4 modelMat = glm::rotate(glm::scale(glm::mat4(1.0f), glm::vec3(0.7f, 0.7f, 0.7f)),
+                                         (float)frame, glm::vec3(0.0f, 1.0f, 0.0f));
+        glm::mat4 MVP = projMat * viewMat * modelMat;
+        float time = fmodf(frame * 0.01f, 1.0f);
+
+        raster.clear(glm::vec4(0.0f, 0.2f, 0.8f, 1.0f));
+        // vertex_shader.vert
+        const float *p = &positions[0];
+        SoftRasterizer::VertexShader vertexShader = [p, MVP, time](unsigned int i, SoftVertex &out) {
+            const float *position = p + 3*i;
+            float phase = time * 2*PI + (position[0] + 0.6f) * 1.25f*PI;
+            float newY = position[1] + 0.2f * sinf(phase);
+            out.position = MVP * glm::vec4(position[0], newY, position[2], 1.0f);
+        };
+        // fragment_shader.frag, orange
+        SoftRasterizer::FragmentShader fragmentShader = [](const float *, glm::vec4 &color) {
+            color = glm::vec4(1.0f, 0.5f, 0.0f, 0.6f);
+        };
+        SoftState state = { false, false, true };
+
+        // the same draws as mp1, strips and fans out of one element buffer
+        const int first[] = { 0, 6, 10, 16, 22, 26 };
+        const int count[] = { 6, 4, 6, 6, 4, 6 };
+        const int mode[] = { SOFT_TRIANGLE_STRIP, SOFT_TRIANGLE_FAN, SOFT_TRIANGLE_STRIP,
+                             SOFT_TRIANGLE_STRIP, SOFT_TRIANGLE_FAN, SOFT_TRIANGLE_STRIP };
+        for (int i = 0; i < 6; i++)
+            raster.draw(mode[i], &elements[first[i]], count[i], 24, 0, vertexShader, fragmentShader, state);
+        for (int i = 0; i != 12; i++)
+            raster.draw(SOFT_TRIANGLE_STRIP, &elements[32 + 4*i], 4, 24, 0, vertexShader, fragmentShader, state);
+    }
+};
+
+// ---- mp2 : the terrain and the sea --------------------------------------
+
+struct Terrain : Scene {
+    int res;
+    float sealevel;
+    std::vector<float> verts, norms;
+    std::vector<unsigned int> faces;
+    Image albedo;
+
+    Terrain() : res(257), sealevel(0.0f) {}
+
+    // mountain-retained.cpp, the same seeding gives the same heights
+    static float frand(float x, float y) {
+        static int a = 1588635695, b = 1117695901;
+        int xi, yi;
+        memcpy(&xi, &x, sizeof(int));
+        memcpy(&yi, &y, sizeof(int));
+        srand(((xi * a) % b) - ((yi * b) % a));
+        return 2.0*((float)rand()/(float)RAND_MAX) - 1.0;
+    }
+
+    float &vert(int i, int j, int k) { return verts[3*(j*res + i) + k]; }
+
+    void mountain(int i, int j, int s) {
+        if (s > 1) {
+            float x[4], y[4], z[4];
+            const int ci[4] = { i, i + s, i, i + s }, cj[4] = { j, j, j + s, j + s };
+            for (int c = 0; c < 4; c++) {
+                x[c] = vert(ci[c], cj[c], 0);
+                y[c] = vert(ci[c], cj[c], 1);
+                z[c] = vert(ci[c], cj[c], 2);
+            }
+            // the midpoints of the four sides and the center, in the order frand is called
+            const int pair[4][2] = { {0, 1}, {0, 2}, {1, 3}, {2, 3} };
+            const int mi[4] = { i + s/2, i, i + s, i + s/2 }, mj[4] = { j, j + s/2, j + s/2, j + s };
+            for (int m = 0; m < 4; m++) {
+                float mx = 0.5*(x[pair[m][0]] + x[pair[m][1]]);
+                float my = 0.5*(y[pair[m][0]] + y[pair[m][1]]);
+                float mz = 0.5*(z[pair[m][0]] + z[pair[m][1]]);
+                mz += 0.5*((float)s/res)*frand(mx, my);
+                vert(mi[m], mj[m], 0) = mx;
+                vert(mi[m], mj[m], 1) = my;
+                vert(mi[m], mj[m], 2) = mz;
+            }
+            float cx = 0.25*(x[0] + x[1] + x[2] + x[3]);
+            float cy = 0.25*(y[0] + y[1] + y[2] + y[3]);
+            float cz = 0.25*(z[0] + z[1] + z[2] + z[3]);
+            cz += 0.5*((float)s/res)*frand(cx, cy);
+            vert(i + s/2, j + s/2, 0) = cx;
+            vert(i + s/2, j + s/2, 1) = cy;
+            vert(i + s/2, j + s/2, 2) = cz;
+
+            mountain(i, j, s/2);
+            mountain(i + s/2, j, s/2);
+            mountain(i, j + s/2, s/2);
+            mountain(i + s/2, j + s/2, s/2);
+        } else {
+            float dx, dy, dz;
+            if (i == 0)
+                dx = vert(i + 1, j, 2) - vert(i, j, 2);
+            else if (i == res - 1)
+                dx = vert(i, j, 2) - vert(i - 1, j, 2);
+            else
+                dx = (vert(i + 1, j, 2) - vert(i - 1, j, 2))/2.0;
+            if (j == 0)
+                dy = vert(i, j + 1, 2) - vert(i, j, 2);
+            else if (j == res - 1)
+                dy = vert(i, j, 2) - vert(i, j - 1, 2);
+            else
+                dy = (vert(i, j + 1, 2) - vert(i, j - 1, 2))/2.0;
+            dx *= res;
+            dy *= res;
+            dz = 1.0/sqrt(dx*dx + dy*dy + 1.0);
+            norms[3*(j*res + i)] = dx*dz;
+            norms[3*(j*res + i) + 1] = dy*dz;
+            norms[3*(j*res + i) + 2] = dz;
+        }
+    }
+
+    // mp2.cc
+    float height(float u, float v) const {
+        float x = glm::clamp(u, 0.0f, 1.0f) * (res - 1);
+        float y = glm::clamp(v, 0.0f, 1.0f) * (res - 1);
+        int i = std::min((int)x, res - 2);
+        int j = std::min((int)y, res - 2);
+        const float *h = &verts[3*(j*res + i) + 2];
+        return glm::mix(glm::mix(h[0], h[3], x - i), glm::mix(h[3*res], h[3*res + 3], x - i), y - j);
+    }
+
+    static float lattice(int x, int y) {
+        unsigned int h = (unsigned int)x * 374761393u + (unsigned int)y * 668265263u;
+        h = (h ^ (h >> 13)) * 1274126177u;
+        return (h ^ (h >> 16)) / 4294967295.0f;
+    }
+
+    static float value_noise(float x, float y) {
+        float fx = floorf(x), fy = floorf(y);
+        int i = (int)fx, j = (int)fy;
+        float sx = glm::smoothstep(0.0f, 1.0f, x - fx);
+        float sy = glm::smoothstep(0.0f, 1.0f, y - fy);
+        return glm::mix(glm::mix(lattice(i, j), lattice(i + 1, j), sx),
+                        glm::mix(lattice(i, j + 1), lattice(i + 1, j + 1), sx), sy);
+    }
+
+    // generate_terrain_page of mp2.cc over the whole texture at one level
+    glm::vec3 terrain_color(float u, float v, float step) const {
+        const glm::vec3 sand(0.76f, 0.70f, 0.50f);
+        const glm::vec3 grass(0.25f, 0.42f, 0.15f);
+        const glm::vec3 rock(0.42f, 0.38f, 0.34f);
+        const glm::vec3 snow(0.95f, 0.95f, 0.97f);
+        float cell = 1.0f / (res - 1);
+        float h = height(u, v);
+        float dx = (height(u + cell, v) - height(u - cell, v)) / (2.0f*cell*TERRAIN_SIZE);
+        float dy = (height(u, v + cell) - height(u, v - cell)) / (2.0f*cell*TERRAIN_SIZE);
+        float slope = sqrtf(dx*dx + dy*dy);
+        float detail = 0.0f, amplitude = 0.5f;
+        for (float frequency = (res - 1) / 4.0f; frequency*step < 0.5f && amplitude > 0.01f; frequency *= 2.0f, amplitude *= 0.5f)
+            detail += amplitude * (value_noise(u*frequency, v*frequency) - 0.5f);
+        float elevation = h - sealevel + 0.05f*detail;
+        glm::vec3 color = glm::mix(sand, grass, glm::smoothstep(0.02f, 0.06f, elevation));
+        color = glm::mix(color, rock, glm::smoothstep(0.5f, 0.9f, slope + 0.3f*detail));
+        color = glm::mix(color, snow, glm::smoothstep(0.35f, 0.45f, elevation) * (1.0f - glm::smoothstep(0.8f, 1.2f, slope)));
+        return glm::clamp(color * (1.0f + 0.6f*detail), 0.0f, 1.0f);
+    }
+
+    bool load() {
+        verts.assign(res*res*3, 0.0f);
+        norms.assign(res*res*3, 0.0f);
+        const int corner[4][2] = { {0, 0}, {res - 1, 0}, {0, res - 1}, {res - 1, res - 1} };
+        for (int c = 0; c < 4; c++) {
+            vert(corner[c][0], corner[c][1], 0) = corner[c][0] ? 5.0f : -5.0f;
+            vert(corner[c][0], corner[c][1], 1) = corner[c][1] ? 5.0f : -5.0f;
+            vert(corner[c][0], corner[c][1], 2) = 0.0f;
+        }
+        mountain(0, 0, res - 1);
+        for (int j = 0; j < res - 1; j++) {
+            for (int i = 0; i < res - 1; i++) {
+                unsigned int quad[6] = { (unsigned int)(j*res + i), (unsigned int)(j*res + i + 1), (unsigned int)((j + 1)*res + i + 1),
+                                         (unsigned int)(j*res + i), (unsigned int)((j + 1)*res + i + 1), (unsigned int)((j + 1)*res + i) };
+                faces.insert(faces.end(), quad, quad + 6);
+            }
+        }
+
+        // the virtual texture's colours, all of it at once
+        albedo.width = albedo.height = TERRAIN_TEXTURE_SIZE;
+        albedo.rgb.resize(3*TERRAIN_TEXTURE_SIZE*TERRAIN_TEXTURE_SIZE);
+        parallelFor(TERRAIN_TEXTURE_SIZE, 16, [this](size_t begin, size_t end) {
+            float step = 1.0f / TERRAIN_TEXTURE_SIZE;
+            for (size_t j = begin; j < end; j++) {
+                for (int i = 0; i < TERRAIN_TEXTURE_SIZE; i++) {
+                    glm::vec3 color = terrain_color((i + 0.5f)*step, (j + 0.5f)*step, step);
+                    unsigned char *texel = &albedo.rgb[3*(j*TERRAIN_TEXTURE_SIZE + i)];
+                    texel[0] = (unsigned char)(color.x * 255.0f);
+                    texel[1] = (unsigned char)(color.y * 255.0f);
+                    texel[2] = (unsigned char)(color.z * 255.0f);
+                }
+            }
+        });
+        return true;
+    }
+
+    void draw(SoftRasterizer &raster, int frame) {
+        // the plane backs up along its view a bit every tick
+        glm::vec3 planePosition = glm::vec3(0.5, 0, 0.5);
+        glm::mat4 viewMat = glm::lookAt(planePosition, planePosition + glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
+        viewMat = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, 0.005f*frame)) * viewMat;
+        glm::mat4 VP = glm::perspective(90.0f, 1.0f, 0.01f, 10.0f) * viewMat;
+        glm::vec3 viewPosition = camera_position(viewMat);
+        bool underwater = viewPosition.z < sealevel;
+
+        // the sun straight above, materials times its white
+        glm::vec4 light = glm::vec4(0.0f, 0.0f, 1.0f, 0.0f);
+        Material tan = { glm::vec4(0.35f, 0.35f, 0.35f, 1.0f), glm::vec4(0.9f, 0.9f, 0.9f, 1.0f), glm::vec4(0.1f, 0.1f, 0.1f, 1.0f), 50.0f };
+        Material sea = { glm::vec4(0.0f, 0.0f, 0.2f, 0.2f), glm::vec4(0.0f, 0.0f, 0.8f, 0.2f), glm::vec4(0.5f, 0.5f, 1.0f, 0.4f), 10.0f };
+
+        raster.clear(glm::vec4(0.5f, 0.5f, 1.0f, 0.0f));
+
+        // vertex_shader.vert, the model matrix is the identity
+        const float *positions = &verts[0], *normals = &norms[0];
+        SoftRasterizer::VertexShader terrainVertex = [positions, normals, VP](unsigned int i, SoftVertex &out) {
+            const float *p = positions + 3*i, *n = normals + 3*i;
+            out.position = VP * glm::vec4(p[0], p[1], p[2], 1.0f);
+            for (int k = 0; k < 3; k++) {
+                out.varyings[k] = n[k];
+                out.varyings[3 + k] = p[k];
+            }
+        };
+        // fragment_shader.frag
+        const Image &texture = albedo;
+        SoftRasterizer::FragmentShader terrainFragment = [&texture, tan, light, viewPosition, underwater](const float *v, glm::vec4 &color) {
+            glm::vec3 normal = glm::normalize(glm::vec3(v[0], v[1], v[2]));
+            glm::vec3 world = glm::vec3(v[3], v[4], v[5]);
+            glm::vec3 albedo = sample(texture, world.x / TERRAIN_SIZE + 0.5f, world.y / TERRAIN_SIZE + 0.5f);
+            color = phong(tan, light, viewPosition, normal, world) * glm::vec4(albedo.x, albedo.y, albedo.z, 1.0f);
+            if (underwater)
+                color = color * glm::vec4(0.4f, 0.4f, 1.0f, 1.0f);
+        };
+        SoftState opaque = { true, true, false };
+        raster.draw(SOFT_TRIANGLES, &faces[0], faces.size(), res*res, 6, terrainVertex, terrainFragment, opaque);
+
+        // the sea last, blended over the terrain under it
+        float level = sealevel;
+        SoftRasterizer::VertexShader seaVertex = [level, VP](unsigned int i, SoftVertex &out) {
+            glm::vec3 p = glm::vec3(i & 1 ? 5.0f : -5.0f, i & 2 ? 5.0f : -5.0f, level);
+            out.position = VP * glm::vec4(p.x, p.y, p.z, 1.0f);
+            out.varyings[0] = p.x;
+            out.varyings[1] = p.y;
+            out.varyings[2] = p.z;
+        };
+        SoftRasterizer::FragmentShader seaFragment = [sea, light, viewPosition, underwater](const float *v, glm::vec4 &color) {
+            color = phong(sea, light, viewPosition, glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(v[0], v[1], v[2]));
+            if (underwater)
+                color = color * glm::vec4(0.4f, 0.4f, 1.0f, 1.0f);
+        };
+        SoftState transparent = { true, false, true };
+        raster.draw(SOFT_TRIANGLE_STRIP, NULL, 4, 4, 3, seaVertex, seaFragment, transparent);
+    }
+};
+
+// ---- mp3 : the teapot ---------------------------------------------------
+
+struct Teapot : Scene {
+    std::string directory;
+    std::vector<glm::vec3> vertices, normals;
+    std::vector<glm::vec2> uvs;
+    std::vector<unsigned int> faces;
+    Image surface;
+
+    Teapot(const char *dir) : directory(dir) {}
+
+    // load_obj of mp3.cc
+    bool load_obj(const char *filename) {
+        std::ifstream obj_file(filename);
+        if (!obj_file) {
+            std::cerr << "error: unable to open the obj file:" << filename << std::endl;
+            return false;
+        }
+        std::string line;
+        while (std::getline(obj_file, line)) {
+            std::istringstream stream(line);
+            char mode = '\0';
+            stream >> mode;
+            if (mode == 'v') {
+                glm::vec3 vertex;
+                stream >> vertex.x >> vertex.y >> vertex.z;
+                vertices.push_back(vertex);
+            } else if (mode == 'f') {
+                unsigned int vertex_index[3];
+                stream >> vertex_index[0] >> vertex_index[1] >> vertex_index[2];
+                for (int k = 0; k < 3; k++)
+                    faces.push_back(vertex_index[k] - 1);
+            }
+        }
+        return !vertices.empty();
+    }
+
+    bool load() {
+        if (!load_obj((directory + "/teapot_0.obj").c_str()))
+            return false;
+        computeVertexNormals(faces, vertices, NORMAL_WEIGHT_ANGLE, normals);
+
+        // cylindrical texture coordinates
+        float max_y = 0;
+        for (size_t i = 0; i < vertices.size(); i++)
+            max_y = std::max(max_y, vertices[i].y);
+        uvs.resize(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++) {
+            uvs[i].x = atan2(vertices[i].z, vertices[i].x) / (2*PI) + 0.5;
+            uvs[i].y = vertices[i].y / max_y;
+        }
+
+        // white like mp3's placeholder if the image isn't there, or without SOIL
+        std::string path = directory + "/qinghua.jpg";
+#ifndef SWRENDER_NO_SOIL
+        unsigned char *pixels = SOIL_load_image(path.c_str(), &surface.width, &surface.height, 0, SOIL_LOAD_RGB);
+#else
+        unsigned char *pixels = NULL;
+#endif
+        if (pixels && surface.width > 1 && surface.height > 1) {
+            surface.rgb.assign(pixels, pixels + 3*surface.width*surface.height);
+        } else {
+            printf("can't load %s, drawing the teapot white\n", path.c_str());
+            surface.width = surface.height = 2;
+            surface.rgb.assign(12, 255);
+        }
+#ifndef SWRENDER_NO_SOIL
+        if (pixels)
+            SOIL_free_image_data(pixels);
+#endif
+        return true;
+    }
+
+    void draw(SoftRasterizer &raster, int frame) {
+        // a degree per tick around y
+        glm::mat4 projMat = glm::perspective(90.0f, 1.0f, 0.01f, 10.0f);
+        glm::mat4 viewMat = glm::lookAt(glm::vec3(0.0, 0.5, 1), glm::vec3(0.0, 0.3, 0.0), glm::vec3(0, 1, 0));
+        glm::mat4 modelMat = glm::rotate(glm::scale(glm::mat4(1.0f), glm::vec3(0.2f)), (float)frame, glm::vec3(0, 1, 0));
+        glm::mat3 normalMat = glm::transpose(glm::inverse(glm::mat3(modelMat)));
+        glm::mat4 VP = projMat * viewMat;
+        glm::vec3 viewPosition = camera_position(viewMat);
+        glm::vec4 light = glm::vec4(1.0f, 1.0f, 1.0f, 1.0f);
+        Material material = { glm::vec4(0.4f), glm::vec4(0.7f), glm::vec4(1.0f), 0.8f };
+
+        raster.clear(glm::vec4(1.0f, 1.0f, 1.0f, 0.0f));
+
+        // vertex_shader.vert
+        const glm::vec3 *p = &vertices[0], *n = &normals[0];
+        const glm::vec2 *t = &uvs[0];
+        SoftRasterizer::VertexShader vertexShader = [p, n, t, modelMat, normalMat, VP](unsigned int i, SoftVertex &out) {
+            glm::vec4 world = modelMat * glm::vec4(p[i].x, p[i].y, p[i].z, 1.0f);
+            glm::vec3 normal = normalMat * n[i];
+            out.position = VP * world;
+            out.varyings[0] = world.x; out.varyings[1] = world.y; out.varyings[2] = world.z;
+            out.varyings[3] = normal.x; out.varyings[4] = normal.y; out.varyings[5] = normal.z;
+            out.varyings[6] = t[i].x; out.varyings[7] = t[i].y;
+        };
+        // fragment_shader.frag without the normal map, the probe and the lamps
+        const Image &texture = surface;
+        SoftRasterizer::FragmentShader fragmentShader = [&texture, material, light, viewPosition](const float *v, glm::vec4 &color) {
+            glm::vec3 world = glm::vec3(v[0], v[1], v[2]);
+            glm::vec3 normal = glm::normalize(glm::vec3(v[3], v[4], v[5]));
+            glm::vec3 texel = sample(texture, v[6], v[7]);
+            color = glm::vec4(texel.x, texel.y, texel.z, 1.0f) * phong(material, light, viewPosition, normal, world);
+        };
+        SoftState opaque = { true, true, false };
+        raster.draw(SOFT_TRIANGLES, &faces[0], faces.size(), vertices.size(), 8, vertexShader, fragmentShader, opaque);
+    }
+};
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("usage: %s i|terrain|teapot [frames] [image.ppm]\n", argv[0]);
+        return 1;
+    }
+    std::string name = argv[1];
+    int frames = argc > 2 ? std::max(atoi(argv[2]), 1) : 100;
+    std::string output = argc > 3 ? argv[3] : name + ".ppm";
+
+    Scene *scene = NULL;
+    if (name == "i")
+        scene = new DancingI();
+    else if (name == "terrain")
+        scene = new Terrain();
+    else if (name == "teapot")
+        scene = new Teapot("../mp3");
+    else {
+        printf("no scene %s, one of i, terrain or teapot\n", name.c_str());
+        return 1;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (!scene->load())
+        return 1;
+    printf("%s loaded in %.1f ms\n", name.c_str(),
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+
+    SoftRasterizer raster;
+    if (!raster.create(WIDTH, HEIGHT))
+        return 1;
+
+    // as many frames as the GL program would animate, timed without the output
+    double total = 0.0, slowest = 0.0;
+    for (int frame = 0; frame < frames; frame++) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        scene->draw(raster, frame);
+        raster.finish();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        total += ms;
+        slowest = std::max(slowest, ms);
+    }
+    printf("%d frames of %d x %d on %d threads : %.2f ms a frame (%.0f fps), %.2f ms at worst\n",
+           frames, WIDTH, HEIGHT, (int)raster.threadCount(), total / frames, 1000.0 * frames / total, slowest);
+    printf("last frame : %zu triangles, %zu blocks rejected by the depth hierarchy\n",
+           raster.triangleCount(), raster.culledBlocks());
+
+    std::vector<unsigned char> rgb;
+    raster.readPixels(rgb);
+    write_ppm(output.c_str(), rgb, WIDTH, HEIGHT);
+
+    raster.release();
+    delete scene;
+    return 0;
+}